@@ -0,0 +1,646 @@
+/*
+ * blink1-bench.c -- measure blink1-lib command throughput & latency
+ *
+ * 2012-2022, Tod Kurt, http://todbot.com/blog/ , http://thingm.com/
+ *
+ * Run all benchmarks against all attached blink(1)s:
+ * ./blink1-bench
+ *
+ * Run just the handle pool benchmark, 500 iterations:
+ * ./blink1-bench -n 500 pool
+ *
+ * Compare backends by building with each USBLIB_TYPE and running:
+ * ./blink1-bench -n 1000 latency
+ *
+ * Run the pattern parser benchmark, no blink(1) needed:
+ * ./blink1-bench parse
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>    // for memset(), strcmp(), et al
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>    // for getopt_long()
+#ifndef _WIN32
+#include <sys/resource.h>  // for getrusage()
+#endif
+
+#include "blink1-lib.h"
+#include "blink1-lib-internal.h"  // cache hooks, to fill the cache with fake devices
+
+// normally this is obtained from git tags and filled out by the Makefile
+#ifndef BLINK1_VERSION
+#define BLINK1_VERSION "v0.0"
+#endif
+
+int iterations = 100;
+int numDevicesToUse = 0;  // 0 = all
+uint32_t deviceIds[blink1_max_devices];
+
+typedef struct {
+    const char* name;
+    const char* desc;
+    void (*func)(void);
+    int offline;        // runs without a blink(1)
+} benchmark_t;
+
+// ---------------------------------------------------------------------------
+
+// print one result line, ops/sec and mean latency per op
+static void report(const char* name, int ops, int64_t elapsed_millis)
+{
+    if( elapsed_millis <= 0 ) elapsed_millis = 1;
+    printf("  %-28s %6d ops in %6lld ms : %9.1f ops/sec, %8.3f ms/op\n",
+           name, ops, (long long)elapsed_millis,
+           (1000.0 * ops) / elapsed_millis, (double)elapsed_millis / ops);
+}
+
+//
+// Open/close for every command (the old blink1-tool way) vs pooled handles
+//
+static void bench_pool(void)
+{
+    int ops = 0;
+    int64_t start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        for( int i=0; i < numDevicesToUse; i++ ) {
+            blink1_device* dev = blink1_openById( deviceIds[i] );
+            if( dev == NULL ) continue;
+            blink1_fadeToRGB( dev, 0, n, 0, 0 );
+            blink1_close( dev );
+            ops++;
+        }
+    }
+    report("open+fade+close", ops, blink1_millis() - start);
+
+    ops = 0;
+    start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        for( int i=0; i < numDevicesToUse; i++ ) {
+            blink1_device* dev = blink1_poolAcquire( deviceIds[i] );
+            if( dev == NULL ) continue;
+            blink1_fadeToRGB( dev, 0, 0, n, 0 );
+            blink1_poolRelease( dev );
+            ops++;
+        }
+    }
+    report("pool acquire+fade+release", ops, blink1_millis() - start);
+    blink1_poolCloseAll();
+}
+
+//
+// One blocking write per device in a loop vs a concurrent batch
+//
+static void bench_batch(void)
+{
+    int ops = 0;
+    int64_t start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        for( int i=0; i < numDevicesToUse; i++ ) {
+            blink1_device* dev = blink1_poolAcquire( deviceIds[i] );
+            if( dev == NULL ) continue;
+            blink1_fadeToRGB( dev, 0, n, 0, n );
+            blink1_poolRelease( dev );
+        }
+        ops++;
+    }
+    report("serial fade, all devices", ops, blink1_millis() - start);
+
+    blink1_batch_cmd_t cmds[blink1_max_devices];
+    ops = 0;
+    start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        for( int i=0; i < numDevicesToUse; i++ ) {
+            blink1_batch_fadeToRGBN( &cmds[i], deviceIds[i], 0, 0, n, n, 0 );
+        }
+        blink1_batch_write( cmds, numDevicesToUse );
+        ops++;
+    }
+    report("batch fade, all devices", ops, blink1_millis() - start);
+    blink1_poolCloseAll();
+}
+
+//
+// Query latency per query type, send+get per device vs pipelined batch
+//
+static void bench_query(void)
+{
+    const char* queries = "vrSRb";  // version, rgb, playstate, pattline, startup
+    char name[40];
+    for( const char* q = queries; *q; q++ ) {
+        int ops = 0;
+        int64_t start = blink1_millis();
+        for( int n=0; n < iterations; n++ ) {
+            for( int i=0; i < numDevicesToUse; i++ ) {
+                blink1_device* dev = blink1_poolAcquire( deviceIds[i] );
+                if( dev == NULL ) continue;
+                uint8_t buf[blink1_buf_size] = { blink1_report_id, *q };
+                if( blink1_read( dev, buf, sizeof(buf) ) != -1 ) ops++;
+                blink1_poolRelease( dev );
+            }
+        }
+        snprintf(name, sizeof(name), "serial '%c', per device", *q);
+        report(name, ops, blink1_millis() - start);
+
+        blink1_batch_cmd_t cmds[blink1_max_devices];
+        ops = 0;
+        start = blink1_millis();
+        for( int n=0; n < iterations; n++ ) {
+            for( int i=0; i < numDevicesToUse; i++ ) {
+                blink1_batch_query( &cmds[i], deviceIds[i], *q, 0 );
+            }
+            ops += numDevicesToUse - blink1_batch_read( cmds, numDevicesToUse );
+        }
+        snprintf(name, sizeof(name), "pipelined '%c', per device", *q);
+        report(name, ops, blink1_millis() - start);
+    }
+    blink1_poolCloseAll();
+}
+
+//
+// Loading & reading back a full 32-line pattern, line at a time vs bulk reports
+//
+static void bench_pattern(void)
+{
+    patternline_t pattern[32];
+    for( int i=0; i < 32; i++ ) {
+        pattern[i].color.r = i*8; pattern[i].color.g = 0; pattern[i].color.b = 255-i*8;
+        pattern[i].millis = 100;
+        pattern[i].ledn = i % 3;
+    }
+
+    int ops = 0;
+    int64_t start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        blink1_device* dev = blink1_poolAcquire( deviceIds[n % numDevicesToUse] );
+        if( dev == NULL ) continue;
+        for( int i=0; i < 32; i++ ) {
+            blink1_setLEDN( dev, pattern[i].ledn );
+            blink1_writePatternLine( dev, pattern[i].millis, pattern[i].color.r,
+                                     pattern[i].color.g, pattern[i].color.b, i );
+        }
+        blink1_poolRelease( dev );
+        ops++;
+    }
+    report("32 lines, setLEDN+writeLine", ops, blink1_millis() - start);
+
+    ops = 0;
+    start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        blink1_device* dev = blink1_poolAcquire( deviceIds[n % numDevicesToUse] );
+        if( dev == NULL ) continue;
+        if( blink1_writePatternBulk( dev, pattern, 32, 0 ) != -1 ) ops++;
+        blink1_poolRelease( dev );
+    }
+    report("32 lines, writePatternBulk", ops, blink1_millis() - start);
+
+    ops = 0;
+    start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        blink1_device* dev = blink1_poolAcquire( deviceIds[n % numDevicesToUse] );
+        if( dev == NULL ) continue;
+        patternline_t* pl = pattern;
+        for( int i=0; i < 32; i++, pl++ ) {
+            blink1_readPatternLineN( dev, &pl->millis, &pl->color.r, &pl->color.g,
+                                     &pl->color.b, &pl->ledn, i );
+        }
+        blink1_poolRelease( dev );
+        ops++;
+    }
+    report("32 lines, readPatternLineN", ops, blink1_millis() - start);
+
+    ops = 0;
+    start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        blink1_device* dev = blink1_poolAcquire( deviceIds[n % numDevicesToUse] );
+        if( dev == NULL ) continue;
+        if( blink1_readPatternBulk( dev, pattern, 32, 0 ) != -1 ) ops++;
+        blink1_poolRelease( dev );
+    }
+    report("32 lines, readPatternBulk", ops, blink1_millis() - start);
+    blink1_poolCloseAll();
+}
+
+// moving rainbow-ish frame, stops after 'iterations' frames
+static int bench_frame_render( rgb_t* leds, int count, uint32_t frame, void* arg )
+{
+    for( int i=0; i < count; i++ ) {
+        leds[i].r = (frame + i*14) & 0xff;
+        leds[i].g = (frame*2 + i*14) & 0xff;
+        leds[i].b = (frame*3 + i*14) & 0xff;
+    }
+    return frame < (uint32_t)iterations;
+}
+
+//
+// Setting all 18 LEDs, one fadeToRGBN per LED vs one frame,
+// then streaming at a target fps
+//
+static void bench_frame(void)
+{
+    rgb_t leds[blink1mk3_max_leds];
+    blink1_device* dev = blink1_poolAcquire( deviceIds[0] );
+    if( dev == NULL ) return;
+
+    int ops = 0;
+    int64_t start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        bench_frame_render( leds, blink1mk3_max_leds, n, NULL );
+        for( int i=0; i < blink1mk3_max_leds; i++ ) {
+            blink1_fadeToRGBN( dev, 0, leds[i].r, leds[i].g, leds[i].b, i+1 );
+        }
+        ops++;
+    }
+    report("18 LEDs, fadeToRGBN each", ops, blink1_millis() - start);
+
+    ops = 0;
+    start = blink1_millis();
+    for( int n=0; n < iterations; n++ ) {
+        bench_frame_render( leds, blink1mk3_max_leds, n, NULL );
+        if( blink1_writeFrame( dev, leds, 0, blink1mk3_max_leds ) != -1 ) ops++;
+    }
+    report("18 LEDs, writeFrame", ops, blink1_millis() - start);
+
+    int rates[] = { 50, 100, 200 };
+    for( int k=0; k < 3; k++ ) {
+        blink1_stream_stats_t stats;
+        blink1_streamFrames( dev, rates[k], 0, blink1mk3_max_leds,
+                             bench_frame_render, NULL, &stats );
+        printf("  streamFrames @ %3d fps         %6d sent, %6d dropped in %6lld ms\n",
+               rates[k], stats.sent, stats.dropped, (long long)stats.elapsed);
+    }
+    blink1_poolRelease( dev );
+    blink1_poolCloseAll();
+}
+
+
+//
+// Cache lookup by serial, path and handle as the device count grows
+//
+static void bench_lookup(void)
+{
+    int sizes[] = { 8, 32, 128, 512, 2048 };
+    int added = 0;
+    char path[64], serial[serialstrmax];
+    for( int k=0; k < 5; k++ ) {
+        for( ; added < sizes[k]; added++ ) {
+            snprintf( path, sizeof(path), "bench:%d", added );
+            snprintf( serial, sizeof(serial), "F%07X", added );
+            blink1_cacheInsert( path, serial );
+        }
+        int lookups = iterations * 1000;
+        int64_t t0 = blink1_micros();
+        for( int n=0; n < lookups; n++ ) {
+            snprintf( serial, sizeof(serial), "F%07X", n % added );
+            if( blink1_getCacheIndexBySerial( serial ) < 0 ) break;
+        }
+        int64_t t1 = blink1_micros();
+        for( int n=0; n < lookups; n++ ) {
+            snprintf( path, sizeof(path), "bench:%d", n % added );
+            if( blink1_getCacheIndexByPath( path ) < 0 ) break;
+        }
+        int64_t t2 = blink1_micros();
+        for( int n=0; n < lookups; n++ ) {  // a handle that's not in the cache
+            blink1_getCacheIndexByDev( (blink1_device*)&sizes[n % 5] );
+        }
+        int64_t t3 = blink1_micros();
+        printf("  %5d devices: by serial %6.1f ns, by path %6.1f ns, by handle %6.1f ns\n",
+               blink1_getCachedCount(), (t1-t0) * 1000.0 / lookups,
+               (t2-t1) * 1000.0 / lookups, (t3-t2) * 1000.0 / lookups);
+    }
+    for( int i=0; i < added; i++ ) {
+        snprintf( path, sizeof(path), "bench:%d", i );
+        blink1_cacheRemove( path );
+    }
+}
+
+// threads in this process, or -1 if unknown
+static int thread_count(void)
+{
+    int threads = -1;
+#ifdef __linux__
+    char line[128];
+    FILE* f = fopen("/proc/self/status", "r");
+    if( f == NULL ) return -1;
+    while( fgets(line, sizeof(line), f) != NULL ) {
+        if( sscanf(line, "Threads: %d", &threads) == 1 ) break;
+    }
+    fclose(f);
+#endif
+    return threads;
+}
+
+// context switches of all threads in this process so far, or -1 if unknown
+static long context_switches(void)
+{
+#ifndef _WIN32
+    struct rusage ru;
+    if( getrusage(RUSAGE_SELF, &ru) == 0 ) return ru.ru_nvcsw + ru.ru_nivcsw;
+#endif
+    return -1;
+}
+
+//
+// Thread count, context switch rate and query latency as more devices
+// are held open at the same time
+//
+static void bench_devices(void)
+{
+    blink1_device* devs[blink1_max_devices];
+    int opened = 0;
+    int size = 1;
+    while( opened < numDevicesToUse ) {
+        if( size > numDevicesToUse ) size = numDevicesToUse;
+        for( ; opened < size; opened++ ) {
+            devs[opened] = blink1_openById( deviceIds[opened] );
+        }
+
+        // idle: only the input report transfers are running
+        long cs0 = context_switches();
+        int64_t t0 = blink1_millis();
+        blink1_sleep( 500 );
+        long cs1 = context_switches();
+        int64_t t1 = blink1_millis();
+
+        // busy: one query round trip per open device per iteration
+        int ops = 0;
+        for( int n=0; n < iterations; n++ ) {
+            for( int i=0; i < opened; i++ ) {
+                if( devs[i] == NULL ) continue;
+                uint8_t buf[blink1_buf_size] = { blink1_report_id, 'v' };
+                if( blink1_read( devs[i], buf, sizeof(buf) ) != -1 ) ops++;
+            }
+        }
+        long cs2 = context_switches();
+        int64_t t2 = blink1_millis();
+        if( t1 <= t0 ) t1 = t0 + 1;
+        if( t2 <= t1 ) t2 = t1 + 1;
+        if( ops == 0 ) ops = 1;
+
+        printf("  %4d open: %4d threads, %8.1f csw/s idle, %8.1f csw/s busy, %8.3f ms/query\n",
+               opened, thread_count(),
+               (cs1 - cs0) * 1000.0 / (t1 - t0), (cs2 - cs1) * 1000.0 / (t2 - t1),
+               (double)(t2 - t1) / ops);
+        size *= 2;
+    }
+    for( int i=0; i < opened; i++ ) {
+        if( devs[i] != NULL ) blink1_close( devs[i] );
+    }
+}
+
+//
+// Open and close latency, to compare with few and many devices attached
+//
+static void bench_open(void)
+{
+    int64_t open_us = 0, close_us = 0;
+    int ops = 0;
+    for( int n=0; n < iterations; n++ ) {
+        int64_t t0 = blink1_micros();
+        blink1_device* dev = blink1_openById( deviceIds[n % numDevicesToUse] );
+        int64_t t1 = blink1_micros();
+        if( dev == NULL ) continue;
+        blink1_close( dev );
+        open_us += t1 - t0;
+        close_us += blink1_micros() - t1;
+        ops++;
+    }
+    if( ops == 0 ) ops = 1;
+    printf("  %4d blink(1)s attached: open %8.3f ms, close %8.3f ms\n",
+           blink1_getCachedCount(), open_us / 1000.0 / ops, close_us / 1000.0 / ops);
+}
+
+// lowlevel backend this was built with, build once per USBLIB_TYPE to compare
+#if USE_HIDDATA
+#define bench_backend "hiddata"
+#elif USE_HIDRAW
+#define bench_backend "hidraw"
+#else
+#define bench_backend "hidapi"
+#endif
+
+static int cmp_int64( const void* a, const void* b )
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+//
+// Per-command latency distribution on an open handle, for comparing backends
+//
+static void bench_latency(void)
+{
+    static const char* names[] = { "fadeToRGB (write)", "getVersion (write+read)",
+                                   "readRGB (write+read)" };
+    int64_t* us = malloc( iterations * sizeof(int64_t) );
+    if( us == NULL ) return;
+    printf("  backend: %s\n", bench_backend);
+    for( int c=0; c < 3; c++ ) {
+        int ops = 0;
+        for( int n=0; n < iterations; n++ ) {
+            blink1_device* dev = blink1_poolAcquire( deviceIds[n % numDevicesToUse] );
+            if( dev == NULL ) continue;
+            uint16_t millis; uint8_t r, g, b;
+            int64_t t0 = blink1_micros();
+            int rc;
+            switch( c ) {
+            case 0:  rc = blink1_fadeToRGB( dev, 0, n, n, n ); break;
+            case 1:  rc = blink1_getVersion( dev ); break;
+            default: rc = blink1_readRGB( dev, &millis, &r, &g, &b, 0 ); break;
+            }
+            int64_t t1 = blink1_micros();
+            blink1_poolRelease( dev );
+            if( rc != -1 ) us[ops++] = t1 - t0;
+        }
+        if( ops == 0 ) continue;
+        qsort( us, ops, sizeof(int64_t), cmp_int64 );
+        printf("  %-28s %6d ops: p50 %7.3f ms, p99 %7.3f ms, max %7.3f ms\n",
+               names[c], ops, us[ops/2] / 1000.0, us[(ops*99)/100] / 1000.0,
+               us[ops-1] / 1000.0);
+    }
+    free( us );
+    blink1_poolCloseAll();
+}
+
+//
+// Pattern parsing, patterns/sec for device-sized and long patterns,
+// then random mutations of a pattern to check the parser stays in bounds
+//
+static void bench_parse(void)
+{
+    static char str[200000];
+    int len = 0;
+    int repeats;
+    blink1_parse_error_t err;
+    patternline_t lines[32];
+    int ops = iterations * 1000;
+
+    len = sprintf(str, "3");
+    for( int i=0; i < 32; i++ ) {
+        len += sprintf(str+len, ", #%2.2x%2.2x%2.2x,%d.%d,%d", i*8, 255-i*8, i, i/10, i%10, i%3);
+    }
+    int64_t start = blink1_millis();
+    for( int n=0; n < ops; n++ ) {
+        blink1_parsePatternN( str, len, &repeats, lines, 32, &err );
+    }
+    report("parse 32-line pattern", ops, blink1_millis() - start);
+
+    int biglines = 0;
+    len = sprintf(str, "0");
+    while( len < (int)sizeof(str) - 30 ) {
+        len += sprintf(str+len, ",#%6.6x,0.%d,%d", biglines*4099 & 0xffffff, biglines%10, biglines%3);
+        biglines++;
+    }
+    ops = iterations;
+    start = blink1_millis();
+    for( int n=0; n < ops; n++ ) {
+        if( blink1_parsePatternN( str, len, &repeats, NULL, 0, &err ) != biglines ) {
+            printf("  long pattern: wrong line count\n");
+            break;
+        }
+    }
+    char name[40];
+    sprintf(name, "parse %d-line pattern", biglines);
+    report(name, ops, blink1_millis() - start);
+
+    // mutate a pattern, parse into a small buffer, check it stays inside
+    const char* seed = "4,#ff0000,0.5,1, 00ff00 ,1.25,2,,0x0000ff,0.05,0, #123,2,0x1";
+    patternline_t small[4+1];
+    int parsed = 0, rejected = 0, failures = 0;
+    ops = iterations * 100;
+    srand(1);
+    for( int n=0; n < ops; n++ ) {
+        len = strlen(seed);
+        memcpy(str, seed, len);
+        for( int m = 1 + rand() % 4; m > 0 && len > 0; m-- ) {
+            int pos = rand() % len;
+            switch( rand() % 4 ) {
+            case 0: str[pos] = rand() % 256; break;              // flip a byte
+            case 1: str[pos] = ",#.x 09af-"[rand() % 10]; break; // likely char
+            case 2: len = pos; break;                            // truncate
+            case 3: memmove(str+pos+1, str+pos, len-pos);        // duplicate
+                    len++; break;
+            }
+        }
+        memset( &small[4], 0xa5, sizeof(patternline_t) );
+        int rc = blink1_parsePatternN( str, len, &repeats, small, 4, &err );
+        int count = blink1_parsePatternN( str, len, &repeats, NULL, 0, &err );
+        uint8_t* canary = (uint8_t*)&small[4];
+        int bad = (rc < -1 || rc > 4) || (rc >= 0 && rc != count) ||
+            (rc == -1 && err.offset > (size_t)len);
+        for( size_t i=0; i < sizeof(patternline_t); i++ ) {
+            if( canary[i] != 0xa5 ) bad = 1;
+        }
+        if( bad && failures++ == 0 ) {
+            printf("  mutated pattern failed: '%.*s'\n", len, str);
+        }
+        if( rc >= 0 ) parsed++; else rejected++;
+    }
+    printf("  %d mutated patterns: %d parsed, %d rejected, %d failures\n",
+           ops, parsed, rejected, failures);
+}
+
+static const benchmark_t benchmarks[] = {
+    {"pool",  "open/close per command vs pooled handles", bench_pool },
+    {"batch", "per-device loop vs concurrent batch update", bench_batch },
+    {"query", "per-device send+get vs pipelined batch query", bench_query },
+    {"pattern", "pattern upload & readback, line at a time vs bulk", bench_pattern },
+    {"frame", "per-LED updates vs whole frames, frame streaming", bench_frame },
+    {"lookup", "device cache lookups vs number of devices", bench_lookup },
+    {"devices", "threads, context switches & latency vs open devices", bench_devices },
+    {"open", "open & close latency with the attached devices", bench_open },
+    {"latency", "per-command latency of the " bench_backend " backend", bench_latency },
+    {"parse", "pattern parsing, patterns/sec & mutated input", bench_parse, 1 },
+};
+static const int benchmarks_count = sizeof(benchmarks)/sizeof(benchmark_t);
+
+//
+static void usage(char *myName)
+{
+    fprintf(stderr,
+"Usage: \n"
+"  %s [options] [benchmark ...]\n"
+"where [options] are: \n"
+"  -n num, --iterations=num    Number of iterations per benchmark (default 100)\n"
+"  -d dNums --id all|deviceIds Use these blink(1) ids (from blink1-tool --list) \n"
+"  -h, --help                  This help page\n"
+"and [benchmark] is one or more of (default all): \n",
+            myName);
+    for( int i=0; i < benchmarks_count; i++ ) {
+        fprintf(stderr, "  %-12s  %s\n", benchmarks[i].name, benchmarks[i].desc);
+    }
+    fprintf(stderr,"\n");
+}
+
+//
+int main(int argc, char** argv)
+{
+    int option_index = 0, opt;
+    char* opt_str = "hn:d:";
+    static struct option loptions[] = {
+        {"iterations", required_argument, 0,      'n'},
+        {"id",         required_argument, 0,      'd'},
+        {"help",       no_argument,       0,      'h'},
+        {NULL,         0,                 0,      0}
+    };
+    while(1) {
+        opt = getopt_long(argc, argv, opt_str, loptions, &option_index);
+        if (opt==-1) break; // parsed all the args
+        switch (opt) {
+        case 'n':
+            iterations = strtol(optarg,NULL,10);
+            break;
+        case 'd':
+            numDevicesToUse = 0;
+            if( strcmp(optarg,"all") != 0 ) {
+                char* pch = strtok( optarg, " ,");
+                while( pch != NULL && numDevicesToUse < blink1_max_devices ) {
+                    int base = (strlen(pch)==8) ? 16:0;
+                    deviceIds[numDevicesToUse++] = strtol(pch,NULL,base);
+                    pch = strtok(NULL, " ,");
+                }
+            }
+            break;
+        case 'h':
+            usage("blink1-bench");
+            exit(1);
+            break;
+        }
+    }
+
+    int offline = 1;  // only running benchmarks that need no blink(1)
+    for( int i=0; i < benchmarks_count; i++ ) {
+        int selected = (optind >= argc);
+        for( int a=optind; a < argc; a++ ) {
+            if( strcmp(argv[a], benchmarks[i].name) == 0 ) selected = 1;
+        }
+        if( selected && !benchmarks[i].offline ) offline = 0;
+    }
+
+    int count = (offline) ? 0 : blink1_enumerate();
+    if( count == 0 && !offline ) {
+        fprintf(stderr, "no blink(1) devices found\n");
+        exit(1);
+    }
+    if( count > blink1_max_devices ) count = blink1_max_devices;
+    if( numDevicesToUse == 0 ) {
+        numDevicesToUse = count;
+        for( int i=0; i < count; i++ ) deviceIds[i] = i;
+    }
+
+    printf("blink1-bench version: %s, %d device(s), %d iterations\n",
+           BLINK1_VERSION, numDevicesToUse, iterations);
+
+    for( int i=0; i < benchmarks_count; i++ ) {
+        int selected = (optind >= argc);
+        for( int a=optind; a < argc; a++ ) {
+            if( strcmp(argv[a], benchmarks[i].name) == 0 ) selected = 1;
+        }
+        if( !selected ) continue;
+        printf("%s: %s\n", benchmarks[i].name, benchmarks[i].desc);
+        benchmarks[i].func();
+    }
+
+    return 0;
+}
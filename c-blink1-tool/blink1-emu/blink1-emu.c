@@ -0,0 +1,343 @@
+/*
+ * blink1-emu.c -- emulate blink(1) devices with Linux uhid
+ *
+ * Creates virtual blink(1) mk1, mk2, or mk3 devices via /dev/uhid.
+ * They show up as hidraw devices with the real VID/PID and serial number,
+ * so blink1-lib, blink1-tool and blink1-tiny-server can be tested and
+ * benchmarked without hardware.
+ *
+ * Feature reports are answered by the mk3 firmware's own command handling,
+ * via the firmware simulator in firmware-v30x/sim, run in real time.
+ * mk1 & mk2 devices use the same command set on report id 1 only,
+ * with their own version number and serial number range.
+ *
+ * Each virtual device runs in its own process, since the simulator
+ * handles one device per process.
+ *
+ * Needs write access to /dev/uhid (usually root, or "modprobe uhid" first).
+ *
+ * Create 100 mk3 devices, each taking 1 msec per feature report:
+ * sudo ./blink1-emu -n 100 -l 1000
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <linux/input.h>  // BUS_USB
+#include <linux/uhid.h>
+
+#include "blink1-sim.h"
+
+#define blink1_vid 0x27B8
+#define blink1_pid 0x01ED
+
+#define REPORT_ID  1
+#define REPORT2_ID  2
+#define REPORT_COUNT blink1sim_report_size
+#define REPORT2_COUNT blink1sim_report2_size
+
+static int emu_type = 3;          // 1 = mk1, 2 = mk2, 3 = mk3
+static uint32_t emu_serial;
+
+// mk3 HID descriptor, from firmware-v30x/descriptors.h
+static const uint8_t hidDescriptor2[] = {
+    0x06, 0xAB, 0xFF,
+    0x0A, 0x00, 0x20,
+    0xA1, 0x01,                    // COLLECTION (Application)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x85, REPORT_ID,               //   REPORT_ID (1)
+    0x95, REPORT_COUNT,            //   REPORT_COUNT (8)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x85, REPORT2_ID,              //   REPORT_ID (2)
+    0x95, REPORT2_COUNT,           //   REPORT_COUNT (60)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+    0xc0,                          // END_COLLECTION
+};
+
+// mk1 & mk2 HID descriptor, report id 1 only
+static const uint8_t hidDescriptor1[] = {
+    0x06, 0xAB, 0xFF,
+    0x0A, 0x00, 0x20,
+    0xA1, 0x01,                    // COLLECTION (Application)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x85, REPORT_ID,               //   REPORT_ID (1)
+    0x95, REPORT_COUNT,            //   REPORT_COUNT (8)
+    0x09, 0x00,                    //   USAGE (Undefined)
+    0xb2, 0x02, 0x01,              //   FEATURE (Data,Var,Abs,Buf)
+    0xc0,                          // END_COLLECTION
+};
+
+static int verbose = 0;
+static int latency_usec = 0;       // added to every feature report
+static struct timespec start_time;
+static uint8_t shown[blink1sim_num_leds*3];  // last LED colors printed
+
+static volatile sig_atomic_t done = 0;
+
+static void sigHandler(int sig)
+{
+    (void)sig;
+    done = 1;
+}
+
+static uint32_t emuMillis(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint32_t)( (t.tv_sec - start_time.tv_sec) * 1000 +
+                       (t.tv_nsec - start_time.tv_nsec) / 1000000 );
+}
+
+// called by the simulator with every LED frame, print LEDs if they changed
+static void showFrame(uint32_t millis, const uint8_t* rgb, void* arg)
+{
+    (void)arg;
+    if( memcmp(shown, rgb, sizeof(shown)) == 0 ) return;
+    memcpy(shown, rgb, sizeof(shown));
+    printf("%08x: %6u ms:", emu_serial, (unsigned)millis);
+    int n = (emu_type == 1) ? 1 : 2;  // number of physical LEDs
+    for( int i = 0; i < n; i++ ) {
+        printf(" #%2.2x%2.2x%2.2x", rgb[i*3+0], rgb[i*3+1], rgb[i*3+2]);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static int uhidWrite(int fd, struct uhid_event* ev)
+{
+    ssize_t rc = write(fd, ev, sizeof(*ev));
+    if( rc != sizeof(*ev) ) {
+        fprintf(stderr, "%08x: uhid write failed: %s\n", emu_serial,
+                (rc < 0) ? strerror(errno) : "short write");
+        return -1;
+    }
+    return 0;
+}
+
+static int uhidCreate(int fd)
+{
+    struct uhid_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = UHID_CREATE2;
+    snprintf((char*)ev.u.create2.name, sizeof(ev.u.create2.name),
+             "ThingM blink(1) mk%d", emu_type);
+    snprintf((char*)ev.u.create2.phys, sizeof(ev.u.create2.phys),
+             "blink1-emu/%08x", emu_serial);
+    snprintf((char*)ev.u.create2.uniq, sizeof(ev.u.create2.uniq),
+             "%08x", emu_serial);
+    const uint8_t* desc = (emu_type == 3) ? hidDescriptor2 : hidDescriptor1;
+    uint16_t descsize = (emu_type == 3) ? sizeof(hidDescriptor2) : sizeof(hidDescriptor1);
+    memcpy(ev.u.create2.rd_data, desc, descsize);
+    ev.u.create2.rd_size = descsize;
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = blink1_vid;
+    ev.u.create2.product = blink1_pid;
+    ev.u.create2.version = 0x0100 * emu_type;
+    return uhidWrite(fd, &ev);
+}
+
+// handle one event from the kernel, feature reports go to the simulator
+static int uhidEvent(int fd, struct uhid_event* ev)
+{
+    struct uhid_event reply;
+    memset(&reply, 0, sizeof(reply));
+
+    if( ev->type == UHID_SET_REPORT ) {
+        struct uhid_set_report_req* req = &ev->u.set_report;
+        reply.type = UHID_SET_REPORT_REPLY;
+        reply.u.set_report_reply.id = req->id;
+        reply.u.set_report_reply.err = EIO;
+        if( req->rtype == UHID_FEATURE_REPORT && req->size > 0 ) {
+            req->data[0] = req->rnum;
+            if( blink1sim_sendReport(req->data, req->size) != -1 ) {
+                reply.u.set_report_reply.err = 0;
+            }
+        }
+    }
+    else if( ev->type == UHID_GET_REPORT ) {
+        struct uhid_get_report_req* req = &ev->u.get_report;
+        reply.type = UHID_GET_REPORT_REPLY;
+        reply.u.get_report_reply.id = req->id;
+        reply.u.get_report_reply.err = EIO;
+        if( req->rtype == UHID_FEATURE_REPORT ) {
+            uint8_t* buf = reply.u.get_report_reply.data;
+            buf[0] = req->rnum;
+            int count = blink1sim_getReport(buf, blink1sim_report2_size);
+            if( count != -1 ) {
+                reply.u.get_report_reply.size = count;
+                reply.u.get_report_reply.err = 0;
+            }
+        }
+    }
+    else {
+        return 0;  // UHID_START, UHID_OPEN, UHID_CLOSE, UHID_OUTPUT, etc.
+    }
+
+    if( latency_usec ) usleep(latency_usec);
+    return uhidWrite(fd, &reply);
+}
+
+// run one virtual device until signalled, does not return
+static void runDevice(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    // power up with factory pattern & settings, like an unprogrammed device
+    blink1sim_reset(emu_type, emu_serial);
+    blink1sim_srand(emu_serial);
+    if( verbose ) blink1sim_setFrameCallback(showFrame, NULL);
+
+    int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+    if( fd < 0 ) {
+        fprintf(stderr, "%08x: cannot open /dev/uhid: %s\n", emu_serial, strerror(errno));
+        exit(1);
+    }
+    if( uhidCreate(fd) == -1 ) exit(1);
+    if( verbose ) printf("%08x: created mk%d\n", emu_serial, emu_type);
+
+    struct uhid_event ev;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while( !done ) {
+        // sleep until the firmware has something to do, or a report comes in
+        blink1sim_advanceTo(emuMillis());
+        int wait = (int32_t)(blink1sim_nextEvent() - emuMillis());
+        if( wait < 0 ) wait = 0;
+
+        int rc = poll(&pfd, 1, wait);
+        if( rc < 0 && errno != EINTR ) break;
+        if( rc <= 0 ) continue;
+
+        blink1sim_advanceTo(emuMillis());
+        ssize_t len = read(fd, &ev, sizeof(ev));
+        if( len <= 0 ) {
+            if( len < 0 && (errno == EINTR || errno == EAGAIN) ) continue;
+            break;
+        }
+        if( uhidEvent(fd, &ev) == -1 ) break;
+    }
+
+    close(fd);  // destroys the device
+    exit(0);
+}
+
+static void usage(char* myName)
+{
+    fprintf(stderr,
+"Usage: \n"
+"  %s [options]\n"
+"where [options] can be:\n"
+"  -n NUM, --count=NUM        number of devices to create (default 1)\n"
+"  -t TYPE, --type=TYPE       device type: 1, 2, or 3 for mk1, mk2, mk3 (default 3)\n"
+"  -s SERIAL, --serial=SERIAL first serial number in hex (default 10000000, 20000000, 30000000)\n"
+"  -l USEC, --latency=USEC    add USEC microseconds to every feature report\n"
+"  -v, --verbose              print LED color changes\n"
+"  -h, --help                 this help page\n"
+"\n"
+"Devices are removed when %s exits.\n"
+            ,myName, myName);
+}
+
+int main(int argc, char** argv)
+{
+    int count = 1;
+    uint32_t serialstart = 0;
+
+    static struct option loptions[] = {
+        {"count",   required_argument, 0, 'n'},
+        {"type",    required_argument, 0, 't'},
+        {"serial",  required_argument, 0, 's'},
+        {"latency", required_argument, 0, 'l'},
+        {"verbose", no_argument,       0, 'v'},
+        {"help",    no_argument,       0, 'h'},
+        {NULL,      0,                 0, 0}
+    };
+    int opt;
+    while( (opt = getopt_long(argc, argv, "n:t:s:l:vh", loptions, NULL)) != -1 ) {
+        switch( opt ) {
+        case 'n': count = strtol(optarg, NULL, 0); break;
+        case 't': emu_type = strtol(optarg, NULL, 0); break;
+        case 's': serialstart = strtoul(optarg, NULL, 16); break;
+        case 'l': latency_usec = strtol(optarg, NULL, 0); break;
+        case 'v': verbose++; break;
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if( count < 1 || emu_type < 1 || emu_type > 3 || latency_usec < 0 ) {
+        usage(argv[0]);
+        exit(1);
+    }
+    if( serialstart == 0 ) serialstart = 0x10000000 * emu_type;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigHandler;  // no SA_RESTART, so poll() & wait() return
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pid_t* pids = calloc(count, sizeof(pid_t));
+    if( pids == NULL ) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    int started = 0;
+    for( int i = 0; i < count && !done; i++ ) {
+        emu_serial = serialstart + i;
+        pid_t pid = fork();
+        if( pid == 0 ) {
+            runDevice();
+        }
+        if( pid < 0 ) {
+            fprintf(stderr, "fork failed: %s\n", strerror(errno));
+            break;
+        }
+        pids[started++] = pid;
+    }
+    printf("blink1-emu: %d mk%d device%s, serials %08x-%08x\n", started, emu_type,
+           (started == 1) ? "" : "s", serialstart, serialstart + started - 1);
+    fflush(stdout);
+
+    // wait for a signal or for all devices to go away
+    int running = started;
+    int failed = 0;
+    while( running > 0 ) {
+        if( done == 1 ) {
+            done = 2;
+            for( int i = 0; i < started; i++ ) {
+                if( pids[i] ) kill(pids[i], SIGTERM);
+            }
+        }
+        int status;
+        pid_t pid = wait(&status);
+        if( pid < 0 ) {
+            if( errno == EINTR ) continue;
+            break;
+        }
+        for( int i = 0; i < started; i++ ) {
+            if( pids[i] == pid ) pids[i] = 0;
+        }
+        if( WIFEXITED(status) && WEXITSTATUS(status) != 0 ) failed++;
+        running--;
+    }
+    free(pids);
+    return (failed) ? 1 : 0;
+}
@@ -0,0 +1,35 @@
+/**
+ * blink(1) C library -- internal hooks
+ *
+ * Not part of the public API and not installed. Shared between
+ * blink1-lib.c, its lowlevel backends and the in-tree tools that
+ * need to drive the device cache directly (e.g. blink1-bench).
+ *
+ */
+
+#ifndef __BLINK1_LIB_INTERNAL_H__
+#define __BLINK1_LIB_INTERNAL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Add a device to the cache, keeping it sorted by serial.
+ * Normally called by the backend's hotplug monitor.
+ * @param path OS-specific device path (copied)
+ * @param serial device serial number (copied)
+ */
+void blink1_cacheInsert( const char* path, const char* serial );
+
+/**
+ * Drop a device from the cache. Open handles to it stay valid to close.
+ * @param path OS-specific device path
+ */
+void blink1_cacheRemove( const char* path );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
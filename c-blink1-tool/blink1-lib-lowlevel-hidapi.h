@@ -2,6 +2,218 @@
 #include "hidapi.h"
 
 
+//
+// hotplug monitoring
+//
+// Once the cache has been filled by a full hid_enumerate(), a monitor
+// thread keeps it current from hotplug events, so later calls to
+// blink1_enumerate() don't have to walk the whole bus again.
+// The monitor matches whatever VID/PID the cache was last filled for.
+//
+
+#if defined(BLINK1_HOTPLUG_UDEV)
+#include <libudev.h>
+#include <poll.h>
+#include <errno.h>
+
+// get serial of a hidraw node if it's one of ours, from its parent hid device
+static int blink1_udevMatch( struct udev_device* rawdev, char* serial, int len )
+{
+    struct udev_device* hiddev =
+        udev_device_get_parent_with_subsystem_devtype( rawdev, "hid", NULL );
+    if( hiddev == NULL ) return 0;
+    const char* hidid = udev_device_get_property_value( hiddev, "HID_ID" );
+    const char* uniq  = udev_device_get_property_value( hiddev, "HID_UNIQ" );
+    unsigned int bus, vid, pid;
+    if( hidid == NULL || sscanf( hidid, "%x:%x:%x", &bus, &vid, &pid ) != 3 ) {
+        return 0;
+    }
+    if( (int)vid != __atomic_load_n( &blink1_cached_vid, __ATOMIC_RELAXED ) ||
+        (int)pid != __atomic_load_n( &blink1_cached_pid, __ATOMIC_RELAXED ) ) return 0;
+    if( uniq == NULL || uniq[0] == '\0' ) return 0;  // can happen if not root
+    snprintf( serial, len, "%s", uniq );
+    return 1;
+}
+
+static void* blink1_hotplugThread( void* arg )
+{
+    struct udev_monitor* mon = (struct udev_monitor*) arg;
+    struct pollfd pfd = { udev_monitor_get_fd(mon), POLLIN, 0 };
+    while( 1 ) {
+        if( poll( &pfd, 1, -1 ) < 0 ) {
+            if( errno == EINTR ) continue;
+            break;
+        }
+        struct udev_device* rawdev = udev_monitor_receive_device( mon );
+        if( rawdev == NULL ) continue;
+        const char* action = udev_device_get_action( rawdev );
+        const char* node   = udev_device_get_devnode( rawdev );
+        char serial[serialstrmax];
+        if( action && node ) {
+            if( strcmp( action, "add" ) == 0 &&
+                blink1_udevMatch( rawdev, serial, sizeof(serial) ) ) {
+                blink1_cacheInsert( node, serial );
+            }
+            else if( strcmp( action, "remove" ) == 0 ) {
+                blink1_cacheRemove( node );
+            }
+        }
+        udev_device_unref( rawdev );
+    }
+    LOG("blink1_hotplugThread: udev monitor failed, back to full scans\n");
+    __atomic_store_n( &blink1_hotplug_active, 0, __ATOMIC_RELEASE );
+    return NULL;
+}
+
+// start the udev monitor, returns 0 if running, -1 if not available
+static int blink1_hotplugStart(void)
+{
+    struct udev* udev = udev_new();
+    if( udev == NULL ) return -1;
+    struct udev_monitor* mon = udev_monitor_new_from_netlink( udev, "udev" );
+    if( mon == NULL ) {
+        udev_unref( udev );
+        return -1;
+    }
+    pthread_t thread;
+    if( udev_monitor_filter_add_match_subsystem_devtype( mon, "hidraw", NULL ) < 0 ||
+        udev_monitor_enable_receiving( mon ) < 0 ||
+        pthread_create( &thread, NULL, blink1_hotplugThread, mon ) != 0 ) {
+        udev_monitor_unref( mon );
+        udev_unref( udev );
+        return -1;
+    }
+    pthread_detach( thread );
+    return 0;
+}
+
+#elif defined(BLINK1_HOTPLUG_LIBUSB)
+#include <libusb.h>
+
+static libusb_context* blink1_usbctx = NULL;
+// arrivals wait here until the event thread can read their serial,
+// as synchronous transfers aren't allowed inside a hotplug callback
+static libusb_device** blink1_usbarrived = NULL;
+static int blink1_usbarrived_count = 0;
+static int blink1_usbarrived_cap = 0;
+
+// same path hidapi's libusb backend uses, "bus-port.port:config.interface"
+static int blink1_usbPath( libusb_device* usbdev, char* path, int len )
+{
+    uint8_t ports[8];
+    int nports = libusb_get_port_numbers( usbdev, ports, sizeof(ports) );
+    struct libusb_config_descriptor* conf;
+    if( nports <= 0 || libusb_get_config_descriptor( usbdev, 0, &conf ) != 0 ) {
+        return -1;
+    }
+    int ifnum = -1;
+    for( int j=0; j < conf->bNumInterfaces && ifnum < 0; j++ ) {
+        if( conf->interface[j].num_altsetting > 0 &&
+            conf->interface[j].altsetting[0].bInterfaceClass == LIBUSB_CLASS_HID ) {
+            ifnum = conf->interface[j].altsetting[0].bInterfaceNumber;
+        }
+    }
+    int n = snprintf( path, len, "%u-%u", libusb_get_bus_number(usbdev), ports[0] );
+    for( int j=1; j < nports; j++ ) {
+        n += snprintf( path+n, len-n, ".%u", ports[j] );
+    }
+    snprintf( path+n, len-n, ":%u.%u", conf->bConfigurationValue, ifnum );
+    libusb_free_config_descriptor( conf );
+    return (ifnum < 0) ? -1 : 0;
+}
+
+static int LIBUSB_CALL blink1_usbHotplug( libusb_context* ctx, libusb_device* usbdev,
+                                          libusb_hotplug_event event, void* arg )
+{
+    (void)ctx; (void)arg;
+    struct libusb_device_descriptor desc;
+    if( libusb_get_device_descriptor( usbdev, &desc ) != 0 ||
+        desc.idVendor != __atomic_load_n( &blink1_cached_vid, __ATOMIC_RELAXED ) ||
+        desc.idProduct != __atomic_load_n( &blink1_cached_pid, __ATOMIC_RELAXED ) ) {
+        return 0;
+    }
+    if( event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT ) {
+        char path[pathstrmax];
+        if( blink1_usbPath( usbdev, path, sizeof(path) ) == 0 ) {
+            blink1_cacheRemove( path );
+        }
+    }
+    else {
+        if( blink1_usbarrived_count == blink1_usbarrived_cap ) {
+            int cap = blink1_usbarrived_cap ? blink1_usbarrived_cap*2 : cache_max;
+            libusb_device** arrived = realloc( blink1_usbarrived, cap * sizeof(libusb_device*) );
+            if( arrived == NULL ) return 0;
+            blink1_usbarrived = arrived;
+            blink1_usbarrived_cap = cap;
+        }
+        blink1_usbarrived[blink1_usbarrived_count++] = libusb_ref_device( usbdev );
+    }
+    return 0;
+}
+
+static void blink1_usbAdd( libusb_device* usbdev )
+{
+    char path[pathstrmax];
+    unsigned char serial[serialstrmax] = {0};
+    struct libusb_device_descriptor desc;
+    libusb_device_handle* handle;
+    if( blink1_usbPath( usbdev, path, sizeof(path) ) != 0 ||
+        libusb_get_device_descriptor( usbdev, &desc ) != 0 ||
+        libusb_open( usbdev, &handle ) != 0 ) {
+        return;
+    }
+    int rc = libusb_get_string_descriptor_ascii( handle, desc.iSerialNumber,
+                                                 serial, sizeof(serial) );
+    libusb_close( handle );
+    if( rc > 0 ) {
+        blink1_cacheInsert( path, (const char*)serial );
+    }
+}
+
+static void* blink1_hotplugThread( void* arg )
+{
+    (void)arg;
+    int rc;
+    while( (rc = libusb_handle_events( blink1_usbctx )) == 0 ||
+           rc == LIBUSB_ERROR_INTERRUPTED ) {
+        for( int i=0; i < blink1_usbarrived_count; i++ ) {
+            blink1_usbAdd( blink1_usbarrived[i] );
+            libusb_unref_device( blink1_usbarrived[i] );
+        }
+        blink1_usbarrived_count = 0;
+    }
+    LOG("blink1_hotplugThread: libusb events failed, back to full scans\n");
+    __atomic_store_n( &blink1_hotplug_active, 0, __ATOMIC_RELEASE );
+    return NULL;
+}
+
+// start the libusb hotplug monitor, returns 0 if running, -1 if not available
+static int blink1_hotplugStart(void)
+{
+    if( libusb_init( &blink1_usbctx ) != 0 ) return -1;
+    pthread_t thread;
+    if( !libusb_has_capability( LIBUSB_CAP_HAS_HOTPLUG ) ||
+        libusb_hotplug_register_callback( blink1_usbctx,
+              LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+              0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+              LIBUSB_HOTPLUG_MATCH_ANY, blink1_usbHotplug, NULL, NULL ) != 0 ||
+        pthread_create( &thread, NULL, blink1_hotplugThread, NULL ) != 0 ) {
+        libusb_exit( blink1_usbctx );
+        blink1_usbctx = NULL;
+        return -1;
+    }
+    pthread_detach( thread );
+    return 0;
+}
+
+#else
+// no hotplug support on this backend, always do full scans
+static int blink1_hotplugStart(void)
+{
+    return -1;
+}
+#endif
+
 //
 int blink1_enumerate(void)
 {
@@ -13,45 +225,84 @@ int blink1_enumerateByVidPid(int vid, int pid)
 {
     struct hid_device_info *devs, *cur_dev;
 
-    int p = 0;
-    devs = hid_enumerate(vid, pid);
+    // hotplug events have kept the cache current, nothing to scan
+    static int rescan = 0;  // last scan kept racing hotplug events
+    if( __atomic_load_n( &blink1_hotplug_active, __ATOMIC_ACQUIRE ) &&
+        !__atomic_load_n( &rescan, __ATOMIC_ACQUIRE ) &&
+        vid == blink1_cached_vid && pid == blink1_cached_pid ) {
+        return blink1_getCachedCount();
+    }
+
+    blink1_poolCloseAll(); // cache indices are about to change
+
+    // start the monitor before scanning so no arrival falls in between,
+    // events for devices the scan also finds are no-ops
+    __atomic_store_n( &blink1_cached_vid, vid, __ATOMIC_RELAXED );
+    __atomic_store_n( &blink1_cached_pid, pid, __ATOMIC_RELAXED );
+    static int hotplug_started = 0;
+    if( __atomic_exchange_n( &hotplug_started, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+        int active = (blink1_hotplugStart() == 0);
+        __atomic_store_n( &blink1_hotplug_active, active, __ATOMIC_RELEASE );
+        LOG("blink1_enumerateByVidPid: hotplug %s\n",
+            active ? "active" : "unavailable");
+    }
+
+    // a hotplug event handled while scanning would be lost when the scan
+    // replaces the cache, so scan again if one came in meanwhile
+    for( int tries=1; ; tries++ ) {
+        uint32_t gen = __atomic_load_n( &blink1_hotplug_gen, __ATOMIC_ACQUIRE );
+        devs = hid_enumerate(vid, pid);
+        cache_wrlock();
+        int raced = (__atomic_load_n( &blink1_hotplug_gen, __ATOMIC_ACQUIRE ) != gen);
+        if( !raced || tries == 5 ) {  // if still racing, scan again next call
+            __atomic_store_n( &rescan, raced, __ATOMIC_RELEASE );
+            break;
+        }
+        cache_wrunlock();
+        hid_free_enumeration(devs);
+        LOG("blink1_enumerateByVidPid: devices changed during scan, again\n");
+    }
+
+    blink1_cacheClear();
     cur_dev = devs;
     while (cur_dev) {
         if( (cur_dev->vendor_id != 0 && cur_dev->product_id != 0) &&
             (cur_dev->vendor_id == vid && cur_dev->product_id == pid) ) {
             if( cur_dev->serial_number != NULL ) { // can happen if not root
-                strncpy( blink1_infos[p].path, cur_dev->path,
-                    sizeof(blink1_infos[p].path));
-                snprintf(blink1_infos[p].serial, sizeof(blink1_infos[p].serial),
-                    "%ls", cur_dev->serial_number);
-                //wcscpy( blink1_infos[p].serial, cur_dev->serial_number );
-                //uint32_t sn = wcstol( cur_dev->serial_number, NULL, 16);
-                uint32_t serialnum = strtol( blink1_infos[p].serial, NULL, 16);
-                blink1_infos[p].type = BLINK1_MK1;
-                if(      serialnum >= blink1mk3_serialstart ) {
-                    blink1_infos[p].type = BLINK1_MK3;
-                }
-                else if( serialnum >= blink1mk2_serialstart ) {
-                    blink1_infos[p].type = BLINK1_MK2;
-                }
-                p++;
+                char serial[serialstrmax];
+                snprintf(serial, sizeof(serial), "%ls", cur_dev->serial_number);
+                if( blink1_cacheAppend( cur_dev->path, serial ) == NULL ) break;
             }
         }
         cur_dev = cur_dev->next;
     }
     hid_free_enumeration(devs);
 
+    int p = blink1_cached_count;
     LOG("blink1_enumerateByVidPid: done, %d devices found\n",p);
+    blink1_sortCache();
     for( int i=0; i<p; i++ ) {
-        LOG("blink1_enumerateByVidPid: blink1_infos[%d].serial=%s\n",
-            i, blink1_infos[i].serial);
+        LOG("blink1_enumerateByVidPid: blink1_infos[%d]->serial=%s\n",
+            i, blink1_infos[i]->serial);
     }
-    blink1_cached_count = p;
-    blink1_sortCache();
+    cache_wrunlock();
 
     return p;
 }
 
+// open a handle without noting it in the cache
+static blink1_device* blink1_lowlevelOpenByPath(const char* path)
+{
+    if( path == NULL || strlen(path) == 0 ) return NULL;
+    return hid_open_path( path );
+}
+
+// close a handle that's not in the cache (anymore)
+static void blink1_lowlevelClose( blink1_device* dev )
+{
+    hid_close( dev );
+}
+
 //
 blink1_device* blink1_openByPath(const char* path)
 {
@@ -59,15 +310,12 @@ blink1_device* blink1_openByPath(const char* path)
 
     LOG("blink1_openByPath: %s\n", path);
 
-    blink1_device* handle = hid_open_path( path );
+    blink1_device* handle = blink1_lowlevelOpenByPath( path );
 
     LOG("blink1_openByPath: handle=%p\n",handle);
 
-    int i = blink1_getCacheIndexByPath( path );
-    if( i >= 0 ) {  // good
-        blink1_infos[i].dev = handle;
-    }
-    else { // uh oh, not in cache, now what?
+    if( blink1_cacheSetDev( path, NULL, handle ) < 0 ) {
+        // uh oh, not in cache, now what?
       LOG("blink1_openByPath: error no match");
     }
     return handle;
@@ -81,10 +329,12 @@ blink1_device* blink1_openBySerial(const char* serial)
     int pid = blink1_pid();
 
     LOG("blink1_openBySerial: %s at vid/pid %x/%x\n", serial, vid,pid);
-    int i = blink1_getCacheIndexBySerial( serial );
+    cache_rdlock();
+    int i = blink1_cacheFindSerial( serial );
     if( i >= 0 ) {
-        serial = blink1_infos[i].serial;
+        serial = blink1_infos[i]->serial;  // as the device has it, interned
     }
+    cache_rdunlock();
 
     wchar_t wserialstr[serialstrmax] = {L'\0'};
 #ifdef _WIN32   // omg windows
@@ -92,14 +342,13 @@ blink1_device* blink1_openBySerial(const char* serial)
 #else
     swprintf( wserialstr, serialstrmax, L"%s", serial); // convert to wchar_t*
 #endif
-    LOG("blink1_openBySerial: serialstr: '%ls' %d\n", wserialstr,
-        blink1_getCacheIndexBySerial( serial ) );
+    LOG("blink1_openBySerial: serialstr: '%ls' %d\n", wserialstr, i );
     blink1_device* handle = hid_open(vid,pid, wserialstr );
     if( handle ) LOG("blink1_openBySerial: got a blink1_device handle\n");
 
+    i = blink1_cacheSetDev( NULL, serial, handle );
     if( i >= 0 ) {
         LOG("blink1_openBySerial: good, serial id:%d was in cache\n",i);
-        blink1_infos[i].dev = handle;
     }
     else { // uh oh, not in cache, now what?
         LOG("blink1_openBySerial: uh oh, serial id:%d was NOT IN CACHE\n",i);
@@ -138,7 +387,7 @@ void blink1_close_internal( blink1_device* dev )
     LOG("close_internal:%p\n",dev);
     if( dev != NULL ) {
         blink1_clearCacheDev(dev); // FIXME: hmmm
-        hid_close(dev);
+        blink1_lowlevelClose(dev);
     }
     //hid_exit(); // FIXME: this cleans up libusb in a way that hid_close doesn't
 }
@@ -152,10 +401,13 @@ int blink1_write( blink1_device* dev, void* buf, int len)
     if( dev==NULL ) {
         return -1; // BLINK1_ERR_NOTOPEN;
     }
+    int64_t t0 = blink1_statsStart();
     int rc = hid_send_feature_report( dev, buf, len );
+    blink1_statsRecord( dev, blink1_stats_write, b[1], t0, rc==-1 );
     // FIXME: put this in an ifdef?
     if( rc==-1 ) {
         LOG("blink1_write error: %ls\n", hid_error(dev));
+        blink1_poolMarkStale(dev);
     }
     return rc;
 }
@@ -165,9 +417,13 @@ int blink1_read_nosend( blink1_device* dev, void* buf, int len)
   if( dev==NULL ) {
     return -1; // BLINK1_ERR_NOTOPEN;
   }
-  int rc = 0;
-  if( (rc = hid_get_feature_report(dev, buf, len) == -1) ) {
+  uint8_t cmd = ((uint8_t*)buf)[1];
+  int64_t t0 = blink1_statsStart();
+  int rc = hid_get_feature_report(dev, buf, len);
+  blink1_statsRecord( dev, blink1_stats_read, cmd, t0, rc==-1 );
+  if( rc == -1 ) {
     LOG("error reading data: %s\n",blink1_error_msg(rc));
+    blink1_poolMarkStale(dev);
   }
   return rc;
 }
@@ -179,10 +435,17 @@ int blink1_read( blink1_device* dev, void* buf, int len)
     if( dev==NULL ) {
         return -1; // BLINK1_ERR_NOTOPEN;
     }
+    uint8_t cmd = ((uint8_t*)buf)[1];
+    int64_t t0 = blink1_statsStart();
     int rc = hid_send_feature_report(dev, buf, len); // FIXME: check rc
+    blink1_statsRecord( dev, blink1_stats_write, cmd, t0, rc==-1 );
 
-    if( (rc = hid_get_feature_report(dev, buf, len) == -1) ) {
+    t0 = blink1_statsStart();
+    rc = hid_get_feature_report(dev, buf, len);
+    blink1_statsRecord( dev, blink1_stats_read, cmd, t0, rc==-1 );
+    if( (rc = (rc == -1)) ) {
       LOG("error reading data: %s\n",blink1_error_msg(rc));
+      blink1_poolMarkStale(dev);
     }
     return rc;
 }
@@ -32,10 +32,14 @@ int blink1_enumerate(void)
 int blink1_enumerateByVidPid(int vid, int pid)
 {
     int p = 0; 
+    blink1_poolCloseAll(); // cache indices are about to change
     if( blink1_open() ) { 
         blink1_close(static_dev);
         p = 1;
     }
+    cache_wrlock();
+    blink1_cacheClear();
+    if( p ) blink1_cacheAppend( "", "" ); // libusb-0.1 gives no path or serial
 
     /*
     struct hid_device_info *devs, *cur_dev;
@@ -65,13 +69,24 @@ int blink1_enumerateByVidPid(int vid, int pid)
     hid_free_enumeration(devs);
 */
     
-    blink1_cached_count = p;
-
     blink1_sortCache();
+    cache_wrunlock();
 
     return p;
 }
 
+// open a handle without noting it in the cache
+static blink1_device* blink1_lowlevelOpenByPath(const char* path)
+{
+    return blink1_open();  // libusb-0.1 gives no path, there's just one
+}
+
+// close a handle that's not in the cache (anymore)
+static void blink1_lowlevelClose( blink1_device* dev )
+{
+    usbhidCloseDevice( dev );
+}
+
 //
 blink1_device* blink1_openByPath(const char* path)
 {
@@ -166,7 +181,7 @@ void blink1_close_internal( blink1_device* dev )
 {
     if( dev != NULL ) {
         blink1_clearCacheDev(dev); // FIXME: hmmm 
-        usbhidCloseDevice(dev);
+        blink1_lowlevelClose(dev);
     }
     //hid_exit();// FIXME: this cleans up libusb in a way that hid_close doesn't
 }
@@ -178,13 +193,37 @@ int blink1_write( blink1_device* dev, void* buf, int len)
     if( dev==NULL ) {
         return -1; // BLINK1_ERR_NOTOPEN;
     }
-    if( (rc = usbhidSetReport(dev, buf, len) != 0) ){
+    uint8_t cmd = ((uint8_t*)buf)[1];
+    int64_t t0 = blink1_statsStart();
+    rc = usbhidSetReport(dev, buf, len);
+    blink1_statsRecord( dev, blink1_stats_write, cmd, t0, rc != 0 );
+    if( (rc = (rc != 0)) ){
         LOG( "blink1_write error: %s\n", blink1_error_msg(rc));
+        blink1_poolMarkStale(dev);
     }
 
     return rc;
 }
 
+// get the current response report without sending a request first
+int blink1_read_nosend( blink1_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // BLINK1_ERR_NOTOPEN;
+    }
+    uint8_t reportid = ((uint8_t*)buf)[0];
+    uint8_t cmd = ((uint8_t*)buf)[1];
+    int64_t t0 = blink1_statsStart();
+    int rc = usbhidGetReport(dev, reportid, (char*)buf, &len);
+    blink1_statsRecord( dev, blink1_stats_read, cmd, t0, rc != 0 );
+    if( rc != 0 ) {
+        LOG("error reading data: %s\n", blink1_error_msg(rc));
+        blink1_poolMarkStale(dev);
+        return -1;
+    }
+    return len;
+}
+
 // len should contain length of buf
 // after call, len will contain actual len of buf read
 int blink1_read( blink1_device* dev, void* buf, int len)
@@ -193,9 +232,14 @@ int blink1_read( blink1_device* dev, void* buf, int len)
         return -1; // BLINK1_ERR_NOTOPEN;
     }
     uint8_t reportid = ((uint8_t*)buf)[0];
+    uint8_t cmd = ((uint8_t*)buf)[1];
     int rc = blink1_write( dev, buf, len); // FIXME: check rc
-    if((rc = usbhidGetReport(dev, reportid, (char*)buf, &len)) != 0) {
+    int64_t t0 = blink1_statsStart();
+    rc = usbhidGetReport(dev, reportid, (char*)buf, &len);
+    blink1_statsRecord( dev, blink1_stats_read, cmd, t0, rc != 0 );
+    if( rc != 0 ) {
         LOG("error reading data: %s\n", blink1_error_msg(rc));
+        blink1_poolMarkStale(dev);
     }
     return rc;
 }
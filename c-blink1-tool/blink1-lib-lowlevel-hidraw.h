@@ -0,0 +1,261 @@
+
+//
+// Linux hidraw backend
+//
+// Talks to /dev/hidrawN directly with HIDIOCSFEATURE/HIDIOCGFEATURE
+// ioctls, as blink1raw/blink1raw.c does. Devices are found by reading
+// /sys/class/hidraw/*/device/uevent, so there's no hidapi, libusb or
+// udev dependency and no wide-string serial conversion.
+//
+
+#include <linux/hidraw.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+
+#ifndef HIDIOCSFEATURE
+#define HIDIOCSFEATURE(len) _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x06, len)
+#define HIDIOCGFEATURE(len) _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x07, len)
+#endif
+
+#define blink1_hidraw_sysdir "/sys/class/hidraw"
+
+struct blink1_hidraw_ {
+    int fd;
+};
+
+// get serial of a hidraw node if it's a vid/pid device, from its uevent
+// e.g. "HID_ID=0003:000027B8:000001ED" and "HID_UNIQ=3f5ad8b2"
+static int blink1_hidrawMatch( const char* name, int vid, int pid,
+                               char* serial, int len )
+{
+    char path[pathstrmax];
+    char buf[4096];
+    snprintf( path, sizeof(path), blink1_hidraw_sysdir "/%s/device/uevent", name );
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 ) return 0;
+    ssize_t n = read( fd, buf, sizeof(buf)-1 );
+    close( fd );
+    if( n <= 0 ) return 0;
+    buf[n] = '\0';
+
+    int matched = 0;
+    serial[0] = '\0';
+    for( char* line = buf; line && *line; ) {
+        char* next = strchr( line, '\n' );
+        if( next ) *next++ = '\0';
+        unsigned int bus, v, p;
+        if( sscanf( line, "HID_ID=%x:%x:%x", &bus, &v, &p ) == 3 ) {
+            matched = ((int)v == vid && (int)p == pid);
+        }
+        else if( strncmp( line, "HID_UNIQ=", 9 ) == 0 ) {
+            snprintf( serial, len, "%s", line+9 );
+        }
+        line = next;
+    }
+    return matched && serial[0] != '\0';
+}
+
+//
+int blink1_enumerate(void)
+{
+    return blink1_enumerateByVidPid( blink1_vid(), blink1_pid() );
+}
+
+// get all matching devices by VID/PID pair
+int blink1_enumerateByVidPid(int vid, int pid)
+{
+    blink1_poolCloseAll(); // cache indices are about to change
+    __atomic_store_n( &blink1_cached_vid, vid, __ATOMIC_RELAXED );
+    __atomic_store_n( &blink1_cached_pid, pid, __ATOMIC_RELAXED );
+    // no monitor, a sysfs scan is cheap enough
+    __atomic_store_n( &blink1_hotplug_active, 0, __ATOMIC_RELEASE );
+
+    DIR* dir = opendir( blink1_hidraw_sysdir );
+
+    cache_wrlock();
+    blink1_cacheClear();
+    struct dirent* ent;
+    while( dir && (ent = readdir(dir)) != NULL ) {
+        char serial[serialstrmax];
+        char path[pathstrmax];
+        if( strncmp( ent->d_name, "hidraw", 6 ) != 0 ) continue;
+        if( !blink1_hidrawMatch( ent->d_name, vid, pid, serial, sizeof(serial) ) ) {
+            continue;
+        }
+        snprintf( path, sizeof(path), "/dev/%s", ent->d_name );
+        if( blink1_cacheAppend( path, serial ) == NULL ) break;
+    }
+    if( dir ) closedir( dir );
+
+    int p = blink1_cached_count;
+    LOG("blink1_enumerateByVidPid: done, %d devices found\n",p);
+    blink1_sortCache();
+    cache_wrunlock();
+
+    return p;
+}
+
+// open a handle without noting it in the cache
+static blink1_device* blink1_lowlevelOpenByPath(const char* path)
+{
+    if( path == NULL || strlen(path) == 0 ) return NULL;
+    int fd = open( path, O_RDWR | O_CLOEXEC );
+    if( fd < 0 ) {
+        LOG("blink1_openByPath: %s\n", strerror(errno));
+        return NULL;
+    }
+    blink1_device* handle = malloc( sizeof(blink1_device) );
+    if( handle == NULL ) {
+        close( fd );
+        return NULL;
+    }
+    handle->fd = fd;
+    return handle;
+}
+
+// close a handle that's not in the cache (anymore)
+static void blink1_lowlevelClose( blink1_device* dev )
+{
+    close( dev->fd );
+    free( dev );
+}
+
+//
+blink1_device* blink1_openByPath(const char* path)
+{
+    if( path == NULL || strlen(path) == 0 ) return NULL;
+
+    LOG("blink1_openByPath: %s\n", path);
+
+    blink1_device* handle = blink1_lowlevelOpenByPath( path );
+    if( handle == NULL ) return NULL;
+
+    if( blink1_cacheSetDev( path, NULL, handle ) < 0 ) {
+        // opened by path but not enumerated, still usable
+        LOG("blink1_openByPath: error no match");
+    }
+    return handle;
+}
+
+//
+blink1_device* blink1_openBySerial(const char* serial)
+{
+    if( serial == NULL || strlen(serial) == 0 ) return NULL;
+
+    LOG("blink1_openBySerial: %s\n", serial);
+    const char* path = NULL;
+    for( int tries=0; tries < 2 && path == NULL; tries++ ) {
+        if( tries ) blink1_enumerate();  // maybe plugged in since the last scan
+        cache_rdlock();
+        int i = blink1_cacheFindSerial( serial );
+        if( i >= 0 ) path = blink1_infos[i]->path;  // interned
+        cache_rdunlock();
+    }
+    if( path == NULL ) {
+        LOG("blink1_openBySerial: serial %s not found\n", serial);
+        return NULL;
+    }
+    return blink1_openByPath( path );
+}
+
+//
+blink1_device* blink1_openById( uint32_t i )
+{
+    LOG("blink1_openById: %d \n", i );
+    if( i > blink1_max_devices ) { // then i is a serial number not an array index
+        char serialstr[serialstrmax];
+        snprintf(serialstr, sizeof(serialstr), "%x", i);
+        return blink1_openBySerial( serialstr );
+    }
+    // otherwise it's an index 0-(count-1)
+    return blink1_openByPath( blink1_getCachedPath(i) );
+}
+
+//
+blink1_device* blink1_open(void)
+{
+    blink1_enumerate();
+
+    return blink1_openById( 0 );
+}
+
+//
+void blink1_close_internal( blink1_device* dev )
+{
+    LOG("close_internal:%p\n",dev);
+    if( dev != NULL ) {
+        blink1_clearCacheDev(dev);
+        blink1_lowlevelClose( dev );
+    }
+}
+
+//
+int blink1_write( blink1_device* dev, void* buf, int len)
+{
+    uint8_t* b = buf;
+    LOG("blink1_write: %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x\n",
+        b[0],b[1],b[2],b[3],b[4],b[5],b[6],b[7]);
+    if( dev==NULL ) {
+        return -1; // BLINK1_ERR_NOTOPEN;
+    }
+    int64_t t0 = blink1_statsStart();
+    int rc = ioctl( dev->fd, HIDIOCSFEATURE(len), buf );
+    blink1_statsRecord( dev, blink1_stats_write, b[1], t0, rc < 0 );
+    if( rc < 0 ) {
+        LOG("blink1_write error: %s\n", blink1_error_msg(errno));
+        blink1_poolMarkStale(dev);
+        return -1;
+    }
+    return rc;
+}
+
+// get the current response report without sending a request first
+int blink1_read_nosend( blink1_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // BLINK1_ERR_NOTOPEN;
+    }
+    uint8_t cmd = ((uint8_t*)buf)[1];
+    int64_t t0 = blink1_statsStart();
+    int rc = ioctl( dev->fd, HIDIOCGFEATURE(len), buf );
+    blink1_statsRecord( dev, blink1_stats_read, cmd, t0, rc < 0 );
+    if( rc < 0 ) {
+        LOG("error reading data: %s\n", blink1_error_msg(errno));
+        blink1_poolMarkStale(dev);
+        return -1;
+    }
+    return rc;
+}
+
+// len should contain length of buf
+// returns 0 on success, -1 on error
+int blink1_read( blink1_device* dev, void* buf, int len)
+{
+    if( blink1_write( dev, buf, len ) == -1 ) return -1;
+    return (blink1_read_nosend( dev, buf, len ) == -1) ? -1 : 0;
+}
+
+// FIXME: Does not work at all times
+// for mk1 devices only
+int blink1_readRGB_mk1(blink1_device *dev, uint16_t* fadeMillis,
+                       uint8_t* r, uint8_t* g, uint8_t* b)
+{
+    (void)fadeMillis;  // mk1 doesn't report it
+    uint8_t buf[blink1_buf_size] = { blink1_report_id };
+    blink1_sleep( 50 ); // FIXME:
+    int rc = blink1_read_nosend( dev, buf, sizeof(buf) );
+    *r = buf[2];
+    *g = buf[3];
+    *b = buf[4];
+    return rc;
+}
+
+//
+char *blink1_error_msg(int errCode)
+{
+    return strerror(errCode);
+}
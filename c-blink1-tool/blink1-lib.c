@@ -13,30 +13,88 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>  // for toupper()
+#include <limits.h> // for INT_MAX
 #include <unistd.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #define   swprintf   _snwprintf
+#elif defined(__APPLE__)
+#include <mach/mach_time.h>  // for mach_absolute_time()
+#include <pthread.h>
 #else
 //#include <unistd.h>    // for usleep()
+#include <time.h>      // for clock_gettime()
+#include <pthread.h>
 #endif
 
 #include "blink1-lib.h"
+#include "blink1-lib-internal.h"
 
 int msg_quiet = 0;
 
+// hash indices into the device cache, one chain per key
+#define blink1_hash_serial   0
+#define blink1_hash_path     1
+#define blink1_hash_dev      2
+#define blink1_hash_pooldev  3
+#define blink1_hash_count    4
+
 // blink1 copy of some hid_device_info and other bits.
 // this seems kinda dumb, though. is there a better way?
 typedef struct blink1_info_ {
     blink1_device* dev;  // device, if opened, NULL otherwise
-    char path[pathstrmax];  // platform-specific device path
-    char serial[serialstrmax];
+    const char* path;    // platform-specific device path, interned
+    const char* serial;  // interned
     int type;  // from blink1types
+    blink1_device* pooldev; // pooled device, if opened, NULL otherwise
+    int pool_refcnt;        // number of outstanding blink1_poolAcquire()s
+    int pool_stale;         // pooldev had an I/O error, reopen when unused
+    int pool_closing;       // close pooldev when its last user releases it
+    int64_t pool_atime;     // time pooldev was last released
+    uint32_t pool_gen;      // blink1_pool_gen when pooldev was opened
+    int fwversion;          // firmware version, 0 if not read yet
+    int index;              // position in blink1_infos[]
+    struct blink1_info_* hnext[blink1_hash_count]; // hash chains
+    struct blink1_info_* orphan_next; // on blink1_orphans
 } blink1_info;
 
-static blink1_info blink1_infos[cache_max];
+// entries are allocated individually so their strings stay put
+// when the cache grows or is re-sorted
+static blink1_info** blink1_infos = NULL;  // sorted by serial
 static int blink1_cached_count = 0;  // number of cached entities
+static int blink1_cached_cap = 0;    // allocated size of blink1_infos
+// entries dropped from the cache while their pooled handle was in use,
+// kept until blink1_poolRelease() gives back its last use
+static blink1_info* blink1_orphans = NULL;
+// bumped for every handle the pool opens, 0 is never used
+static uint32_t blink1_pool_gen = 0;
+static blink1_info** blink1_hash[blink1_hash_count]; // blink1_cached_cap buckets each
+// these three are read by the hotplug thread, use __atomic loads & stores
+static int blink1_cached_vid = 0;    // VID/PID the cache was filled for
+static int blink1_cached_pid = 0;
+static int blink1_hotplug_active = 0; // cache is kept current by hotplug
+// bumped by every hotplug event, so a scan can tell it raced one
+static uint32_t blink1_hotplug_gen = 0;
+
+// blink1_infos[] and its entries are written by the hotplug thread, so
+// every access to an entry is made with the read lock held, and anything
+// that changes an entry takes the write lock. Entries can be freed once
+// the lock is dropped, so nothing outside it keeps a blink1_info pointer.
+// Devices are never opened or closed with the lock held.
+#ifdef _WIN32
+static SRWLOCK blink1_cache_lock = SRWLOCK_INIT;
+#define cache_rdlock()   AcquireSRWLockShared(&blink1_cache_lock)
+#define cache_rdunlock() ReleaseSRWLockShared(&blink1_cache_lock)
+#define cache_wrlock()   AcquireSRWLockExclusive(&blink1_cache_lock)
+#define cache_wrunlock() ReleaseSRWLockExclusive(&blink1_cache_lock)
+#else
+static pthread_rwlock_t blink1_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+#define cache_rdlock()   pthread_rwlock_rdlock(&blink1_cache_lock)
+#define cache_rdunlock() pthread_rwlock_unlock(&blink1_cache_lock)
+#define cache_wrlock()   pthread_rwlock_wrlock(&blink1_cache_lock)
+#define cache_wrunlock() pthread_rwlock_unlock(&blink1_cache_lock)
+#endif
 
 static int blink1_enable_degamma = 1;
 
@@ -57,6 +115,34 @@ int blink1_lib_verbose = 0;
 #define blink1_eeaddr_patternstart (blink1_eeaddr_serialnum + blink1_serialnum_len)
 
 void blink1_sortCache(void);
+static void blink1_poolMarkStale( blink1_device* dev );
+static void blink1_cacheClear(void);
+static blink1_info* blink1_cacheAppend( const char* path, const char* serial );
+static int blink1_cacheFindSerial( const char* serial );
+static int blink1_cacheSetDev( const char* path, const char* serial, blink1_device* dev );
+
+// statistics, see blink1_stats_enable(). Backends bracket each report
+// transfer with blink1_statsStart() and blink1_statsRecord()
+#define blink1_stats_write 0
+#define blink1_stats_read  1
+static int blink1_stats_on = 0;
+static blink1_stats_t blink1_stats;
+// per-device numbers, open addressed by serial, slots are never given back
+static blink1_devstats_t blink1_devstats[blink1_stats_devices_max];
+#define blink1_statsCount(field) \
+    { if( __atomic_load_n(&blink1_stats_on, __ATOMIC_RELAXED) ) \
+          __atomic_fetch_add( &blink1_stats.field, 1, __ATOMIC_RELAXED ); }
+
+// start time for blink1_statsRecord(), or 0 when not collecting
+static inline int64_t blink1_statsStart(void)
+{
+    if( !__atomic_load_n( &blink1_stats_on, __ATOMIC_RELAXED ) ) return 0;
+    return blink1_micros();
+}
+static void blink1_statsRecord( blink1_device* dev, int op, uint8_t cmd,
+                                int64_t t0, int failed );
+static void blink1_statsMap( blink1_device* dev, const char* serial );
+static void blink1_statsUnmap( blink1_device* dev );
 
 const char * const deviceTypeStrings[] =
     {
@@ -69,6 +155,8 @@ const char * const deviceTypeStrings[] =
 
 #if USE_HIDDATA
 #include "blink1-lib-lowlevel-hiddata.h"
+#elif USE_HIDRAW
+#include "blink1-lib-lowlevel-hidraw.h"
 #else
 //#if USE_HIDAPI
 #include "blink1-lib-lowlevel-hidapi.h"
@@ -88,30 +176,327 @@ const char * const deviceTypeStrings[] =
 //
 int blink1_getCachedCount(void)
 {
-    return blink1_cached_count;
+    cache_rdlock();
+    int count = blink1_cached_count;
+    cache_rdunlock();
+    return count;
 }
 
-//
+// path & serial strings are interned, so they outlive the entry
 const char* blink1_getCachedPath(int i)
 {
-    if( i > blink1_getCachedCount()-1 ) return NULL;
-    return blink1_infos[i].path;
+    const char* path = NULL;
+    cache_rdlock();
+    if( i >= 0 && i < blink1_cached_count ) path = blink1_infos[i]->path;
+    cache_rdunlock();
+    return path;
 }
 //
 const char* blink1_getCachedSerial(int i)
 {
-    if( i > blink1_getCachedCount()-1 ) return NULL;
-    return blink1_infos[i].serial;
+    const char* serial = NULL;
+    cache_rdlock();
+    if( i >= 0 && i < blink1_cached_count ) serial = blink1_infos[i]->serial;
+    cache_rdunlock();
+    return serial;
 }
 
-int blink1_getCacheIndexByPath( const char* path )
+//
+// device cache registry
+//
+// blink1_infos[] is a growable array of entries kept sorted by serial,
+// so cache index ids stay as before. Serial, path and both handle
+// fields are also hashed, so lookups don't depend on device count.
+// Everything here expects the caller to hold blink1_cache_lock.
+//
+
+// FNV-1a, serials compare case-insensitively so hash them that way too
+static uint32_t blink1_hashStr( const char* s, int nocase )
+{
+    uint32_t h = 2166136261u;
+    for( ; *s; s++ ) {
+        h ^= (uint8_t)( nocase ? tolower((uint8_t)*s) : *s );
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t blink1_hashPtr( const void* p )
+{
+    uint64_t x = (uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+// Each distinct path and serial string is stored once and never freed,
+// so pointers from blink1_getCachedPath() & co stay good after the
+// entry is gone. Called with the write lock held.
+typedef struct blink1_str_ {
+    struct blink1_str_* next;
+    char s[];
+} blink1_str_t;
+#define blink1_strs_count 256
+static blink1_str_t* blink1_strs[blink1_strs_count];
+
+static const char* blink1_intern( const char* str, size_t max )
+{
+    size_t len = strnlen( str, max-1 );
+    uint32_t h = 2166136261u;
+    for( size_t i=0; i < len; i++ ) {
+        h ^= (uint8_t)str[i];
+        h *= 16777619u;
+    }
+    blink1_str_t** head = &blink1_strs[ h % blink1_strs_count ];
+    for( blink1_str_t* bs = *head; bs; bs = bs->next ) {
+        if( strncmp( bs->s, str, len ) == 0 && bs->s[len] == '\0' ) return bs->s;
+    }
+    blink1_str_t* bs = malloc( sizeof(blink1_str_t) + len + 1 );
+    if( bs == NULL ) return NULL;
+    memcpy( bs->s, str, len );
+    bs->s[len] = '\0';
+    bs->next = *head;
+    *head = bs;
+    return bs->s;
+}
+
+static blink1_info** blink1_hashBucket( blink1_info* bi, int t )
+{
+    uint32_t h;
+    switch( t ) {
+    case blink1_hash_serial: h = blink1_hashStr( bi->serial, 1 ); break;
+    case blink1_hash_path:   h = blink1_hashStr( bi->path, 0 );   break;
+    case blink1_hash_dev:    h = blink1_hashPtr( bi->dev );       break;
+    default:                 h = blink1_hashPtr( bi->pooldev );   break;
+    }
+    return &blink1_hash[t][ h & (blink1_cached_cap-1) ];
+}
+
+// closed handles aren't indexed
+static int blink1_hashed( blink1_info* bi, int t )
+{
+    if( t == blink1_hash_dev )     return bi->dev != NULL;
+    if( t == blink1_hash_pooldev ) return bi->pooldev != NULL;
+    return 1;
+}
+
+static void blink1_hashLink( blink1_info* bi, int t )
+{
+    if( !blink1_hashed( bi, t ) ) return;
+    blink1_info** head = blink1_hashBucket( bi, t );
+    bi->hnext[t] = *head;
+    *head = bi;
+}
+
+static void blink1_hashUnlink( blink1_info* bi, int t )
+{
+    if( !blink1_hashed( bi, t ) ) return;
+    blink1_info** pp = blink1_hashBucket( bi, t );
+    while( *pp && *pp != bi ) pp = &(*pp)->hnext[t];
+    if( *pp ) *pp = bi->hnext[t];
+}
+
+// make room for n entries, doubling, and rehash if the tables grew
+static int blink1_cacheReserve( int n )
+{
+    if( n <= blink1_cached_cap ) return 0;
+    int cap = blink1_cached_cap ? blink1_cached_cap : cache_max;
+    while( cap < n ) cap *= 2;  // stays a power of two, for the bucket mask
+
+    blink1_info** infos = realloc( blink1_infos, cap * sizeof(blink1_info*) );
+    if( infos == NULL ) return -1;
+    blink1_infos = infos;
+
+    blink1_info** tables[blink1_hash_count];
+    for( int t=0; t < blink1_hash_count; t++ ) {
+        tables[t] = calloc( cap, sizeof(blink1_info*) );
+        if( tables[t] == NULL ) {
+            while( t-- ) free( tables[t] );
+            return -1;
+        }
+    }
+    for( int t=0; t < blink1_hash_count; t++ ) {
+        free( blink1_hash[t] );
+        blink1_hash[t] = tables[t];
+    }
+    blink1_cached_cap = cap;
+    for( int i=0; i < blink1_cached_count; i++ ) {
+        for( int t=0; t < blink1_hash_count; t++ ) {
+            blink1_hashLink( blink1_infos[i], t );
+        }
+    }
+    LOG("blink1_cacheReserve: grew to %d entries\n", cap);
+    return 0;
+}
+
+// let go of an entry that's out of the cache. Returns its idle pooled
+// handle for closing, if any. An entry with its pooled handle in use
+// goes on blink1_orphans instead.
+static blink1_device* blink1_infoDrop( blink1_info* bi )
+{
+    blink1_statsUnmap( bi->dev );
+    if( bi->pooldev && bi->pool_refcnt > 0 ) {
+        bi->orphan_next = blink1_orphans;
+        blink1_orphans = bi;
+        return NULL;
+    }
+    blink1_device* idledev = bi->pooldev;
+    blink1_statsUnmap( idledev );
+    free( bi );
+    return idledev;
+}
+
+static void blink1_cacheClear(void)
+{
+    blink1_statsCount( enumerations );
+    for( int i=0; i < blink1_cached_count; i++ ) {
+        // normally blink1_poolCloseAll() has closed idle pooled handles
+        blink1_device* idledev = blink1_infoDrop( blink1_infos[i] );
+        if( idledev ) blink1_lowlevelClose( idledev );
+    }
+    for( int t=0; t < blink1_hash_count; t++ ) {
+        if( blink1_hash[t] ) memset( blink1_hash[t], 0, blink1_cached_cap * sizeof(blink1_info*) );
+    }
+    blink1_cached_count = 0;
+}
+
+// add an entry at the end, unsorted, returns NULL if out of memory
+static blink1_info* blink1_cacheAppend( const char* path, const char* serial )
+{
+    if( blink1_cacheReserve( blink1_cached_count + 1 ) == -1 ) return NULL;
+    blink1_info* bi = calloc( 1, sizeof(blink1_info) );
+    if( bi == NULL ) return NULL;
+    bi->path = blink1_intern( path, pathstrmax );
+    bi->serial = blink1_intern( serial, serialstrmax );
+    if( bi->path == NULL || bi->serial == NULL ) {
+        free( bi );
+        return NULL;
+    }
+    uint32_t serialnum = strtol( bi->serial, NULL, 16);
+    bi->type = BLINK1_MK1;
+    if(      serialnum >= blink1mk3_serialstart ) {
+        bi->type = BLINK1_MK3;
+    }
+    else if( serialnum >= blink1mk2_serialstart ) {
+        bi->type = BLINK1_MK2;
+    }
+    bi->index = blink1_cached_count;
+    blink1_infos[blink1_cached_count++] = bi;
+    blink1_hashLink( bi, blink1_hash_serial );
+    blink1_hashLink( bi, blink1_hash_path );
+    return bi;
+}
+
+// renumber entries after they've moved
+static void blink1_cacheReindex( int from )
+{
+    for( int i=from; i < blink1_cached_count; i++ ) {
+        blink1_infos[i]->index = i;
+    }
+}
+
+static int blink1_cacheFindPath( const char* path )
+{
+    if( blink1_cached_cap == 0 ) return -1;
+    blink1_info* bi =
+        blink1_hash[blink1_hash_path][ blink1_hashStr(path,0) & (blink1_cached_cap-1) ];
+    for( ; bi; bi = bi->hnext[blink1_hash_path] ) {
+        if( strcmp( bi->path, path ) == 0 ) return bi->index;
+    }
+    return -1;
+}
+
+static int blink1_cacheFindSerial( const char* serial )
+{
+    if( blink1_cached_cap == 0 ) return -1;
+    blink1_info* bi =
+        blink1_hash[blink1_hash_serial][ blink1_hashStr(serial,1) & (blink1_cached_cap-1) ];
+    for( ; bi; bi = bi->hnext[blink1_hash_serial] ) {
+        if( strcasecmp( bi->serial, serial ) == 0 ) return bi->index;
+    }
+    return -1;
+}
+
+static int blink1_cacheFindDev( blink1_device* dev )
 {
-    for( int i=0; i< cache_max; i++ ) {
-        if( strcmp( blink1_infos[i].path, (const char*) path ) == 0 ) return i;
+    if( blink1_cached_cap == 0 || dev == NULL ) return -1;
+    uint32_t h = blink1_hashPtr( dev ) & (blink1_cached_cap-1);
+    for( blink1_info* bi = blink1_hash[blink1_hash_dev][h]; bi;
+         bi = bi->hnext[blink1_hash_dev] ) {
+        if( bi->dev == dev ) return bi->index;
+    }
+    for( blink1_info* bi = blink1_hash[blink1_hash_pooldev][h]; bi;
+         bi = bi->hnext[blink1_hash_pooldev] ) {
+        if( bi->pooldev == dev ) return bi->index;
     }
     return -1;
 }
 
+// entry for a blink1 id, an index or a serial number
+static blink1_info* blink1_cacheFindId( uint32_t id )
+{
+    int i = id;
+    if( id > blink1_max_devices ) {
+        char serialstr[serialstrmax];
+        snprintf(serialstr, sizeof(serialstr), "%X", id);
+        i = blink1_cacheFindSerial( serialstr );
+    }
+    return (i >= 0 && i < blink1_cached_count) ? blink1_infos[i] : NULL;
+}
+
+// handle fields are indexed, so set them through here, write lock held
+static void blink1_infoSetDev( blink1_info* bi, blink1_device* dev )
+{
+    blink1_hashUnlink( bi, blink1_hash_dev );
+    blink1_statsUnmap( bi->dev );
+    bi->dev = dev;
+    blink1_statsMap( dev, bi->serial );
+    blink1_hashLink( bi, blink1_hash_dev );
+}
+
+static void blink1_infoSetPoolDev( blink1_info* bi, blink1_device* dev )
+{
+    blink1_hashUnlink( bi, blink1_hash_pooldev );
+    blink1_statsUnmap( bi->pooldev );
+    bi->pooldev = dev;
+    blink1_statsMap( dev, bi->serial );
+    bi->pool_refcnt = 0;
+    bi->pool_stale = 0;
+    bi->pool_closing = 0;
+    if( dev && ++blink1_pool_gen == 0 ) blink1_pool_gen = 1;
+    bi->pool_gen = dev ? blink1_pool_gen : 0;
+    blink1_hashLink( bi, blink1_hash_pooldev );
+}
+
+// take the pooled handle out of its entry, to be closed after unlocking
+static blink1_device* blink1_infoTakePoolDev( blink1_info* bi )
+{
+    blink1_device* dev = bi->pooldev;
+    blink1_infoSetPoolDev( bi, NULL );
+    return dev;
+}
+
+// note the plain handle a blink1_open*() made, in the entry for path,
+// or for serial if path is NULL. Returns its index or -1
+static int blink1_cacheSetDev( const char* path, const char* serial, blink1_device* dev )
+{
+    cache_wrlock();
+    int i = path ? blink1_cacheFindPath( path ) : blink1_cacheFindSerial( serial );
+    if( i >= 0 ) blink1_infoSetDev( blink1_infos[i], dev );
+    cache_wrunlock();
+    return i;
+}
+
+int blink1_getCacheIndexByPath( const char* path )
+{
+    if( path == NULL ) return -1;
+    cache_rdlock();
+    int i = blink1_cacheFindPath( path );
+    cache_rdunlock();
+    return i;
+}
+
 int blink1_getCacheIndexById( uint32_t i )
 {
     if( i > blink1_max_devices ) { // then i is a serial number not an array index
@@ -124,47 +509,270 @@ int blink1_getCacheIndexById( uint32_t i )
 
 int blink1_getCacheIndexBySerial( const char* serial )
 {
-    for( int i=0; i< cache_max; i++ ) {
-        if( strcasecmp( blink1_infos[i].serial, serial ) == 0 ) return i;
-    }
-    return -1;
+    if( serial == NULL ) return -1;
+    cache_rdlock();
+    int i = blink1_cacheFindSerial( serial );
+    cache_rdunlock();
+    return i;
 }
 
 int blink1_getCacheIndexByDev( blink1_device* dev )
 {
-    for( int i=0; i< cache_max; i++ ) {
-        if( blink1_infos[i].dev == dev ) return i;
-    }
-    return -1;
+    cache_rdlock();
+    int i = blink1_cacheFindDev( dev );
+    cache_rdunlock();
+    return i;
 }
 
 const char* blink1_getSerialForDev(blink1_device* dev)
 {
-    int i = blink1_getCacheIndexByDev( dev );
-    if( i>=0 ) return blink1_infos[i].serial;
-    return NULL;
+    const char* serial = NULL;
+    cache_rdlock();
+    int i = blink1_cacheFindDev( dev );
+    if( i>=0 ) serial = blink1_infos[i]->serial;
+    cache_rdunlock();
+    return serial;
 }
 
 int blink1_clearCacheDev( blink1_device* dev )
 {
-    int i = blink1_getCacheIndexByDev( dev );
-    if( i>=0 ) blink1_infos[i].dev = NULL; // FIXME: hmmmm
+    cache_wrlock();
+    int i = blink1_cacheFindDev( dev );
+    if( i>=0 ) {
+        blink1_info* bi = blink1_infos[i];
+        if( bi->pooldev == dev ) { // closing a pooled handle
+            blink1_infoTakePoolDev( bi );
+        }
+        else {
+            blink1_infoSetDev( bi, NULL ); // FIXME: hmmmm
+        }
+    }
+    cache_wrunlock();
     return i;
 }
 
+//
+// incremental cache updates, fed by the backend's hotplug monitor
+//
+
+// add a newly-arrived device, keeping the cache sorted by serial
+void blink1_cacheInsert( const char* path, const char* serial )
+{
+    cache_wrlock();
+    __atomic_fetch_add( &blink1_hotplug_gen, 1, __ATOMIC_RELEASE );
+    blink1_info* bi = NULL;
+    if( blink1_cacheFindPath( path ) < 0 ) {
+        bi = blink1_cacheAppend( path, serial );
+    }
+    if( bi ) {
+        int i = blink1_cached_count - 1;
+        while( i > 0 && strncmp( blink1_infos[i-1]->serial, serial,
+                                 serialstrmax ) > 0 ) {
+            blink1_infos[i] = blink1_infos[i-1];
+            i--;
+        }
+        blink1_infos[i] = bi;
+        blink1_cacheReindex( i );
+        blink1_statsCount( hotplug_adds );
+        LOG("blink1_cacheInsert: %s at %d, %s\n", serial, i, path);
+    }
+    cache_wrunlock();
+}
+
+// drop a departed device. Handles still held by callers stay valid
+// to close, they're just no longer found in the cache. A pooled handle
+// in use is closed by its last blink1_poolRelease().
+void blink1_cacheRemove( const char* path )
+{
+    blink1_device* idledev = NULL;
+    cache_wrlock();
+    __atomic_fetch_add( &blink1_hotplug_gen, 1, __ATOMIC_RELEASE );
+    int i = blink1_cacheFindPath( path );
+    if( i >= 0 ) {
+        blink1_info* bi = blink1_infos[i];
+        LOG("blink1_cacheRemove: %s at %d, %s\n", bi->serial, i, path);
+        blink1_statsCount( hotplug_removes );
+        for( int t=0; t < blink1_hash_count; t++ ) {
+            blink1_hashUnlink( bi, t );
+        }
+        blink1_cached_count--;
+        memmove( &blink1_infos[i], &blink1_infos[i+1],
+                 (blink1_cached_count - i) * sizeof(blink1_info*) );
+        blink1_cacheReindex( i );
+        idledev = blink1_infoDrop( bi );
+    }
+    cache_wrunlock();
+    if( idledev ) blink1_lowlevelClose( idledev ); // already out of the cache
+}
+
+//
+// device handle pool
+//
+// Pooled handles live in blink1_infos[].pooldev, separate from the
+// plain blink1_open*() handle in blink1_infos[].dev, so the two styles
+// of use don't step on each other.
+//
+
+blink1_device* blink1_poolAcquire( uint32_t id )
+{
+    blink1_device* olddev = NULL;
+    blink1_device* dev = NULL;
+    cache_wrlock();
+    blink1_info* bi = blink1_cacheFindId( id );
+    if( bi == NULL ) {
+        cache_wrunlock();
+        return NULL;
+    }
+    // lazily revalidate: a handle that errored is reopened once unused
+    if( bi->pooldev && bi->pool_stale && bi->pool_refcnt == 0 ) {
+        LOG("blink1_poolAcquire: reopening stale handle for %s\n", bi->serial);
+        olddev = blink1_infoTakePoolDev( bi );
+    }
+    if( bi->pooldev ) {
+        bi->pool_refcnt++;
+        dev = bi->pooldev;
+    }
+    const char* path = bi->path;  // interned, good after unlocking
+    cache_wrunlock();
+    if( olddev ) blink1_lowlevelClose( olddev );
+    if( dev ) return dev;
+
+    // open without the lock, then check the device is still there
+    blink1_device* newdev = blink1_lowlevelOpenByPath( path );
+    if( newdev == NULL ) return NULL;
+    cache_wrlock();
+    int i = blink1_cacheFindPath( path );
+    if( i >= 0 ) {
+        bi = blink1_infos[i];
+        if( bi->pooldev == NULL ) {  // else another thread opened one meanwhile
+            blink1_infoSetPoolDev( bi, newdev );
+            newdev = NULL;
+        }
+        bi->pool_refcnt++;
+        dev = bi->pooldev;
+    }
+    cache_wrunlock();
+    if( newdev ) blink1_lowlevelClose( newdev );
+    return dev;
+}
+
+void blink1_poolRelease( blink1_device* dev )
+{
+    if( dev == NULL ) return;
+    blink1_device* closedev = NULL;  // pooled, and out of the cache
+    int ours = 0;
+    cache_wrlock();
+    int i = blink1_cacheFindDev( dev );
+    if( i >= 0 && blink1_infos[i]->pooldev == dev ) {
+        blink1_info* bi = blink1_infos[i];
+        ours = 1;
+        if( bi->pool_refcnt > 0 ) bi->pool_refcnt--;
+        bi->pool_atime = blink1_millis();
+        if( bi->pool_closing && bi->pool_refcnt == 0 ) {
+            LOG("blink1_poolRelease: closing handle %d, last user is done\n", i);
+            closedev = blink1_infoTakePoolDev( bi );
+        }
+    }
+    blink1_info** pp = &blink1_orphans;
+    while( !ours && *pp && (*pp)->pooldev != dev ) pp = &(*pp)->orphan_next;
+    if( !ours && *pp ) {  // its device went away while it was in use
+        blink1_info* bi = *pp;
+        ours = 1;
+        if( --bi->pool_refcnt == 0 ) {
+            LOG("blink1_poolRelease: closing handle of departed %s\n", bi->serial);
+            *pp = bi->orphan_next;
+            closedev = bi->pooldev;
+            blink1_statsUnmap( closedev );
+            free( bi );
+        }
+    }
+    cache_wrunlock();
+    if( closedev ) blink1_lowlevelClose( closedev );
+    if( !ours ) blink1_close( dev );  // not a pooled handle
+}
+
+uint32_t blink1_poolGeneration( blink1_device* dev )
+{
+    uint32_t gen = 0;
+    cache_rdlock();
+    int i = blink1_cacheFindDev( dev );
+    if( i >= 0 && blink1_infos[i]->pooldev == dev ) gen = blink1_infos[i]->pool_gen;
+    cache_rdunlock();
+    return gen;
+}
+
+// take pooled handles that aren't in use out of the cache, with
+// pool_atime at or before deadline. Busy ones are marked pool_closing
+// if closebusy. Returns a malloc'd list to close, count in *n
+static blink1_device** blink1_poolTake( int64_t deadline, int closebusy, int* n )
+{
+    *n = 0;
+    cache_wrlock();
+    blink1_device** devs = malloc( (blink1_cached_count+1) * sizeof(blink1_device*) );
+    for( int i=0; devs && i < blink1_cached_count; i++ ) {
+        blink1_info* bi = blink1_infos[i];
+        if( bi->pooldev == NULL ) continue;
+        if( bi->pool_refcnt == 0 && bi->pool_atime <= deadline ) {
+            LOG("blink1_poolTake: closing idle handle %d\n", i);
+            devs[(*n)++] = blink1_infoTakePoolDev( bi );
+        }
+        else if( bi->pool_refcnt > 0 && closebusy ) {
+            bi->pool_closing = 1;
+        }
+    }
+    cache_wrunlock();
+    return devs;
+}
+
+int blink1_poolFlush( int idle_millis )
+{
+    int n;
+    blink1_device** devs = blink1_poolTake( blink1_millis() - idle_millis, 0, &n );
+    for( int i=0; i < n; i++ ) blink1_lowlevelClose( devs[i] );
+    free( devs );
+    return n;
+}
+
+// handles still in use are closed by blink1_poolRelease() instead,
+// whether or not their entry survives until then
+void blink1_poolCloseAll(void)
+{
+    int n;
+    blink1_device** devs = blink1_poolTake( INT64_MAX, 1, &n );
+    for( int i=0; i < n; i++ ) blink1_lowlevelClose( devs[i] );
+    free( devs );
+}
+
+// called by low-level read/write on error
+static void blink1_poolMarkStale( blink1_device* dev )
+{
+    cache_wrlock();
+    int i = blink1_cacheFindDev( dev );
+    if( i >= 0 && blink1_infos[i]->pooldev == dev ) {
+        blink1_infos[i]->pool_stale = 1;
+        blink1_statsCount( stale_handles );
+    }
+    cache_wrunlock();
+}
+
 blink1Type_t blink1_deviceTypeById( int i )
 {
-    //if( i>=0  && blink1_infos[i].type == BLINK1_MK2 ) return 1;
-    //if( i>= 0 ) {
-    return blink1_infos[i].type;
-    //}
-    //return 0;
+    blink1Type_t type = BLINK1_UNKNOWN;
+    cache_rdlock();
+    if( i >= 0 && i < blink1_cached_count ) type = blink1_infos[i]->type;
+    cache_rdunlock();
+    return type;
 }
 
 // returns BLINK1_MK2, BLINK1_MK3, or BLINK1
 blink1Type_t blink1_deviceType( blink1_device* dev )
 {
-  return blink1_deviceTypeById( blink1_getCacheIndexByDev(dev) );
+    blink1Type_t type = BLINK1_UNKNOWN;
+    cache_rdlock();
+    int i = blink1_cacheFindDev( dev );
+    if( i >= 0 ) type = blink1_infos[i]->type;
+    cache_rdunlock();
+    return type;
 }
 
 const char* blink1_deviceTypeToStr(blink1Type_t t)
@@ -175,16 +783,63 @@ const char* blink1_deviceTypeToStr(blink1Type_t t)
 
 int blink1_isMk2ById( int i )
 {
-    if( i>=0  && blink1_infos[i].type == BLINK1_MK2 ) return 1;
-    return 0;
+    return blink1_deviceTypeById( i ) == BLINK1_MK2;
 }
 
 int blink1_isMk2( blink1_device* dev )
 {
-    return blink1_isMk2ById( blink1_getCacheIndexByDev(dev) );
+    return blink1_deviceType( dev ) == BLINK1_MK2;
+}
+
+// firmware version, read from device once per enumeration
+static int blink1_getCachedVersion( blink1_device* dev )
+{
+    cache_rdlock();
+    int i = blink1_cacheFindDev( dev );
+    int fwversion = (i >= 0) ? blink1_infos[i]->fwversion : 0;
+    cache_rdunlock();
+    if( fwversion > 0 ) return fwversion;
+
+    fwversion = blink1_getVersion(dev);  // no I/O with the lock held
+    if( fwversion > 0 ) {
+        cache_wrlock();
+        i = blink1_cacheFindDev( dev );
+        if( i >= 0 ) blink1_infos[i]->fwversion = fwversion;
+        cache_wrunlock();
+    }
+    return fwversion;
+}
+
+// does device understand the report id 2 bulk commands
+static int blink1_hasBulk( blink1_device* dev )
+{
+    return blink1_deviceType(dev) == BLINK1_MK3 &&
+        blink1_getCachedVersion(dev) >= blink1mk3_bulk_fwversion;
 }
 
 
+// millis to wait before each poll of a not-yet-ready response, ~60ms total
+static const uint8_t blink1_response_backoff[] = { 0, 1, 1, 2, 4, 8, 16, 32 };
+
+//
+int blink1_readResponse( blink1_device* dev, void* buf, int len )
+{
+    uint8_t* b = buf;
+    uint8_t reportid = b[0];
+    uint8_t cmd = b[1];
+    int n = sizeof(blink1_response_backoff);
+    for( int i=0; i < n; i++ ) {
+        if( blink1_response_backoff[i] ) blink1_sleep( blink1_response_backoff[i] );
+        b[0] = reportid;
+        int rc = blink1_read_nosend( dev, buf, len );
+        if( rc == -1 ) return -1;
+        if( b[1] == cmd ) return rc;
+        LOG("blink1_readResponse: '%c' not ready, got %2.2x\n", cmd, b[1]);
+    }
+    b[1] = cmd;
+    return -1;
+}
+
 //
 int blink1_getVersion(blink1_device *dev)
 {
@@ -206,9 +861,8 @@ int blink1_eeread(blink1_device *dev, uint16_t addr, uint8_t* val)
     int len = sizeof(buf);
 
     int rc = blink1_write(dev, buf, len );
-    blink1_sleep( 50 ); // FIXME:
     if( rc != -1 ) // no error
-        rc = blink1_read(dev, buf, len );
+        rc = blink1_readResponse(dev, buf, len );
     if( rc != -1 )
         *val = buf[3];
     return rc;
@@ -271,13 +925,12 @@ int blink1_serialnumwrite(blink1_device *dev, uint8_t* serialnumstr)
     return rc;
 }
 
-int blink1_fadeToRGBN(blink1_device *dev,  uint16_t fadeMillis,
-                      uint8_t r, uint8_t g, uint8_t b, uint8_t n)
+// fill in buf with a 'fade to rgb' report
+static void blink1_makeFadeToRGBN(uint8_t* buf, uint16_t fadeMillis,
+                                  uint8_t r, uint8_t g, uint8_t b, uint8_t n)
 {
     int dms = fadeMillis/10;  // millis_divided_by_10
 
-    char buf[blink1_buf_size];
-
     buf[0] = blink1_report_id;     // report id
     buf[1] = 'c';   // command code for 'fade to rgb'
     buf[2] = ((blink1_enable_degamma) ? blink1_degamma(r) : r );
@@ -286,6 +939,14 @@ int blink1_fadeToRGBN(blink1_device *dev,  uint16_t fadeMillis,
     buf[5] = (dms >> 8);
     buf[6] = dms % 0xff;
     buf[7] = n;
+}
+
+int blink1_fadeToRGBN(blink1_device *dev,  uint16_t fadeMillis,
+                      uint8_t r, uint8_t g, uint8_t b, uint8_t n)
+{
+    uint8_t buf[blink1_buf_size];
+
+    blink1_makeFadeToRGBN(buf, fadeMillis, r,g,b, n);
 
     int rc = blink1_write(dev, buf, sizeof(buf) );
 
@@ -334,6 +995,70 @@ int blink1_setRGB(blink1_device *dev, uint8_t r, uint8_t g, uint8_t b )
     return rc;
 }
 
+//
+int blink1_writeFrame( blink1_device* dev, const rgb_t* leds,
+                       uint8_t start, uint8_t count )
+{
+    if( count > blink1mk3_max_leds ) count = blink1mk3_max_leds;
+    if( !blink1_hasBulk(dev) ) {
+        int rc = 0;
+        for( int i=0; i < count && rc != -1; i++ ) {
+            rc = blink1_fadeToRGBN( dev, 0, leds[i].r, leds[i].g, leds[i].b,
+                                    start+i+1 );
+        }
+        return (rc == -1) ? -1 : 0;
+    }
+
+    uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'X', start, count };
+    uint8_t* p = buf + 4;
+    for( int i=0; i < count; i++ ) {
+        p[0] = (blink1_enable_degamma) ? blink1_degamma(leds[i].r) : leds[i].r;
+        p[1] = (blink1_enable_degamma) ? blink1_degamma(leds[i].g) : leds[i].g;
+        p[2] = (blink1_enable_degamma) ? blink1_degamma(leds[i].b) : leds[i].b;
+        p += 3;
+    }
+    int rc = blink1_write( dev, buf, sizeof(buf) );
+    return (rc == -1) ? -1 : 0;
+}
+
+//
+int blink1_streamFrames( blink1_device* dev, int fps, uint8_t start, uint8_t count,
+                         blink1_frame_func render, void* arg,
+                         blink1_stream_stats_t* stats )
+{
+    rgb_t leds[blink1mk3_max_leds];
+    blink1_stream_stats_t st = {0,0,0};
+    int rc = 0;
+    if( fps <= 0 ) fps = 1;
+    if( count > blink1mk3_max_leds ) count = blink1mk3_max_leds;
+    memset( leds, 0, sizeof(leds) );
+
+    int64_t begin = blink1_millis();
+    uint32_t frame = 0;
+    while( 1 ) {
+        // frame is due at begin + frame/fps, skip any whose slot has passed
+        int64_t now = blink1_millis();
+        uint32_t due = (uint32_t)(((now - begin) * fps) / 1000);
+        if( due > frame ) {
+            st.dropped += due - frame;
+            frame = due;
+        }
+        if( !render( leds, count, frame, arg ) ) break;
+        rc = blink1_writeFrame( dev, leds, start, count );
+        if( rc == -1 ) break;
+        st.sent++;
+        frame++;
+        int64_t next = begin + ((int64_t)frame * 1000) / fps;
+        now = blink1_millis();
+        if( next > now ) blink1_sleep( next - now );
+    }
+    st.elapsed = blink1_millis() - begin;
+    LOG("blink1_streamFrames: %d sent, %d dropped in %lld ms\n",
+        st.sent, st.dropped, (long long)st.elapsed);
+    if( stats ) *stats = st;
+    return rc;
+}
+
 // mk2 devices only
 int blink1_readRGB(blink1_device *dev, uint16_t* fadeMillis,
                    uint8_t* r, uint8_t* g, uint8_t* b,
@@ -392,10 +1117,10 @@ int blink1_play(blink1_device *dev, uint8_t play, uint8_t startpos)
     return blink1_playloop(dev, play, startpos, 0,0);
 }
 
-// mk2 devices only
-int blink1_playloop(blink1_device *dev, uint8_t play, uint8_t startpos,uint8_t endpos, uint8_t count)
+// fill in buf with a 'play loop' report
+static void blink1_makePlayloop(uint8_t* buf, uint8_t play, uint8_t startpos,
+                                uint8_t endpos, uint8_t count)
 {
-    uint8_t buf[blink1_buf_size];
     buf[0] = blink1_report_id;
     buf[1] = 'p';
     buf[2] = play;
@@ -404,6 +1129,13 @@ int blink1_playloop(blink1_device *dev, uint8_t play, uint8_t startpos,uint8_t e
     buf[5] = count;
     buf[6] = 0;
     buf[7] = 0;
+}
+
+// mk2 devices only
+int blink1_playloop(blink1_device *dev, uint8_t play, uint8_t startpos,uint8_t endpos, uint8_t count)
+{
+    uint8_t buf[blink1_buf_size];
+    blink1_makePlayloop(buf, play, startpos, endpos, count);
 
     int rc = blink1_write(dev, buf, sizeof(buf) );
     return rc;
@@ -444,6 +1176,106 @@ int blink1_writePatternLine(blink1_device *dev, uint16_t fadeMillis,
     return rc;
 }
 
+// pattern lines per 'M' report: {2,'M',pos,count, r,g,b,th,tl,n, ...}
+#define blink1_bulk_lines ((blink1_report2_size-4) / 6)
+
+//
+static int blink1_writePatternLines( blink1_device* dev, const patternline_t* lines,
+                                     int count, uint8_t pos, int degamma )
+{
+    int rc = 0;
+    if( !blink1_hasBulk(dev) ) {
+        for( int i=0; i < count && rc != -1; i++ ) {
+            const patternline_t* pl = &lines[i];
+            rc = blink1_setLEDN( dev, pl->ledn );
+            if( rc == -1 ) break;
+            if( degamma ) {
+                rc = blink1_writePatternLine( dev, pl->millis, pl->color.r,
+                                              pl->color.g, pl->color.b, pos+i );
+            }
+            else {
+                int dms = pl->millis/10;  // millis_divided_by_10
+                uint8_t buf[blink1_buf_size] =
+                    { blink1_report_id, 'P', pl->color.r, pl->color.g, pl->color.b,
+                      (dms>>8), (dms & 0xff), pos+i };
+                rc = blink1_write( dev, buf, sizeof(buf) );
+            }
+        }
+        return (rc == -1) ? -1 : 0;
+    }
+
+    for( int i=0; i < count; i += blink1_bulk_lines ) {
+        int n = count - i;
+        if( n > blink1_bulk_lines ) n = blink1_bulk_lines;
+        uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'M', pos+i, n };
+        uint8_t* p = buf + 4;
+        for( int j=0; j < n; j++ ) {
+            const patternline_t* pl = &lines[i+j];
+            int dms = pl->millis/10;  // millis_divided_by_10
+            p[0] = (degamma) ? blink1_degamma(pl->color.r) : pl->color.r;
+            p[1] = (degamma) ? blink1_degamma(pl->color.g) : pl->color.g;
+            p[2] = (degamma) ? blink1_degamma(pl->color.b) : pl->color.b;
+            p[3] = dms >> 8;
+            p[4] = dms & 0xff;
+            p[5] = pl->ledn;
+            p += 6;
+        }
+        rc = blink1_write( dev, buf, sizeof(buf) );
+        if( rc == -1 ) return -1;
+    }
+    return 0;
+}
+
+//
+int blink1_writePatternBulk( blink1_device* dev, const patternline_t* lines,
+                             int count, uint8_t pos )
+{
+    return blink1_writePatternLines( dev, lines, count, pos, blink1_enable_degamma );
+}
+
+//
+int blink1_writePatternBulkRaw( blink1_device* dev, const patternline_t* lines,
+                                int count, uint8_t pos )
+{
+    return blink1_writePatternLines( dev, lines, count, pos, 0 );
+}
+
+//
+int blink1_readPatternBulk( blink1_device* dev, patternline_t* lines,
+                            int count, uint8_t pos )
+{
+    int rc = 0;
+    if( !blink1_hasBulk(dev) ) {
+        for( int i=0; i < count && rc != -1; i++ ) {
+            patternline_t* pl = &lines[i];
+            rc = blink1_readPatternLineN( dev, &pl->millis, &pl->color.r,
+                                          &pl->color.g, &pl->color.b, &pl->ledn, pos+i );
+        }
+        return (rc == -1) ? -1 : 0;
+    }
+
+    for( int i=0; i < count; i += blink1_bulk_lines ) {
+        int n = count - i;
+        if( n > blink1_bulk_lines ) n = blink1_bulk_lines;
+        uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'm', pos+i, n };
+        rc = blink1_write( dev, buf, sizeof(buf) );
+        if( rc != -1 )
+            rc = blink1_readResponse( dev, buf, sizeof(buf) );
+        if( rc == -1 || buf[3] != n ) return -1;
+        uint8_t* p = buf + 4;
+        for( int j=0; j < n; j++ ) {
+            patternline_t* pl = &lines[i+j];
+            pl->color.r = p[0];
+            pl->color.g = p[1];
+            pl->color.b = p[2];
+            pl->millis  = ((p[3] << 8) | p[4]) * 10;
+            pl->ledn    = p[5];
+            p += 6;
+        }
+    }
+    return 0;
+}
+
 //
 int blink1_readPatternLine(blink1_device *dev, uint16_t* fadeMillis,
                            uint8_t* r, uint8_t* g, uint8_t* b,
@@ -623,9 +1455,8 @@ int blink1_testtest( blink1_device *dev, uint8_t reportid )
     uint8_t buf[blink1_report2_size] = { reportid, '!', 0,0,0, 0,0,0 };
 
     int rc = blink1_write(dev, buf, count );
-    blink1_sleep( 50 ); //FIXME:
     if( rc != -1 ) { // no error
-        rc = blink1_read(dev, buf, count);
+        rc = blink1_readResponse(dev, buf, count);
         for( int i=0; i<count; i++ ) {
             printf("%2.2x,",(uint8_t)buf[i]);
         }
@@ -639,15 +1470,626 @@ int blink1_testtest( blink1_device *dev, uint8_t reportid )
 
 
 
-/* ------------------------------------------------------------------------- */
+//
+// statistics
+//
 
-void blink1_enableDegamma()
+static void blink1_statsAdd( blink1_stats_op_t* op, uint64_t us, int failed )
 {
-    blink1_enable_degamma = 1;
+    int b = 0;  // bit length of us
+    for( uint64_t t = us; t && b < blink1_stats_buckets-1; t >>= 1 ) b++;
+    __atomic_fetch_add( &op->count, 1, __ATOMIC_RELAXED );
+    if( failed ) __atomic_fetch_add( &op->errors, 1, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &op->total_us, us, __ATOMIC_RELAXED );
+    __atomic_fetch_add( &op->hist[b], 1, __ATOMIC_RELAXED );
+    uint64_t max = __atomic_load_n( &op->max_us, __ATOMIC_RELAXED );
+    while( us > max &&
+           !__atomic_compare_exchange_n( &op->max_us, &max, us, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+    }
 }
-void blink1_disableDegamma()
+
+// per-device slot for a serial number, claimed on first use.
+// NULL if the table is full
+static blink1_devstats_t* blink1_statsSlot( uint32_t serial )
 {
-    blink1_enable_degamma = 0;
+    if( serial == 0 ) return NULL;
+    for( int n=0; n < blink1_stats_devices_max; n++ ) {
+        blink1_devstats_t* ds =
+            &blink1_devstats[ (serial + n) % blink1_stats_devices_max ];
+        uint32_t cur = __atomic_load_n( &ds->serial, __ATOMIC_ACQUIRE );
+        if( cur == 0 &&
+            __atomic_compare_exchange_n( &ds->serial, &cur, serial, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+            return ds;
+        }
+        if( cur == serial ) return ds;
+    }
+    return NULL;
+}
+
+// Handle to serial number map, so blink1_statsRecord() finds the slot
+// without the cache lock. Open addressed by handle. Entries are set when
+// a handle is put in the cache and cleared when it's taken out, both with
+// the write lock held, so there's one writer. Readers only look up handles
+// they're using, which stay mapped meanwhile.
+// Deleted entries are tombstones, reused by the next insert that probes
+// past them, and turned back into empty slots once nothing probes past
+// them, so handle churn doesn't lengthen probes for good.
+#define blink1_stats_handles_max 512
+#define blink1_stats_unmapped ((blink1_device*)1)  // deleted, keep probing
+static struct {
+    blink1_device* dev;      // NULL if empty
+    uint32_t serial;
+} blink1_stats_handles[blink1_stats_handles_max];
+static int blink1_stats_handles_used;  // live entries, under the write lock
+
+static void blink1_statsMap( blink1_device* dev, const char* serial )
+{
+    if( dev == NULL ) return;
+    uint32_t serialnum = strtoul( serial, NULL, 16 );
+    uint32_t h = blink1_hashPtr( dev );
+    int freeslot = -1;
+    for( int n=0; n < blink1_stats_handles_max; n++ ) {
+        int i = (h + n) % blink1_stats_handles_max;
+        blink1_device* cur = blink1_stats_handles[i].dev;
+        if( cur == dev ) {
+            freeslot = i;
+            break;
+        }
+        if( cur == blink1_stats_unmapped && freeslot < 0 ) freeslot = i;
+        if( cur == NULL ) {
+            if( freeslot < 0 ) freeslot = i;
+            break;
+        }
+    }
+    if( freeslot < 0 ) return;  // full, this handle goes uncounted
+    if( blink1_stats_handles[freeslot].dev != dev ) blink1_stats_handles_used++;
+    // serial first, so a reader that sees dev sees its serial
+    __atomic_store_n( &blink1_stats_handles[freeslot].serial, serialnum, __ATOMIC_RELAXED );
+    __atomic_store_n( &blink1_stats_handles[freeslot].dev, dev, __ATOMIC_RELEASE );
+}
+
+// empty out tombstones that no live entry probes past. A tombstone
+// followed by an empty slot ends every probe that would reach it, so it
+// can be emptied too, working back from i. Readers stop early at an empty
+// slot either way, and only look up live entries. With no live entries
+// left the whole table is tombstones or empty, so clear it all.
+static void blink1_statsSweep( int i )
+{
+    if( blink1_stats_handles_used == 0 ) {
+        for( int n=0; n < blink1_stats_handles_max; n++ ) {
+            __atomic_store_n( &blink1_stats_handles[n].dev, NULL, __ATOMIC_RELEASE );
+        }
+        return;
+    }
+    int next = (i + 1) % blink1_stats_handles_max;
+    if( blink1_stats_handles[next].dev != NULL ) return;
+    while( blink1_stats_handles[i].dev == blink1_stats_unmapped ) {
+        __atomic_store_n( &blink1_stats_handles[i].dev, NULL, __ATOMIC_RELEASE );
+        i = (i + blink1_stats_handles_max - 1) % blink1_stats_handles_max;
+    }
+}
+
+static void blink1_statsUnmap( blink1_device* dev )
+{
+    if( dev == NULL ) return;
+    uint32_t h = blink1_hashPtr( dev );
+    for( int n=0; n < blink1_stats_handles_max; n++ ) {
+        int i = (h + n) % blink1_stats_handles_max;
+        blink1_device* cur = blink1_stats_handles[i].dev;
+        if( cur == NULL ) return;
+        if( cur == dev ) {
+            __atomic_store_n( &blink1_stats_handles[i].serial, 0, __ATOMIC_RELAXED );
+            __atomic_store_n( &blink1_stats_handles[i].dev, blink1_stats_unmapped,
+                              __ATOMIC_RELEASE );
+            blink1_stats_handles_used--;
+            blink1_statsSweep( i );
+            return;
+        }
+    }
+}
+
+// per-device slot for dev, NULL if it's not mapped or the table is full
+static blink1_devstats_t* blink1_statsDev( blink1_device* dev )
+{
+    uint32_t h = blink1_hashPtr( dev );
+    for( int n=0; n < blink1_stats_handles_max; n++ ) {
+        int i = (h + n) % blink1_stats_handles_max;
+        blink1_device* cur = __atomic_load_n( &blink1_stats_handles[i].dev, __ATOMIC_ACQUIRE );
+        if( cur == NULL ) return NULL;
+        if( cur == dev ) {
+            return blink1_statsSlot(
+                __atomic_load_n( &blink1_stats_handles[i].serial, __ATOMIC_RELAXED ) );
+        }
+    }
+    return NULL;
+}
+
+// account one report transfer started at t0 (from blink1_statsStart())
+static void blink1_statsRecord( blink1_device* dev, int op, uint8_t cmd,
+                                int64_t t0, int failed )
+{
+    if( t0 == 0 ) return;
+    int64_t us = blink1_micros() - t0;
+    if( us < 0 ) us = 0;
+    blink1_stats_op_t* ops = (op == blink1_stats_write) ?
+        blink1_stats.writes : blink1_stats.reads;
+    blink1_statsAdd( &ops[cmd & 0x7f], us, failed );
+    blink1_devstats_t* ds = blink1_statsDev( dev );
+    if( ds ) {
+        blink1_statsAdd( (op == blink1_stats_write) ? &ds->write : &ds->read,
+                         us, failed );
+    }
+}
+
+// copy size bytes of uint64_t counters, each one read atomically
+static void blink1_statsCopy( void* dst, void* src, size_t size )
+{
+    uint64_t* d = dst;
+    uint64_t* s = src;
+    for( size_t i=0; i < size / sizeof(uint64_t); i++ ) {
+        d[i] = __atomic_load_n( &s[i], __ATOMIC_RELAXED );
+    }
+}
+
+// zero size bytes of uint64_t counters, each one stored atomically,
+// as they may be counted up meanwhile
+static void blink1_statsZero( void* dst, size_t size )
+{
+    uint64_t* d = dst;
+    for( size_t i=0; i < size / sizeof(uint64_t); i++ ) {
+        __atomic_store_n( &d[i], 0, __ATOMIC_RELAXED );
+    }
+}
+
+void blink1_stats_enable( int on )
+{
+    __atomic_store_n( &blink1_stats_on, on ? 1 : 0, __ATOMIC_RELAXED );
+}
+
+void blink1_stats_reset(void)
+{
+    blink1_statsZero( &blink1_stats, sizeof(blink1_stats) );
+    // keep the slots' serials, so devices stay where they are
+    for( int i=0; i < blink1_stats_devices_max; i++ ) {
+        blink1_statsZero( &blink1_devstats[i].write, sizeof(blink1_stats_op_t) );
+        blink1_statsZero( &blink1_devstats[i].read,  sizeof(blink1_stats_op_t) );
+    }
+}
+
+void blink1_stats_get( blink1_stats_t* stats )
+{
+    blink1_statsCopy( stats, &blink1_stats, sizeof(blink1_stats_t) );
+}
+
+static int blink1_statsCmpSerial( const void* a, const void* b )
+{
+    uint32_t sa = ((const blink1_devstats_t*)a)->serial;
+    uint32_t sb = ((const blink1_devstats_t*)b)->serial;
+    return (sa > sb) - (sa < sb);
+}
+
+int blink1_stats_getDevices( blink1_devstats_t* devstats, int max )
+{
+    int n = 0;
+    for( int i=0; i < blink1_stats_devices_max && n < max; i++ ) {
+        blink1_devstats_t* ds = &blink1_devstats[i];
+        uint32_t serial = __atomic_load_n( &ds->serial, __ATOMIC_ACQUIRE );
+        if( serial == 0 ) continue;
+        devstats[n].serial = serial;
+        blink1_statsCopy( &devstats[n].write, &ds->write, sizeof(blink1_stats_op_t) );
+        blink1_statsCopy( &devstats[n].read,  &ds->read,  sizeof(blink1_stats_op_t) );
+        n++;
+    }
+    qsort( devstats, n, sizeof(blink1_devstats_t), blink1_statsCmpSerial );
+    return n;
+}
+
+uint64_t blink1_stats_percentile( const blink1_stats_op_t* op, double pct )
+{
+    uint64_t total = 0;
+    for( int b=0; b < blink1_stats_buckets; b++ ) total += op->hist[b];
+    if( total == 0 ) return 0;
+    uint64_t want = (uint64_t)(total * pct / 100.0 + 0.5);
+    if( want < 1 ) want = 1;
+    uint64_t seen = 0;
+    for( int b=0; b < blink1_stats_buckets-1; b++ ) {
+        seen += op->hist[b];
+        if( seen >= want ) {
+            uint64_t us = (uint64_t)1 << b;
+            return (us < op->max_us) ? us : op->max_us;
+        }
+    }
+    return op->max_us;
+}
+
+static void blink1_statsPrintOp( FILE* fp, const char* name,
+                                 const blink1_stats_op_t* op )
+{
+    if( op->count == 0 ) return;
+    fprintf(fp, "  %-12s %8llu ok %6llu err  mean %7.3f  p50 %7.3f  p99 %7.3f  max %7.3f ms\n",
+            name,
+            (unsigned long long)(op->count - op->errors),
+            (unsigned long long)op->errors,
+            op->total_us / 1000.0 / op->count,
+            blink1_stats_percentile(op, 50) / 1000.0,
+            blink1_stats_percentile(op, 99) / 1000.0,
+            op->max_us / 1000.0);
+}
+
+void blink1_stats_print( FILE* fp )
+{
+    blink1_stats_t* st = malloc( sizeof(blink1_stats_t) );
+    blink1_devstats_t* ds = malloc( blink1_stats_devices_max * sizeof(blink1_devstats_t) );
+    if( !st || !ds ) {
+        free( st ); free( ds );
+        return;
+    }
+    blink1_stats_get( st );
+    fprintf(fp, "blink1 stats: %llu enumerations, %llu hotplug adds, "
+            "%llu hotplug removes, %llu stale handles\n",
+            (unsigned long long)st->enumerations,
+            (unsigned long long)st->hotplug_adds,
+            (unsigned long long)st->hotplug_removes,
+            (unsigned long long)st->stale_handles);
+    char name[16];
+    for( int c=0; c < 128; c++ ) {
+        snprintf(name, sizeof(name), isprint(c) ? "write '%c'" : "write 0x%02x", c);
+        blink1_statsPrintOp( fp, name, &st->writes[c] );
+    }
+    for( int c=0; c < 128; c++ ) {
+        snprintf(name, sizeof(name), isprint(c) ? "read '%c'" : "read 0x%02x", c);
+        blink1_statsPrintOp( fp, name, &st->reads[c] );
+    }
+    int n = blink1_stats_getDevices( ds, blink1_stats_devices_max );
+    for( int i=0; i < n; i++ ) {
+        if( ds[i].write.count == 0 && ds[i].read.count == 0 ) continue;
+        fprintf(fp, " device %8.8x:\n", ds[i].serial);
+        blink1_statsPrintOp( fp, "write", &ds[i].write );
+        blink1_statsPrintOp( fp, "read",  &ds[i].read );
+    }
+    free( st );
+    free( ds );
+}
+
+
+
+//
+// batched multi-device commands
+//
+
+void blink1_batch_fadeToRGBN( blink1_batch_cmd_t* cmd, uint32_t id,
+                              uint16_t fadeMillis,
+                              uint8_t r, uint8_t g, uint8_t b, uint8_t n )
+{
+    cmd->id = id;
+    cmd->rc = 0;
+    blink1_makeFadeToRGBN(cmd->buf, fadeMillis, r,g,b, n);
+}
+
+void blink1_batch_playloop( blink1_batch_cmd_t* cmd, uint32_t id, uint8_t play,
+                            uint8_t startpos, uint8_t endpos, uint8_t count )
+{
+    cmd->id = id;
+    cmd->rc = 0;
+    blink1_makePlayloop(cmd->buf, play, startpos, endpos, count);
+}
+
+void blink1_batch_query( blink1_batch_cmd_t* cmd, uint32_t id,
+                         uint8_t query, uint8_t arg )
+{
+    cmd->id = id;
+    cmd->rc = 0;
+    memset(cmd->buf, 0, sizeof(cmd->buf));
+    cmd->buf[0] = blink1_report_id;
+    cmd->buf[1] = query;
+    cmd->buf[7] = arg;
+}
+
+// one per device in a batch
+typedef struct {
+    blink1_device* dev;
+    const char* serial;        // interned, so one device is one pointer
+    blink1_batch_cmd_t* cmds;  // whole batch, worker only sends its own
+    const char** serials;      // device of each command, looked up once
+    int count;
+    int query;                 // also collect each command's response
+} blink1_batch_worker;
+
+// send all of a batch's commands for one device, in order
+static void blink1_batch_run( blink1_batch_worker* w )
+{
+    for( int k=0; k < w->count; k++ ) {
+        blink1_batch_cmd_t* cmd = &w->cmds[k];
+        if( w->serials[k] != w->serial ) continue;
+        cmd->rc = blink1_write( w->dev, cmd->buf, sizeof(cmd->buf) );
+        if( w->query && cmd->rc != -1 )
+            cmd->rc = blink1_readResponse( w->dev, cmd->buf, sizeof(cmd->buf) );
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI blink1_batch_thread( LPVOID arg )
+{
+    blink1_batch_run( (blink1_batch_worker*)arg );
+    return 0;
+}
+#else
+static void* blink1_batch_thread( void* arg )
+{
+    blink1_batch_run( (blink1_batch_worker*)arg );
+    return NULL;
+}
+#endif
+
+static int blink1_batch_send( blink1_batch_cmd_t* cmds, int count, int query )
+{
+    if( count <= 0 ) return 0;
+    blink1_batch_worker* workers = malloc( count * sizeof(blink1_batch_worker) );
+    const char** serials = malloc( count * sizeof(const char*) );
+    if( workers == NULL || serials == NULL ) {
+        free( workers );
+        free( serials );
+        return count;
+    }
+    int nworkers = 0;
+
+    // open devices up front, on this thread, one worker per distinct device.
+    // Indexes shift on hotplug, so name each device by its serial from here on
+    for( int k=0; k < count; k++ ) {
+        serials[k] = blink1_getCachedSerial( blink1_getCacheIndexById(cmds[k].id) );
+        int w;
+        for( w=0; w < nworkers; w++ ) {
+            if( workers[w].serial == serials[k] ) break;
+        }
+        if( w == nworkers ) {
+            blink1_device* dev = NULL;
+            if( serials[k] ) dev = blink1_poolAcquire( strtoul(serials[k], NULL, 16) );
+            if( dev == NULL ) {
+                LOG("blink1_batch_send: cannot open id %X\n", cmds[k].id);
+                cmds[k].rc = -1;
+                serials[k] = NULL;
+                continue;
+            }
+            workers[w].dev = dev;
+            workers[w].serial = serials[k];
+            workers[w].cmds = cmds;
+            workers[w].serials = serials;
+            workers[w].count = count;
+            workers[w].query = query;
+            nworkers++;
+        }
+    }
+
+    if( nworkers == 1 ) {  // no need for threads
+        blink1_batch_run( &workers[0] );
+    }
+    else if( nworkers > 1 ) {
+#ifdef _WIN32
+        HANDLE* threads = calloc( nworkers, sizeof(HANDLE) );
+        for( int w=0; w < nworkers; w++ ) {
+            if( threads ) {
+                threads[w] = CreateThread(NULL, 0, blink1_batch_thread, &workers[w], 0, NULL);
+            }
+            if( threads == NULL || threads[w] == NULL ) blink1_batch_run( &workers[w] );
+        }
+        for( int w=0; threads && w < nworkers; w++ ) {
+            if( threads[w] == NULL ) continue;
+            WaitForSingleObject( threads[w], INFINITE );
+            CloseHandle( threads[w] );
+        }
+        free( threads );
+#else
+        pthread_t* threads = calloc( nworkers, sizeof(pthread_t) );
+        int* started = calloc( nworkers, sizeof(int) );
+        for( int w=0; w < nworkers; w++ ) {
+            if( threads && started ) {
+                started[w] = (pthread_create(&threads[w], NULL, blink1_batch_thread, &workers[w]) == 0);
+            }
+            if( !started || !started[w] ) blink1_batch_run( &workers[w] );
+        }
+        for( int w=0; started && w < nworkers; w++ ) {
+            if( started[w] ) pthread_join( threads[w], NULL );
+        }
+        free( threads );
+        free( started );
+#endif
+    }
+
+    for( int w=0; w < nworkers; w++ ) {
+        blink1_poolRelease( workers[w].dev );
+    }
+    free( workers );
+    free( serials );
+
+    int failed = 0;
+    for( int k=0; k < count; k++ ) {
+        if( cmds[k].rc == -1 ) failed++;
+    }
+    return failed;
+}
+
+int blink1_batch_write( blink1_batch_cmd_t* cmds, int count )
+{
+    return blink1_batch_send( cmds, count, 0 );
+}
+
+int blink1_batch_read( blink1_batch_cmd_t* cmds, int count )
+{
+    return blink1_batch_send( cmds, count, 1 );
+}
+
+//
+// on-device timed command queue
+//
+
+void blink1_timed_fadeToRGBN( blink1_timedcmd_t* tc, uint32_t at,
+                              uint16_t fadeMillis,
+                              uint8_t r, uint8_t g, uint8_t b, uint8_t n )
+{
+    uint8_t buf[blink1_buf_size];
+    blink1_makeFadeToRGBN(buf, fadeMillis, r,g,b, n);
+    tc->at = at;
+    memcpy(tc->cmd, buf+1, sizeof(tc->cmd));
+}
+
+void blink1_timed_playloop( blink1_timedcmd_t* tc, uint32_t at, uint8_t play,
+                            uint8_t startpos, uint8_t endpos, uint8_t count )
+{
+    uint8_t buf[blink1_buf_size];
+    blink1_makePlayloop(buf, play, startpos, endpos, count);
+    tc->at = at;
+    memcpy(tc->cmd, buf+1, sizeof(tc->cmd));
+}
+
+// queue entries per 'Q' report: {2,'Q',flags,count, t3,t2,t1,t0,cmd,a1..a6, ...}
+#define blink1_queue_entries ((blink1_report2_size-4) / 11)
+
+// send one 'Q' report, returns number of entries added or -1
+static int blink1_queueSend( blink1_device* dev, uint8_t flags,
+                             const blink1_timedcmd_t* cmds, int count,
+                             uint32_t* devmillis, int* freeslots )
+{
+    if( !blink1_hasBulk(dev) ) {
+        LOG("blink1_queueSend: device has no command queue\n");
+        return -1;
+    }
+    uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'Q', flags, count };
+    uint8_t* p = buf + 4;
+    for( int i=0; i < count; i++ ) {
+        p[0] = cmds[i].at >> 24;
+        p[1] = cmds[i].at >> 16;
+        p[2] = cmds[i].at >> 8;
+        p[3] = cmds[i].at;
+        memcpy(p+4, cmds[i].cmd, sizeof(cmds[i].cmd));
+        p += 11;
+    }
+    int rc = blink1_write( dev, buf, sizeof(buf) );
+    if( rc != -1 )
+        rc = blink1_readResponse( dev, buf, sizeof(buf) );
+    if( rc == -1 ) return -1;
+    if( devmillis )
+        *devmillis = ((uint32_t)buf[5] << 24) | ((uint32_t)buf[6] << 16) |
+                     ((uint32_t)buf[7] << 8) | buf[8];
+    if( freeslots ) *freeslots = buf[4];
+    return buf[3];
+}
+
+int blink1_queueCmds( blink1_device* dev, const blink1_timedcmd_t* cmds, int count )
+{
+    int queued = 0;
+    while( queued < count ) {
+        int n = count - queued;
+        if( n > blink1_queue_entries ) n = blink1_queue_entries;
+        int added = blink1_queueSend( dev, 0, cmds+queued, n, NULL, NULL );
+        if( added == -1 ) return -1;
+        queued += added;
+        if( added < n ) break;  // queue full
+    }
+    return queued;
+}
+
+int blink1_queueStatus( blink1_device* dev, uint32_t* devmillis, int* freeslots )
+{
+    int rc = blink1_queueSend( dev, 0, NULL, 0, devmillis, freeslots );
+    return (rc == -1) ? -1 : 0;
+}
+
+int blink1_queueClear( blink1_device* dev )
+{
+    int rc = blink1_queueSend( dev, 0x01, NULL, 0, NULL, NULL );
+    return (rc == -1) ? -1 : 0;
+}
+
+//
+// clock sync & synchronized start
+//
+
+int blink1_clockSync( blink1_device* dev, int samples, blink1_clock_t* clk )
+{
+    int rc = -1;
+    for( int i=0; i < samples; i++ ) {
+        uint32_t devmillis;
+        int freeslots;
+        int64_t t0 = blink1_micros();
+        if( blink1_queueStatus( dev, &devmillis, &freeslots ) == -1 ) return -1;
+        int64_t t1 = blink1_micros();
+        int32_t rtt = t1 - t0;
+        if( rc == -1 || rtt < clk->rtt_us ) {
+            // device read its clock somewhere between t0 and t1,
+            // and millis() truncates, so it's mid-millisecond on average
+            clk->offset_us = (int64_t)devmillis * 1000 + 500 - (t0 + t1) / 2;
+            clk->error_us  = rtt / 2 + 500;
+            clk->rtt_us    = rtt;
+            rc = 0;
+        }
+    }
+    LOG("blink1_clockSync: offset %lld us, +/-%d us, rtt %d us\n",
+        (long long)clk->offset_us, clk->error_us, clk->rtt_us);
+    return rc;
+}
+
+uint32_t blink1_clockDeviceMillis( const blink1_clock_t* clk, int64_t host_us )
+{
+    return (uint32_t)((host_us + clk->offset_us) / 1000);
+}
+
+int blink1_syncPlayloop( const uint32_t* ids, int count, uint32_t delayMillis,
+                         uint8_t play, uint8_t startpos, uint8_t endpos,
+                         uint8_t playcount, int32_t* skew_us )
+{
+    if( count <= 0 ) return 0;
+    blink1_device** devs = calloc( count, sizeof(blink1_device*) );
+    blink1_clock_t* clks = calloc( count, sizeof(blink1_clock_t) );
+    if( devs == NULL || clks == NULL ) {
+        free( devs );
+        free( clks );
+        return count;
+    }
+    int32_t err1 = 0, err2 = 0;  // two largest error bounds
+    int failed = 0;
+
+    for( int i=0; i < count; i++ ) {
+        devs[i] = blink1_poolAcquire( ids[i] );
+        if( devs[i] == NULL || blink1_clockSync( devs[i], 8, &clks[i] ) == -1 ) {
+            LOG("blink1_syncPlayloop: cannot sync id %X\n", ids[i]);
+            if( devs[i] != NULL ) blink1_poolRelease( devs[i] );
+            devs[i] = NULL;
+            failed++;
+            continue;
+        }
+        if( clks[i].error_us > err1 ) { err2 = err1; err1 = clks[i].error_us; }
+        else if( clks[i].error_us > err2 ) { err2 = clks[i].error_us; }
+    }
+
+    int64_t start_us = blink1_micros() + (int64_t)delayMillis * 1000;
+    for( int i=0; i < count; i++ ) {
+        if( devs[i] == NULL ) continue;
+        blink1_timedcmd_t tc;
+        blink1_timed_playloop( &tc, blink1_clockDeviceMillis( &clks[i], start_us ),
+                               play, startpos, endpos, playcount );
+        if( blink1_queueCmds( devs[i], &tc, 1 ) != 1 ) failed++;
+        blink1_poolRelease( devs[i] );
+    }
+    if( blink1_micros() > start_us ) {
+        LOG("blink1_syncPlayloop: start time passed before all devices were queued\n");
+    }
+    if( skew_us ) *skew_us = err1 + err2;
+    free( devs );
+    free( clks );
+    return failed;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void blink1_enableDegamma()
+{
+    blink1_enable_degamma = 1;
+}
+void blink1_disableDegamma()
+{
+    blink1_enable_degamma = 0;
 }
 
 /**
@@ -709,8 +2151,8 @@ int blink1_degamma( int n )
 // qsort char* string comparison function
 int cmp_blink1_info_serial(const void *a, const void *b)
 {
-    blink1_info* bia = (blink1_info*) a;
-    blink1_info* bib = (blink1_info*) b;
+    blink1_info* bia = *(blink1_info**) a;
+    blink1_info* bib = *(blink1_info**) b;
 
     return strncmp( bia->serial,
                     bib->serial,
@@ -719,12 +2161,14 @@ int cmp_blink1_info_serial(const void *a, const void *b)
 
 void blink1_sortCache(void)
 {
-    size_t elemsize = sizeof( blink1_info ); //
+    size_t elemsize = sizeof( blink1_info* ); //
 
+    if( blink1_cached_count == 0 ) return;
     qsort( blink1_infos,
            blink1_cached_count,
            elemsize,
            cmp_blink1_info_serial);
+    blink1_cacheReindex( 0 );
 }
 
 
@@ -743,6 +2187,43 @@ int blink1_pid(void)
     return BLINK1_DEVICE_ID;
 }
 
+// simple cross-platform monotonic millis clock
+int64_t blink1_millis(void)
+{
+#ifdef _WIN32
+    return GetTickCount64();
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t tb;
+    if( tb.denom == 0 ) mach_timebase_info(&tb);
+    return (int64_t)(mach_absolute_time() * tb.numer / tb.denom / 1000000);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+// simple cross-platform monotonic micros clock
+int64_t blink1_micros(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if( freq.QuadPart == 0 ) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (int64_t)((now.QuadPart / freq.QuadPart) * 1000000 +
+                     (now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart);
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t tb;
+    if( tb.denom == 0 ) mach_timebase_info(&tb);
+    return (int64_t)(mach_absolute_time() * tb.numer / tb.denom / 1000);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 // simple cross-platform millis sleep func
 void blink1_sleep(uint32_t millis)
 {
@@ -781,13 +2262,15 @@ void hexdump(FILE* fp, uint8_t *buffer, int len)
 // parse a comma-delimited string containing numbers (dec,hex) into a byte arr
 int hexread(uint8_t *buffer, char *string, int buflen)
 {
-    char    *s;
+    char    *s = string;
     int     pos = 0;
     if( string==NULL ) return -1;
     memset(buffer,0,buflen);  // bzero() not defined on Win32?
-    while((s = strtok(string, ", ")) != NULL && pos < buflen){
-        string = NULL;
+    while( pos < buflen ) {
+        s += strspn(s, ", ");
+        if( *s == 0 ) break;
         buffer[pos++] = (char)strtol(s, NULL, 0);
+        s += strcspn(s, ", ");
     }
     return pos;
 }
@@ -832,28 +2315,172 @@ void hsbtorgb( rgb_t* rgb, uint8_t* hsb )
 
 void remove_whitespace(char *str)
 {
-    char *p;
-    size_t len = strlen(str);
+    char *d = str;
+    for( char *p = str; *p; p++ ) {
+        if( !isspace((unsigned char)*p) ) *d++ = *p;
+    }
+    *d = 0;
+}
+
+//
+// Color & pattern parsing.
+// These work on [p,end) ranges, so they need no NUL, never write to the
+// string and keep no state, unlike the strtok() versions they replace.
+//
+
+static int parse_isspace(char c)
+{
+    return c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\f' || c=='\v';
+}
+
+static int parse_hexval(char c)
+{
+    if( c >= '0' && c <= '9' ) return c - '0';
+    if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
+
+static const char* parse_skipspace(const char* p, const char* end)
+{
+    while( p < end && parse_isspace(*p) ) p++;
+    return p;
+}
+
+// parse decimal or 0x hex number no bigger than max,
+// return end of number, or NULL if there isn't one or it's too big
+static const char* parse_uint(const char* p, const char* end, uint32_t max, uint32_t* val)
+{
+    uint32_t v = 0;
+    int d, digits = 0;
+    if( end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') &&
+        parse_hexval(p[2]) >= 0 ) {
+        for( p += 2; p < end && (d = parse_hexval(*p)) >= 0; p++, digits++ ) {
+            if( v > (max - d) / 16 ) return NULL;
+            v = v*16 + d;
+        }
+    }
+    else {
+        for( ; p < end && *p >= '0' && *p <= '9'; p++, digits++ ) {
+            d = *p - '0';
+            if( v > (max - d) / 10 ) return NULL;
+            v = v*10 + d;
+        }
+    }
+    if( digits == 0 ) return NULL;
+    *val = v;
+    return p;
+}
 
-    for(p = str; *p; p ++, len --) {
-        while(isspace(*p)) memmove(p, p+1, len--);
+// parse seconds like "0.25" into millis, digits past millis are dropped
+static const char* parse_secs(const char* p, const char* end, uint16_t* millis)
+{
+    uint32_t ms = 0, scale = 100;
+    int digits = 0;
+    for( ; p < end && *p >= '0' && *p <= '9'; p++, digits++ ) {
+        ms = ms*10 + (*p - '0');
+        if( ms > 65 ) return NULL;  // more than 65.535 secs
+    }
+    ms *= 1000;
+    if( p < end && *p == '.' ) {
+        for( p++; p < end && *p >= '0' && *p <= '9'; p++, digits++ ) {
+            ms += (*p - '0') * scale;
+            scale /= 10;
+        }
     }
+    if( digits == 0 || ms > 0xffff ) return NULL;
+    *millis = ms;
+    return p;
+}
+
+// parse color in trimmed [p,end), see blink1_parseColor()
+static int parse_color(const char* p, const char* end, rgb_t* color)
+{
+    size_t n = end - p;
+    int hex = 0;
+    if( n > 0 && *p == '#' ) {
+        hex = 1; p++; n--;
+    }
+    else if( n == 6 ) {
+        hex = 1;
+        for( size_t i=0; i < n; i++ ) {
+            if( parse_hexval(p[i]) < 0 ) hex = 0;
+        }
+    }
+    if( hex ) {  // "#ff00ff" or "ff00ff"
+        uint32_t v = 0;
+        if( n < 1 || n > 6 ) return -1;
+        for( ; p < end; p++ ) {
+            int d = parse_hexval(*p);
+            if( d < 0 ) return -1;
+            v = (v << 4) | d;
+        }
+        color->r = (v >> 16) & 0xff;
+        color->g = (v >>  8) & 0xff;
+        color->b = (v >>  0) & 0xff;
+        return 0;
+    }
+    // "255,0,255" or "0xff,0x00,0xff", missing ones are 0
+    uint8_t c[3] = {0,0,0};
+    int i = 0;
+    if( p == end ) return -1;
+    while( p < end ) {
+        uint32_t v;
+        if( i == 3 ) return -1;
+        p = parse_uint(p, end, 255, &v);
+        if( p == NULL ) return -1;
+        c[i++] = v;
+        p = parse_skipspace(p, end);
+        if( p < end && *p == ',' ) p = parse_skipspace(p+1, end);
+    }
+    color->r = c[0];
+    color->g = c[1];
+    color->b = c[2];
+    return 0;
+}
+
+// find next field of a comma-separated list, skipping empty ones,
+// set [*fs,*fe) to the field without surrounding whitespace
+// return start of the field after it, or NULL if there are no more
+static const char* parse_field(const char* p, const char* end,
+                               const char** fs, const char** fe)
+{
+    for( p = parse_skipspace(p, end); p < end && *p == ','; ) {
+        p = parse_skipspace(p+1, end);
+    }
+    if( p == end ) return NULL;
+    *fs = p;
+    while( p < end && *p != ',' ) p++;
+    *fe = p;
+    while( *fe > *fs && parse_isspace((*fe)[-1]) ) (*fe)--;
+    return (p < end) ? p+1 : p;
+}
+
+static int parse_fail(blink1_parse_error_t* err, blink1_parse_err_t code,
+                      size_t offset, int line)
+{
+    if( err ) {
+        err->code = code;
+        err->offset = offset;
+        err->line = line;
+    }
+    return -1;
 }
 
 // parse a color in form either "#ff00ff" or "FF00FF"
 // or "255,0,255" or "0xff,0x00,0xff"
-void parsecolor(rgb_t* color, char* colorstr)
+int blink1_parseColor( rgb_t* color, const char* str, size_t len,
+                       blink1_parse_error_t* err )
 {
-    // parse hex color code like "#FF00FF" or "FF00FF"
-    if( strchr(colorstr,',')==NULL && (colorstr[0] == '#' || strlen(colorstr)==6) ) {
-        colorstr = (colorstr[0] == '#') ? colorstr+1 : colorstr;
-        uint32_t colorint = strtol(colorstr, NULL, 16);
-        color->r = (colorint >> 16) & 0xff;
-        color->g = (colorint >>  8) & 0xff;
-        color->b = (colorint >>  0) & 0xff;
-    } else { // else it's a list like "0xff,0x00,0xff" or "255,0,255"
-        hexread((uint8_t*)color, colorstr, 3);  // FIXME: hardcoded size
+    const char* end = str + len;
+    const char* p = parse_skipspace(str, end);
+    while( end > p && parse_isspace(end[-1]) ) end--;
+    if( p == end ) return parse_fail(err, BLINK1_PARSE_EMPTY, 0, 0);
+    if( parse_color(p, end, color) == -1 ) {
+        return parse_fail(err, BLINK1_PARSE_BAD_COLOR, p - str, 0);
     }
+    if( err ) err->code = BLINK1_PARSE_OK;
+    return 0;
 }
 
 //
@@ -861,36 +2488,84 @@ void parsecolor(rgb_t* color, char* colorstr)
 // - number repeats
 // - pattern array (contains {color,millis,ledn}
 // - pattern length
-int parsePattern( char* str, int* repeats, patternline_t* pattern )
+int blink1_parsePatternN( const char* str, size_t len, int* repeats,
+                          patternline_t* pattern, int maxlines,
+                          blink1_parse_error_t* err )
 {
-    remove_whitespace(str);
-    char* s;
-    s = strtok( str, ", ");
-    if(  s != NULL ) {
-      *repeats = strtol(s,NULL,0);
+    const char* end = str + len;
+    const char *fs, *fe, *next;
+    uint32_t v;
+
+    const char* p = parse_field(str, end, &fs, &fe);
+    if( p == NULL ) return parse_fail(err, BLINK1_PARSE_EMPTY, 0, -1);
+    int neg = (*fs == '-');
+    if( parse_uint(fs + neg, fe, INT_MAX, &v) != fe ) {
+        return parse_fail(err, BLINK1_PARSE_BAD_NUMBER, fs - str, -1);
     }
+    *repeats = neg ? -(int)v : (int)v;
 
-    int i=0;
-    s = strtok(NULL, ","); // prep next parse
-    while( s != NULL ) {
-        //printf("s:'%s'\n",s);
-        parsecolor( &pattern[i].color, s );
-
-        s = strtok(NULL, ",");
-        if( s == NULL ) { msg("bad pattern: no millis\n"); break; }
-        pattern[i].millis = atof(s) * 1000;
+    int n = 0;
+    while( (next = parse_field(p, end, &fs, &fe)) != NULL ) {
+        patternline_t pl;
+        if( pattern && n == maxlines ) {
+            return parse_fail(err, BLINK1_PARSE_TOO_LONG, fs - str, n);
+        }
+        if( parse_color(fs, fe, &pl.color) == -1 ) {
+            return parse_fail(err, BLINK1_PARSE_BAD_COLOR, fs - str, n);
+        }
+        if( (p = parse_field(next, end, &fs, &fe)) == NULL ) {
+            return parse_fail(err, BLINK1_PARSE_NO_MILLIS, len, n);
+        }
+        if( parse_secs(fs, fe, &pl.millis) != fe ) {
+            return parse_fail(err, BLINK1_PARSE_BAD_NUMBER, fs - str, n);
+        }
+        if( (next = parse_field(p, end, &fs, &fe)) == NULL ) {
+            return parse_fail(err, BLINK1_PARSE_NO_LEDN, len, n);
+        }
+        if( parse_uint(fs, fe, 255, &v) != fe ) {
+            return parse_fail(err, BLINK1_PARSE_BAD_NUMBER, fs - str, n);
+        }
+        pl.ledn = v;
+        if( pattern ) pattern[n] = pl;
+        n++;
+        p = next;
+    }
+    if( err ) err->code = BLINK1_PARSE_OK;
+    return n;
+}
 
-        s = strtok(NULL, ",");
-        if( s == NULL ) { msg("bad pattern: no led\n"); break; }
-        pattern[i].ledn = strtol(s,NULL,0);
+const char* blink1_parseErrorStr( blink1_parse_err_t code )
+{
+    switch( code ) {
+    case BLINK1_PARSE_OK:         return "ok";
+    case BLINK1_PARSE_EMPTY:      return "empty";
+    case BLINK1_PARSE_BAD_NUMBER: return "bad number";
+    case BLINK1_PARSE_BAD_COLOR:  return "bad color";
+    case BLINK1_PARSE_NO_MILLIS:  return "no millis";
+    case BLINK1_PARSE_NO_LEDN:    return "no led";
+    case BLINK1_PARSE_TOO_LONG:   return "too many lines";
+    }
+    return "unknown error";
+}
 
-        i++;
+// parse a color in form either "#ff00ff" or "FF00FF"
+// or "255,0,255" or "0xff,0x00,0xff"
+void parsecolor(rgb_t* color, char* colorstr)
+{
+    if( blink1_parseColor( color, colorstr, strlen(colorstr), NULL ) == -1 ) {
+        color->r = color->g = color->b = 0;
+    }
+}
 
-        s = strtok(NULL, ",");
-        if( s == NULL ) break;
+int parsePattern( char* str, int* repeats, patternline_t* pattern )
+{
+    blink1_parse_error_t err;
+    int n = blink1_parsePatternN( str, strlen(str), repeats, pattern, INT_MAX, &err );
+    if( n == -1 ) {
+        msg("bad pattern: %s at char %d\n", blink1_parseErrorStr(err.code), (int)err.offset);
+        n = (err.line > 0) ? err.line : 0;
     }
-    int pattlen = i;
-    return pattlen;
+    return n;
 }
 
 /**
@@ -19,15 +19,18 @@
 extern "C" {
 #endif
 
-#define blink1_max_devices 32
+// ids below this are device cache indexes, above it serial numbers
+#define blink1_max_devices 1024
 
-#define cache_max blink1_max_devices
-//#define cache_max 16
+// initial size of the device cache, it grows as devices are found
+#define cache_max 32
 #define serialstrmax (8 + 1)
 #define pathstrmax 1024
 
 #define blink1mk2_serialstart 0x20000000
 #define blink1mk3_serialstart 0x30000000
+#define blink1mk3_bulk_fwversion 305  // first mk3 firmware with bulk commands
+#define blink1mk3_max_leds 18
 
 #define  BLINK1_VENDOR_ID       0x27B8 /* = 0x27B8 = 10168 = thingm */
 #define  BLINK1_DEVICE_ID       0x01ED /* = 0x01ED */
@@ -54,8 +57,10 @@ struct blink1_device_;
 typedef struct hid_device_ blink1_device; /**< opaque blink1 structure */
 #elif USE_HIDDATA
 typedef struct usbDevice   blink1_device; /**< opaque blink1 structure */
+#elif USE_HIDRAW
+typedef struct blink1_hidraw_ blink1_device; /**< opaque blink1 structure */
 #else
-#warning "USE_HIDAPI or USE_HIDDATA wasn't defined, defaulting to USE_HIDAPI"
+#warning "USE_HIDAPI, USE_HIDDATA or USE_HIDRAW wasn't defined, defaulting to USE_HIDAPI"
 typedef struct hid_device_ blink1_device; /**< opaque blink1 structure */
 #endif
 
@@ -77,8 +82,122 @@ typedef struct {
     uint8_t ledn;     // number of led, or 0 for all
 } patternline_t;
 
+/**
+ * One command in a batch sent by blink1_batch_write().
+ * Fill in with one of the blink1_batch_*() command builders.
+ */
+typedef struct {
+    uint32_t id;                    // blink1 id, as in blink1_openById()
+    uint8_t  buf[blink1_buf_size];  // report to send
+    int      rc;                    // result after blink1_batch_write(), -1 on error
+} blink1_batch_cmd_t;
+
+/**
+ * One command for a blink(1)'s on-device timed command queue.
+ * Fill in with one of the blink1_timed_*() command builders.
+ */
+typedef struct {
+    uint32_t at;                          // device millis() to run at
+    uint8_t  cmd[blink1_report_size-1];   // command & args of a report id 1 report
+} blink1_timedcmd_t;
+
+/**
+ * Estimate of a blink(1)'s clock relative to the host's,
+ * filled in by blink1_clockSync().
+ */
+typedef struct {
+    int64_t offset_us;  // device millis() (as micros) minus host blink1_micros()
+    int32_t error_us;   // offset is good to +/- this
+    int32_t rtt_us;     // round trip of the sample the offset came from
+} blink1_clock_t;
+
+/**
+ * Frame renderer for blink1_streamFrames().
+ * Fill in leds[0..count-1] for frame number 'frame'.
+ * Frame numbers skip ahead when frames are dropped, so animations
+ * should be computed from the frame number, not a counter.
+ * @return 1 to keep streaming, 0 to stop
+ */
+typedef int (*blink1_frame_func)( rgb_t* leds, int count, uint32_t frame, void* arg );
+
+/**
+ * Results of blink1_streamFrames().
+ */
+typedef struct {
+    uint32_t sent;      // frames sent to the device
+    uint32_t dropped;   // frames skipped to hold the target fps
+    int64_t  elapsed;   // millis from first frame to end of stream
+} blink1_stream_stats_t;
+
+// number of latency histogram buckets in blink1_stats_op_t
+#define blink1_stats_buckets 24
+// max number of devices blink1_stats keeps per-device numbers for
+#define blink1_stats_devices_max 64
+
+/**
+ * Counts and latency histogram of one kind of operation, see blink1_stats_get().
+ * hist[i] counts operations that took less than 2^i micros and
+ * at least 2^(i-1), the last bucket also counts all slower ones.
+ */
+typedef struct {
+    uint64_t count;      // operations done
+    uint64_t errors;     // of those, how many failed
+    uint64_t total_us;   // sum of their latencies
+    uint64_t max_us;     // slowest one
+    uint64_t hist[blink1_stats_buckets];
+} blink1_stats_op_t;
+
+/**
+ * Library-wide statistics, filled in by blink1_stats_get().
+ * Writes and reads are feature report transfers, indexed by the command
+ * byte of the report, e.g. writes['c'] for fadeToRGB and reads['v']
+ * for the response to a getVersion. A query is a write and a read.
+ */
+typedef struct {
+    blink1_stats_op_t writes[128];
+    blink1_stats_op_t reads[128];
+    uint64_t enumerations;     // full scans for devices
+    uint64_t hotplug_adds;     // devices added to the cache by hotplug
+    uint64_t hotplug_removes;  // devices removed from the cache by hotplug
+    uint64_t stale_handles;    // pooled handles marked for reopen after an I/O error
+} blink1_stats_t;
+
+/**
+ * Statistics of one device, filled in by blink1_stats_getDevices().
+ */
+typedef struct {
+    uint32_t serial;           // serial number, as in blink1_openById()
+    blink1_stats_op_t write;   // all writes to this device
+    blink1_stats_op_t read;    // all reads from this device
+} blink1_devstats_t;
+
+/**
+ * Error codes from blink1_parseColor() and blink1_parsePatternN().
+ */
+typedef enum {
+    BLINK1_PARSE_OK = 0,
+    BLINK1_PARSE_EMPTY,       // nothing to parse
+    BLINK1_PARSE_BAD_NUMBER,  // number malformed or out of range
+    BLINK1_PARSE_BAD_COLOR,   // color not "#rrggbb", "rrggbb" or "r,g,b"
+    BLINK1_PARSE_NO_MILLIS,   // pattern line ends after its color
+    BLINK1_PARSE_NO_LEDN,     // pattern line ends after its time
+    BLINK1_PARSE_TOO_LONG     // more pattern lines than room for them
+} blink1_parse_err_t;
+
+/**
+ * Where and why blink1_parseColor() or blink1_parsePatternN() failed.
+ */
+typedef struct {
+    blink1_parse_err_t code;
+    size_t offset;   // offset in the string of the bad field
+    int    line;     // pattern line it's in, -1 for the repeats count
+} blink1_parse_error_t;
+
 /**
  * Scan USB for blink(1) devices.
+ * @note Where the backend supports hotplug (udev or libusb), only the
+ *       first call scans the bus; after that the cache is kept current
+ *       by hotplug events and this just returns the cached count.
  * @return number of devices found
  */
 int          blink1_enumerate();
@@ -115,6 +234,9 @@ blink1_device* blink1_openBySerial(const char* serial);
 /**
  * Open by "id", which if from 0-blink1_max_devices is index
  *  or if >blink1_max_devices, is numerical representation of serial number
+ * @note An index is a position in the serial-sorted device cache, so it
+ *       can name a different device once one is plugged in or removed.
+ *       Use the serial number to name a device across calls.
  * @param id ordinal 0-15 id of blink1 or numerical rep of 8-hex digit serial
  * @return blink1_device or NULL if no blink1 found
  */
@@ -135,6 +257,211 @@ blink1_device* blink1_openById( uint32_t id );
  */
 void blink1_close_internal( blink1_device* dev );
 
+/**
+ * Get a pooled handle for blink1 "id", opening it if needed.
+ * Pooled handles stay open across calls so repeated commands
+ * don't pay for a full open/close each time.
+ * Every blink1_poolAcquire() must be matched by a blink1_poolRelease().
+ * @param id ordinal 0-15 id of blink1 or numerical rep of 8-hex digit serial
+ * @return blink1_device or NULL if no blink1 found
+ */
+blink1_device* blink1_poolAcquire( uint32_t id );
+
+/**
+ * Give back a handle gotten from blink1_poolAcquire().
+ * The handle stays open until evicted by blink1_poolFlush().
+ * If dev is not a pooled handle, it is closed.
+ * @param dev blink1_device
+ */
+void blink1_poolRelease( blink1_device* dev );
+
+/**
+ * Generation of a pooled handle, a number that is new for each handle
+ * the pool opens. Reopening may mean the device was replugged, so state
+ * kept about it (e.g. what's in its RAM) should be keyed on this, not
+ * on the handle pointer, which malloc may hand out again.
+ * @param dev handle from blink1_poolAcquire(), still acquired
+ * @return generation, or 0 if dev isn't a pooled handle in the cache
+ */
+uint32_t blink1_poolGeneration( blink1_device* dev );
+
+/**
+ * Close pooled handles that are not in use and have been idle
+ * for at least idle_millis milliseconds.
+ * @param idle_millis idle time threshold, 0 to close all unused handles
+ * @return number of handles closed
+ */
+int blink1_poolFlush( int idle_millis );
+
+/**
+ * Close all pooled handles that are not in use. Handles still in use
+ * are closed when their last user calls blink1_poolRelease().
+ * Called automatically when the device cache is re-enumerated.
+ */
+void blink1_poolCloseAll(void);
+
+/**
+ * Send a list of commands to one or more blink(1) devices concurrently.
+ * Commands are grouped per device and each device gets its own worker
+ * thread, so N devices take about as long as one device.
+ * Commands for the same device are sent in list order.
+ * Devices are gotten from the handle pool (see blink1_poolAcquire()).
+ * @param cmds array of commands, 'rc' of each is filled in on return
+ * @param count number of commands in cmds
+ * @return number of commands that failed, 0 on complete success
+ */
+int blink1_batch_write( blink1_batch_cmd_t* cmds, int count );
+
+/**
+ * Fill in batch command to fade to RGB color, see blink1_fadeToRGBN().
+ * @param cmd batch command to fill in
+ * @param id blink1 id, as in blink1_openById()
+ * @param fadeMillis time to fade in milliseconds
+ * @param r red part of RGB color
+ * @param g green part of RGB color
+ * @param b blue part of RGB color
+ * @param n which LED to address (0=all, 1=1st LED, 2=2nd LED)
+ */
+void blink1_batch_fadeToRGBN( blink1_batch_cmd_t* cmd, uint32_t id,
+                              uint16_t fadeMillis,
+                              uint8_t r, uint8_t g, uint8_t b, uint8_t n );
+
+/**
+ * Fill in batch command to play a color pattern, see blink1_playloop().
+ * @param cmd batch command to fill in
+ * @param id blink1 id, as in blink1_openById()
+ * @param play boolean: 1=play, 0=stop
+ * @param startpos position to start playing from
+ * @param endpos position to end playing
+ * @param count number of times to play (0=forever)
+ */
+void blink1_batch_playloop( blink1_batch_cmd_t* cmd, uint32_t id, uint8_t play,
+                            uint8_t startpos, uint8_t endpos, uint8_t count );
+
+/**
+ * Query one or more blink(1) devices, pipelined.
+ * Each command's buf holds a query (e.g. from blink1_batch_query()).
+ * Like blink1_batch_write(), each device gets its own worker thread, so
+ * all query reports go out together and all responses are collected as
+ * they arrive: N devices take about one round trip instead of N.
+ * Queries for the same device are answered in list order.
+ * @param cmds array of queries, 'buf' and 'rc' of each filled in on return
+ * @param count number of queries in cmds
+ * @return number of queries that failed, 0 on complete success
+ */
+int blink1_batch_read( blink1_batch_cmd_t* cmds, int count );
+
+/**
+ * Fill in batch command to query a blink(1), for blink1_batch_read().
+ * e.g. 'v' version, 'r' read RGB of LED arg, 'R' read pattern line arg,
+ * 'S' read play state, 'b' read startup params.
+ * @param cmd batch command to fill in
+ * @param id blink1 id, as in blink1_openById()
+ * @param query single-character query command
+ * @param arg LED number or pattern position, if query takes one
+ */
+void blink1_batch_query( blink1_batch_cmd_t* cmd, uint32_t id,
+                         uint8_t query, uint8_t arg );
+
+/**
+ * Add timed commands to a blink(1)'s on-device command queue.
+ * The device runs each command when its millis() reaches the command's
+ * 'at', so animation timing doesn't depend on host scheduling.
+ * Use blink1_queueStatus() to get device time and free queue slots.
+ * @note only for mk3 devices with fw305+
+ * @param dev blink1 device to command
+ * @param cmds timed commands, any order
+ * @param count number of commands in cmds
+ * @return number of commands queued (less than count if queue filled),
+ *         or -1 on error or if device has no queue
+ */
+int blink1_queueCmds( blink1_device* dev, const blink1_timedcmd_t* cmds, int count );
+
+/**
+ * Read a blink(1)'s clock and command queue space.
+ * @note only for mk3 devices with fw305+
+ * @param dev blink1 device to command
+ * @param devmillis filled in with device millis() when request was handled
+ * @param freeslots filled in with number of free queue entries
+ * @return -1 on error or if device has no queue, 0 on success
+ */
+int blink1_queueStatus( blink1_device* dev, uint32_t* devmillis, int* freeslots );
+
+/**
+ * Remove all not yet run commands from a blink(1)'s command queue.
+ * @note only for mk3 devices with fw305+
+ * @param dev blink1 device to command
+ * @return -1 on error or if device has no queue, 0 on success
+ */
+int blink1_queueClear( blink1_device* dev );
+
+/**
+ * Fill in timed command to fade to RGB color, see blink1_fadeToRGBN().
+ * @param tc timed command to fill in
+ * @param at device millis() to run at
+ * @param fadeMillis time to fade in milliseconds
+ * @param r red part of RGB color
+ * @param g green part of RGB color
+ * @param b blue part of RGB color
+ * @param n which LED to address (0=all, 1=1st LED, 2=2nd LED)
+ */
+void blink1_timed_fadeToRGBN( blink1_timedcmd_t* tc, uint32_t at,
+                              uint16_t fadeMillis,
+                              uint8_t r, uint8_t g, uint8_t b, uint8_t n );
+
+/**
+ * Fill in timed command to play a color pattern, see blink1_playloop().
+ * @param tc timed command to fill in
+ * @param at device millis() to run at
+ * @param play boolean: 1=play, 0=stop
+ * @param startpos position to start playing from
+ * @param endpos position to end playing
+ * @param count number of times to play (0=forever)
+ */
+void blink1_timed_playloop( blink1_timedcmd_t* tc, uint32_t at, uint8_t play,
+                            uint8_t startpos, uint8_t endpos, uint8_t count );
+
+/**
+ * Estimate a blink(1)'s clock offset from the host clock.
+ * Reads the device clock 'samples' times and keeps the sample with the
+ * shortest round trip, NTP-style.
+ * @note only for mk3 devices with fw305+
+ * @param dev blink1 device to command
+ * @param samples number of round trips to try, e.g. 8
+ * @param clk filled in with offset and its error bound
+ * @return -1 on error or if device has no clock readout, 0 on success
+ */
+int blink1_clockSync( blink1_device* dev, int samples, blink1_clock_t* clk );
+
+/**
+ * Convert a host time to a blink(1)'s millis(), e.g. for blink1_timedcmd_t.at
+ * @param clk clock estimate from blink1_clockSync()
+ * @param host_us host time, from blink1_micros()
+ * @return device millis() at that host time
+ */
+uint32_t blink1_clockDeviceMillis( const blink1_clock_t* clk, int64_t host_us );
+
+/**
+ * Start a color pattern playing on many blink(1)s at the same moment.
+ * Each device's clock is synced, then a playloop command is queued
+ * on each to run at the same host time, 'delayMillis' from now.
+ * @note only for mk3 devices with fw305+
+ * @param ids blink1 ids, as in blink1_openById()
+ * @param count number of ids
+ * @param delayMillis how far in the future to start, must cover the
+ *        time taken to queue the command on all devices
+ * @param play boolean: 1=play, 0=stop
+ * @param startpos position to start playing from
+ * @param endpos position to end playing
+ * @param playcount number of times to play (0=forever)
+ * @param skew_us if not NULL, filled in with the estimated worst-case
+ *        start time difference between any two devices
+ * @return number of devices that failed, 0 on complete success
+ */
+int blink1_syncPlayloop( const uint32_t* ids, int count, uint32_t delayMillis,
+                         uint8_t play, uint8_t startpos, uint8_t endpos,
+                         uint8_t playcount, int32_t* skew_us );
+
 /**
  * Low-level write to blink1 device.
  * Used internally by blink1-lib
@@ -146,7 +473,21 @@ int blink1_write( blink1_device* dev, void* buf, int len);
  */
 int blink1_read( blink1_device* dev, void* buf, int len);
 
+/**
+ * Low-level read of current response, without sending a request.
+ * Used internally by blink1-lib
+ */
 int blink1_read_nosend( blink1_device* dev, void* buf, int len);
+/**
+ * Low-level read of the response to a request already sent with
+ * blink1_write(). If the device has not answered yet (response command
+ * byte doesn't match buf[1]) it is polled again with a short backoff.
+ * @param dev blink1 device the request was sent to
+ * @param buf the request sent, holds the response on return
+ * @param len length of buf
+ * @return length read or -1 on error or timeout
+ */
+int blink1_readResponse( blink1_device* dev, void* buf, int len);
 
 /**
  * Get blink1 firmware version.
@@ -191,6 +532,36 @@ int blink1_fadeToRGBN(blink1_device *dev, uint16_t fadeMillis,
  */
 int blink1_setRGB(blink1_device *dev, uint8_t r, uint8_t g, uint8_t b );
 
+/**
+ * Set many LEDs immediately, no fading, as one frame.
+ * On mk3 fw305+ devices this is one report id 2 transfer shown with a
+ * single LED update, otherwise one blink1_fadeToRGBN() per LED.
+ * @param dev blink1 device to command
+ * @param leds colors of LEDs start..start+count-1
+ * @param start first LED to set (0=1st LED)
+ * @param count number of LEDs, at most blink1mk3_max_leds
+ * @return -1 on error, 0 on success
+ */
+int blink1_writeFrame( blink1_device* dev, const rgb_t* leds,
+                       uint8_t start, uint8_t count );
+
+/**
+ * Stream frames rendered by a callback to a blink(1) at a target rate.
+ * Frames that can't be sent in time are dropped (and counted) rather
+ * than sent late, so animations keep their speed on slow links.
+ * @param dev blink1 device to command
+ * @param fps target frames per second
+ * @param start first LED of each frame (0=1st LED)
+ * @param count number of LEDs in each frame
+ * @param render callback to fill in each frame, returns 0 to stop
+ * @param arg passed to render
+ * @param stats if not NULL, filled in with frame counts on return
+ * @return -1 on error, 0 on success
+ */
+int blink1_streamFrames( blink1_device* dev, int fps, uint8_t start, uint8_t count,
+                         blink1_frame_func render, void* arg,
+                         blink1_stream_stats_t* stats );
+
 /**
  * Read current RGB value on specified LED.
  * @note For mk2 devices only.
@@ -326,6 +697,19 @@ int blink1_readPatternLine(blink1_device *dev, uint16_t* fadeMillis,
 int blink1_readPatternLineN(blink1_device *dev, uint16_t* fadeMillis,
                             uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* ledn,
                             uint8_t pos);
+/**
+ * Read many color pattern lines at once.
+ * On mk3 fw305+ devices lines come back 9 to a report id 2 response,
+ * so a full 32-line pattern takes 4 round trips. Other devices are read
+ * one line at a time via blink1_readPatternLineN().
+ * @param dev blink1 device to command
+ * @param lines array of at least count pattern lines to fill in
+ * @param count number of lines to read
+ * @param pos pattern position of first line
+ * @return -1 on error, 0 on success
+ */
+int blink1_readPatternBulk( blink1_device* dev, patternline_t* lines,
+                            int count, uint8_t pos );
 /**
  * Save color pattern in RAM to nonvolatile storage.
  * @note For mk2 devices only.
@@ -336,6 +720,32 @@ int blink1_readPatternLineN(blink1_device *dev, uint16_t* fadeMillis,
  */
 int blink1_savePattern(blink1_device *dev);
 
+/**
+ * Write many color pattern lines at once.
+ * On mk3 fw305+ devices lines are packed into report id 2 bulk writes,
+ * so a full 32-line pattern takes 4 transfers. Other devices get the
+ * same lines one at a time via blink1_setLEDN() & blink1_writePatternLine().
+ * @param dev blink1 device to command
+ * @param lines pattern lines to write (color, fade millis, LED number)
+ * @param count number of lines in lines
+ * @param pos pattern position of first line
+ * @return -1 on error, 0 on success
+ */
+int blink1_writePatternBulk( blink1_device* dev, const patternline_t* lines,
+                             int count, uint8_t pos );
+
+/**
+ * Same as blink1_writePatternBulk() but colors are sent as given,
+ * for lines that have already been through blink1_degamma().
+ * @param dev blink1 device to command
+ * @param lines pattern lines to write (color, fade millis, LED number)
+ * @param count number of lines in lines
+ * @param pos pattern position of first line
+ * @return -1 on error, 0 on success
+ */
+int blink1_writePatternBulkRaw( blink1_device* dev, const patternline_t* lines,
+                                int count, uint8_t pos );
+
 /**
  * Sets 'ledn' parameter for blink1_savePatternLine()
  * @note only works on fw 204+ devices
@@ -404,6 +814,61 @@ void blink1_adjustBrightness( uint8_t brightness, uint8_t* r, uint8_t* g, uint8_
  */
 void blink1_sleep(uint32_t delayMillis);
 
+/**
+ * Simple wrapper for a cross-platform monotonic millisecond clock.
+ * @return milliseconds since some arbitrary fixed point
+ */
+int64_t blink1_millis(void);
+
+/**
+ * Simple wrapper for a cross-platform monotonic microsecond clock.
+ * @return microseconds since some arbitrary fixed point
+ */
+int64_t blink1_micros(void);
+
+/**
+ * Turn collection of statistics on or off, it's off by default.
+ * When off, each write or read costs one extra load of a flag.
+ * When on, counters are updated with atomics, no locks, and the
+ * per-device numbers cost a lock-free lookup of the handle's serial.
+ * @param on 1 to collect, 0 to stop
+ */
+void blink1_stats_enable( int on );
+
+/**
+ * Zero all statistics.
+ * @note Not atomic with respect to operations running at the same time.
+ */
+void blink1_stats_reset(void);
+
+/**
+ * Take a snapshot of the library-wide statistics.
+ * @param stats where to put them
+ */
+void blink1_stats_get( blink1_stats_t* stats );
+
+/**
+ * Take a snapshot of the per-device statistics.
+ * @param devstats where to put them
+ * @param max room in devstats
+ * @return number of devices filled in
+ */
+int blink1_stats_getDevices( blink1_devstats_t* devstats, int max );
+
+/**
+ * Estimate a latency percentile from a histogram.
+ * @param op operation statistics
+ * @param pct percentile, 0-100, e.g. 99 for p99
+ * @return upper bound in micros of the bucket the percentile falls in
+ */
+uint64_t blink1_stats_percentile( const blink1_stats_op_t* op, double pct );
+
+/**
+ * Print all non-zero statistics, one line per operation and device.
+ * @param fp where to print, e.g. stdout
+ */
+void blink1_stats_print( FILE* fp );
+
 /**
  * Vendor ID for blink1 devices.
  * @return blink1 VID
@@ -418,14 +883,16 @@ int blink1_pid(void);  // return PID for blink(1)
 
 /**
  * Return platform-specific USB path for given cache index.
+ * The string stays valid, and unchanged, after the device is gone.
  * @param i cache index
- * @return path string
+ * @return path string, or NULL if there's no such index
  */
 const char*  blink1_getCachedPath(int i);
 /**
  * Return bilnk1 serial number for given cache index.
+ * The string stays valid, and unchanged, after the device is gone.
  * @param i cache index
- * @return 8-hexdigit serial number as string
+ * @return 8-hexdigit serial number as string, or NULL if there's no such index
  */
 const char*  blink1_getCachedSerial(int i);
 /**
@@ -436,6 +903,7 @@ const char*  blink1_getCachedSerial(int i);
 int          blink1_getCacheIndexByPath( const char* path );
 /**
  * Return cache index for a given blink1 id (0-max or serial number as uint32)
+ * Cache indexes change as devices come and go, see blink1_openById().
  * @param i blink1 id (0-blink1_max_devices or serial as uint32)
  * @return cache index or -1 if not found
  */
@@ -512,7 +980,8 @@ const char* blink1_deviceTypeToStr(blink1Type_t t);
 void hexdump(FILE* fp, uint8_t *buffer, int len);
 
 /**
- *
+ * Parse a comma or space separated list of numbers (dec or 0x hex) into bytes.
+ * @return number of bytes read, at most buflen, or -1 if string is NULL
  */
 int hexread(uint8_t *buffer, char *string, int buflen);
 
@@ -522,15 +991,57 @@ int hexread(uint8_t *buffer, char *string, int buflen);
 void hsbtorgb( rgb_t* rgb, uint8_t* hsb );
 
 /**
- *
+ * Parse a color, see blink1_parseColor(). Color is set to black if
+ * colorstr isn't a valid color.
  */
 void parsecolor(rgb_t* color, char* colorstr);
 
 /**
- *
+ * Parse a pattern string, see blink1_parsePatternN().
+ * @note Doesn't bound the number of lines written to pattern, and
+ *       stops quietly at the first bad line. Prefer blink1_parsePatternN().
+ * @return number of good lines before any bad one
  */
 int parsePattern( char* str, int* repeats, patternline_t* pattern );
 
+/**
+ * Parse a color in the form "#ff00ff", "ff00ff", "255,0,255" or "0xff,0,0xff".
+ * Surrounding whitespace is ignored. Re-entrant, doesn't modify str.
+ * @param color where to put the color
+ * @param str string to parse, need not be NUL-terminated
+ * @param len length of str
+ * @param err if not NULL, filled in with why parsing failed
+ * @return 0 on success, -1 on error
+ */
+int blink1_parseColor( rgb_t* color, const char* str, size_t len,
+                       blink1_parse_error_t* err );
+
+/**
+ * Parse a Blink1Control pattern string, "repeats,color,secs,ledn,color,secs,ledn,...",
+ * e.g. "3,#ff00ff,0.5,0,#000000,0.5,0". Colors are "#rrggbb" or "rrggbb".
+ * Whitespace around fields and empty fields are ignored.
+ * Runs in one pass over str, doesn't allocate, doesn't modify str and is
+ * re-entrant, so it's fine for long pattern files and for threads.
+ * Lines are written to pattern as they're parsed, so on error the lines
+ * before err->line are good.
+ * @param str string to parse, need not be NUL-terminated
+ * @param len length of str
+ * @param repeats where to put the repeats count
+ * @param pattern where to put lines, or NULL to only count them
+ * @param maxlines room in pattern
+ * @param err if not NULL, filled in with why parsing failed
+ * @return number of lines, or -1 on error
+ */
+int blink1_parsePatternN( const char* str, size_t len, int* repeats,
+                          patternline_t* pattern, int maxlines,
+                          blink1_parse_error_t* err );
+
+/**
+ * Describe a parse error code.
+ * @return static string, e.g. "bad color"
+ */
+const char* blink1_parseErrorStr( blink1_parse_err_t code );
+
 /**
  * printf that can be shut up
  *
@@ -10,6 +10,9 @@
  *
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE    // struct ucred
+#endif
 #include <stdio.h>
 #include <stdarg.h>    // vararg stuff
 #include <string.h>    // for memset(), strcmp(), et al
@@ -19,6 +22,14 @@
 #include <time.h>
 #include <unistd.h>    // getuid()
 #include <sys/stat.h>  // stat
+#include <setjmp.h>
+#include <signal.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#endif
 
 #include "blink1-lib.h"
 extern int blink1_lib_verbose;
@@ -47,6 +58,55 @@ uint32_t  deviceIds[blink1_max_devices];
 int verbose;
 int quiet=0;
 
+#ifndef _WIN32
+#define BLINK1_TOOL_DAEMON 1
+#endif
+
+// set while a daemon runs a command for a client, exits come back here
+static jmp_buf* daemon_exit_jmp = NULL;
+static int daemon_exit_code;
+#if BLINK1_TOOL_DAEMON
+static int daemon_client_fd = -1;  // socket of that client
+static volatile sig_atomic_t daemon_stop = 0;
+#endif
+
+// exit(), or in daemon mode just end the current command
+static void tool_exit(int code)
+{
+    if( daemon_exit_jmp ) {
+        daemon_exit_code = code;
+        longjmp( *daemon_exit_jmp, 1 );
+    }
+    exit(code);
+}
+
+// blink1_sleep(), but in daemon mode wake early if the client went away
+// (closed its socket, or got Ctrl-C), or the daemon is stopping.
+// returns -1 then, so a long-running command can stop, else 0
+static int tool_sleep(uint32_t millis)
+{
+#if BLINK1_TOOL_DAEMON
+    if( daemon_client_fd >= 0 ) {
+        int64_t end = blink1_millis() + millis;
+        while( 1 ) {
+            // the client sends nothing more, so readable means EOF
+            struct pollfd pfd = { daemon_client_fd, POLLIN, 0 };
+            int64_t left = end - blink1_millis();
+            int n = poll(&pfd, 1, (left > 0) ? (int)left : 0);
+            if( n > 0 || daemon_stop ) return -1;
+            if( n == 0 && left <= 0 ) return 0;
+            if( n < 0 && errno != EINTR ) return 0;
+        }
+    }
+#endif
+    if( millis ) blink1_sleep(millis);
+    return 0;
+}
+
+// give back the global device. It comes from the handle pool, so
+// in daemon mode it stays open for the next command
+#define release_dev() { blink1_poolRelease(dev); dev=NULL; }
+
 /*
   TBD: replace printf()s with something like this
 void logpri(int loglevel, char* fmt, ...)
@@ -93,7 +153,9 @@ static void usage(char *myName)
 "  --play <1/0,pos>            Start playing color pattern (at pos)\n"
 "  --play <1/0,start,end,cnt>  Playing color pattern sub-loop (mk2)\n"
 "  --playstate                 Return current status of pattern playing (mk2)\n"
+"  --syncplay <1/0,start,end,cnt> Play pattern on all -d devices in sync, -t ms from now (mk3)\n"
 "  --playpattern <patternstr>  Play Blink1Control pattern string in blink1-tool\n"
+"                              (or '@file' to read a pattern of any length from file)\n"
 "  --writepattern <patternstr> Write Blink1Control pattern string to blink(1)\n"
 "  --readpattern               Download full blink(1) patt as Blink1Control str\n"
 "  --servertickle <1/0>[,1/0,start,end] Turn on/off servertickle (w/on/off, uses -t msec)\n"
@@ -105,6 +167,10 @@ static void usage(char *myName)
 "  --version                   Display blink1-tool version info \n"
 "  --setstartup                Set startup parameters (v206+,mk3) \n"
 "  --getstartup                Get startup parameters (v206+,mk3) \n"
+"  --clocksync                 Measure device clock offsets & skew (mk3)\n"
+#ifndef _WIN32
+"  --daemon                    Keep devices open, run later blink1-tool cmds\n"
+#endif
 #if ENABLE_MK3 == 1
 "  --gobootload                Enable bootloader (mk3 only)\n"
 "  --lockbootload              Lock bootloader (mk3 only)\n"
@@ -120,6 +186,7 @@ static void usage(char *myName)
 "  -l <led>, --led=<led>       Which LED to use, 0=all/1=top/2=bottom (mk2+)\n"
 "  --ledn 1,3,5,7              Specify a list of LEDs to light\n"
 "  -v, --verbose               verbose debugging msgs\n"
+"  --stats                     Print command counts & latencies when done\n"
 "\n"
 "Examples: \n"
 "  blink1-tool -m 100 --rgb=255,0,255    # Fade to #FF00FF in 0.1 seconds \n"
@@ -163,6 +230,10 @@ static void usage(char *myName)
 "   blink1-tool -t 200 -m 100 --rgb ff00ff --blink 5 \n"
 " - If using several blink(1)s, use '-d all' or '-d 0,2' to select 1st,3rd: \n"
 "   blink1-tool -d all -t 50 -m 50 -rgb 00ff00 --blink 10 \n"
+#ifndef _WIN32
+" - With 'blink1-tool --daemon &' running, blink1-tool sends its commands\n"
+"   to the daemon, skipping device scan & open (socket: $BLINK1_TOOL_SOCKET)\n"
+#endif
 #if __linux__
 " - Linux: if blink(1) not detected, run blink1-tool --add_udev_rules\n"
 #endif
@@ -195,6 +266,8 @@ enum {
     CMD_PLAY,
     CMD_STOP,
     CMD_GETPLAYSTATE,
+    CMD_SYNCPLAY,
+    CMD_CLOCKSYNC,
     CMD_RANDOM,
     CMD_CHASE,
     CMD_VERSION,
@@ -224,26 +297,279 @@ enum {
 //
 // Fade to RGB for multiple blink1 devices.
 // Uses globals numDevicesToUse, deviceIds, quiet
+// All devices are sent to concurrently, from the blink1-lib handle pool
 //
 int blink1_fadeToRGBForDevices( uint16_t mils, uint8_t rr,uint8_t gg, uint8_t bb, uint8_t nn ) {
-    blink1_device* d;
-    int rc;
+    blink1_batch_cmd_t cmds[blink1_max_devices];
     for( int i=0; i< numDevicesToUse; i++ ) {
-        d = blink1_openById( deviceIds[i] );
-        if( d == NULL ) continue;
         msg("set dev:%X:%d to rgb:0x%2.2x,0x%2.2x,0x%2.2x over %d msec\n",
             deviceIds[i], nn, rr,gg,bb, mils, nn);
-        if( nn==0 ) {
-            rc = blink1_fadeToRGB(d, mils, rr,gg,bb);
-        } else {
-            rc = blink1_fadeToRGBN(d,mils, rr,gg,bb, nn);
+        blink1_batch_fadeToRGBN( &cmds[i], deviceIds[i], mils, rr,gg,bb, nn);
+    }
+    int failed = blink1_batch_write( cmds, numDevicesToUse );
+    if( failed && !quiet ) { // on error, do something, anything.
+        printf("error on fadeToRGBForDevices\n");
+    }
+    return 0; // FIXME
+}
+
+// Firmware version from a 'v' query answered by blink1_batch_read(),
+// same scaling as blink1_getVersion(), or -1 on error
+int versionFromQuery( blink1_batch_cmd_t* query ) {
+    if( query->rc == -1 ) return -1;
+    return ((query->buf[3]-'0') * 100) + (query->buf[4]-'0');
+}
+
+// Serial number id for a blink1 id, with its serial string in *serialp,
+// "-" if not found. Cache indexes shift as devices come and go (the
+// daemon keeps the cache current), so hold on to serials, not indexes
+uint32_t serialIdForId( uint32_t id, const char** serialp ) {
+    const char* serial = blink1_getCachedSerial( blink1_getCacheIndexById(id) );
+    *serialp = serial ? serial : "-";
+    return serial ? strtoul(serial, NULL, 16) : id;
+}
+
+// Step k of a host-timed animation: fill in the command to run,
+// return millis until step k+1, or -1 when the animation is done.
+// Must depend only on k, each device is at its own step.
+typedef int32_t (*anim_step_func)( uint32_t k, blink1_timedcmd_t* tc, void* arg );
+
+// how far ahead of a device's clock the first step is scheduled
+#define anim_lead_millis 100
+
+//
+// Run an animation on all devices (globals numDevicesToUse, deviceIds)
+// using each device's on-device command queue, keeping the queues
+// topped up, so host scheduling jitter doesn't show.
+// Returns -1 without doing anything if any device has no queue.
+//
+int playQueued( anim_step_func step, void* arg ) {
+    blink1_device* devs[blink1_max_devices];
+    uint32_t next_at[blink1_max_devices];
+    uint32_t k[blink1_max_devices];
+    int done[blink1_max_devices];
+    int rc = 0;
+
+    for( int i=0; i< numDevicesToUse; i++ ) {
+        uint32_t now;
+        int freeslots;
+        devs[i] = blink1_poolAcquire( deviceIds[i] );
+        if( devs[i] == NULL || blink1_queueStatus( devs[i], &now, &freeslots ) == -1 ) {
+            for( int j=0; j<=i; j++ ) {
+                if( devs[j] != NULL ) blink1_poolRelease( devs[j] );
+            }
+            return -1;
         }
-        if( rc == -1 && !quiet ) { // on error, do something, anything.
-            printf("error on fadeToRGBForDevices\n");
+        blink1_queueClear( devs[i] );
+        next_at[i] = now + anim_lead_millis;
+        k[i] = 0;
+        done[i] = 0;
+    }
+
+    int active = numDevicesToUse;
+    int stopped = 0;  // the daemon's client went away
+    while( active && !stopped ) {
+        int32_t ahead = -1;  // least time queued on any device still stepping
+        for( int i=0; i< numDevicesToUse; i++ ) {
+            if( done[i] ) continue;
+            uint32_t now;
+            int freeslots, n = 0, end = 0;
+            if( blink1_queueStatus( devs[i], &now, &freeslots ) == -1 ) {
+                rc = -1; done[i] = 1; active--;
+                continue;
+            }
+            if( freeslots > 0 ) {
+                blink1_timedcmd_t tcs[freeslots];  // one per free queue slot
+                int32_t holds[freeslots];
+                while( n < freeslots ) {
+                    int32_t hold = step( k[i] + n, &tcs[n], arg );
+                    if( hold < 0 ) { end = 1; break; }
+                    tcs[n].at = n ? tcs[n-1].at + holds[n-1] : next_at[i];
+                    holds[n] = hold;
+                    n++;
+                }
+                int queued = n ? blink1_queueCmds( devs[i], tcs, n ) : 0;
+                if( queued == -1 ) {
+                    msg("device %X: queue error\n", deviceIds[i]);
+                    rc = -1; done[i] = 1; active--;
+                    continue;
+                }
+                // steps the queue didn't take are made again next time
+                if( queued > 0 ) {
+                    next_at[i] = tcs[queued-1].at + holds[queued-1];
+                    k[i] += queued;
+                }
+                if( end && queued == n ) {
+                    done[i] = 1; active--;
+                    continue;
+                }
+            }
+            int32_t queued_millis = next_at[i] - now;
+            if( queued_millis < 0 ) queued_millis = 0;
+            if( ahead < 0 || queued_millis < ahead ) ahead = queued_millis;
+        }
+        if( active && tool_sleep( (ahead > 20) ? ahead/2 : 10 ) == -1 ) {
+            stopped = 1;
         }
-        blink1_close( d );
     }
-    return 0; // FIXME
+
+    // block until the last step has run, like the host-timed version
+    // or, stopped, drop what's still queued
+    int32_t remaining = 0;
+    for( int i=0; i< numDevicesToUse; i++ ) {
+        uint32_t now;
+        int freeslots;
+        if( stopped ) blink1_queueClear( devs[i] );
+        else if( blink1_queueStatus( devs[i], &now, &freeslots ) != -1 &&
+            (int32_t)(next_at[i] - now) > remaining ) {
+            remaining = next_at[i] - now;
+        }
+        blink1_poolRelease( devs[i] );
+    }
+    if( remaining > 0 ) tool_sleep( remaining );
+    return rc;
+}
+
+// --blink: on, off, 'count' times (0 = forever)
+typedef struct {
+    int count;
+    uint16_t fade_millis;
+    int32_t hold_millis;
+    uint8_t r, g, b, ledn;
+} blink_anim_t;
+
+int32_t blink_step( uint32_t k, blink1_timedcmd_t* tc, void* arg ) {
+    blink_anim_t* a = arg;
+    if( a->count > 0 && k >= (uint32_t)a->count*2 ) return -1;
+    if( k % 2 == 0 ) blink1_timed_fadeToRGBN( tc, 0, a->fade_millis, a->r,a->g,a->b, a->ledn );
+    else             blink1_timed_fadeToRGBN( tc, 0, a->fade_millis, 0,0,0, a->ledn );
+    return a->hold_millis;
+}
+
+// --glimmer: LEDs 1 & 2 alternate full and half brightness, then off
+int32_t glimmer_step( uint32_t k, blink1_timedcmd_t* tc, void* arg ) {
+    blink_anim_t* a = arg;
+    uint32_t n = a->count;
+    uint8_t ledn = (k % 2) + 1;
+    if( k >= n*4 + 2 ) return -1;
+    if( k >= n*4 ) { // turn them both off
+        blink1_timed_fadeToRGBN( tc, 0, a->fade_millis, 0,0,0, ledn );
+        return 0;
+    }
+    int full = ((k % 4) == 0 || (k % 4) == 3);
+    uint8_t d = full ? 1 : 2;
+    blink1_timed_fadeToRGBN( tc, 0, a->fade_millis, a->r/d, a->g/d, a->b/d, ledn );
+    return (k % 2) ? a->hold_millis/2 : 0;
+}
+
+// --playpattern: pattern lines, 'count' times through (-1 = forever)
+typedef struct {
+    patternline_t* pattern;
+    int pattlen;
+    int count;
+    int fade_millis;     // -1 = half of line's millis
+    uint8_t brightness;
+} pattern_anim_t;
+
+int32_t pattern_step( uint32_t k, blink1_timedcmd_t* tc, void* arg ) {
+    pattern_anim_t* a = arg;
+    if( a->count >= 0 && k >= (uint32_t)(a->count * a->pattlen) ) return -1;
+    patternline_t pat = a->pattern[ k % a->pattlen ];
+    uint16_t m = (a->fade_millis != -1) ? a->fade_millis : pat.millis/2;
+    blink1_adjustBrightness( a->brightness, &pat.color.r, &pat.color.g, &pat.color.b);
+    blink1_timed_fadeToRGBN( tc, 0, m, pat.color.r, pat.color.g, pat.color.b, pat.ledn );
+    return pat.millis;
+}
+
+// --playpattern/--writepattern arg, "@file" reads the pattern from file
+// returns malloc'd string, or NULL on error
+static char* pattern_load( const char* arg, size_t* len )
+{
+    if( arg[0] != '@' ) {
+        *len = strlen(arg);
+        return strdup(arg);
+    }
+    FILE* fp = fopen( arg+1, "rb" );
+    if( fp == NULL ) {
+        fprintf(stderr, "couldn't open pattern file '%s'\n", arg+1);
+        return NULL;
+    }
+    size_t size = 4096, n = 0, r;
+    char* str = malloc(size);
+    while( str && (r = fread(str+n, 1, size-n, fp)) > 0 ) {
+        n += r;
+        if( n == size ) {
+            char* s = realloc(str, size*2);
+            if( s == NULL ) { free(str); str = NULL; break; }
+            str = s;
+            size *= 2;
+        }
+    }
+    fclose(fp);
+    *len = n;
+    return str;
+}
+
+// parse pattern, at most maxlines lines, or any number if maxlines is 0
+// returns malloc'd lines, or NULL on error
+static patternline_t* pattern_parse( const char* str, size_t len, int maxlines,
+                                     int* repeats, int* pattlen )
+{
+    blink1_parse_error_t err;
+    int n = maxlines;
+    if( n == 0 ) {
+        n = blink1_parsePatternN( str, len, repeats, NULL, 0, &err );
+    }
+    patternline_t* pattern = (n > 0) ? malloc( n * sizeof(patternline_t) ) : NULL;
+    if( n > 0 && pattern ) {
+        n = blink1_parsePatternN( str, len, repeats, pattern, n, &err );
+    }
+    if( n <= 0 || pattern == NULL ) {
+        if( n == 0 ) { err.code = BLINK1_PARSE_EMPTY; err.offset = len; }
+        fprintf(stderr, "bad pattern: %s at char %zu\n",
+                blink1_parseErrorStr(err.code), err.offset);
+        free(pattern);
+        return NULL;
+    }
+    *pattlen = n;
+    return pattern;
+}
+
+// --chase animation, rendered a frame at a time for blink1_streamFrames()
+typedef struct {
+    int fps;
+    int step_millis;     // time for the chase head to move one LED
+    int length;          // number of LEDs in the chase
+    int loops;           // times around, or -1 for forever
+    uint8_t brightness;
+    uint8_t (*grad)[3];  // gradient, 'length' colors, head first
+} chase_t;
+
+// head LED moves every step_millis, each LED fading from its old gradient
+// color to its new one in between, like the firmware would
+int chase_render( rgb_t* leds, int count, uint32_t frame, void* arg ) {
+    chase_t* ch = arg;
+    uint32_t t = (uint32_t)(((uint64_t)frame * 1000) / ch->fps);
+    uint32_t step = t / ch->step_millis;
+    int frac = ((t % ch->step_millis) * 256) / ch->step_millis;
+    int loop = step / ch->length;
+    if( ch->loops >= 0 && loop >= ch->loops ) return 0;
+    if( tool_sleep(0) == -1 ) return 0;  // daemon's client went away
+    int i = step % ch->length;  // front led lit
+    for( int j=0; j < count; j++ ) {
+        int grad_index = i-j;
+        if( grad_index < 0 ) grad_index += ch->length;
+        int prev_index = (grad_index == 0) ? ch->length-1 : grad_index-1;
+        uint8_t* c0 = ch->grad[prev_index];
+        uint8_t* c1 = ch->grad[grad_index];
+        uint8_t r = c0[0] + ((c1[0] - c0[0]) * frac) / 256;
+        uint8_t g = c0[1] + ((c1[1] - c0[1]) * frac) / 256;
+        uint8_t b = c0[2] + ((c1[2] - c0[2]) * frac) / 256;
+        if( loop == 0 && j > i ) { r = g = b = 0; } // not reached yet
+        blink1_adjustBrightness( ch->brightness, &r, &g, &b);
+        leds[j].r = r; leds[j].g = g; leds[j].b = b;
+    }
+    return 1;
 }
 
 #if __linux__
@@ -264,7 +590,7 @@ void add_udev_rules() {
   printf("Running script...\n");
   system(UDEV_SHELLSCRIPT);
   printf("...Done.\n");
-  exit(0);
+  tool_exit(0);
 }
 // returns 1 if file exists, 0 if it doesn't exist
 int udev_file_exists() {
@@ -274,13 +600,15 @@ int udev_file_exists() {
 #endif
 
 //
-int main(int argc, char** argv)
+static int run_command(int argc, char** argv)
 {
     int nogamma = 0;
     int brightness = 0;
+    int stats = 0;
 
     int16_t arg = 0;  // generic int arg for cmds that take an arg
     char*  argbuf[150]; // generic str arg for cmds that take an arg
+    const char* pattarg = NULL;  // --playpattern & --writepattern arg
     uint8_t chasebuf[3]; // could use other buf
     int vid = 0;
     int pid = 0;
@@ -303,7 +631,24 @@ int main(int argc, char** argv)
 
     static int cmd  = CMD_NONE;
 
-    setbuf(stdout, NULL);  // turn off buffering of stdout
+    // a daemon runs many commands, so start each from the defaults
+    cmd = CMD_NONE;
+    millis = -1;
+    delayMillis = -1;
+    numDevicesToUse = 1;
+    memset( deviceIds, 0, sizeof(deviceIds));
+    verbose = 0;
+    quiet = 0;
+    msg_setquiet(quiet);
+    blink1_lib_verbose = 0;
+    blink1_enableDegamma();
+    blink1_stats_enable(0);
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    optreset = 1;
+    optind = 1;
+#else
+    optind = 0;  // glibc: full getopt re-initialization
+#endif
 
     // parse options
     int option_index = 0, opt;
@@ -317,6 +662,7 @@ int main(int argc, char** argv)
         {"led",        required_argument, 0,      'l'},
         {"ledn",       required_argument, 0,      'l'},
         {"nogamma",    no_argument,       0,      'g'},
+        {"stats",      no_argument,       0,      'S'},
         {"brightness", required_argument, 0,      'b'},
         {"vid",        required_argument, 0,      'V'},
         {"pid",        required_argument, 0,      'P'},
@@ -347,6 +693,8 @@ int main(int argc, char** argv)
         {"play",       required_argument, &cmd,   CMD_PLAY},
         {"stop",       no_argument,       &cmd,   CMD_STOP},
         {"playstate",  no_argument,       &cmd,   CMD_GETPLAYSTATE},
+        {"syncplay",   required_argument, &cmd,   CMD_SYNCPLAY},
+        {"clocksync",  no_argument,       &cmd,   CMD_CLOCKSYNC},
         {"random",     optional_argument, &cmd,   CMD_RANDOM },
         {"chase",      optional_argument, &cmd,   CMD_CHASE },
         {"running",    optional_argument, &cmd,   CMD_CHASE },
@@ -396,6 +744,7 @@ int main(int argc, char** argv)
             case CMD_SETPATTLINE:
             case CMD_GETPATTLINE:
             case CMD_PLAY:
+            case CMD_SYNCPLAY:
             case CMD_SERVERDOWN:
             case CMD_SETSTARTUP: // FIXME
                 hexread(cmdbuf, optarg, sizeof(cmdbuf));  // cmd w/ hexlist arg
@@ -413,7 +762,7 @@ int main(int argc, char** argv)
                 break;
             case CMD_PLAYPATTERN:
             case CMD_WRITEPATTERN:
-                strncpy( (char*)argbuf, optarg, sizeof(argbuf) );
+                pattarg = optarg;
                 break;
             case CMD_ON:
                 rgbbuf.r = 255; rgbbuf.g = 255; rgbbuf.b = 255;
@@ -444,6 +793,11 @@ int main(int argc, char** argv)
         case 'g':
             nogamma = 1;
             break;
+        case 'S':
+            stats = 1;
+            blink1_stats_reset();
+            blink1_stats_enable(1);
+            break;
         case 'b':
             brightness = strtol(optarg,NULL,10);
             break;
@@ -497,7 +851,7 @@ int main(int argc, char** argv)
                 //int base = 0;
                 pch = strtok( optarg, " ,");
                 numDevicesToUse = 0;
-                while( pch != NULL ) {
+                while( pch != NULL && numDevicesToUse < blink1_max_devices ) {
                     int base = (strlen(pch)==8) ? 16:0;
                     deviceIds[numDevicesToUse++] = strtol(pch,NULL,base);
                     pch = strtok(NULL, " ,");
@@ -510,14 +864,14 @@ int main(int argc, char** argv)
             break;
         case 'h':
             usage( "blink1-tool" );
-            exit(1);
+            tool_exit(1);
             break;
         }
     } // while(1) arg parsing
 
     if(argc < 2){
         usage( "blink1-tool" );
-        exit(1);
+        tool_exit(1);
     }
 
     // get a list of all devices and their paths
@@ -529,9 +883,15 @@ int main(int argc, char** argv)
     else {
         count = blink1_enumerate();
     }
+    // cache indexes past this can only be reached by serial number
+    if( count > blink1_max_devices ) count = blink1_max_devices;
 
 #if __linux__
     if( cmd == CMD_ADD_UDEV ) {
+      if( daemon_exit_jmp ) { // no sudo prompt from a daemon
+        msg("stop the blink1-tool daemon to use --add_udev_rules\n");
+        tool_exit(1);
+      }
       add_udev_rules();
     }
 #endif
@@ -539,13 +899,13 @@ int main(int argc, char** argv)
     if( cmd == CMD_VERSION ) {
         char verbuf[40] = "";
         if( count ) {
-            dev = blink1_openById( deviceIds[0] );
+            dev = blink1_poolAcquire( deviceIds[0] );
             rc = blink1_getVersion(dev);
-            blink1_close(dev);
+            release_dev();
             snprintf(verbuf, sizeof(verbuf), ", fw version: %d", rc);
         }
         msg("blink1-tool version: %s%s\n",BLINK1_VERSION,verbuf);
-        exit(0);
+        tool_exit(0);
     }
 
     // rationalize various options to known-good state
@@ -560,7 +920,7 @@ int main(int argc, char** argv)
             printf("Have you added udev rules? Try blink1-tool --add_udev_rules\n");
         }
 #endif
-        exit(1);
+        tool_exit(1);
     }
 
     if( numDevicesToUse == 0 ) numDevicesToUse = count;
@@ -576,7 +936,7 @@ int main(int argc, char** argv)
 
     // actually open up the device to start talking to it
     if(verbose) printf("openById: %X\n", deviceIds[0]);
-    dev = blink1_openById( deviceIds[0] );
+    dev = blink1_poolAcquire( deviceIds[0] );
 
     if( dev == NULL ) {
         msg("cannot open blink(1), bad id or serial number\n");
@@ -585,7 +945,7 @@ int main(int argc, char** argv)
 	  printf("Have you added udev rules? Try blink1-tool --add_udev_rules\n");
 	}
 #endif
-        exit(1);
+        tool_exit(1);
     }
 
     // FIXME: verify mk2 does better gamma correction
@@ -616,15 +976,20 @@ int main(int argc, char** argv)
     // begin command processing
 
     if( cmd == CMD_LIST ) {
-        blink1_close(dev);
+        release_dev();
         printf("blink(1) list: \n");
+        blink1_batch_cmd_t queries[blink1_max_devices];
+        const char* serials[blink1_max_devices];
         for( int i=0; i< count; i++ ) {
-            dev = blink1_openBySerial( blink1_getCachedSerial(i) );
-            rc = blink1_getVersion(dev);
-            blink1_close(dev);
-            const char* t = blink1_deviceTypeToStr(blink1_deviceTypeById(i));
+            blink1_batch_query( &queries[i], serialIdForId(i, &serials[i]), 'v', 0 );
+        }
+        blink1_batch_read( queries, count );  // ask all devices at once
+        for( int i=0; i< count; i++ ) {
+            rc = versionFromQuery( &queries[i] );
+            int idx = blink1_getCacheIndexBySerial( serials[i] );
+            const char* t = blink1_deviceTypeToStr(blink1_deviceTypeById(idx));
             printf("id:%d - serialnum:%s (%s) fw version:%d\n",
-                   i, blink1_getCachedSerial(i), t, rc);
+                   i, serials[i], t, rc);
         }
 #ifdef USE_HIDDATA
         printf("(Listing not supported in HIDDATA builds)\n");
@@ -648,21 +1013,26 @@ int main(int argc, char** argv)
         }
     }
     else if( cmd == CMD_FWVERSION ) {
-        blink1_close(dev);
+        release_dev();
+        blink1_batch_cmd_t queries[blink1_max_devices];
+        const char* serials[blink1_max_devices];
         for( int i=0; i<count; i++ ) {
-            dev = blink1_openById( deviceIds[i] );
-            if( dev == NULL ) continue;
-            rc = blink1_getVersion(dev);
+            uint32_t id = serialIdForId( deviceIds[i], &serials[i] );
+            blink1_batch_query( &queries[i], id, 'v', 0 );
+        }
+        blink1_batch_read( queries, count );  // ask all devices at once
+        for( int i=0; i<count; i++ ) {
+            if( queries[i].rc == -1 ) continue;
+            rc = versionFromQuery( &queries[i] );
+            int idx = blink1_getCacheIndexBySerial( serials[i] );
             printf("id:%d - firmware:%d serialnum:%s %s\n", i, rc,
-                   blink1_getCachedSerial(i),
-                   (blink1_isMk2ById(i)) ? "(mk2)":"");
-            blink1_close(dev);
+                   serials[i], (blink1_isMk2ById(idx)) ? "(mk2)":"");
         }
     }
     else if( cmd == CMD_RGB || cmd == CMD_ON  || cmd == CMD_OFF ||
              cmd == CMD_RED || cmd == CMD_BLU || cmd == CMD_GRN ||
              cmd == CMD_CYAN || cmd == CMD_MAGENTA || cmd == CMD_YELLOW ) {
-        blink1_close(dev); // close global device, open as needed
+        release_dev(); // close global device, open as needed
 
         uint8_t r = rgbbuf.r;
         uint8_t g = rgbbuf.g;
@@ -715,6 +1085,44 @@ int main(int argc, char** argv)
         printf("playing:%d start-end:%d-%d count:%d pos:%d\n",
                playing, startpos, endpos, playcount, playpos);
     }
+    else if( cmd == CMD_SYNCPLAY ) {
+        release_dev();
+        uint8_t play     = cmdbuf[0];
+        uint8_t startpos = cmdbuf[1];
+        uint8_t endpos   = cmdbuf[2];
+        uint8_t count    = cmdbuf[3];
+        int32_t skew_us;
+        msg("%s color pattern from pos %d-%d (%d times) on %d devices\n",
+            ((play)?"playing":"stopping"), startpos, endpos, count, numDevicesToUse);
+        int failed = blink1_syncPlayloop( deviceIds, numDevicesToUse, delayMillis,
+                                          play, startpos, endpos, count, &skew_us );
+        if( failed ) {
+            if( !quiet ) printf("error on syncplay: %d devices failed\n", failed);
+            rc = -1;
+        }
+        msg("estimated start skew: %d us\n", skew_us);
+    }
+    else if( cmd == CMD_CLOCKSYNC ) {
+        release_dev();
+        int32_t err1 = 0, err2 = 0;
+        for( int i=0; i<numDevicesToUse; i++ ) {
+            blink1_clock_t clk;
+            blink1_device* d = blink1_poolAcquire( deviceIds[i] );
+            if( d == NULL || blink1_clockSync( d, 8, &clk ) == -1 ) {
+                printf("id:%X - clock sync failed (needs mk3 fw%d+)\n",
+                       deviceIds[i], blink1mk3_bulk_fwversion);
+                if( d != NULL ) blink1_poolRelease( d );
+                continue;
+            }
+            blink1_poolRelease( d );
+            printf("id:%X - offset:%lld us error:+/-%d us rtt:%d us\n", deviceIds[i],
+                   (long long)clk.offset_us, clk.error_us, clk.rtt_us);
+            if( clk.error_us > err1 ) { err2 = err1; err1 = clk.error_us; }
+            else if( clk.error_us > err2 ) { err2 = clk.error_us; }
+        }
+        if( numDevicesToUse > 1 )
+            printf("estimated max skew between devices: %d us\n", err1 + err2);
+    }
     else if( cmd == CMD_SAVEPATTERN ) {
         msg("writing pattern to flash\n");
         rc = blink1_savePattern(dev);
@@ -751,7 +1159,7 @@ int main(int argc, char** argv)
     else if( cmd == CMD_RANDOM ) {
         int cnt = blink1_getCachedCount();
         if( arg==0 ) arg = 1;
-        if( cnt>1 ) blink1_close(dev); // close global device, open as needed
+        if( cnt>1 ) release_dev(); // close global device, open as needed
         msg("random %d times: \n", arg);
         for( int i=0; i<arg; i++ ) {
             uint8_t r = rand()%255;
@@ -765,7 +1173,7 @@ int main(int argc, char** argv)
                 i, id, blink1_getCachedCount(), r,g,b);
 
             blink1_device* mydev = dev;
-            if( cnt > 1 ) mydev = blink1_openById( id );
+            if( cnt > 1 ) mydev = blink1_poolAcquire( id );
             if( ledn == 0 ) {
                 rc = blink1_fadeToRGB(mydev, millis,r,g,b);
             } else {
@@ -776,9 +1184,9 @@ int main(int argc, char** argv)
                 printf("error during random\n");
                 //break;
             }
-            if( cnt > 1 ) blink1_close( mydev );
+            if( cnt > 1 ) blink1_poolRelease( mydev );
 
-            blink1_sleep(delayMillis);
+            if( tool_sleep(delayMillis) == -1 ) break;
         }
     }
     // this whole thing is a huge mess currently // FIXME
@@ -815,25 +1223,18 @@ int main(int argc, char** argv)
             led_grad[temp][2] = c[2] * i / chase_length;
         }
 
-        // do the animation
-        uint8_t first=1;
-        do {
-            for( int i=0; i < chase_length; ++i) { // i = front led lit
-                for( int j = 0; j<chase_length; ++j) {
-                    int grad_index=i-j;
-                    if (grad_index < 0) grad_index+=chase_length;
-                    uint8_t r = led_grad[grad_index][0];
-                    uint8_t g = led_grad[grad_index][1];
-                    uint8_t b = led_grad[grad_index][2];
-                    blink1_adjustBrightness( brightness, &r, &g, &b);
-                    if ((j <= i) || (!first)) {
-                        rc = blink1_fadeToRGBN(dev, 10 + (millis/chase_length), r,g,b,led_start+j);
-                    }
-                }
-                blink1_sleep(delayMillis/chase_length);
-            }
-            first = 0;
-        } while( loopcnt-- );
+        // stream the animation as whole frames
+        chase_t ch;
+        ch.fps = 50;
+        ch.step_millis = (delayMillis/chase_length > 0) ? delayMillis/chase_length : 1;
+        ch.length = chase_length;
+        ch.loops = (loopcnt < 0) ? -1 : loopcnt+1;
+        ch.brightness = brightness;
+        ch.grad = led_grad;
+        blink1_stream_stats_t stats;
+        rc = blink1_streamFrames( dev, ch.fps, led_start-1, chase_length,
+                                  chase_render, &ch, &stats );
+        msg("chase: %d frames, %d dropped\n", stats.sent, stats.dropped);
     }
     else if( cmd == CMD_BLINK ) {
         int16_t n = arg;
@@ -843,16 +1244,19 @@ int main(int argc, char** argv)
         if( r == 0 && b == 0 && g == 0 ) {
             r = g = b = 255;
         }
-        blink1_close(dev);
+        release_dev();
         blink1_adjustBrightness( brightness, &r, &g, &b);
         msg("blink %d times rgb:%2.2x,%2.2x,%2.2x: \n", n,r,g,b);
-        if( n == 0 ) n = -1; // repeat forever
-        while( n==-1 || n-- ) {
-            rc = blink1_fadeToRGBForDevices( millis,r,g,b,ledn);
-            blink1_sleep(delayMillis);
-            rc = blink1_fadeToRGBForDevices( millis,0,0,0,ledn);
-            blink1_sleep(delayMillis);
-         }
+        blink_anim_t anim = { n, millis, delayMillis, r,g,b, ledn };
+        if( playQueued( blink_step, &anim ) == -1 ) { // no device queue, time it here
+            if( n == 0 ) n = -1; // repeat forever
+            while( n==-1 || n-- ) {
+                rc = blink1_fadeToRGBForDevices( millis,r,g,b,ledn);
+                if( tool_sleep(delayMillis) == -1 ) break;
+                rc = blink1_fadeToRGBForDevices( millis,0,0,0,ledn);
+                if( tool_sleep(delayMillis) == -1 ) break;
+            }
+        }
     }
     else if( cmd == CMD_GLIMMER ) {
         uint8_t n = arg;
@@ -864,17 +1268,20 @@ int main(int argc, char** argv)
             r = g = b = 127;
         }
         msg("glimmering %d times rgb:#%2.2x%2.2x%2.2x: \n", n,r,g,b);
-        for( int i=0; i<n; i++ ) {
-            blink1_fadeToRGBN(dev, millis,r,g,b, 1);
-            blink1_fadeToRGBN(dev, millis,r/2,g/2,b/2, 2);
-            blink1_sleep(delayMillis/2);
-            blink1_fadeToRGBN(dev, millis,r/2,g/2,b/2, 1);
-            blink1_fadeToRGBN(dev, millis,r,g,b, 2);
-            blink1_sleep(delayMillis/2);
+        blink_anim_t anim = { n, millis, delayMillis, r,g,b, 0 };
+        if( playQueued( glimmer_step, &anim ) == -1 ) { // no device queue, time it here
+            for( int i=0; i<n; i++ ) {
+                blink1_fadeToRGBN(dev, millis,r,g,b, 1);
+                blink1_fadeToRGBN(dev, millis,r/2,g/2,b/2, 2);
+                if( tool_sleep(delayMillis/2) == -1 ) break;
+                blink1_fadeToRGBN(dev, millis,r/2,g/2,b/2, 1);
+                blink1_fadeToRGBN(dev, millis,r,g,b, 2);
+                if( tool_sleep(delayMillis/2) == -1 ) break;
+            }
+            // turn them both off
+            blink1_fadeToRGBN(dev, millis, 0,0,0, 1);
+            blink1_fadeToRGBN(dev, millis, 0,0,0, 2);
         }
-        // turn them both off
-        blink1_fadeToRGBN(dev, millis, 0,0,0, 1);
-        blink1_fadeToRGBN(dev, millis, 0,0,0, 2);
     }
     else if( cmd == CMD_SERVERDOWN ) {
         int on = cmdbuf[0];
@@ -888,15 +1295,29 @@ int main(int argc, char** argv)
         blink1_serverdown( dev, on, delayMillis, st, start_pos, end_pos );
     }
     else if( cmd == CMD_PLAYPATTERN ) {
-        blink1_close(dev);
-        msg("play pattern: %s\n",argbuf);
+        release_dev();
+        msg("play pattern: %s\n",pattarg);
 
         int repeats = -1;
-        patternline_t pattern[32];
-        int pattlen = parsePattern( (char*)argbuf, &repeats, pattern);
-        msg("repeats: %d\n", repeats);
-        if( repeats==0 ) repeats=-1;
+        int pattlen = 0;
+        size_t pattstrlen;
+        char* pattstr = pattern_load( pattarg, &pattstrlen );
+        patternline_t* pattern = NULL;
+        if( pattstr ) {
+            pattern = pattern_parse( pattstr, pattstrlen, 0, &repeats, &pattlen );
+            free(pattstr);
+        }
+        if( pattern == NULL ) {
+            rc = -1;
+            repeats = 0;
+        }
+        msg("repeats: %d, %d lines\n", repeats, pattlen);
+        if( repeats==0 && pattern ) repeats=-1;
 
+        pattern_anim_t anim = { pattern, pattlen, repeats, millis, brightness };
+        if( pattlen > 0 && playQueued( pattern_step, &anim ) != -1 ) {
+            repeats = 0; // done on device
+        }
         while( repeats==-1 || repeats-- ) {
             for( int i=0; i<pattlen; i++ ) {
                 patternline_t pat = pattern[i];
@@ -908,55 +1329,69 @@ int main(int argc, char** argv)
                 uint8_t b = pat.color.b;
                 blink1_adjustBrightness( brightness, &r, &g, &b);
                 blink1_fadeToRGBForDevices( m, r,g,b, pat.ledn);
-                blink1_sleep( pat.millis );
+                if( tool_sleep( pat.millis ) == -1 ) {
+                    repeats = 0;
+                    break;
+                }
             }
         }
+        free(pattern);
     }
     else if( cmd == CMD_WRITEPATTERN ) {
-        msg("write pattern: %s\n", argbuf);
+        msg("write pattern: %s\n", pattarg);
 
         int repeats = -1;
-        patternline_t pattern[32];
-        int pattlen = parsePattern( (char*)argbuf, &repeats, pattern);
+        int pattlen = 0;
+        size_t pattstrlen;
+        char* pattstr = pattern_load( pattarg, &pattstrlen );
+        patternline_t* pattern = NULL;
+        if( pattstr ) {  // 32 lines is all a blink(1) holds
+            pattern = pattern_parse( pattstr, pattstrlen, 32, &repeats, &pattlen );
+            free(pattstr);
+        }
         //msg("repeats: %d is ignored for writepattern\n", repeats);
 
         for( int i=0; i<pattlen; i++ ) {
-            patternline_t pat = pattern[i];
+            patternline_t* pat = &pattern[i];
 
-            msg("writing line %d: %2.2x,%2.2x,%2.2x : %d : %d\n", i, pat.color.r,pat.color.g,pat.color.b, pat.millis,pat.ledn );
-            blink1_setLEDN(dev, pat.ledn);
-            rc = blink1_writePatternLine(dev, pat.millis/2, pat.color.r, pat.color.g, pat.color.b, i);
+            msg("writing line %d: %2.2x,%2.2x,%2.2x : %d : %d\n", i, pat->color.r,pat->color.g,pat->color.b, pat->millis,pat->ledn );
+            pat->millis /= 2;
+        }
+        rc = (pattern) ? blink1_writePatternBulk(dev, pattern, pattlen, 0) : -1;
+        if( rc == -1 && !quiet ) {
+            printf("error on writepattern\n");
         }
+        free(pattern);
 
     }
     else if( cmd == CMD_CLEARPATTERN ) {
         msg("clearing pattern...");
-        for( int i=0; i<16; i++ ) { // FIXME: pattern length
-          rc = blink1_writePatternLine(dev, 0, 0,0,0, i );
-        }
+        patternline_t blank[16]; // FIXME: pattern length
+        memset( blank, 0, sizeof(blank) );
+        rc = blink1_writePatternBulk(dev, blank, 16, 0 );
         msg("done\n");
     }
     else if( cmd == CMD_READPATTERN ) {
         msg("read pattern:\n");
-        uint8_t r,g,b,n;
-        uint16_t msecs;
-        int maxstrlen = 2048;
         int pattlen = 32;
-        char str[maxstrlen];
-        str[0] = '\0';
-        strcat(str, "{0");
-        char strline[maxstrlen/pattlen];
-        //strcat(str, "{0"); // repeats forever
-        for( int i=0; i<pattlen; i++ ) {
-            rc = blink1_readPatternLineN(dev, &msecs, &r,&g,&b, &n, i );
-            //if( !(msecs==0 && r==0 && g==0 && b==0) ) {
-            snprintf(strline, (maxstrlen/pattlen), ",#%2.2x%2.2x%2.2x,%0.2f,%d", r,g,b, (msecs/1000.0),n);
-            strcat(str,strline);
-            //}
+        patternline_t pattern[pattlen];
+        rc = blink1_readPatternBulk(dev, pattern, pattlen, 0);
+        if( rc == -1 ) {
+            if( !quiet ) printf("error on readpattern\n");
+        }
+        else {
+            // "{0" repeats forever, then ",#rrggbb,s.ss,n" per line, then "}"
+            char str[4 + pattlen*24];
+            int len = snprintf(str, sizeof(str), "{0");
+            for( int i=0; i<pattlen; i++ ) {
+                patternline_t* pl = &pattern[i];
+                len += snprintf(str+len, sizeof(str)-len, ",#%2.2x%2.2x%2.2x,%0.2f,%d",
+                                pl->color.r, pl->color.g, pl->color.b,
+                                (pl->millis/1000.0), pl->ledn);
+            }
+            snprintf(str+len, sizeof(str)-len, "}");
+            msg("%s\n",str);
         }
-        strcat(str,"}");
-        msg("%s\n",str);
-        // msg("len:%d\n",strlen(str));
     }
     else if( cmd == CMD_SETSTARTUP ) {
       msg("set startup params:");
@@ -1020,7 +1455,7 @@ int main(int argc, char** argv)
       msg("Locking blink(1) mk3 bootloader so it cannot be executed via blink1-tool.\n");
       msg("You must physically take apart blink(1) mk3 to re-enable bootloader..\n");
       msg("if you do not want to do this, press Ctrl-C in next 3 seconds...\n");
-      blink1_sleep(3000);
+      if( tool_sleep(3000) == -1 ) tool_exit(1);  // Ctrl-C'd from a daemon client
 
       rc = blink1_bootloaderLock(dev);
       if( rc == 0 ) {
@@ -1046,6 +1481,400 @@ int main(int argc, char** argv)
     }
 
 
-    blink1_close(dev);
+    if( stats ) blink1_stats_print(stdout);
+    release_dev();
+    if( daemon_exit_jmp == NULL ) blink1_poolCloseAll(); // daemon keeps them
+    return 0;
+}
+
+#if BLINK1_TOOL_DAEMON
+//
+// Daemon mode: "blink1-tool --daemon" keeps the device cache and
+// pooled handles around and runs commands sent over a unix socket.
+// A plain blink1-tool invocation first tries that socket and, if a
+// daemon answers, hands it argv plus its own stdout & stderr, so the
+// command's output lands where it would have anyway.
+//
+// Request:  uint32_t argc, uint32_t len, then len bytes of
+//           NUL-terminated args, with stdout & stderr fds attached
+// Reply:    int32_t exit status
+//
+
+#define daemon_args_max  (64*1024)
+
+static void daemon_sighandler(int sig)
+{
+    (void)sig;
+    daemon_stop = 1;
+}
+
+// $BLINK1_TOOL_SOCKET, else one socket per user, in a directory only
+// that user can get into ($XDG_RUNTIME_DIR or /tmp/blink1-tool-<uid>/).
+// With 'create' the directory is made if needed. Either way it must be
+// a real directory (not a symlink someone planted), ours and 0700.
+// returns 0, or -1 if the directory isn't safe to use
+static int daemon_sockpath(char* path, size_t len, int create)
+{
+    const char* env = getenv("BLINK1_TOOL_SOCKET");
+    const char* rundir = getenv("XDG_RUNTIME_DIR");
+    if( env && *env ) {  // user's choice, the peer checks still apply
+        snprintf(path, len, "%s", env);
+        return 0;
+    }
+    char dir[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    if( rundir && *rundir ) snprintf(dir, sizeof(dir), "%s/blink1-tool", rundir);
+    else snprintf(dir, sizeof(dir), "/tmp/blink1-tool-%d", (int)geteuid());
+    snprintf(path, len, "%s/daemon.sock", dir);
+
+    if( create && mkdir(dir, 0700) < 0 && errno != EEXIST ) return -1;
+    struct stat st;
+    if( lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != geteuid() || (st.st_mode & 077) ) {
+        return -1;
+    }
+    return 0;
+}
+
+// is the process at the other end of fd running as this user?
+static int daemon_peer_ok(int fd)
+{
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if( getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ) return 0;
+    return cred.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if( getpeereid(fd, &uid, &gid) < 0 ) return 0;
+    return uid == geteuid();
+#endif
+}
+
+// returns connected socket, or -1 if no daemon is listening on path
+static int daemon_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if( strlen(path) >= sizeof(addr.sun_path) ) return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( fd < 0 ) return -1;
+    if( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int read_full(int fd, void* buf, size_t len)
+{
+    uint8_t* p = buf;
+    while( len ) {
+        ssize_t n = read(fd, p, len);
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return -1;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = buf;
+    while( len ) {
+        ssize_t n = write(fd, p, len);
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return -1;
+        p += n; len -= n;
+    }
+    return 0;
+}
+
+// "@file" pattern args are opened by whoever runs the command, and the
+// daemon has its own working directory, so send them as "@/abs/path".
+// Only pattern args start with '@' ("--playpattern=@file" included).
+// returns malloc'd arg, or NULL if the file can't be resolved
+static char* daemon_resolve_arg(const char* arg)
+{
+    const char* at = (arg[0] == '@') ? arg : NULL;
+    if( at == NULL && strncmp(arg, "--", 2) == 0 ) {
+        const char* eq = strchr(arg, '=');
+        if( eq && eq[1] == '@' ) at = eq + 1;
+    }
+    if( at == NULL ) return strdup(arg);
+    char* real = realpath(at + 1, NULL);
+    if( real == NULL ) return NULL;
+    size_t pre = at - arg;
+    char* out = malloc(pre + 1 + strlen(real) + 1);
+    if( out ) {
+        memcpy(out, arg, pre);
+        out[pre] = '@';
+        strcpy(out + pre + 1, real);
+    }
+    free(real);
+    return out;
+}
+
+//
+// Client side: returns the command's exit status,
+// or -1 if the daemon could not be reached (caller runs it locally)
+//
+static int daemon_client(int argc, char** argv)
+{
+    // resolve args first, an unreadable "@file" is reported by a local run
+    char** av = calloc(argc, sizeof(char*));
+    if( av == NULL ) return -1;
+    size_t len = 0;
+    int ok = 1;
+    for( int i=0; i<argc && ok; i++ ) {
+        av[i] = daemon_resolve_arg(argv[i]);
+        if( av[i] == NULL ) ok = 0;
+        else len += strlen(av[i]) + 1;
+    }
+    char* args = (ok && len <= daemon_args_max) ? malloc(len) : NULL;
+    if( args ) {
+        char* p = args;
+        for( int i=0; i<argc; i++ ) {
+            size_t l = strlen(av[i]) + 1;
+            memcpy(p, av[i], l);
+            p += l;
+        }
+    }
+    for( int i=0; i<argc; i++ ) free(av[i]);
+    free(av);
+    if( args == NULL ) return -1;
+
+    // our stdout, stderr and args only go to a daemon of our own
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int fd = -1;
+    if( daemon_sockpath(path, sizeof(path), 0) == 0 ) fd = daemon_connect(path);
+    if( fd >= 0 && !daemon_peer_ok(fd) ) {
+        fprintf(stderr, "blink1-tool: %s is not our daemon, running locally\n", path);
+        close(fd);
+        fd = -1;
+    }
+    if( fd < 0 ) { free(args); return -1; }
+
+    uint32_t hdr[2] = { argc, len };
+    int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    union {  // aligned room for the fds
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    struct iovec iov[2] = { { hdr, sizeof(hdr) }, { args, len } };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    // header and args are small enough to go out in one message,
+    // so a short send means the daemon went away
+    ssize_t n = sendmsg(fd, &mh, 0);
+    free(args);
+    if( n != (ssize_t)(sizeof(hdr) + len) ) { close(fd); return -1; }
+
+    int32_t status;
+    if( read_full(fd, &status, sizeof(status)) < 0 ) {
+        fprintf(stderr, "blink1-tool: daemon closed connection\n");
+        status = 1;
+    }
+    close(fd);
+    return status;
+}
+
+// run one client request, returns its exit status
+// run_command() for the daemon, returning tool_exit()'s code if it
+// calls that. Kept apart from daemon_serve() so the setjmp() frame holds
+// no locals that change after it, which a longjmp() could clobber
+static int daemon_run_command(int argc, char** argv)
+{
+    jmp_buf env;
+    int status;
+    if( setjmp(env) == 0 ) {
+        daemon_exit_jmp = &env;
+        status = run_command(argc, argv);
+    }
+    else {  // command called tool_exit()
+        status = daemon_exit_code;
+        release_dev();
+    }
+    daemon_exit_jmp = NULL;
+    return status;
+}
+
+static int daemon_serve(int cfd)
+{
+    uint32_t hdr[2];
+    int fds[2] = { -1, -1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctrl;
+    struct iovec iov = { hdr, sizeof(hdr) };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+
+    ssize_t n = recvmsg(cfd, &mh, 0);
+    struct cmsghdr* cm = (n > 0) ? CMSG_FIRSTHDR(&mh) : NULL;
+    if( cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+        cm->cmsg_len == CMSG_LEN(sizeof(fds)) ) {
+        memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    }
+    if( n < (ssize_t)sizeof(hdr) && n > 0 ) {  // rest of header
+        if( read_full(cfd, (uint8_t*)hdr + n, sizeof(hdr) - n) < 0 ) n = -1;
+        else n = sizeof(hdr);
+    }
+
+    uint32_t argc = hdr[0], len = hdr[1];
+    char* args = NULL;
+    char** argv = NULL;
+    int status = 1;
+    if( n != sizeof(hdr) || fds[0] < 0 || fds[1] < 0 ||
+        argc == 0 || len == 0 || len > daemon_args_max || argc > len ) {
+        goto done;
+    }
+    args = malloc(len);
+    argv = calloc(argc + 1, sizeof(char*));
+    if( args == NULL || argv == NULL || read_full(cfd, args, len) < 0 ) {
+        goto done;
+    }
+    args[len-1] = '\0';
+    char* p = args;
+    for( uint32_t i=0; i<argc; i++ ) {
+        if( p >= args + len ) goto done;  // fewer args than promised
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+
+    // the command's output goes to the client's stdout & stderr
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+
+    daemon_client_fd = cfd;  // tool_sleep() watches it
+    status = daemon_run_command(argc, argv);
+    daemon_client_fd = -1;
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+ done:
+    if( fds[0] >= 0 ) close(fds[0]);
+    if( fds[1] >= 0 ) close(fds[1]);
+    free(argv);
+    free(args);
+    return status;
+}
+
+//
+// Serve commands until SIGINT or SIGTERM. Requests are run one at
+// a time, in order of arrival, so commands to a device never overlap.
+// Long-running commands (--blink 0, endless patterns) stop when their
+// client disconnects or is interrupted, so the next client isn't stuck.
+//
+static int daemon_run(void)
+{
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    if( daemon_sockpath(path, sizeof(path), 1) < 0 ) {
+        fprintf(stderr, "blink1-tool: socket directory for %s must be a 0700 "
+                "directory owned by this user\n", path);
+        return 1;
+    }
+
+    int fd = daemon_connect(path);
+    if( fd >= 0 ) {
+        close(fd);
+        fprintf(stderr, "blink1-tool: daemon already running on %s\n", path);
+        return 1;
+    }
+    unlink(path);  // stale socket from a daemon that died
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);  // daemon_sockpath() keeps it short enough
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if( lfd < 0 ) { perror("blink1-tool: socket"); return 1; }
+    mode_t oldmask = umask(0077);  // only this user may send commands
+    int rc = bind(lfd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(oldmask);
+    if( rc < 0 || listen(lfd, 16) < 0 ) {
+        fprintf(stderr, "blink1-tool: cannot listen on %s: %s\n",
+                path, strerror(errno));
+        close(lfd);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_sighandler;  // no SA_RESTART, accept() returns
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);  // clients may go away mid-command
+
+    // first scan now, later commands use the hotplug-maintained cache
+    int count = blink1_enumerate();
+    fprintf(stderr, "blink1-tool: daemon listening on %s, %d device%s\n",
+            path, count, (count==1) ? "" : "s");
+
+    while( !daemon_stop ) {
+        int cfd = accept(lfd, NULL, NULL);
+        if( cfd < 0 ) {
+            if( errno == EINTR || errno == ECONNABORTED ) continue;
+            perror("blink1-tool: accept");
+            break;
+        }
+        if( !daemon_peer_ok(cfd) ) {  // only this user may send commands
+            fprintf(stderr, "blink1-tool: refused a client of another user\n");
+            close(cfd);
+            continue;
+        }
+        int32_t status = daemon_serve(cfd);
+        write_full(cfd, &status, sizeof(status));
+        close(cfd);
+    }
+
+    close(lfd);
+    unlink(path);
+    blink1_poolCloseAll();
     return 0;
 }
+#endif // BLINK1_TOOL_DAEMON
+
+//
+int main(int argc, char** argv)
+{
+    setbuf(stdout, NULL);  // turn off buffering of stdout
+
+#if BLINK1_TOOL_DAEMON
+    if( argc == 2 && strcmp(argv[1], "--daemon") == 0 ) {
+        return daemon_run();
+    }
+    if( argc >= 2 ) {
+        int status = daemon_client(argc, argv);
+        if( status >= 0 ) return status;
+    }
+#endif
+    return run_command(argc, argv);
+}
@@ -21,6 +21,9 @@
 #include <getopt.h>    // for getopt_long_only()
 #include <sys/time.h>
 #include <signal.h>
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 
 #include "mongoose.h"
 
@@ -45,13 +48,9 @@ static char http_listen_host[120] = "localhost"; // or 0.0.0.0 for any
 static int http_listen_port = 8934;  // was 8000
 static char http_listen_url[100]; // will be "http://localhost:8000"
 
-typedef struct cache_info_ {
-    blink1_device* dev;  // device, if opened, NULL otherwise
-    int64_t atime;  // time last used
-} cache_info;
-
+// devices are kept open in the blink1-lib handle pool,
+// and closed after being idle for this long
 static int64_t idle_atime = 1000 /* milliseconds */;
-static cache_info cache_infos[cache_max];
 
 DictionaryRef       patterndict;
 DictionaryCallbacks patterndictc;
@@ -77,8 +76,13 @@ static const url_info supported_urls[]
     {"/blink1/magenta",       "turn blink(1) solid magenta"},
     {"/blink1/fadeToRGB",     "turn blink(1) specified RGB color by 'rgb' arg"},
     {"/blink1/blink",         "blink the blink(1) the specified RGB color"},
-    {"/blink1/pattern/play",  "play color pattern specified by 'pattern' arg"},
+    {"/blink1/pattern",       "list patterns stored with /blink1/pattern/add"},
+    {"/blink1/pattern/add",   "store 'pattern' arg as a pattern named by 'pname' arg"},
+    {"/blink1/pattern/play",  "play color pattern specified by 'pattern' or 'pname' arg"},
     {"/blink1/random",        "turn the blink(1) a random color"},
+    {"/blink1/blinkserver",   "blink 'rgb' color 'count' times, as an effect"},
+    {"/blink1/effect",        "get state of effect specified by 'effect_id' arg"},
+    {"/blink1/effect/cancel", "cancel effect specified by 'effect_id' arg"},
     {"/blink1/servertickle/on","Enable servertickle, uses 'millis' or 'time' arg"},
     {"/blink1/servertickle/off","Disable servertickle"}
 };
@@ -93,6 +97,7 @@ void usage()
 "  --host host, -H host           host to listen on ('127.0.0.1' or '0.0.0.0')\n"
 "  --no-html                      do not serve static HTML help\n"
 "  --logging                      log accesses to stdout\n"
+"  --loadtest secs[,clients]      measure requests/sec & latency, then exit\n"
 "  --version                      version of this program\n"
 "  --help, -h                     this help page\n"
 "\n",
@@ -113,41 +118,89 @@ void usage()
 "  'millis' -- milliseconds to fade, or blink, e.g. 'millis=500'\n"
 "  'count'  -- number of times to blink, for /blink1/blink, e.g. 'count=3'\n"
 "  'pattern'-- color pattern string (e.g. '3,00ffff,0.2,0,000000,0.2,0')\n"
+"  'pname'  -- name of a stored pattern, e.g. 'pname=cyanblink'\n"
+"  'effect_id' -- id returned by /blink1/random and /blink1/blinkserver\n"
 "\n"
 "Examples: \n"
 "  /blink1/blue?bright=127 -- set blink1 blue, at half-intensity \n"
 "  /blink1/fadeToRGB?rgb=FF00FF&millis=500 -- fade to purple over 500ms\n"
 "  /blink1/pattern/play?pattern=3,00ffff,0.2,0,000000,0.2,0 -- blink cyan 3 times\n"
+"  /blink1/pattern/add?pname=cyanblink&pattern=3,00ffff,0.2,0,000000,0.2,0\n"
+"  /blink1/pattern/play?pname=cyanblink -- play stored pattern\n"
 "  /blink1/servertickle?on=1&millis=5000 -- turn servertickle on with 5 sec timer\n"
+"  /blink1/random?count=10&millis=1000 -- 10 random colors, returns effect_id\n"
 "\n"
         );
 }
 
-void cache_flush(int idle_threshold_millis);
+//
+// threads
+//
+// HTTP requests are parsed and answered on the mongoose thread, while
+// device I/O is done by one worker thread per device, so a slow device
+// only holds up its own requests.
+//
+#ifdef _WIN32
+typedef CRITICAL_SECTION   mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+typedef SRWLOCK            rwlock_t;
+typedef HANDLE             thread_t;
+#define mutex_init(m)       InitializeCriticalSection(m)
+#define mutex_lock(m)       EnterCriticalSection(m)
+#define mutex_unlock(m)     LeaveCriticalSection(m)
+#define cond_init(c)        InitializeConditionVariable(c)
+#define cond_wait(c,m)      SleepConditionVariableCS(c,m,INFINITE)
+#define cond_signal(c)      WakeConditionVariable(c)
+#define rwlock_init(l)      InitializeSRWLock(l)
+#define rwlock_rdlock(l)    AcquireSRWLockShared(l)
+#define rwlock_rdunlock(l)  ReleaseSRWLockShared(l)
+#define rwlock_wrlock(l)    AcquireSRWLockExclusive(l)
+#define rwlock_wrunlock(l)  ReleaseSRWLockExclusive(l)
+#define thread_create(t,fn,arg) \
+    ((*(t) = CreateThread(NULL, 0, fn, arg, 0, NULL)) != NULL ? 0 : -1)
+#define THREAD_FUNC(name)   DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN       return 0
+#else
+typedef pthread_mutex_t    mutex_t;
+typedef pthread_cond_t     cond_t;
+typedef pthread_rwlock_t   rwlock_t;
+typedef pthread_t          thread_t;
+#define mutex_init(m)       pthread_mutex_init(m, NULL)
+#define mutex_lock(m)       pthread_mutex_lock(m)
+#define mutex_unlock(m)     pthread_mutex_unlock(m)
+#define cond_init(c)        pthread_cond_init(c, NULL)
+#define cond_wait(c,m)      pthread_cond_wait(c,m)
+#define cond_signal(c)      pthread_cond_signal(c)
+#define rwlock_init(l)      pthread_rwlock_init(l, NULL)
+#define rwlock_rdlock(l)    pthread_rwlock_rdlock(l)
+#define rwlock_rdunlock(l)  pthread_rwlock_unlock(l)
+#define rwlock_wrlock(l)    pthread_rwlock_wrlock(l)
+#define rwlock_wrunlock(l)  pthread_rwlock_unlock(l)
+#define thread_create(t,fn,arg) pthread_create(t, NULL, fn, arg)
+#define THREAD_FUNC(name)   void* name(void* arg)
+#define THREAD_RETURN       return NULL
+#endif
 
+// The blink1-lib handle pool is thread safe, and re-enumerating leaves
+// handles in use open until they're returned. A worker still holds
+// devices_lock for reading while it uses a handle, so that re-enumerating,
+// which takes it for writing, doesn't renumber devices under a command.
+static rwlock_t devices_lock;
+
+static void device_workers_forget(void);
+
+// call with devices_lock held for reading
 blink1_device* cache_getDeviceById(uint32_t id)
 {
-    int i = blink1_getCacheIndexById(id);
-    blink1_device* dev=NULL;
-    if( i>=0 ) {
-        dev = cache_infos[i].dev;
-    }
-    // printf("cache_getDeviceById: %p from %d at %d\n", dev, id, i);
+    blink1_device* dev = blink1_poolAcquire(id);
     if( !dev ) {
-        dev = blink1_openById(id);
-        if( !dev ) {
-            cache_flush(0);
-            blink1_enumerate();
-            dev = blink1_openById(id);
-            if( !dev ) {
-                return NULL;
-            }
-        }
-        i = blink1_getCacheIndexByDev(dev);
-        // printf("cache_getDeviceById: %p to %d \n", dev, i);
-        if( i>=0 ) {
-            cache_infos[i].dev = dev;
-        }
+        rwlock_rdunlock(&devices_lock);
+        rwlock_wrlock(&devices_lock);
+        blink1_enumerate();  // device may have moved, also flushes the pool
+        device_workers_forget();
+        rwlock_wrunlock(&devices_lock);
+        rwlock_rdlock(&devices_lock);
+        dev = blink1_poolAcquire(id);
     }
     // printf("cache_getDeviceById: return %p\n", dev);
     return dev;
@@ -157,28 +210,254 @@ blink1_device* cache_getDeviceById(uint32_t id)
 
 void cache_return_internal( blink1_device* dev )
 {
-    int i = blink1_getCacheIndexByDev(dev);
-    // printf("cache_return_internal: %p at %d\n", dev, i);
-    if( i>=0 ) {
-        cache_infos[i].atime = mg_millis();
+    blink1_poolRelease(dev);
+}
+
+void cache_flush(int idle_threshold_millis)
+{
+    blink1_poolFlush(idle_threshold_millis);
+}
+
+//
+// device commands
+//
+// A request that talks to a device becomes an http_cmd_t. It is queued
+// to that device's worker, and once func has run there it is handed back
+// to the mongoose thread through a socket pair, which sends the reply.
+// Effect steps use the same path, with no connection to answer.
+//
+
+#define device_workers_max  16  // devices (plus the enumerate worker)
+#define device_queue_depth  8   // commands per device, more get a 429
+
+#define pattern_lines_max   32  // pattern RAM of a mk2 or mk3
+
+// a pattern string, parsed with brightness and degamma already applied
+typedef struct _compiled_pattern {
+    uint32_t      pattern_id;  // same id means same lines, 0 if none
+    int           repeats;
+    int           len;
+    patternline_t lines[pattern_lines_max];
+} compiled_pattern_t;
+
+typedef struct _http_cmd http_cmd_t;
+typedef void (*http_cmd_func)( http_cmd_t* cmd );
+struct _device_worker;
+
+struct _http_cmd {
+    http_cmd_func func;      // run on the device's worker thread
+    bool     exclusive;      // run with devices_lock held for writing
+    unsigned long conn_id;   // connection to reply to, 0 for none
+    uint32_t effect_id;      // effect this is a step of, 0 for none
+    int      rc;
+    char     uri_str[1000];
+    uint32_t id;
+    uint8_t  ledn;
+    uint8_t  bright;
+    uint8_t  count;
+    uint16_t millis;
+    rgb_t    rgb;
+    bool     on;             // for servertickle
+    char     pattstr[1000];
+    compiled_pattern_t patt; // pattern to play, copied from the cache
+    char     status[1000];
+    DictionaryRef resultsdict;
+    struct _device_worker* worker;  // set when queued
+    struct _http_cmd* next;  // in the done list
+};
+
+typedef struct _device_worker {
+    char        key[40];     // "id:" and the device's serial id, "" if unused
+                             // only touched on the mongoose thread
+    mutex_t     lock;
+    cond_t      cond;
+    http_cmd_t* queue[device_queue_depth];
+    int         head;        // the running command, stays queued until done
+    int         len;
+    thread_t    thread;
+    // only touched from this worker's thread, or with devices_lock
+    // held for writing
+    uint32_t    resident_pattern; // compiled pattern in device RAM, 0 if unknown
+    uint32_t    resident_gen;     // blink1_poolGeneration() it was written with
+} device_worker_t;
+
+static device_worker_t device_workers[device_workers_max];
+
+// devices may have been reset or replaced, forget what's in their RAM.
+// call with devices_lock held for writing
+static void device_workers_forget(void)
+{
+    for( int i=0; i< device_workers_max; i++ ) {
+        device_workers[i].resident_pattern = 0;
     }
-    else {
-        blink1_close(dev);
+}
+
+// finished commands, newest first, waiting for the mongoose thread
+static mutex_t     done_lock;
+static http_cmd_t* done_head = NULL;
+static int         done_pipe = -1;
+
+static http_cmd_t* http_cmd_new(unsigned long conn_id)
+{
+    http_cmd_t* cmd = calloc(1, sizeof(http_cmd_t));
+    if( cmd == NULL ) return NULL;
+    cmd->conn_id = conn_id;
+    if( conn_id ) {
+        DictionaryCallbacks resultsdictc = DictionaryStandardStringCallbacks();
+        cmd->resultsdict = DictionaryCreate( 100, &resultsdictc );
     }
+    return cmd;
 }
 
-void cache_flush(int idle_threshold_millis)
+static void http_cmd_free(http_cmd_t* cmd)
+{
+    if( cmd->resultsdict ) DictionaryDelete(cmd->resultsdict);
+    free(cmd);
+}
+
+// hand a finished command back to the mongoose thread
+static void done_push(http_cmd_t* cmd)
+{
+    mutex_lock(&done_lock);
+    bool wake = (done_head == NULL);  // else a wakeup is already on its way
+    cmd->next = done_head;
+    done_head = cmd;
+    mutex_unlock(&done_lock);
+    if( wake ) send(done_pipe, "", 1, 0);
+}
+
+static THREAD_FUNC(device_worker_thread)
+{
+    device_worker_t* w = (device_worker_t*)arg;
+    mutex_lock(&w->lock);
+    while( 1 ) {
+        while( w->len == 0 ) cond_wait(&w->cond, &w->lock);
+        http_cmd_t* cmd = w->queue[w->head];
+        mutex_unlock(&w->lock);
+
+        if( cmd->exclusive ) rwlock_wrlock(&devices_lock);
+        else                 rwlock_rdlock(&devices_lock);
+        cmd->func(cmd);
+        if( cmd->exclusive ) rwlock_wrunlock(&devices_lock);
+        else                 rwlock_rdunlock(&devices_lock);
+
+        mutex_lock(&w->lock);
+        w->head = (w->head + 1) % device_queue_depth;
+        w->len--;
+        mutex_unlock(&w->lock);
+        done_push(cmd);
+        mutex_lock(&w->lock);
+    }
+    THREAD_RETURN;
+}
+
+// Cache indexes shift when devices come and go, so turn an index id
+// into the device's serial number id before holding on to it.
+static uint32_t device_serialId(uint32_t id)
+{
+    if( id > blink1_max_devices ) return id;  // already a serial
+    const char* serial = blink1_getCachedSerial(id);
+    uint32_t sid = serial ? strtoul(serial, NULL, 16) : 0;
+    return (sid > blink1_max_devices) ? sid : id;
+}
+
+// Turn id into the serial id of a device in the cache. A miss
+// re-enumerates, at most once a second, to find a newly plugged device.
+// Returns false if there's no such device
+static bool device_lookup(uint32_t* id)
+{
+    static uint64_t last_enumerate_ms = 0;
+    uint32_t sid = device_serialId(*id);
+    if( blink1_getCacheIndexById(sid) < 0 ) {
+        uint64_t now = mg_millis();
+        if( last_enumerate_ms && now - last_enumerate_ms < 1000 ) return false;
+        last_enumerate_ms = now;
+        rwlock_wrlock(&devices_lock);
+        blink1_enumerate();
+        device_workers_forget();
+        rwlock_wrunlock(&devices_lock);
+        sid = device_serialId(*id);
+        if( blink1_getCacheIndexById(sid) < 0 ) return false;
+    }
+    *id = sid;
+    return true;
+}
+
+// is worker w's queue empty? Only the mongoose thread queues, so it
+// stays empty until we queue to it
+static bool device_worker_idle(device_worker_t* w)
 {
-    int64_t deadline = mg_millis() - idle_threshold_millis;
-    int count = blink1_getCachedCount();
-    for( int i=0; i< count; i++ ) {
-        if( cache_infos[i].dev && cache_infos[i].atime < deadline ) {
-            // printf("DEBUG cache_flush: id=%d handle=%p atime=%lld\n", i, cache_infos[i].dev, cache_infos[i].atime);
-            blink1_close(cache_infos[i].dev)
-            cache_infos[i].atime = 0;
+    mutex_lock(&w->lock);
+    bool idle = (w->len == 0);
+    mutex_unlock(&w->lock);
+    return idle;
+}
+
+// an idle worker to take over for a new key, preferring one whose
+// device is gone. Its resident pattern is tagged with the pool generation
+// of the old device's handle, so the new device won't match it.
+static device_worker_t* device_worker_reap(void)
+{
+    device_worker_t* idle = NULL;
+    for( int i=0; i< device_workers_max; i++ ) {
+        device_worker_t* w = &device_workers[i];
+        if( !device_worker_idle(w) ) continue;
+        uint32_t id = strtoul(w->key + 3, NULL, 16);
+        if( strncmp(w->key, "id:", 3) == 0 && blink1_getCacheIndexById(id) < 0 ) {
+            return w;  // device unplugged
         }
+        if( !idle ) idle = w;
     }
+    return idle;
+}
+
+// Queue cmd to the worker for its device, starting the worker if needed.
+// Returns 0 if queued, -1 if the device's queue is full,
+// -2 if no worker could be had, -3 if there's no such device.
+static int device_submit(http_cmd_t* cmd)
+{
+    char key[40] = "*";  // exclusive commands get a worker of their own
+    if( !cmd->exclusive ) {
+        // key by serial number, and have the command use it too so it
+        // still reaches the same device if indexes shift while queued
+        if( !device_lookup(&cmd->id) ) return -3;
+        snprintf(key, sizeof(key), "id:%X", cmd->id);
+    }
+
+    device_worker_t* w = NULL;
+    for( int i=0; i< device_workers_max && !w; i++ ) {
+        if( strcmp(device_workers[i].key, key) == 0 ) w = &device_workers[i];
+    }
+    for( int i=0; i< device_workers_max && !w; i++ ) {
+        if( device_workers[i].key[0] != '\0' ) continue;
+        device_worker_t* nw = &device_workers[i];
+        mutex_init(&nw->lock);
+        cond_init(&nw->cond);
+        if( thread_create(&nw->thread, device_worker_thread, nw) != 0 ) {
+            return -2;
+        }
+        strcpy(nw->key, key);
+        w = nw;
+    }
+    if( !w ) {  // all slots have workers, take over an idle one
+        w = device_worker_reap();
+        if( !w ) return -2;
+        strcpy(w->key, key);
+    }
+
+    mutex_lock(&w->lock);
+    if( w->len == device_queue_depth ) {
+        mutex_unlock(&w->lock);
+        return -1;
+    }
+    cmd->worker = w;
+    w->queue[(w->head + w->len) % device_queue_depth] = cmd;
+    w->len++;
+    cond_signal(&w->cond);
+    mutex_unlock(&w->lock);
+    return 0;
 }
+
 void blink1_do_color(rgb_t rgb, uint32_t millis, uint32_t id,
                     uint8_t ledn, uint8_t bright, char* status)
 {
@@ -200,6 +479,343 @@ void blink1_do_color(rgb_t rgb, uint32_t millis, uint32_t id,
     cache_return(dev);
 }
 
+//
+// compiled pattern cache
+//
+// Pattern strings are parsed once into a compiled_pattern_t, keyed by
+// the string and brightness, so playing a pattern again skips the parse.
+// Each device worker remembers which compiled pattern is in its device's
+// RAM, so playing it again skips the upload too. Lives on the mongoose
+// thread, workers get a copy.
+//
+
+#define compiled_patterns_max  32
+
+typedef struct _pattern_cache_entry {
+    compiled_pattern_t patt;
+    char     src[1000];        // pattern string it was compiled from
+    uint8_t  bright;
+    int64_t  atime;            // last use, least recently used is evicted
+} pattern_cache_entry;
+
+static pattern_cache_entry pattern_cache[compiled_patterns_max];
+static uint32_t pattern_last_id = 0;
+
+// returns compiled pattern for str at brightness bright, NULL if str is bad
+static const compiled_pattern_t* pattern_compile(const char* str, uint8_t bright)
+{
+    pattern_cache_entry* e = NULL;
+    for( int i=0; i< compiled_patterns_max; i++ ) {
+        pattern_cache_entry* pe = &pattern_cache[i];
+        if( pe->patt.pattern_id && pe->bright == bright &&
+            strcmp(pe->src, str) == 0 ) {
+            pe->atime = blink1_millis();
+            return &pe->patt;
+        }
+        if( e == NULL || pe->atime < e->atime ) e = pe;  // unused have atime 0
+    }
+    if( strlen(str) >= sizeof(e->src) ) return NULL;
+
+    int repeats = -1;
+    patternline_t lines[pattern_lines_max];
+    blink1_parse_error_t err;
+    int len = blink1_parsePatternN(str, strlen(str), &repeats,
+                                   lines, pattern_lines_max, &err);
+    if( len == -1 && err.code == BLINK1_PARSE_TOO_LONG ) {
+        len = pattern_lines_max;  // play what fits on the device
+    }
+    if( len <= 0 ) return NULL;
+
+    memcpy(e->patt.lines, lines, len * sizeof(patternline_t));
+    strcpy(e->src, str);
+    e->bright = bright;
+    e->atime = blink1_millis();
+    e->patt.pattern_id = ++pattern_last_id;
+    e->patt.repeats = repeats;
+    e->patt.len = len;
+    for( int i=0; i< len; i++ ) {
+        patternline_t* pl = &e->patt.lines[i];
+        blink1_adjustBrightness( bright, &pl->color.r, &pl->color.g, &pl->color.b);
+        pl->color.r = blink1_degamma(pl->color.r);
+        pl->color.g = blink1_degamma(pl->color.g);
+        pl->color.b = blink1_degamma(pl->color.b);
+    }
+    return &e->patt;
+}
+
+// for DictionaryApplyFunction(), which has no user arg
+static char* pattern_list_str;
+static size_t pattern_list_len;
+
+static void pattern_list_add(const void* key, const void* value)
+{
+    size_t n = strlen(pattern_list_str);
+    snprintf(pattern_list_str + n, pattern_list_len - n, "%s\"%s\": \"%s\"",
+             (n > 1) ? ", " : "", (const char*)key, (const char*)value);
+}
+
+//
+// effects engine
+//
+// Effects that take a while (blinkserver, random) don't sleep in the
+// event handler, that would stall every other HTTP client. Instead they
+// are queued per device and stepped from a mongoose timer. The request
+// returns right away with an "effect_id" that can be polled with
+// /blink1/effect or stopped with /blink1/effect/cancel.
+//
+
+#define effects_max        64   // queued, running and finished effects
+#define effect_queues_max  16   // devices with effects at once
+#define effect_tick_millis 10   // timer period
+
+typedef enum {
+    EFFECT_BLINK,
+    EFFECT_RANDOM
+} effect_type;
+
+typedef enum {
+    EFFECT_FREE = 0,
+    EFFECT_QUEUED,
+    EFFECT_RUNNING,
+    EFFECT_DONE,
+    EFFECT_CANCELLED,
+    EFFECT_FAILED
+} effect_state;
+
+static const char* effect_state_names[] =
+    { "free", "queued", "running", "done", "cancelled", "failed" };
+
+typedef struct _effect {
+    uint32_t     effect_id;
+    effect_type  type;
+    effect_state state;
+    uint32_t     devid;     // blink1 id, as in the 'id' query arg
+    rgb_t        rgb;
+    uint16_t     millis;    // time per blink or color
+    uint8_t      ledn;
+    uint8_t      bright;
+    uint32_t     step;      // next step to run
+    uint32_t     steps;     // total steps
+    uint64_t     next_ms;   // when the next step is due
+    struct _effect* next;   // next in device queue
+} effect_t;
+
+// a device's effects, in order. head is the one running
+typedef struct _effect_queue {
+    uint32_t  devid;
+    effect_t* head;         // NULL if queue is unused
+    effect_t* tail;
+} effect_queue_t;
+
+static effect_t       effects[effects_max];
+static effect_queue_t effect_queues[effect_queues_max];
+static uint32_t       effect_last_id = 0;
+
+// get an unused effect, recycling the oldest finished one if needed
+static effect_t* effect_alloc(void)
+{
+    effect_t* oldest = NULL;
+    for( int i=0; i< effects_max; i++ ) {
+        effect_t* e = &effects[i];
+        if( e->state == EFFECT_FREE ) { oldest = e; break; }
+        if( e->state >= EFFECT_DONE &&
+            (oldest == NULL || e->effect_id < oldest->effect_id) ) {
+            oldest = e;
+        }
+    }
+    if( oldest == NULL ) return NULL;
+    memset(oldest, 0, sizeof(effect_t));
+    oldest->effect_id = ++effect_last_id;
+    return oldest;
+}
+
+static effect_t* effect_find(uint32_t effect_id)
+{
+    for( int i=0; i< effects_max; i++ ) {
+        if( effects[i].state != EFFECT_FREE && effects[i].effect_id == effect_id ) {
+            return &effects[i];
+        }
+    }
+    return NULL;
+}
+
+static effect_queue_t* effect_queue_find(uint32_t devid)
+{
+    for( int i=0; i< effect_queues_max; i++ ) {
+        if( effect_queues[i].head && effect_queues[i].devid == devid ) {
+            return &effect_queues[i];
+        }
+    }
+    return NULL;
+}
+
+// queue effect behind any others for its device, returns 0 or -1 if full
+static int effect_queue(effect_t* e)
+{
+    effect_queue_t* q = effect_queue_find(e->devid);
+    if( q ) {
+        q->tail->next = e;
+        q->tail = e;
+        e->state = EFFECT_QUEUED;
+        return 0;
+    }
+    for( int i=0; i< effect_queues_max; i++ ) {
+        q = &effect_queues[i];
+        if( q->head == NULL ) {
+            q->devid = e->devid;
+            q->head = q->tail = e;
+            e->state = EFFECT_QUEUED;
+            e->next_ms = mg_millis();  // start on the next tick
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// take effect out of its device queue, marking it finished with state
+static void effect_finish(effect_t* e, effect_state state)
+{
+    effect_queue_t* q = effect_queue_find(e->devid);
+    if( q ) {
+        effect_t** pp = &q->head;
+        effect_t* prev = NULL;
+        while( *pp && *pp != e ) { prev = *pp; pp = &(*pp)->next; }
+        if( *pp == e ) {
+            bool was_head = (prev == NULL);
+            *pp = e->next;
+            if( q->tail == e ) q->tail = prev;
+            if( was_head && q->head ) q->head->next_ms = mg_millis();
+        }
+    }
+    e->next = NULL;
+    e->state = state;
+}
+
+// color for the effect's next step
+static rgb_t effect_color(effect_t* e)
+{
+    rgb_t c = {0,0,0};
+    switch( e->type ) {
+    case EFFECT_BLINK:  // even steps on, odd steps off
+        if( !(e->step & 1) ) c = e->rgb;
+        break;
+    case EFFECT_RANDOM:
+        c.r = rand() % 255;
+        c.g = rand() % 255;
+        c.b = rand() % 255;
+        blink1_adjustBrightness( e->bright, &c.r, &c.g, &c.b);
+        break;
+    }
+    return c;
+}
+
+// worker side of an effect step
+static void do_effect_step(http_cmd_t* cmd)
+{
+    blink1_device* dev = cache_getDeviceById(cmd->id);
+    cmd->rc = -1;
+    if( dev ) {
+        cmd->rc = blink1_fadeToRGBN( dev, cmd->millis,
+                                     cmd->rgb.r,cmd->rgb.g,cmd->rgb.b, cmd->ledn );
+    }
+    cache_return(dev);
+}
+
+// back on the mongoose thread, a failed step ends its effect
+static void effect_step_done(http_cmd_t* cmd)
+{
+    effect_t* e = effect_find(cmd->effect_id);
+    if( e && cmd->rc == -1 && e->state <= EFFECT_RUNNING ) {
+        effect_finish(e, EFFECT_FAILED);
+    }
+}
+
+// mongoose timer callback, advances every device's running effect
+static void effects_tick(void* arg)
+{
+    (void)arg;
+    uint64_t now = mg_millis();
+    for( int i=0; i< effect_queues_max; i++ ) {
+        effect_queue_t* q = &effect_queues[i];
+        effect_t* e;
+        while( (e = q->head) != NULL && e->next_ms <= now ) {
+            if( e->step == e->steps ) {  // last step has had its time
+                effect_finish(e, EFFECT_DONE);
+                continue;
+            }
+            http_cmd_t* cmd = http_cmd_new(0);
+            if( cmd == NULL ) break;
+            cmd->func = do_effect_step;
+            cmd->effect_id = e->effect_id;
+            cmd->id = e->devid;
+            cmd->ledn = e->ledn;
+            cmd->millis = e->millis/2;
+            cmd->rgb = effect_color(e);
+            int rc = device_submit(cmd);
+            if( rc == -3 ) {  // device gone
+                http_cmd_free(cmd);
+                effect_finish(e, EFFECT_FAILED);
+                continue;
+            }
+            if( rc != 0 ) {  // device busy, retry next tick
+                http_cmd_free(cmd);
+                break;
+            }
+            uint16_t wait = e->millis/2;
+            e->state = EFFECT_RUNNING;
+            e->step++;
+            // keep to the schedule, unless we have fallen behind it
+            e->next_ms = (now - e->next_ms > (uint64_t)wait) ? now + wait
+                                                              : e->next_ms + wait;
+        }
+    }
+}
+
+// true if effects are waiting to be stepped
+static bool effects_pending(void)
+{
+    for( int i=0; i< effect_queues_max; i++ ) {
+        if( effect_queues[i].head ) return true;
+    }
+    return false;
+}
+
+static void effect_describe(effect_t* e, DictionaryRef d)
+{
+    char str[40];
+    sprintf(str, "%u", e->effect_id);
+    DictionaryInsert(d, "effect_id", str);
+    DictionaryInsert(d, "effect_state", effect_state_names[e->state]);
+    sprintf(str, "%u/%u", e->step, e->steps);
+    DictionaryInsert(d, "effect_progress", str);
+}
+
+// queue a new effect and describe it in d, or append an error to status
+static void effect_start(effect_type type, uint32_t steps, rgb_t rgb,
+                         uint16_t millis, uint32_t id, uint8_t ledn,
+                         uint8_t bright, char* status, DictionaryRef d)
+{
+    effect_t* e = effect_alloc();
+    if( !e ) {
+        sprintf(status+strlen(status), ": error: too many effects");
+        return;
+    }
+    e->type = type;
+    e->devid = device_serialId(id);
+    e->rgb = rgb;
+    e->millis = millis;
+    e->ledn = ledn;
+    e->bright = bright;
+    e->steps = steps;
+    if( effect_queue(e) == -1 ) {
+        e->state = EFFECT_FREE;
+        sprintf(status+strlen(status), ": error: too many devices with effects");
+        return;
+    }
+    effects_tick(NULL);  // first step now if the device is idle
+    effect_describe(e, d);
+}
+
 //
 //
 void DictionaryPrintAsJsonMg(struct mg_connection *nc, DictionaryRef d )
@@ -236,261 +852,457 @@ static void log_access(struct mg_connection *c, char* uri_str, int resp_code) {
 }
 
 
+//
+// device command handlers, run on the device's worker thread
+//
+
+static void do_status(http_cmd_t* cmd)
+{
+    blink1_device* dev = cache_getDeviceById(cmd->id);
+    if( dev ) {
+        uint16_t msecs;
+        int rc = blink1_readRGB(dev, &msecs, &cmd->rgb.r,&cmd->rgb.g,&cmd->rgb.b, 0 );
+        if( rc==-1 ) {
+            printf("error on readRGB\n");
+        }
+        cache_return(dev);
+    }
+}
+
+// exclusive, no device handles are in use
+static void do_enumerate(http_cmd_t* cmd)
+{
+    char tmpstr[1000];
+    blink1_poolFlush(0);
+    int c = blink1_enumerate();
+    device_workers_forget();
+
+    sprintf(tmpstr,"[");
+    for( int i=0; i< c; i++ ) {
+        const char* serial = blink1_getCachedSerial(i);
+        if( !serial ) break;  // unplugged since
+        sprintf(tmpstr+strlen(tmpstr), "%s\"%s\"", (i ? ",":""), serial);
+    }
+    sprintf(tmpstr+strlen(tmpstr), "]");
+    DictionaryInsert(cmd->resultsdict, "blink1_serialnums", tmpstr);
+
+    const char* blink1_serialnum = blink1_getCachedSerial(0);
+    if( blink1_serialnum ) {
+        sprintf(tmpstr, "%s00000000", blink1_serialnum);
+        DictionaryInsert(cmd->resultsdict, "blink1_id", tmpstr);
+    }
+}
+
+static void do_color(http_cmd_t* cmd)
+{
+    blink1_do_color(cmd->rgb, cmd->millis, cmd->id, cmd->ledn, cmd->bright,
+                    cmd->status);
+}
+
+// play cmd->patt, uploading it only if it's not already in device RAM
+static void do_pattern_play(http_cmd_t* cmd)
+{
+    device_worker_t* w = cmd->worker;
+    compiled_pattern_t* patt = &cmd->patt;
+    blink1_device* dev = cache_getDeviceById(cmd->id);
+    if( !dev ) {
+        sprintf(cmd->status+strlen(cmd->status), ": error: no blink1 found");
+        return;
+    }
+    // a reopened handle may mean a replugged device, with its RAM reset
+    uint32_t gen = blink1_poolGeneration(dev);
+    bool resident = (gen != 0 && w->resident_pattern == patt->pattern_id &&
+                     w->resident_gen == gen);
+    msg("pattern %u: %d lines, repeats:%d%s\n", patt->pattern_id, patt->len,
+        patt->repeats, resident ? ", already on device" : "");
+    int rc = 0;
+    if( !resident ) {
+        w->resident_pattern = 0;
+        rc = blink1_writePatternBulkRaw(dev, patt->lines, patt->len, 0);
+        if( rc == 0 ) {
+            w->resident_pattern = patt->pattern_id;
+            w->resident_gen = gen;
+        }
+    }
+    if( rc == 0 ) {
+        rc = blink1_playloop(dev, 1, 0/*startpos*/, patt->len-1/*endpos*/, cmd->count/*count*/);
+    }
+    cache_return(dev);
+    if( rc == -1 ) {
+        sprintf(cmd->status+strlen(cmd->status), ": error: couldn't play pattern");
+    }
+    if( cmd->resultsdict ) {
+        DictionaryInsert(cmd->resultsdict, "pattern_uploaded", resident ? "0" : "1");
+    }
+}
+
+static void do_servertickle(http_cmd_t* cmd)
+{
+    uint8_t start_pos = 0;
+    uint8_t end_pos = 0;
+    uint8_t st_off_state = 0;
+    blink1_device* dev = cache_getDeviceById(cmd->id);
+    blink1_serverdown( dev, cmd->on, cmd->millis, st_off_state, start_pos, end_pos );
+    cache_return(dev);
+}
+
+//
+// replies, on the mongoose thread
+//
+
+static void http_cmd_reply(struct mg_connection *c, http_cmd_t* cmd, int resp_code)
+{
+    char tmpstr[100];
+    if( cmd->status[0] != '\0' ) {
+        sprintf(tmpstr, "#%2.2x%2.2x%2.2x", cmd->rgb.r,cmd->rgb.g,cmd->rgb.b );
+        mg_printf(c, "HTTP/1.1 %d %s\r\n%sTransfer-Encoding: chunked\r\n\r\n",
+                  resp_code, (resp_code == 429) ? "Too Many Requests" :
+                  (resp_code == 503) ? "Service Unavailable" :
+                  (resp_code == 404) ? "Not Found" : "OK",
+                  (resp_code == 429) ? "Retry-After: 1\r\n" : "");
+        mg_http_printf_chunk(c,
+                             "{\n");
+
+        DictionaryPrintAsJsonMg(c, cmd->resultsdict);
+
+        // these aren't in the resultsdict because storing numbers is annoying
+        mg_http_printf_chunk(c,
+                             "\"millis\": %d,\n"
+                             "\"time\": %g,\n"
+                             "\"rgb\": \"%s\",\n"
+                             "\"ledn\": %d,\n"
+                             "\"bright\": %d,\n"
+                             "\"count\": %d,\n"
+                             "\"status\":  \"%s\"\n",
+                             cmd->millis,
+                            (cmd->millis/1000.0),
+                             tmpstr,
+                             cmd->ledn,
+                             cmd->bright,
+                             cmd->count,
+                             cmd->status
+                             );
+
+        mg_http_printf_chunk(c,
+                             "}\n"
+                             );
+
+        mg_http_write_chunk(c, "", 0); /* Send empty chunk, the end of response */
+    }
+
+    // access logging
+    if( enable_logging ) {
+        log_access(c, cmd->uri_str, resp_code);
+    }
+}
+
+// Per-connection state, the fn_data of accepted connections.
+// A device command's reply goes out when its worker is done, so while
+// one is pending, later requests on the connection are held back
+// unparsed. Pipelined requests are then answered in order.
+typedef struct {
+    bool busy;              // a device reply is pending
+    struct mg_iobuf held;   // requests that came in meanwhile
+} http_conn_t;
+
+// the pending reply on c has gone out, parse what was held back
+static void http_conn_resume(struct mg_connection* c)
+{
+    http_conn_t* hc = (http_conn_t*)c->fn_data;
+    if( hc == NULL ) return;
+    hc->busy = false;
+    c->is_full = 0;  // read again
+    if( hc->held.len == 0 ) return;
+    // held requests go before anything read since
+    if( mg_iobuf_add(&c->recv, 0, hc->held.buf, hc->held.len, MG_IO_SIZE) != hc->held.len ) {
+        c->is_closing = 1;
+    }
+    mg_iobuf_free(&hc->held);
+    long n = 0;
+    mg_call(c, MG_EV_READ, &n);  // mongoose parses them, as if just read
+}
+
+// a command came back from its worker: reply, if the client is still there
+static void http_cmd_done(struct mg_mgr* mgr, http_cmd_t* cmd)
+{
+    if( cmd->effect_id ) {
+        effect_step_done(cmd);
+    }
+    if( cmd->conn_id ) {
+        for( struct mg_connection* c = mgr->conns; c != NULL; c = c->next ) {
+            if( c->id == cmd->conn_id ) {
+                http_cmd_reply(c, cmd, (cmd->status[0] != '\0') ? 200 : 404);
+                http_conn_resume(c);
+                break;
+            }
+        }
+    }
+    http_cmd_free(cmd);
+}
+
+// the mongoose end of the socket pair the workers wake us with
+static void done_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+    if( ev != MG_EV_READ ) {
+        return;
+    }
+    c->recv.len = 0;  // just wakeups
+
+    mutex_lock(&done_lock);
+    http_cmd_t* list = done_head;
+    done_head = NULL;
+    mutex_unlock(&done_lock);
+
+    http_cmd_t* fifo = NULL;  // list is newest first
+    while( list ) {
+        http_cmd_t* next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while( fifo ) {
+        http_cmd_t* next = fifo->next;
+        http_cmd_done(c->mgr, fifo);
+        fifo = next;
+    }
+}
+
 static void ev_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
 {
+    http_conn_t* hc = (http_conn_t*)fn_data;
+    if( ev == MG_EV_ACCEPT ) {
+        c->fn_data = calloc(1, sizeof(http_conn_t));  // NULL: replies unordered
+        return;
+    }
+    if( ev == MG_EV_CLOSE && hc ) {
+        mg_iobuf_free(&hc->held);
+        free(hc);
+        c->fn_data = NULL;
+        return;
+    }
     if(ev != MG_EV_HTTP_MSG) {
         return;
     }
+    if( hc && hc->busy ) {  // answer in order: hold this and what follows
+        if( mg_iobuf_add(&hc->held, hc->held.len, c->recv.buf, c->recv.len,
+                         MG_IO_SIZE) != c->recv.len ) {
+            c->is_closing = 1;
+        }
+        c->recv.len = 0;  // nothing left for mongoose to parse
+        c->is_full = 1;   // and nothing more to read, until resumed
+        return;
+    }
 
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
 
-    uint32_t id=0;
-    uint8_t ledn=0, bright=0;
-    char status[1000];  status[0] = 0;
-    char uri_str[1000];
+    http_cmd_t* cmd = http_cmd_new(c->id);
+    if( cmd == NULL ) {
+        mg_http_reply(c, 503, "", "out of memory\n");
+        return;
+    }
+    char* status = cmd->status;
+    DictionaryRef resultsdict = cmd->resultsdict;
     char tmpstr[1000];
-    char pattstr[1000];
-    char pnamestr[1000];
-    //int rc;
-    uint16_t millis = 0;
-    rgb_t rgb = {0,0,0}; // for parsecolor
-    uint8_t count = 0;
-
-    DictionaryCallbacks resultsdictc = DictionaryStandardStringCallbacks();
-    DictionaryRef resultsdict = DictionaryCreate( 100, &resultsdictc );
+    char pnamestr[1000] = "";
+    uint32_t effect_id = 0;
 
     struct mg_str* uri = &hm->uri;
     struct mg_str* querystr = &hm->query;
 
-    mg_snprintf(uri_str, uri->len+1, "%s", uri->ptr); // uri->ptr gives us char ptr
+    mg_snprintf(cmd->uri_str, uri->len+1, "%s", uri->ptr); // uri->ptr gives us char ptr
 
-    DictionaryInsert(resultsdict, "uri", uri_str);
+    DictionaryInsert(resultsdict, "uri", cmd->uri_str);
     DictionaryInsert(resultsdict, "version", blink1_server_version);
 
     // parse all possible query args (it's just easier this way)
     if( mg_http_get_var(querystr, "millis", tmpstr, sizeof(tmpstr)) > 0 ) {
-        millis = strtod(tmpstr,NULL);
+        cmd->millis = strtod(tmpstr,NULL);
     }
     if( mg_http_get_var(querystr, "time", tmpstr, sizeof(tmpstr)) > 0 ) {
-        millis = 1000 * strtof(tmpstr,NULL);
+        cmd->millis = 1000 * strtof(tmpstr,NULL);
     }
     if( mg_http_get_var(querystr, "rgb", tmpstr, sizeof(tmpstr)) > 0 ) {
-        parsecolor( &rgb, tmpstr);
+        parsecolor( &cmd->rgb, tmpstr);
     }
     if( mg_http_get_var(querystr, "count", tmpstr, sizeof(tmpstr)) > 0 ) {
-        count = strtod(tmpstr,NULL);
+        cmd->count = strtod(tmpstr,NULL);
     }
     if( mg_http_get_var(querystr, "id", tmpstr, sizeof(tmpstr)) > 0 ) {
         char* pch;
         pch = strtok(tmpstr, " ,");
         int base = (strlen(pch)==8) ? 16:0;
-        id = strtol(pch,NULL,base);
+        cmd->id = strtol(pch,NULL,base);
     }
     if( mg_http_get_var(querystr, "ledn", tmpstr, sizeof(tmpstr)) > 0 ) {
-        ledn = strtod(tmpstr,NULL);
+        cmd->ledn = strtod(tmpstr,NULL);
     }
     if( mg_http_get_var(querystr, "bright", tmpstr, sizeof(tmpstr)) > 0 ) {
-        bright = strtod(tmpstr,NULL);
+        cmd->bright = strtod(tmpstr,NULL);
     }
     if( mg_http_get_var(querystr, "pattern", tmpstr, sizeof(tmpstr)) > 0 ) {
-        strcpy(pattstr, tmpstr);
+        strcpy(cmd->pattstr, tmpstr);
     }
     if( mg_http_get_var(querystr, "pname", tmpstr, sizeof(tmpstr)) > 0 ) {
         strcpy(pnamestr, tmpstr);
     }
+    if( mg_http_get_var(querystr, "effect_id", tmpstr, sizeof(tmpstr)) > 0 ) {
+        effect_id = strtoul(tmpstr,NULL,10);
+    }
 
     if( mg_vcmp( uri, "/blink1") == 0 ||
              mg_vcmp( uri, "/blink1/") == 0  ) {
         sprintf(status, "blink1 status");
-        blink1_device* dev = cache_getDeviceById(id);
-        if( dev ) {
-            uint16_t msecs;
-            int rc = blink1_readRGB(dev, &msecs, &rgb.r,&rgb.g,&rgb.b, 0 );
-            if( rc==-1 ) {
-                printf("error on readRGB\n");
-            }
-            cache_return(dev);
-        }
+        cmd->func = do_status;
     }
     else if( mg_vcmp( uri, "/blink1/id") == 0 ||
              mg_vcmp( uri, "/blink1/id/") == 0 ||
              mg_vcmp( uri, "/blink1/enumerate") == 0 ) {
         sprintf(status, "blink1 id");
-        cache_flush(0);
-        int c = blink1_enumerate();
-
-        sprintf(tmpstr,"[");
-        for( int i=0; i< c; i++ ) {
-            sprintf(tmpstr+strlen(tmpstr), "\"%s\"", blink1_getCachedSerial(i));
-            if( i!=c-1 ) { sprintf(tmpstr+strlen(tmpstr), ","); } // ugh
-        }
-        sprintf(tmpstr+strlen(tmpstr), "]");
-        DictionaryInsert(resultsdict, "blink1_serialnums", tmpstr);
-
-        const char* blink1_serialnum = blink1_getCachedSerial(0);
-        if( blink1_serialnum ) {
-            sprintf(tmpstr, "%s00000000", blink1_serialnum);
-            DictionaryInsert(resultsdict, "blink1_id", tmpstr);
-        }
+        cmd->func = do_enumerate;
+        cmd->exclusive = true;
     }
     else if( mg_vcmp( uri, "/blink1/off") == 0 ) {
         sprintf(status, "blink1 off");
-        rgb.r = 0; rgb.g = 0; rgb.b = 0;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->rgb = (rgb_t){0,0,0};
+        cmd->func = do_color;
     }
     else if( mg_vcmp( uri, "/blink1/on") == 0 ) {
         sprintf(status, "blink1 on");
-        rgb.r = 255; rgb.g = 255; rgb.b = 255;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->rgb = (rgb_t){255,255,255};
+        cmd->func = do_color;
     }
     else if( mg_vcmp( uri, "/blink1/red") == 0 ) {
         sprintf(status, "blink1 red");
-        rgb.r = 255; rgb.g = 0; rgb.b = 0;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->rgb = (rgb_t){255,0,0};
+        cmd->func = do_color;
     }
     else if( mg_vcmp( uri, "/blink1/green") == 0 ) {
         sprintf(status, "blink1 green");
-        rgb.r = 0; rgb.g = 255; rgb.b = 0;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->rgb = (rgb_t){0,255,0};
+        cmd->func = do_color;
     }
     else if( mg_vcmp( uri, "/blink1/blue") == 0 ) {
         sprintf(status, "blink1 blue");
-        rgb.r = 0; rgb.g = 0; rgb.b = 255;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->rgb = (rgb_t){0,0,255};
+        cmd->func = do_color;
     }
     else if( mg_vcmp( uri, "/blink1/cyan") == 0 ) {
         sprintf(status, "blink1 cyan");
-        rgb.r = 0; rgb.g = 255; rgb.b = 255;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->rgb = (rgb_t){0,255,255};
+        cmd->func = do_color;
     }
     else if( mg_vcmp( uri, "/blink1/yellow") == 0 ) {
         sprintf(status, "blink1 yellow");
-        rgb.r = 255; rgb.g = 255; rgb.b = 0;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->rgb = (rgb_t){255,255,0};
+        cmd->func = do_color;
     }
     else if( mg_vcmp( uri, "/blink1/magenta") == 0 ) {
         sprintf(status, "blink1 magenta");
-        rgb.r = 255; rgb.g = 0; rgb.b = 255;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->rgb = (rgb_t){255,0,255};
+        cmd->func = do_color;
     }
     else if( mg_vcmp( uri, "/blink1/fadeToRGB") == 0 ) {
         sprintf(status, "blink1 fadeToRGB");
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
+        cmd->func = do_color;
     }
     else if( mg_vcmp(uri, "/blink1/blink") == 0 ) {
         sprintf(status, "blink1 blink");
-        if( rgb.r==0 && rgb.g==0 && rgb.b==0 ) { rgb.r=255;rgb.g=255;rgb.b=255; }
-        if( count==0 ) { count = 3; }
-        if( millis==0 ) { millis = 300; }
-        int repeats = -1;
-        patternline_t pattern[32];
-        blink1_adjustBrightness( bright, &rgb.r, &rgb.g, &rgb.b);
+        rgb_t* rgb = &cmd->rgb;
+        if( rgb->r==0 && rgb->g==0 && rgb->b==0 ) { rgb->r=255;rgb->g=255;rgb->b=255; }
+        if( cmd->count==0 ) { cmd->count = 3; }
+        if( cmd->millis==0 ) { cmd->millis = 300; }
         sprintf(tmpstr, "%d,#%2.2x%2.2x%2.2x,%f,%d,#000000,%f,0",
-                count, rgb.r,rgb.g,rgb.b, (float)millis/1000.0, ledn,
-                (float)millis/1000.0);
+                cmd->count, rgb->r,rgb->g,rgb->b, (float)cmd->millis/1000.0, cmd->ledn,
+                (float)cmd->millis/1000.0);
         msg("pattstr:%s\n", tmpstr);
-        int pattlen = parsePattern( tmpstr, &repeats, pattern);
-
-        blink1_device* dev = cache_getDeviceById(id);
-        for( int i=0; i<pattlen; i++ ) {
-            patternline_t pat = pattern[i];
-            blink1_setLEDN(dev, pat.ledn);
-            msg("  writing line %d: %2.2x,%2.2x,%2.2x : %d : %d\n",
-                  i, pat.color.r,pat.color.g,pat.color.b, pat.millis, pat.ledn );
-            blink1_writePatternLine(dev, pat.millis, pat.color.r, pat.color.g, pat.color.b, i);
+        const compiled_pattern_t* patt = pattern_compile(tmpstr, cmd->bright);
+        if( patt ) {
+            sprintf(tmpstr, "%u", patt->pattern_id);
+            DictionaryInsert(resultsdict, "pattern_id", tmpstr);
+            cmd->patt = *patt;
+            cmd->func = do_pattern_play;
         }
-        blink1_playloop(dev, 1, 0/*startpos*/, pattlen-1/*endpos*/, count/*count*/);
-        cache_return(dev);
     }
-    /*
     else if( mg_vcmp(uri, "/blink1/pattern") == 0 ||
              mg_vcmp(uri, "/blink1/pattern/") == 0 ) {
-
-        tmpstr
-        DictionaryInsert(statussdict, "patterns", tmpstr);
-
-    }
-    else if( mg_vcmp(uri, "/blink1/pattern/add") == 0 ) {
-        sprintf(result, "blink1 pattern add");
-        DictionaryInsert(patterndict, pnamestr, pattstr);
-        DictionaryInsert(resultsdict, "pattern", pattstr);
+        sprintf(status, "blink1 pattern");
+        char liststr[4000] = "{";
+        pattern_list_str = liststr;
+        pattern_list_len = sizeof(liststr) - 1;  // room for the "}"
+        DictionaryApplyFunction(patterndict, pattern_list_add);
+        strcat(liststr, "}");
+        DictionaryInsert(resultsdict, "patterns", liststr);
     }
-    */
-    else if( mg_vcmp(uri, "/blink1/pattern/play") == 0 ) {
-        sprintf(status, "blink1 pattern play");
-        /*
-        if( pnamestr[0] != 0 && pattstr[0] != 0 ) {
-            DictionaryInsert(patterndict, pnamestr, pattstr);
+    else if( mg_vcmp(uri, "/blink1/pattern/add") == 0 ||
+             mg_vcmp(uri, "/blink1/pattern/play") == 0 ) {
+        bool play = (mg_vcmp(uri, "/blink1/pattern/play") == 0);
+        sprintf(status, "blink1 pattern %s", play ? "play" : "add");
+        // a named pattern is stored as given, and compiled on first use
+        if( pnamestr[0] != 0 && cmd->pattstr[0] != 0 ) {
+            DictionaryInsert(patterndict, pnamestr, cmd->pattstr);
         }
+        const char* src = cmd->pattstr;
         if( pnamestr[0] != 0 ) {
-            DictionaryGetValue(patterndict, pnamestr);
+            src = DictionaryGetValue(patterndict, pnamestr);
+            if( src ) DictionaryInsert(resultsdict, "pname", pnamestr);
         }
-        */
-        if( pattstr[0] == 0 ) { // no pattern
+        const compiled_pattern_t* patt = (src && src[0]) ?
+            pattern_compile(src, cmd->bright) : NULL;
+        if( !patt ) {
+            sprintf(status+strlen(status), ": error: %s",
+                    (src && src[0]) ? "bad pattern" : "no such pattern");
         }
-
-        patternline_t pattern[32];
-        int repeats = -1;
-        int pattlen = parsePattern( pattstr, &repeats, pattern);
-        if( !count ) { count = repeats; }
-
-        blink1_device* dev = cache_getDeviceById(id);
-
-        msg("pattlen:%d, repeats:%d\n", pattlen,repeats);
-        for( int i=0; i<pattlen; i++ ) {
-            patternline_t pat = pattern[i];
-            blink1_setLEDN(dev, pat.ledn);
-            msg("    writing line %d: %2.2x,%2.2x,%2.2x : %d : %d\n",
-                  i, pat.color.r,pat.color.g,pat.color.b, pat.millis, pat.ledn );
-            blink1_writePatternLine(dev, pat.millis, pat.color.r, pat.color.g, pat.color.b, i);
+        else if( !play && pnamestr[0] == 0 ) {
+            sprintf(status+strlen(status), ": error: no pname");
+        }
+        else {
+            sprintf(tmpstr, "%u", patt->pattern_id);
+            DictionaryInsert(resultsdict, "pattern_id", tmpstr);
+            if( play ) {
+                cmd->patt = *patt;
+                if( !cmd->count ) { cmd->count = patt->repeats; }
+                cmd->func = do_pattern_play;
+            }
         }
-        blink1_playloop(dev, 1, 0/*startpos*/, pattlen-1/*endpos*/, count/*count*/);
-        cache_return(dev);
     }
     else if( mg_vcmp( uri, "/blink1/blinkserver") == 0 ) {
         sprintf(status, "blink1 blinkserver");
         //if( r==0 && g==0 && b==0 ) { r = 255; g = 255; b = 255; }
-        if( millis==0 ) { millis = 200; }
-
-        blink1_device* dev = cache_getDeviceById(id);
-        //blink1_adjustBrightness( bright, &r, &g, &b);
-        //msg("rgb:%d,%d,%d\n",r,g,b);
-        for( int i=0; i<count; i++ ) {
-            blink1_fadeToRGBN( dev, millis/2, rgb.r,rgb.g,rgb.b, ledn );
-            blink1_sleep( millis/2 ); // fixme
-            blink1_fadeToRGBN( dev, millis/2, 0,0,0, ledn );
-            blink1_sleep( millis/2 ); // fixme
-        }
-        cache_return(dev);
+        if( cmd->millis==0 ) { cmd->millis = 200; }
+
+        effect_start(EFFECT_BLINK, 2*cmd->count, cmd->rgb, cmd->millis, cmd->id,
+                     cmd->ledn, 0, status, resultsdict);
     }
-    //else if( mg_http_match_uri(hm, "/blink1/servertickle/*")) { 
+    //else if( mg_http_match_uri(hm, "/blink1/servertickle/*")) {
     else if( mg_vcmp( uri, "/blink1/servertickle/on") == 0 ||
              mg_vcmp( uri, "/blink1/servertickle/off") == 0 ) {
-        bool st_on = (mg_vcmp(uri, "/blink1/servertickle/on") == 0);
-        if( millis==0 ) { millis = 2000; }
-        sprintf(status, "blink1 servertickle %s", st_on? "on":"off");
-        uint8_t start_pos = 0;
-        uint8_t end_pos = 0;
-        uint8_t st_off_state = 0;
-        blink1_device* dev = cache_getDeviceById(id);
-        blink1_serverdown( dev, st_on, millis, st_off_state, start_pos, end_pos );
-        cache_return(dev);
-        DictionaryInsert(resultsdict, "on", st_on? "1":"0");
+        cmd->on = (mg_vcmp(uri, "/blink1/servertickle/on") == 0);
+        if( cmd->millis==0 ) { cmd->millis = 2000; }
+        sprintf(status, "blink1 servertickle %s", cmd->on? "on":"off");
+        DictionaryInsert(resultsdict, "on", cmd->on? "1":"0");
+        cmd->func = do_servertickle;
     }
     else if( mg_vcmp( uri, "/blink1/random") == 0 ) {
         sprintf(status, "blink1 random");
-        if( count==0 ) { count = 1; }
-        if( millis==0 ) { millis = 200; }
-        blink1_device* dev = cache_getDeviceById(id);
-        for( int i=0; i<count; i++ ) {
-            uint8_t r = rand() % 255;
-            uint8_t g = rand() % 255;
-            uint8_t b = rand() % 255 ;
-            blink1_adjustBrightness( bright, &r, &g, &b);
-            blink1_fadeToRGBN( dev, millis/2, r,g,b, ledn );
-            blink1_sleep( millis/2 ); // fixme
+        if( cmd->count==0 ) { cmd->count = 1; }
+        if( cmd->millis==0 ) { cmd->millis = 200; }
+        effect_start(EFFECT_RANDOM, cmd->count, cmd->rgb, cmd->millis, cmd->id,
+                     cmd->ledn, cmd->bright, status, resultsdict);
+    }
+    else if( mg_vcmp( uri, "/blink1/effect") == 0 ||
+             mg_vcmp( uri, "/blink1/effect/cancel") == 0 ) {
+        bool cancel = (mg_vcmp( uri, "/blink1/effect/cancel") == 0);
+        sprintf(status, "blink1 effect%s", cancel ? " cancel" : "");
+        effect_t* e = effect_find(effect_id);
+        if( !e ) {
+            sprintf(status+strlen(status), ": error: no such effect_id");
+        }
+        else {
+            if( cancel && e->state <= EFFECT_RUNNING ) {
+                effect_finish(e, EFFECT_CANCELLED);
+            }
+            effect_describe(e, resultsdict);
         }
-        cache_return(dev);
     }
     else {
         if( show_html ) {
@@ -510,54 +1322,160 @@ static void ev_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_
 
     int resp_code = 404;  // no found by default
 
-    if( status[0] != '\0' ) {
+    if( cmd->func ) {  // device I/O, reply when the device's worker is done
+        int rc = device_submit(cmd);
+        if( rc == 0 ) {
+            if( hc ) {
+                hc->busy = true;
+                c->is_full = 1;
+            }
+            return;
+        }
+        sprintf(status+strlen(status), (rc == -1) ? ": error: device busy" :
+                                       (rc == -3) ? ": error: no blink1 found"
+                                                  : ": error: too many devices");
+        resp_code = (rc == -1) ? 429 : (rc == -3) ? 404 : 503;
+    }
+    else if( status[0] != '\0' ) {
         resp_code = 200;
-        sprintf(tmpstr, "#%2.2x%2.2x%2.2x", rgb.r,rgb.g,rgb.b );
-        mg_printf(c, "HTTP/1.1 %d OK\r\nTransfer-Encoding: chunked\r\n\r\n", resp_code);
-        mg_http_printf_chunk(c,
-                             "{\n");
+    }
+    http_cmd_reply(c, cmd, resp_code);
+    http_cmd_free(cmd);
+}
 
-        DictionaryPrintAsJsonMg(c, resultsdict);
+// Handle interrupts, like Ctrl-C
+static volatile sig_atomic_t s_signo;
+static void signal_handler(int signo) {
+  s_signo = signo;
+}
 
-        // these aren't in the resultsdict because storing numbers is annoying
-        mg_http_printf_chunk(c,
-                             "\"millis\": %d,\n"
-                             "\"time\": %g,\n"
-                             "\"rgb\": \"%s\",\n"
-                             "\"ledn\": %d,\n"
-                             "\"bright\": %d,\n"
-                             "\"count\": %d,\n"
-                             "\"status\":  \"%s\"\n",
-                             millis,
-                            (millis/1000.0),
-                             tmpstr,
-                             ledn,
-                             bright,
-                             count,
-                             status
-                             );
+//
+// load test
+//
+// "--loadtest secs[,clients]" runs HTTP clients against this server for
+// secs seconds, spreading /blink1/fadeToRGB requests over all devices,
+// then prints requests/sec and latency percentiles and exits.
+// Use blink1-emu to get as many emulated devices as needed.
+//
 
-        mg_http_printf_chunk(c,
-                             "}\n"
-                             );
+static int loadtest_secs = 0;
+static int loadtest_clients = 8;
+
+typedef struct _loadtest_client {
+    int      n;           // which client, picks the device
+    uint32_t reqs;        // requests sent
+    int64_t  sent_us;     // when the outstanding request was sent
+} loadtest_client;
+
+static struct {
+    int64_t* lat_us;      // latency of every reply
+    size_t   count;
+    size_t   cap;
+    int      ok;
+    int      busy;        // 429s
+    int      errors;
+    int      devices;
+    bool     stop;
+} loadtest;
+
+static void loadtest_send(struct mg_connection *c, loadtest_client* lc)
+{
+    char req[200];  // mg_printf() doesn't know "%6.6x"
+    lc->reqs++;
+    int len = snprintf(req, sizeof(req),
+                       "GET /blink1/fadeToRGB?rgb=%6.6x&millis=100&id=%d HTTP/1.1\r\n"
+                       "Host: localhost\r\n\r\n",
+                       (lc->reqs * 0x10101) & 0xffffff, lc->n % loadtest.devices);
+    lc->sent_us = blink1_micros();
+    mg_send(c, req, len);
+}
 
-        mg_http_write_chunk(c, "", 0); /* Send empty chunk, the end of response */
+static void loadtest_handler(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+    loadtest_client* lc = (loadtest_client*)fn_data;
+    if( ev == MG_EV_CONNECT ) {
+        loadtest_send(c, lc);
     }
-
-    // access logging
-    if( enable_logging ) { 
-        log_access(c, uri_str, resp_code);
+    else if( ev == MG_EV_HTTP_MSG && lc->reqs == 1 ) {
+        loadtest_send(c, lc);  // warm-up, first reply includes connect time
+    }
+    else if( ev == MG_EV_HTTP_MSG ) {
+        struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+        int code = mg_http_status(hm);
+        if( code == 200 ) loadtest.ok++;
+        else if( code == 429 ) loadtest.busy++;
+        else loadtest.errors++;
+        if( loadtest.count == loadtest.cap ) {
+            size_t cap = loadtest.cap ? 2*loadtest.cap : 4096;
+            int64_t* lat = realloc(loadtest.lat_us, cap * sizeof(int64_t));
+            if( lat ) { loadtest.lat_us = lat; loadtest.cap = cap; }
+        }
+        if( loadtest.count < loadtest.cap ) {
+            loadtest.lat_us[loadtest.count++] = blink1_micros() - lc->sent_us;
+        }
+        if( !loadtest.stop ) loadtest_send(c, lc);
+    }
+    else if( ev == MG_EV_ERROR ) {
+        loadtest.errors++;
     }
 }
 
-// ----------------------------------------------------------------------
+static int cmp_int64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
 
-// Handle interrupts, like Ctrl-C
-static int s_signo;
-static void signal_handler(int signo) {
-  s_signo = signo;
+static THREAD_FUNC(loadtest_thread)
+{
+    (void)arg;
+    struct mg_mgr mgr;
+    char url[100];
+    bool anyhost = (strcmp(http_listen_host, "0.0.0.0") == 0);
+    snprintf(url, sizeof(url), "http://%s:%d/",
+             anyhost ? "127.0.0.1" : http_listen_host, http_listen_port);
+
+    mg_mgr_init(&mgr);
+    loadtest_client* clients = calloc(loadtest_clients, sizeof(loadtest_client));
+    for( int i=0; clients && i< loadtest_clients; i++ ) {
+        clients[i].n = i;
+        mg_http_connect(&mgr, url, loadtest_handler, &clients[i]);
+    }
+
+    int64_t start = blink1_millis();
+    while( blink1_millis() - start < loadtest_secs * 1000 ) {
+        mg_mgr_poll(&mgr, 50);
+    }
+    loadtest.stop = true;
+    int64_t elapsed = blink1_millis() - start;
+    int64_t drain = blink1_millis();
+    while( blink1_millis() - drain < 1000 ) {  // let outstanding replies in
+        mg_mgr_poll(&mgr, 50);
+    }
+    mg_mgr_free(&mgr);
+    free(clients);
+
+    size_t n = loadtest.count;
+    printf("loadtest: %d clients, %d devices, %d secs\n",
+           loadtest_clients, loadtest.devices, loadtest_secs);
+    printf("  requests: %zu  ok: %d  busy(429): %d  errors: %d\n",
+           n, loadtest.ok, loadtest.busy, loadtest.errors);
+    if( n ) {
+        qsort(loadtest.lat_us, n, sizeof(int64_t), cmp_int64);
+        printf("  %.1f requests/sec\n", n * 1000.0 / elapsed);
+        printf("  latency usec: p50 %lld  p90 %lld  p99 %lld  max %lld\n",
+               (long long)loadtest.lat_us[n/2],
+               (long long)loadtest.lat_us[n*9/10],
+               (long long)loadtest.lat_us[n*99/100],
+               (long long)loadtest.lat_us[n-1]);
+    }
+    free(loadtest.lat_us);
+    s_signo = SIGTERM;  // done, stop the server
+    THREAD_RETURN;
 }
 
+// ----------------------------------------------------------------------
+
 int main(int argc, char *argv[]) {
     struct mg_mgr mgr;
     struct mg_connection *c;
@@ -582,6 +1500,7 @@ int main(int argc, char *argv[]) {
         {"logging",    no_argument,       0,      'l'},
         {"help",       no_argument, 0,            'h'},
         {"version",    no_argument, 0,            'V'},
+        {"loadtest",   required_argument, 0,      'L'},
         {NULL,         0,           0,             0 },
     };
 
@@ -605,6 +1524,14 @@ int main(int argc, char *argv[]) {
         case 'l':
             enable_logging = true;
             break;
+        case 'L':  // secs[,clients]
+            loadtest_secs = strtol(optarg,NULL,10);
+            if( strchr(optarg,',') ) {
+                loadtest_clients = strtol(strchr(optarg,',')+1,NULL,10);
+            }
+            if( loadtest_secs < 1 ) loadtest_secs = 1;
+            if( loadtest_clients < 1 ) loadtest_clients = 1;
+            break;
         case 'H':
             strncpy(http_listen_host, optarg, sizeof(http_listen_host));
             break;
@@ -651,13 +1578,36 @@ int main(int argc, char *argv[]) {
 
     mg_mgr_init(&mgr);
 
-    if ((c = mg_http_listen(&mgr, http_listen_url, ev_handler, &mgr)) == NULL) {
+    if ((c = mg_http_listen(&mgr, http_listen_url, ev_handler, NULL)) == NULL) {
       MG_LOG(MG_LL_ERROR, ("Cannot listen on %s.", http_listen_url));
       exit(EXIT_FAILURE);
     }
 
+    mutex_init(&done_lock);
+    rwlock_init(&devices_lock);
+    if( (done_pipe = mg_mkpipe(&mgr, done_handler, NULL, false)) < 0 ) {
+      MG_LOG(MG_LL_ERROR, ("Cannot create worker wakeup pipe."));
+      exit(EXIT_FAILURE);
+    }
+
+    mg_timer_add(&mgr, effect_tick_millis, MG_TIMER_REPEAT, effects_tick, NULL);
+
+    if( loadtest_secs ) {
+        thread_t lt;
+        loadtest.devices = blink1_enumerate();
+        if( loadtest.devices < 1 ) {
+            printf("loadtest: no blink(1) devices found, try blink1-emu\n");
+            exit(EXIT_FAILURE);
+        }
+        if( thread_create(&lt, loadtest_thread, NULL) != 0 ) {
+            printf("loadtest: cannot start client thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     while (s_signo == 0) {
-        mg_mgr_poll(&mgr, 1000);
+        // poll often enough to step effects on time, only while there are some
+        mg_mgr_poll(&mgr, effects_pending() ? effect_tick_millis : 1000);
         cache_flush(idle_atime);
     }
     mg_mgr_free(&mgr);
@@ -244,6 +244,82 @@ extern "C" {
 		*/
 		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id);
 
+		/** @brief Criteria for hid_enumerate_ex() and hid_enumerate_foreach().
+
+			A zero or NULL field matches any device.
+		*/
+		struct hid_enumerate_filter {
+			/** Device Vendor ID */
+			unsigned short vendor_id;
+			/** Device Product ID */
+			unsigned short product_id;
+			/** Serial Number, compared exactly */
+			const wchar_t *serial_number;
+			/** Usage Page for this Device/Interface */
+			unsigned short usage_page;
+			/** Usage for this Device/Interface */
+			unsigned short usage;
+		};
+
+		/** @brief Callback for hid_enumerate_foreach().
+
+			@ingroup API
+			@param info One matching device. It is only valid during
+				the call; its next field is always NULL.
+			@param user_data The pointer passed to hid_enumerate_foreach().
+
+			@returns
+				Zero to continue the enumeration, non-zero to stop it.
+		*/
+		typedef int (HID_API_CALL *hid_enumerate_callback)(const struct hid_device_info *info, void *user_data);
+
+		/** @brief Enumerate the HID Devices matching a filter.
+
+			Like hid_enumerate(), but matches on all fields of @p filter.
+			Where the backend allows it, devices are filtered before
+			their strings are read and converted, so a narrow filter is
+			much cheaper than filtering the result of hid_enumerate().
+
+			@ingroup API
+			@param filter The criteria to match, or NULL to return all
+				HID devices.
+
+			@returns
+				This function returns a pointer to a linked list of type
+				struct #hid_device_info, or NULL in the case of failure or
+				if no matching devices are present in the system.
+				Call hid_error(NULL) to get the failure reason.
+
+			@note The returned value by this function must to be freed by calling hid_free_enumeration(),
+			      when not needed anymore.
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enumerate_filter *filter);
+
+		/** @brief Call a function for each HID Device matching a filter.
+
+			A convenience wrapper around hid_enumerate_ex(): the
+			matching devices are enumerated into a list as usual, then
+			handed to @p callback one at a time, and the list is freed.
+			It saves walking and freeing the list and lets the caller
+			stop early, but costs the same as hid_enumerate_ex().
+			@p callback is called with no library locks held, so it may
+			call hid_open() or enumerate again.
+
+			@ingroup API
+			@param filter The criteria to match, or NULL to match all
+				HID devices.
+			@param callback Called once per matching device, must not
+				be NULL.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns the number of devices passed to
+				@p callback. On error it returns 0, or -1 where the
+				backend tells errors apart from finding no devices
+				(Linux). Call hid_error(NULL) to get the failure reason.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_enumerate_foreach(const struct hid_enumerate_filter *filter, hid_enumerate_callback callback, void *user_data);
+
 		/** @brief Free an enumeration Linked List
 
 			This function frees a linked list created by hid_enumerate().
@@ -473,6 +549,80 @@ extern "C" {
 		*/
 		int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned char *data, size_t length);
 
+		/** @brief Completion callback for asynchronous feature reports.
+
+			@ingroup API
+			@param dev The device the report was submitted to.
+			@param data The buffer passed to hid_send_feature_report_async()
+				or hid_get_feature_report_async().
+			@param res The value the matching synchronous call would have
+				returned: the number of bytes transferred (including the
+				report number), or -1 on error.
+			@param user_data The pointer passed at submission.
+		*/
+		typedef void (HID_API_CALL *hid_feature_report_callback)(hid_device *dev, unsigned char *data, int res, void *user_data);
+
+		/** @brief Send a Feature report to the device without waiting for it to complete.
+
+			Like hid_send_feature_report(), but returns as soon as the
+			report is queued. @p callback is called once the report has
+			been sent or has failed, on a thread owned by the library.
+			@p data must stay valid until then.
+
+			Reports submitted to the same device complete in submission
+			order, including reports submitted with
+			hid_get_feature_report_async(). hid_close() waits for all
+			pending reports of the device to complete. On Linux
+			(hidraw) @p callback may call hid_close() on its device,
+			which is then closed once its last report has completed;
+			other backends do not support that.
+
+			Backends without native asynchronous I/O complete the report
+			synchronously, before this function returns.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send, including
+				the report number.
+			@param callback Called when the report completes.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns 0 if the report was submitted, and
+				-1 on error, in which case @p callback is not called.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_send_feature_report_async(hid_device *dev, const unsigned char *data, size_t length, hid_feature_report_callback callback, void *user_data);
+
+		/** @brief Get a feature report from a HID device without waiting for it to complete.
+
+			Like hid_get_feature_report(), but returns as soon as the
+			request is queued. @p callback is called once the report has
+			been read into @p data or the request has failed, on a thread
+			owned by the library. @p data must stay valid until then.
+			Ordering and hid_close() behave as for
+			hid_send_feature_report_async().
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param data A buffer to put the read data into, including
+				the Report ID. Set the first byte of @p data[] to the
+				Report ID of the report to be read, or set it to zero
+				if your device does not use numbered reports.
+			@param length The number of bytes to read, including an
+				extra byte for the report ID.
+			@param callback Called when the report completes.
+			@param user_data Passed to @p callback.
+
+			@returns
+				This function returns 0 if the request was submitted, and
+				-1 on error, in which case @p callback is not called.
+				Call hid_error(dev) to get the failure reason.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_feature_report_async(hid_device *dev, unsigned char *data, size_t length, hid_feature_report_callback callback, void *user_data);
+
 		/** @brief Close a HID device.
 
 			@ingroup API
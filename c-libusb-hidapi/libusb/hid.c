@@ -77,11 +77,25 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
-struct input_report {
+/* Default number of slots in a device's input report ring. Must be a power
+   of two. Can be changed with hid_libusb_set_input_report_queue_depth(). */
+#define INPUT_REPORT_QUEUE_DEPTH_DEFAULT 32
+
+/* Single-producer/single-consumer ring of input reports received from the
+   device. read_callback() is the only producer and only moves head;
+   hid_read_timeout() is the only consumer and only moves tail. Both indices
+   run freely and are masked on use, so head == tail means empty and
+   head - tail == depth means full. Slots are preallocated, slot_size bytes
+   each (the input endpoint's max packet size). */
+struct input_report_queue {
 	uint8_t *data;
-	size_t len;
-	struct input_report *next;
+	size_t *lens;
+	size_t slot_size;
+	size_t mask;
+	size_t head;
+	size_t tail;
+	size_t drops;
+	int reader_waiting; /* Set under the mutex while a reader sleeps */
 };
 
 
@@ -110,14 +124,22 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
-	/* Read thread objects */
+	/* Read transfer objects. The transfer is serviced by the shared
+	   event loop threads; thread_state only provides the mutex and
+	   condition that hid_read_timeout() sleeps on. */
 	hidapi_thread_state thread_state;
 	int shutdown_thread;
 	int transfer_loop_finished;
 	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	/* Number of asynchronous feature reports in flight */
+	int pending_feature_reports;
+
+	/* Queue of received input reports. */
+	struct input_report_queue input_reports;
+
+	/* Next device in event_loop.devices */
+	struct hid_device_ *next_open;
 
 	/* Was kernel driver detached by libusb */
 #ifdef DETACH_KERNEL_DRIVER
@@ -133,8 +155,95 @@ static struct hid_api_version api_version = {
 
 static libusb_context *usb_context = NULL;
 
+static size_t input_report_queue_depth = INPUT_REPORT_QUEUE_DEPTH_DEFAULT;
+
+/* Threads running libusb event handling on usb_context for every open
+   device. They are started when the first device is opened and stopped
+   when the last one is closed. */
+static struct {
+	hidapi_thread_state state; /* mutex guards the fields below */
+	hidapi_thread_state *threads;
+	int num_threads;
+	int open_devices;
+	int shutdown;
+	int failed; /* a thread stopped on a fatal libusb error */
+	/* Open devices, for failing their reads if the threads stop. Has
+	   its own mutex, event_thread() can't take state while
+	   event_loop_release() holds it to join the threads. */
+	hidapi_thread_state devices_state;
+	hid_device *devices;
+} event_loop;
+
+static int event_loop_num_threads = 1;
+
+/* A HID interface found by the last bus scan, keyed by its hidapi path. */
+struct device_cache_entry {
+	char path[64];
+	libusb_device *device; /* referenced */
+	int interface_num;
+	struct device_cache_entry *next; /* hash chain */
+};
+
+/* Path to libusb_device map used by hid_open_path(). It is rebuilt from a
+   full bus scan when a path is not found, and marked invalid by libusb
+   hotplug events. Without hotplug support it is never trusted. */
+static struct {
+	hidapi_thread_state state; /* mutex guards the fields below */
+	struct device_cache_entry *entries;
+	size_t count;
+	struct device_cache_entry **buckets;
+	size_t mask;
+	int valid; /* cleared by hotplug_callback() */
+	int hotplug;
+#if LIBUSB_API_VERSION >= 0x01000102
+	libusb_hotplug_callback_handle hotplug_handle;
+#endif
+} device_cache;
+
 uint16_t get_usb_code_for_current_locale(void);
 static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static void stop_transfer_loop(hid_device *dev);
+static void event_loop_fail(void);
+static void device_cache_init(void);
+static void device_cache_exit(void);
+
+/* The ring indices are shared between the read thread and the caller of
+   hid_read_timeout() without a lock. */
+#define queue_load(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define queue_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int input_report_queue_init(struct input_report_queue *q, size_t slot_size)
+{
+	size_t depth = 1;
+	while (depth < input_report_queue_depth && depth <= (SIZE_MAX >> 1))
+		depth <<= 1;
+
+	if (slot_size == 0)
+		slot_size = 1;
+
+	q->data = (uint8_t*) malloc(depth * slot_size);
+	q->lens = (size_t*) calloc(depth, sizeof(*q->lens));
+	if (!q->data || !q->lens) {
+		free(q->data);
+		free(q->lens);
+		q->data = NULL;
+		q->lens = NULL;
+		return -1;
+	}
+	q->slot_size = slot_size;
+	q->mask = depth - 1;
+	q->head = 0;
+	q->tail = 0;
+	q->drops = 0;
+	q->reader_waiting = 0;
+	return 0;
+}
+
+/* Returns non-zero if at least one report is queued. */
+static int input_report_queue_pending(struct input_report_queue *q)
+{
+	return queue_load(&q->head) != queue_load(&q->tail);
+}
 
 static hid_device *new_hid_device(void)
 {
@@ -151,6 +260,9 @@ static void free_hid_device(hid_device *dev)
 	/* Clean up the thread objects */
 	hidapi_thread_state_destroy(&dev->thread_state);
 
+	free(dev->input_reports.data);
+	free(dev->input_reports.lens);
+
 	hid_free_enumeration(dev->device_info);
 
 	/* Free the device itself */
@@ -481,6 +593,10 @@ int HID_API_EXPORT hid_init(void)
 		if (libusb_init(&usb_context))
 			return -1;
 
+		hidapi_thread_state_init(&event_loop.state);
+		hidapi_thread_state_init(&event_loop.devices_state);
+		device_cache_init();
+
 		/* Set the locale if it's not set. */
 		locale = setlocale(LC_CTYPE, NULL);
 		if (!locale)
@@ -493,8 +609,13 @@ int HID_API_EXPORT hid_init(void)
 int HID_API_EXPORT hid_exit(void)
 {
 	if (usb_context) {
+		device_cache_exit();
+
 		libusb_exit(usb_context);
 		usb_context = NULL;
+
+		hidapi_thread_state_destroy(&event_loop.state);
+		hidapi_thread_state_destroy(&event_loop.devices_state);
 	}
 
 	return 0;
@@ -903,6 +1024,71 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 	}
 }
 
+/* Returns non-zero if info passes every criterion of filter. */
+static int enumerate_filter_matches(const struct hid_enumerate_filter *filter, const struct hid_device_info *info)
+{
+	if (!filter)
+		return 1;
+	if (filter->vendor_id != 0 && filter->vendor_id != info->vendor_id)
+		return 0;
+	if (filter->product_id != 0 && filter->product_id != info->product_id)
+		return 0;
+	if (filter->serial_number &&
+	    (!info->serial_number || wcscmp(filter->serial_number, info->serial_number) != 0))
+		return 0;
+	if (filter->usage_page != 0 && filter->usage_page != info->usage_page)
+		return 0;
+	if (filter->usage != 0 && filter->usage != info->usage)
+		return 0;
+	return 1;
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enumerate_filter *filter)
+{
+	/* This backend can only narrow the scan by VID/PID; the other
+	   criteria are applied to the result. */
+	struct hid_device_info *root = hid_enumerate(filter ? filter->vendor_id : 0, filter ? filter->product_id : 0);
+	struct hid_device_info **link = &root;
+
+	while (*link) {
+		struct hid_device_info *d = *link;
+		if (enumerate_filter_matches(filter, d)) {
+			link = &d->next;
+		}
+		else {
+			*link = d->next;
+			d->next = NULL;
+			hid_free_enumeration(d);
+		}
+	}
+
+	return root;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_enumerate_foreach(const struct hid_enumerate_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	struct hid_device_info *devs = hid_enumerate_ex(filter);
+	struct hid_device_info *d = devs;
+	int count = 0;
+
+	while (d) {
+		struct hid_device_info *next = d->next;
+		count++;
+
+		/* The callback sees each device on its own. */
+		d->next = NULL;
+		if (callback(d, user_data)) {
+			d->next = next;
+			break;
+		}
+		d->next = next;
+		d = next;
+	}
+
+	hid_free_enumeration(devs);
+	return count;
+}
+
 hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	struct hid_device_info *devs, *cur_dev;
@@ -945,39 +1131,35 @@ static void LIBUSB_CALL read_callback(struct libusb_transfer *transfer)
 	int res;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-
-		struct input_report *rpt = (struct input_report*) malloc(sizeof(*rpt));
-		rpt->data = (uint8_t*) malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
-
-		hidapi_thread_mutex_lock(&dev->thread_state);
-
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			hidapi_thread_cond_signal(&dev->thread_state);
+		struct input_report_queue *q = &dev->input_reports;
+		size_t head = q->head; /* Only this thread writes head */
+
+		if (head - queue_load(&q->tail) > q->mask) {
+			/* The queue is full. Drop the new report rather than
+			   growing forever if the user never reads anything
+			   from the device. */
+			__atomic_fetch_add(&q->drops, 1, __ATOMIC_RELAXED);
 		}
 		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
-
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
+			size_t slot = head & q->mask;
+			size_t len = (size_t) transfer->actual_length;
+			if (len > q->slot_size)
+				len = q->slot_size;
+			memcpy(q->data + slot * q->slot_size, transfer->buffer, len);
+			q->lens[slot] = len;
+			queue_store(&q->head, head + 1);
+
+			/* Wake a reader sleeping in hid_read_timeout(). The
+			   full barrier pairs with the one taken by the reader
+			   between setting reader_waiting and re-checking the
+			   queue, so one of the two always sees the other. */
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&q->reader_waiting, __ATOMIC_RELAXED)) {
+				hidapi_thread_mutex_lock(&dev->thread_state);
+				hidapi_thread_cond_signal(&dev->thread_state);
+				hidapi_thread_mutex_unlock(&dev->thread_state);
 			}
 		}
-		hidapi_thread_mutex_unlock(&dev->thread_state);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
 		dev->shutdown_thread = 1;
@@ -993,7 +1175,7 @@ static void LIBUSB_CALL read_callback(struct libusb_transfer *transfer)
 	}
 
 	if (dev->shutdown_thread) {
-		dev->transfer_loop_finished = 1;
+		stop_transfer_loop(dev);
 		return;
 	}
 
@@ -1001,86 +1183,152 @@ static void LIBUSB_CALL read_callback(struct libusb_transfer *transfer)
 	res = libusb_submit_transfer(transfer);
 	if (res != 0) {
 		LOG("Unable to submit URB: (%d) %s\n", res, libusb_error_name(res));
-		dev->shutdown_thread = 1;
-		dev->transfer_loop_finished = 1;
+		stop_transfer_loop(dev);
 	}
 }
 
-
-static void *read_thread(void *param)
+/* Marks the device's transfer loop as finished and wakes any threads
+   which are waiting on data (in hid_read_timeout()). The broadcast is done
+   under the mutex to make sure that a thread which is about to go to sleep
+   waiting on the condition actually will go to sleep before the condition
+   is signaled. */
+static void stop_transfer_loop(hid_device *dev)
 {
-	int res;
-	hid_device *dev = param;
-	uint8_t *buf;
-	const size_t length = dev->input_ep_max_packet_size;
+	hidapi_thread_mutex_lock(&dev->thread_state);
+	dev->shutdown_thread = 1;
+	hidapi_thread_cond_broadcast(&dev->thread_state);
+	hidapi_thread_mutex_unlock(&dev->thread_state);
 
-	/* Set up the transfer object. */
-	buf = (uint8_t*) malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
+	/* This must be the last access to dev: hid_close() may free it as
+	   soon as it sees the transfer loop has finished. */
+	__atomic_store_n(&dev->transfer_loop_finished, 1, __ATOMIC_RELEASE);
+}
 
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	res = libusb_submit_transfer(dev->transfer);
-	if(res < 0) {
-                LOG("libusb_submit_transfer failed: %d %s. Stopping read_thread from running\n", res, libusb_error_name(res));
-                dev->shutdown_thread = 1;
-                dev->transfer_loop_finished = 1;
-	}
 
-	/* Notify the main thread that the read thread is up and running. */
-	hidapi_thread_barrier_wait(&dev->thread_state);
+static void *event_thread(void *param)
+{
+	(void)param;
 
-	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
-		res = libusb_handle_events(usb_context);
+	/* Handle events for all open devices until the last one is closed.
+	   event_loop.shutdown is passed as the completion flag, so libusb
+	   re-checks it under its own locks before going back to sleep. */
+	while (!__atomic_load_n(&event_loop.shutdown, __ATOMIC_ACQUIRE)) {
+		int res;
+#if LIBUSB_API_VERSION >= 0x01000105
+		res = libusb_handle_events_completed(usb_context, &event_loop.shutdown);
+#else
+		/* No libusb_interrupt_event_handler(); poll the flag instead. */
+		struct timeval tv = { 0, 100000 };
+		res = libusb_handle_events_timeout_completed(usb_context, &tv, &event_loop.shutdown);
+#endif
 		if (res < 0) {
 			/* There was an error. */
-			LOG("read_thread(): (%d) %s\n", res, libusb_error_name(res));
+			LOG("event_thread(): (%d) %s\n", res, libusb_error_name(res));
 
 			/* Break out of this loop only on fatal error.*/
 			if (res != LIBUSB_ERROR_BUSY &&
 			    res != LIBUSB_ERROR_TIMEOUT &&
 			    res != LIBUSB_ERROR_OVERFLOW &&
 			    res != LIBUSB_ERROR_INTERRUPTED) {
-				dev->shutdown_thread = 1;
+				event_loop_fail();
 				break;
 			}
 		}
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
+	return NULL;
+}
 
-	while (!dev->transfer_loop_finished)
-		libusb_handle_events_completed(usb_context, &dev->transfer_loop_finished);
+/* Called by an event thread stopping on a fatal error. Stops the other
+   threads and fails every open device, as if it had been unplugged, so
+   readers get -1 instead of waiting for reports that will never be
+   handled. The threads are started again by the next open. */
+static void event_loop_fail(void)
+{
+	hid_device *dev;
 
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition actually will go to sleep before the condition is
-	   signaled. */
-	hidapi_thread_mutex_lock(&dev->thread_state);
-	hidapi_thread_cond_broadcast(&dev->thread_state);
-	hidapi_thread_mutex_unlock(&dev->thread_state);
+	__atomic_store_n(&event_loop.failed, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&event_loop.shutdown, 1, __ATOMIC_RELEASE);
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(usb_context);
+#endif
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to hidapi_thread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+	hidapi_thread_mutex_lock(&event_loop.devices_state);
+	for (dev = event_loop.devices; dev; dev = dev->next_open) {
+		hidapi_thread_mutex_lock(&dev->thread_state);
+		dev->shutdown_thread = 1;
+		hidapi_thread_cond_broadcast(&dev->thread_state);
+		hidapi_thread_mutex_unlock(&dev->thread_state);
+	}
+	hidapi_thread_mutex_unlock(&event_loop.devices_state);
+}
 
-	return NULL;
+/* Joins and frees the event threads, event_loop.state held. */
+static void event_loop_stop_threads(void)
+{
+	int i;
+	__atomic_store_n(&event_loop.shutdown, 1, __ATOMIC_RELEASE);
+#if LIBUSB_API_VERSION >= 0x01000105
+	libusb_interrupt_event_handler(usb_context);
+#endif
+	for (i = 0; i < event_loop.num_threads; i++) {
+		hidapi_thread_join(&event_loop.threads[i]);
+		hidapi_thread_state_destroy(&event_loop.threads[i]);
+	}
+	free(event_loop.threads);
+	event_loop.threads = NULL;
+	event_loop.num_threads = 0;
+}
+
+/* Registers an open device with the shared event loop, starting the event
+   threads if this is the first one, or if they stopped on an error. */
+static void event_loop_acquire(hid_device *dev)
+{
+	hidapi_thread_mutex_lock(&event_loop.devices_state);
+	dev->next_open = event_loop.devices;
+	event_loop.devices = dev;
+	hidapi_thread_mutex_unlock(&event_loop.devices_state);
+
+	hidapi_thread_mutex_lock(&event_loop.state);
+	if (event_loop.open_devices > 0 &&
+	    __atomic_load_n(&event_loop.failed, __ATOMIC_ACQUIRE)) {
+		LOG("event_loop_acquire(): restarting event threads\n");
+		event_loop_stop_threads();
+	}
+	if (event_loop.open_devices++ == 0 || event_loop.num_threads == 0) {
+		int i;
+		event_loop.shutdown = 0;
+		event_loop.failed = 0;
+		event_loop.threads = (hidapi_thread_state*) calloc(event_loop_num_threads, sizeof(hidapi_thread_state));
+		event_loop.num_threads = event_loop.threads ? event_loop_num_threads : 0;
+		for (i = 0; i < event_loop.num_threads; i++) {
+			hidapi_thread_state_init(&event_loop.threads[i]);
+			hidapi_thread_create(&event_loop.threads[i], event_thread, NULL);
+		}
+	}
+	hidapi_thread_mutex_unlock(&event_loop.state);
+}
+
+/* Unregisters a closed device, stopping the event threads if it was the
+   last one. */
+static void event_loop_release(hid_device *dev)
+{
+	hid_device **p;
+
+	hidapi_thread_mutex_lock(&event_loop.devices_state);
+	for (p = &event_loop.devices; *p; p = &(*p)->next_open) {
+		if (*p == dev) {
+			*p = dev->next_open;
+			break;
+		}
+	}
+	hidapi_thread_mutex_unlock(&event_loop.devices_state);
+
+	hidapi_thread_mutex_lock(&event_loop.state);
+	if (--event_loop.open_devices == 0) {
+		event_loop_stop_threads();
+	}
+	hidapi_thread_mutex_unlock(&event_loop.state);
 }
 
 static void init_xbox360(libusb_device_handle *device_handle, unsigned short idVendor, unsigned short idProduct, const struct libusb_config_descriptor *conf_desc)
@@ -1241,66 +1489,132 @@ static int hidapi_initialize_device(hid_device *dev, const struct libusb_interfa
 		}
 	}
 
-	hidapi_thread_create(&dev->thread_state, read_thread, dev);
+	if (input_report_queue_init(&dev->input_reports, dev->input_ep_max_packet_size) < 0) {
+		LOG("can't allocate the input report queue\n");
+		libusb_release_interface(dev->device_handle, intf_desc->bInterfaceNumber);
+#ifdef DETACH_KERNEL_DRIVER
+		if (dev->is_driver_detached) {
+			res = libusb_attach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
+			if (res < 0)
+				LOG("Failed to reattach the driver to kernel: (%d) %s\n", res, libusb_error_name(res));
+		}
+#endif
+		return 0;
+	}
+
+	/* Set up the transfer object. */
+	dev->transfer = libusb_alloc_transfer(0);
+	libusb_fill_interrupt_transfer(dev->transfer,
+		dev->device_handle,
+		dev->input_endpoint,
+		(uint8_t*) malloc(dev->input_ep_max_packet_size),
+		dev->input_ep_max_packet_size,
+		read_callback,
+		dev,
+		5000/*timeout*/);
+
+	/* Make the first submission. Further submissions are made
+	   from inside read_callback(), on one of the event loop threads. */
+	res = libusb_submit_transfer(dev->transfer);
+	if (res < 0) {
+		LOG("libusb_submit_transfer failed: %d %s. Not reading input reports\n", res, libusb_error_name(res));
+		dev->shutdown_thread = 1;
+		dev->transfer_loop_finished = 1;
+	}
 
-	/* Wait here for the read thread to be initialized. */
-	hidapi_thread_barrier_wait(&dev->thread_state);
+	event_loop_acquire(dev);
 	return 1;
 }
 
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+static size_t device_cache_hash(const char *path)
 {
-	hid_device *dev = NULL;
+	size_t h = 5381;
+	while (*path)
+		h = h * 33 + (unsigned char) *path++;
+	return h;
+}
 
+static void device_cache_clear(void)
+{
+	size_t i;
+	for (i = 0; i < device_cache.count; i++)
+		libusb_unref_device(device_cache.entries[i].device);
+	free(device_cache.entries);
+	free(device_cache.buckets);
+	device_cache.entries = NULL;
+	device_cache.buckets = NULL;
+	device_cache.count = 0;
+	device_cache.mask = 0;
+}
+
+/* Returns the entry for path, or NULL. Called with the mutex locked. */
+static struct device_cache_entry *device_cache_find(const char *path)
+{
+	struct device_cache_entry *e;
+	if (!device_cache.buckets)
+		return NULL;
+	for (e = device_cache.buckets[device_cache_hash(path) & device_cache.mask]; e; e = e->next) {
+		if (!strcmp(e->path, path))
+			return e;
+	}
+	return NULL;
+}
+
+/* Scans the bus and records every HID interface hid_enumerate() would
+   list. Called with the mutex locked. */
+static void device_cache_rebuild(void)
+{
 	libusb_device **devs = NULL;
-	libusb_device *usb_dev = NULL;
-	int res = 0;
+	libusb_device *usb_dev;
+	ssize_t num_devs;
+	size_t capacity = 0;
+	size_t i;
 	int d = 0;
-	int good_open = 0;
 
-	if(hid_init() < 0)
-		return NULL;
+	device_cache_clear();
 
-	dev = new_hid_device();
+	/* Mark valid before scanning, so a hotplug event that arrives
+	   during the scan invalidates the result. */
+	__atomic_store_n(&device_cache.valid, device_cache.hotplug, __ATOMIC_SEQ_CST);
+
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	if (num_devs < 0)
+		return;
 
-	libusb_get_device_list(usb_context, &devs);
-	while ((usb_dev = devs[d++]) != NULL && !good_open) {
+	while ((usb_dev = devs[d++]) != NULL) {
 		struct libusb_device_descriptor desc;
 		struct libusb_config_descriptor *conf_desc = NULL;
-		int j,k;
+		int j, k;
 
-		res = libusb_get_device_descriptor(usb_dev, &desc);
-		if (res < 0)
+		if (libusb_get_device_descriptor(usb_dev, &desc) < 0)
 			continue;
 
-		res = libusb_get_active_config_descriptor(usb_dev, &conf_desc);
-		if (res < 0)
+		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
 			libusb_get_config_descriptor(usb_dev, 0, &conf_desc);
 		if (!conf_desc)
 			continue;
 
-		for (j = 0; j < conf_desc->bNumInterfaces && !good_open; j++) {
+		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
 			const struct libusb_interface *intf = &conf_desc->interface[j];
-			for (k = 0; k < intf->num_altsetting && !good_open; k++) {
+			for (k = 0; k < intf->num_altsetting; k++) {
 				const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
-				if (should_enumerate_interface(desc.idVendor, intf_desc)) {
-					char dev_path[64];
-					get_path(&dev_path, usb_dev, conf_desc->bConfigurationValue, intf_desc->bInterfaceNumber);
-					if (!strcmp(dev_path, path)) {
-						/* Matched Paths. Open this device */
-
-						/* OPEN HERE */
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							break;
-						}
-						good_open = hidapi_initialize_device(dev, intf_desc, conf_desc);
-						if (!good_open)
-							libusb_close(dev->device_handle);
-					}
+				struct device_cache_entry *e;
+				if (!should_enumerate_interface(desc.idVendor, intf_desc))
+					continue;
+
+				if (device_cache.count == capacity) {
+					size_t new_capacity = capacity ? capacity * 2 : 16;
+					e = (struct device_cache_entry*) realloc(device_cache.entries, new_capacity * sizeof(*e));
+					if (!e)
+						break;
+					device_cache.entries = e;
+					capacity = new_capacity;
 				}
+				e = &device_cache.entries[device_cache.count++];
+				get_path(&e->path, usb_dev, conf_desc->bConfigurationValue, intf_desc->bInterfaceNumber);
+				e->device = libusb_ref_device(usb_dev);
+				e->interface_num = intf_desc->bInterfaceNumber;
 			}
 		}
 		libusb_free_config_descriptor(conf_desc);
@@ -1308,6 +1622,169 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 
 	libusb_free_device_list(devs, 1);
 
+	/* Index the entries now that they no longer move. The first
+	   altsetting of an interface wins, as in the old bus walk. */
+	i = 1;
+	while (i < device_cache.count * 2)
+		i <<= 1;
+	device_cache.buckets = (struct device_cache_entry**) calloc(i, sizeof(*device_cache.buckets));
+	if (!device_cache.buckets) {
+		device_cache_clear();
+		return;
+	}
+	device_cache.mask = i - 1;
+	for (i = 0; i < device_cache.count; i++) {
+		struct device_cache_entry *e = &device_cache.entries[i];
+		size_t b = device_cache_hash(e->path) & device_cache.mask;
+		if (device_cache_find(e->path))
+			continue;
+		e->next = device_cache.buckets[b];
+		device_cache.buckets[b] = e;
+	}
+}
+
+/* Returns a referenced libusb_device for path and its interface number,
+   or NULL. A valid cache is trusted unless rescan is set; otherwise the
+   bus is scanned first. On a cache miss the bus is scanned once more, in
+   case the device arrived after the last scan. */
+static libusb_device *device_cache_lookup(const char *path, int rescan, int *interface_num)
+{
+	struct device_cache_entry *e;
+	libusb_device *usb_dev = NULL;
+	int scanned = 0;
+
+	hidapi_thread_mutex_lock(&device_cache.state);
+	if (rescan || !__atomic_load_n(&device_cache.valid, __ATOMIC_SEQ_CST)) {
+		device_cache_rebuild();
+		scanned = 1;
+	}
+	e = device_cache_find(path);
+	if (!e && !scanned) {
+		device_cache_rebuild();
+		e = device_cache_find(path);
+	}
+	if (e) {
+		usb_dev = libusb_ref_device(e->device);
+		*interface_num = e->interface_num;
+	}
+	hidapi_thread_mutex_unlock(&device_cache.state);
+
+	return usb_dev;
+}
+
+#if LIBUSB_API_VERSION >= 0x01000102
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	(void)ctx;
+	(void)device;
+	(void)event;
+	(void)user_data;
+
+	__atomic_store_n(&device_cache.valid, 0, __ATOMIC_SEQ_CST);
+	return 0; /* Stay registered */
+}
+#endif
+
+static void device_cache_init(void)
+{
+	hidapi_thread_state_init(&device_cache.state);
+	device_cache.valid = 0;
+	device_cache.hotplug = 0;
+
+#if LIBUSB_API_VERSION >= 0x01000102
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+	    libusb_hotplug_register_callback(usb_context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_callback, NULL, &device_cache.hotplug_handle) == LIBUSB_SUCCESS) {
+		device_cache.hotplug = 1;
+	}
+#endif
+}
+
+static void device_cache_exit(void)
+{
+#if LIBUSB_API_VERSION >= 0x01000102
+	if (device_cache.hotplug)
+		libusb_hotplug_deregister_callback(usb_context, device_cache.hotplug_handle);
+#endif
+	device_cache_clear();
+	hidapi_thread_state_destroy(&device_cache.state);
+}
+
+/* Opens the HID interface interface_num of usb_dev into dev. */
+static int open_device_interface(hid_device *dev, libusb_device *usb_dev, int interface_num)
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int good_open = 0;
+	int res;
+	int j, k;
+
+	res = libusb_get_device_descriptor(usb_dev, &desc);
+	if (res < 0)
+		return 0;
+
+	res = libusb_get_active_config_descriptor(usb_dev, &conf_desc);
+	if (res < 0)
+		libusb_get_config_descriptor(usb_dev, 0, &conf_desc);
+	if (!conf_desc)
+		return 0;
+
+	for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting; k++) {
+			const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
+			if (intf_desc->bInterfaceNumber == interface_num &&
+			    should_enumerate_interface(desc.idVendor, intf_desc)) {
+				/* OPEN HERE */
+				res = libusb_open(usb_dev, &dev->device_handle);
+				if (res < 0) {
+					LOG("can't open device\n");
+					goto out;
+				}
+				good_open = hidapi_initialize_device(dev, intf_desc, conf_desc);
+				if (!good_open)
+					libusb_close(dev->device_handle);
+				goto out;
+			}
+		}
+	}
+
+out:
+	libusb_free_config_descriptor(conf_desc);
+	return good_open;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	hid_device *dev = NULL;
+
+	libusb_device *usb_dev = NULL;
+	struct timeval zero_tv = { 0, 0 };
+	int interface_num = 0;
+	int good_open = 0;
+	int attempt;
+
+	if(hid_init() < 0)
+		return NULL;
+
+	dev = new_hid_device();
+
+	/* Deliver any pending hotplug events, so the path cache is current
+	   even if no event loop thread is running. */
+	libusb_handle_events_timeout_completed(usb_context, &zero_tv, NULL);
+
+	/* If a cached device can't be opened it may have been replaced
+	   since the last scan; rescan and try once more. */
+	for (attempt = 0; attempt < 2 && !good_open; attempt++) {
+		usb_dev = device_cache_lookup(path, attempt > 0, &interface_num);
+		if (!usb_dev)
+			break;
+		good_open = open_device_interface(dev, usb_dev, interface_num);
+		libusb_unref_device(usb_dev);
+	}
+
 	/* If we have a good handle, return it. */
 	if (good_open) {
 		return dev;
@@ -1393,6 +1870,21 @@ err:
 	return NULL;
 }
 
+void HID_API_EXPORT_CALL hid_libusb_set_input_report_queue_depth(size_t depth)
+{
+	input_report_queue_depth = depth ? depth : INPUT_REPORT_QUEUE_DEPTH_DEFAULT;
+}
+
+size_t HID_API_EXPORT_CALL hid_libusb_get_input_report_drops(hid_device *dev)
+{
+	return __atomic_load_n(&dev->input_reports.drops, __ATOMIC_RELAXED);
+}
+
+void HID_API_EXPORT_CALL hid_libusb_set_event_threads(int num_threads)
+{
+	event_loop_num_threads = num_threads > 0 ? num_threads : 1;
+}
+
 
 int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
 {
@@ -1451,21 +1943,31 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 }
 
 /* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
+   This should only be called when a report is queued. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
-	size_t len = (length < rpt->len)? length: rpt->len;
+	/* Copy the data out of the oldest slot into the return buffer
+	   (data), and hand the slot back to read_callback(). */
+	struct input_report_queue *q = &dev->input_reports;
+	size_t tail = q->tail; /* Only the reader writes tail */
+	size_t slot = tail & q->mask;
+	size_t len = (length < q->lens[slot])? length: q->lens[slot];
 	if (len > 0)
-		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+		memcpy(data, q->data + slot * q->slot_size, len);
+	queue_store(&q->tail, tail + 1);
 	return len;
 }
 
+/* Marks the calling reader as about to sleep on the condition, then
+   re-checks the queue. Called with the mutex locked. Returns non-zero if a
+   report is queued or the read thread has stopped. */
+static int reader_should_wake(hid_device *dev)
+{
+	__atomic_store_n(&dev->input_reports.reader_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return input_report_queue_pending(&dev->input_reports) || dev->shutdown_thread;
+}
+
 static void cleanup_mutex(void *param)
 {
 	hid_device *dev = param;
@@ -1485,14 +1987,18 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	/* error: variable ‘bytes_read’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered] */
 	int bytes_read; /* = -1; */
 
+	/* There's an input report queued up. Return it without taking the
+	   mutex; read_callback() never touches a slot until we release it. */
+	if (input_report_queue_pending(&dev->input_reports))
+		return return_data(dev, data, length);
+
 	hidapi_thread_mutex_lock(&dev->thread_state);
 	hidapi_thread_cleanup_push(cleanup_mutex, dev);
 
 	bytes_read = -1;
 
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
+	/* A report may have arrived in the meantime. */
+	if (input_report_queue_pending(&dev->input_reports)) {
 		bytes_read = return_data(dev, data, length);
 		goto ret;
 	}
@@ -1506,10 +2012,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!reader_should_wake(dev)) {
 			hidapi_thread_cond_wait(&dev->thread_state);
 		}
-		if (dev->input_reports) {
+		if (input_report_queue_pending(&dev->input_reports)) {
 			bytes_read = return_data(dev, data, length);
 		}
 	}
@@ -1520,10 +2026,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 		hidapi_thread_gettime(&ts);
 		hidapi_thread_addtime(&ts, milliseconds);
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!reader_should_wake(dev)) {
 			res = hidapi_thread_cond_timedwait(&dev->thread_state, &ts);
 			if (res == 0) {
-				if (dev->input_reports) {
+				if (input_report_queue_pending(&dev->input_reports)) {
 					bytes_read = return_data(dev, data, length);
 					break;
 				}
@@ -1550,6 +2056,7 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	}
 
 ret:
+	__atomic_store_n(&dev->input_reports.reader_waiting, 0, __ATOMIC_RELAXED);
 	hidapi_thread_mutex_unlock(&dev->thread_state);
 	hidapi_thread_cleanup_pop(0);
 
@@ -1659,19 +2166,145 @@ int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned c
 	return res;
 }
 
+/* An asynchronous feature report. The control transfer's buffer (setup
+   packet followed by the report data) is allocated right after it. */
+struct feature_report_request {
+	hid_device *dev;
+	unsigned char *data;
+	int skipped_report_id;
+	hid_feature_report_callback callback;
+	void *user_data;
+};
+
+static void LIBUSB_CALL feature_report_callback(struct libusb_transfer *transfer)
+{
+	struct feature_report_request *req = transfer->user_data;
+	hid_device *dev = req->dev;
+	int res = -1;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		const struct libusb_control_setup *setup = libusb_control_transfer_get_setup(transfer);
+		if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
+			/* Copy the report back, leaving the Report ID in place
+			   if it was not sent on the wire. */
+			memcpy(req->data + req->skipped_report_id,
+			       libusb_control_transfer_get_data(transfer),
+			       transfer->actual_length);
+			res = transfer->actual_length;
+		}
+		else {
+			/* Like hid_send_feature_report(), report the whole
+			   requested length. */
+			res = libusb_le16_to_cpu(setup->wLength);
+		}
+		if (req->skipped_report_id)
+			res++;
+	}
+	else {
+		LOG("feature report transfer failed: %d\n", transfer->status);
+	}
+
+	req->callback(dev, req->data, res, req->user_data);
+
+	libusb_free_transfer(transfer);
+	free(req);
+
+	/* This must be the last access to dev: hid_close() may free it as
+	   soon as no reports are pending. */
+	__atomic_fetch_sub(&dev->pending_feature_reports, 1, __ATOMIC_RELEASE);
+}
+
+static int submit_feature_report(hid_device *dev, unsigned char *data, size_t length, int in, hid_feature_report_callback callback, void *user_data)
+{
+	struct feature_report_request *req;
+	struct libusb_transfer *transfer;
+	unsigned char *buf;
+	int skipped_report_id = 0;
+	int report_number = data[0];
+	int res;
+
+	if (report_number == 0x0) {
+		/* Offset the buffer by 1, so that the report ID
+		   will remain in byte 0. */
+		length--;
+		skipped_report_id = 1;
+	}
+
+	req = (struct feature_report_request*) malloc(sizeof(*req) + LIBUSB_CONTROL_SETUP_SIZE + length);
+	transfer = libusb_alloc_transfer(0);
+	if (!req || !transfer) {
+		free(req);
+		libusb_free_transfer(transfer);
+		return -1;
+	}
+	req->dev = dev;
+	req->data = data;
+	req->skipped_report_id = skipped_report_id;
+	req->callback = callback;
+	req->user_data = user_data;
+
+	buf = (unsigned char*) (req + 1);
+	libusb_fill_control_setup(buf,
+		LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|(in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT),
+		in ? 0x01/*HID get_report*/ : 0x09/*HID set_report*/,
+		(3/*HID feature*/ << 8) | report_number,
+		dev->interface,
+		length);
+	if (!in)
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data + skipped_report_id, length);
+
+	libusb_fill_control_transfer(transfer, dev->device_handle, buf,
+		feature_report_callback, req, 1000/*timeout millis*/);
+
+	__atomic_fetch_add(&dev->pending_feature_reports, 1, __ATOMIC_RELAXED);
+	res = libusb_submit_transfer(transfer);
+	if (res < 0) {
+		LOG("libusb_submit_transfer failed: %d %s\n", res, libusb_error_name(res));
+		__atomic_fetch_sub(&dev->pending_feature_reports, 1, __ATOMIC_RELAXED);
+		libusb_free_transfer(transfer);
+		free(req);
+		return -1;
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_send_feature_report_async(hid_device *dev, const unsigned char *data, size_t length, hid_feature_report_callback callback, void *user_data)
+{
+	return submit_feature_report(dev, (unsigned char *)data, length, 0, callback, user_data);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_feature_report_async(hid_device *dev, unsigned char *data, size_t length, hid_feature_report_callback callback, void *user_data)
+{
+	return submit_feature_report(dev, data, length, 1, callback, user_data);
+}
+
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
+	/* Let asynchronous feature reports complete. They are handled by the
+	   event loop threads, or by this thread while it waits. */
+	while (__atomic_load_n(&dev->pending_feature_reports, __ATOMIC_ACQUIRE)) {
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+	}
+
+	/* Stop the transfer loop and wait for read_callback() to see it.
+	   The cancel is repeated in case read_callback() was re-submitting
+	   the transfer while it was first issued; the call fails if no
+	   transfer is pending, but that's OK. */
 	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
+	while (!__atomic_load_n(&dev->transfer_loop_finished, __ATOMIC_ACQUIRE)) {
+		struct timeval tv = { 0, 100000 };
+		libusb_cancel_transfer(dev->transfer);
+		libusb_handle_events_timeout_completed(usb_context, &tv, &dev->transfer_loop_finished);
+	}
 
-	/* Wait for read_thread() to end. */
-	hidapi_thread_join(&dev->thread_state);
+	event_loop_release(dev);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
+	/* Clean up the Transfer objects allocated in hidapi_initialize_device(). */
 	free(dev->transfer->buffer);
 	dev->transfer->buffer = NULL;
 	libusb_free_transfer(dev->transfer);
@@ -1691,13 +2324,7 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	hidapi_thread_mutex_lock(&dev->thread_state);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	hidapi_thread_mutex_unlock(&dev->thread_state);
-
+	/* The queue of received reports is freed with the device. */
 	free_hid_device(dev);
 }
 
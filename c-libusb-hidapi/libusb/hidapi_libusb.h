@@ -49,6 +49,47 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_libusb_wrap_sys_device(intptr_t sys_dev, int interface_num);
 
+		/** @brief Set the depth of the input report queue for devices opened after this call.
+
+			Each opened device buffers input reports received from its
+			interrupt IN endpoint in a preallocated ring of @p depth slots,
+			each slot being the endpoint's max packet size. When the ring
+			is full, newly received reports are dropped and counted (see
+			hid_libusb_get_input_report_drops()).
+
+			@ingroup API
+			@param depth Number of reports to buffer. It is rounded up to
+			a power of two. Pass 0 to restore the default (32).
+		*/
+		HID_API_EXPORT void HID_API_CALL hid_libusb_set_input_report_queue_depth(size_t depth);
+
+		/** @brief Get the number of input reports dropped because the queue was full.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+
+			@returns
+				The number of input reports dropped since the device was opened.
+		*/
+		HID_API_EXPORT size_t HID_API_CALL hid_libusb_get_input_report_drops(hid_device *dev);
+
+		/** @brief Set the number of threads handling libusb events for all open devices.
+
+			Input reports of every open device are received by a shared
+			pool of event threads, started when the first device is
+			opened and stopped when the last one is closed. The new
+			number takes effect the next time the pool is started.
+
+			libusb lets only one thread handle events at a time, so
+			more than one thread only helps when another thread may be
+			blocked inside a libusb callback.
+
+			@ingroup API
+			@param num_threads Number of event threads. Values below 1
+			restore the default (1).
+		*/
+		HID_API_EXPORT void HID_API_CALL hid_libusb_set_event_threads(int num_threads);
+
 #ifdef __cplusplus
 }
 #endif
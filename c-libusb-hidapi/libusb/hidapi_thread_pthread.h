@@ -90,7 +90,7 @@ typedef struct timespec hidapi_timespec;
 typedef struct
 {
 	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	pthread_mutex_t mutex; /* Guards sleeping on condition for input_reports */
 	pthread_cond_t condition;
 	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 
@@ -35,6 +35,7 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
 
 /* Linux */
 #include <linux/hidraw.h>
@@ -68,11 +69,55 @@
 #define HIDIOCGINPUT(len)    _IOC(_IOC_WRITE|_IOC_READ, 'H', 0x0A, len)
 #endif
 
+/* Number of threads running asynchronous feature reports. */
+#ifndef HIDRAW_WORKER_THREADS
+#define HIDRAW_WORKER_THREADS 4
+#endif
+
+/* An asynchronous feature report, queued on its device. */
+struct feature_report_request {
+	struct feature_report_request *next;
+	unsigned char *data;
+	size_t length;
+	int in;
+	hid_feature_report_callback callback;
+	void *user_data;
+};
+
 struct hid_device_ {
 	int device_handle;
 	int blocking;
 	wchar_t *last_error_str;
 	struct hid_device_info* device_info;
+
+	/* Asynchronous feature reports, guarded by worker_pool.mutex */
+	struct feature_report_request *requests;
+	struct feature_report_request *requests_tail;
+	int requests_pending; /* queued or running */
+	int scheduled; /* on the run queue or being served by a worker */
+	int close_pending; /* hid_close() was called from a completion callback */
+	hid_device *next_scheduled;
+};
+
+/* Threads running the blocking feature report ioctls for
+   hid_send_feature_report_async() and hid_get_feature_report_async().
+   Devices with queued reports wait on a run queue. A worker runs one
+   report of a device at a time, so each device's reports complete in
+   order while different devices are served in parallel. The threads are
+   started by the first asynchronous report and stopped by hid_exit(). */
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t work; /* run queue not empty, or shutdown */
+	pthread_cond_t idle; /* a device has no pending reports */
+	pthread_t threads[HIDRAW_WORKER_THREADS];
+	int num_threads;
+	int shutdown;
+	hid_device *run_head;
+	hid_device *run_tail;
+} worker_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
 };
 
 static struct hid_api_version api_version = {
@@ -83,6 +128,12 @@ static struct hid_api_version api_version = {
 
 static wchar_t *last_global_error_str = NULL;
 
+/* udev context used by hid_enumerate(), kept until hid_exit() */
+static struct udev *enumerate_udev = NULL;
+static pthread_mutex_t enumerate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void stop_worker_pool(void);
+
 
 static hid_device *new_hid_device(void)
 {
@@ -570,7 +621,24 @@ next_line:
 }
 
 
-static struct hid_device_info * create_device_info_for_device(struct udev_device *raw_dev)
+/* Returns non-zero if the usage pair passes the filter's usage criteria. */
+static int usage_matches(const struct hid_enumerate_filter *filter, unsigned short page, unsigned short usage)
+{
+	if (!filter)
+		return 1;
+	if (filter->usage_page != 0 && filter->usage_page != page)
+		return 0;
+	if (filter->usage != 0 && filter->usage != usage)
+		return 0;
+	return 1;
+}
+
+/* Builds the records for one hidraw node: one per usage pair in its report
+   descriptor. If filter is set, nodes failing its serial number or usage
+   criteria are rejected before any string is converted, and records for
+   non-matching usage pairs are left out. serial_utf8 is the filter's
+   serial number, already converted. */
+static struct hid_device_info * create_device_info_for_device(struct udev_device *raw_dev, const struct hid_enumerate_filter *filter, const char *serial_utf8)
 {
 	struct hid_device_info *root = NULL;
 	struct hid_device_info *cur_dev = NULL;
@@ -587,6 +655,7 @@ static struct hid_device_info * create_device_info_for_device(struct udev_device
 	char *product_name_utf8 = NULL;
 	unsigned bus_type;
 	int result;
+	int has_report_desc;
 	struct hidraw_report_descriptor report_desc;
 
 	sysfs_path = udev_device_get_syspath(raw_dev);
@@ -627,6 +696,24 @@ static struct hid_device_info * create_device_info_for_device(struct udev_device
 			goto end;
 	}
 
+	if (serial_utf8 && strcmp(serial_utf8, serial_number_utf8) != 0)
+		goto end;
+
+	has_report_desc = get_hid_report_descriptor_from_sysfs(sysfs_path, &report_desc) >= 0;
+
+	if (filter && (filter->usage_page != 0 || filter->usage != 0)) {
+		/* Skip the node unless one of its usage pairs matches. */
+		unsigned short page = 0, usage = 0;
+		unsigned int pos = 0;
+		int found = 0;
+		while (has_report_desc && !found &&
+		       !get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
+			found = usage_matches(filter, page, usage);
+		}
+		if (!found)
+			goto end;
+	}
+
 	/* Create the record. */
 	root = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
 	if (!root)
@@ -724,8 +811,7 @@ static struct hid_device_info * create_device_info_for_device(struct udev_device
 	}
 
 	/* Usage Page and Usage */
-	result = get_hid_report_descriptor_from_sysfs(sysfs_path, &report_desc);
-	if (result >= 0) {
+	if (has_report_desc) {
 		unsigned short page = 0, usage = 0;
 		unsigned int pos = 0;
 		/*
@@ -766,6 +852,22 @@ static struct hid_device_info * create_device_info_for_device(struct udev_device
 		}
 	}
 
+	if (filter && (filter->usage_page != 0 || filter->usage != 0)) {
+		/* Drop the records of usage pairs that don't match. */
+		struct hid_device_info **link = &root;
+		while (*link) {
+			struct hid_device_info *d = *link;
+			if (usage_matches(filter, d->usage_page, d->usage)) {
+				link = &d->next;
+			}
+			else {
+				*link = d->next;
+				d->next = NULL;
+				hid_free_enumeration(d);
+			}
+		}
+	}
+
 end:
 	free(serial_number_utf8);
 	free(product_name_utf8);
@@ -799,7 +901,7 @@ static struct hid_device_info * create_device_info_for_hid_device(hid_device *de
 	/* Open a udev device from the dev_t. 'c' means character device. */
 	udev_dev = udev_device_new_from_devnum(udev, 'c', s.st_rdev);
 	if (udev_dev) {
-		root = create_device_info_for_device(udev_dev);
+		root = create_device_info_for_device(udev_dev, NULL, NULL);
 	}
 
 	if (!root) {
@@ -840,37 +942,69 @@ int HID_API_EXPORT hid_init(void)
 
 int HID_API_EXPORT hid_exit(void)
 {
+	stop_worker_pool();
+
+	pthread_mutex_lock(&enumerate_mutex);
+	if (enumerate_udev) {
+		udev_unref(enumerate_udev);
+		enumerate_udev = NULL;
+	}
+	pthread_mutex_unlock(&enumerate_mutex);
+
 	/* Free global error message */
 	register_global_error(NULL);
 
 	return 0;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Walks the hidraw nodes and appends the records of each node matching
+   filter to *root. Returns the number of records found, or -1 on error. */
+static int enumerate_devices(const struct hid_enumerate_filter *filter, struct hid_device_info **root)
 {
-	struct udev *udev;
 	struct udev_enumerate *enumerate;
 	struct udev_list_entry *devices, *dev_list_entry;
 
-	struct hid_device_info *root = NULL; /* return object */
 	struct hid_device_info *cur_dev = NULL;
+	char *serial_utf8 = NULL;
+	int count = 0;
 
 	hid_init();
 	/* register_global_error: global error is reset by hid_init */
 
-	/* Create the udev object */
-	udev = udev_new();
-	if (!udev) {
+	if (filter && filter->serial_number) {
+		/* Convert the serial number once, so that it can be compared
+		   before any of the devices' strings are converted. */
+		size_t len = wcstombs(NULL, filter->serial_number, 0);
+		if (len == (size_t)-1) {
+			register_global_error("Couldn't convert serial number filter");
+			return -1;
+		}
+		serial_utf8 = (char*) malloc(len + 1);
+		if (!serial_utf8) {
+			register_global_error("Couldn't allocate memory");
+			return -1;
+		}
+		wcstombs(serial_utf8, filter->serial_number, len + 1);
+	}
+
+	pthread_mutex_lock(&enumerate_mutex);
+
+	/* The udev context is kept until hid_exit() */
+	if (!enumerate_udev)
+		enumerate_udev = udev_new();
+	if (!enumerate_udev) {
+		pthread_mutex_unlock(&enumerate_mutex);
+		free(serial_utf8);
 		register_global_error("Couldn't create udev context");
-		return NULL;
+		return -1;
 	}
 
 	/* Create a list of the devices in the 'hidraw' subsystem. */
-	enumerate = udev_enumerate_new(udev);
+	enumerate = udev_enumerate_new(enumerate_udev);
 	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
 	udev_enumerate_scan_devices(enumerate);
 	devices = udev_enumerate_get_list_entry(enumerate);
-	/* For each item, see if it matches the vid/pid, and if so
+	/* For each item, see if it matches the filter, and if so
 	   create a udev_device record for it */
 	udev_list_entry_foreach(dev_list_entry, devices) {
 		const char *sysfs_path;
@@ -886,53 +1020,109 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 		if (!sysfs_path)
 			continue;
 
-		if (vendor_id != 0 || product_id != 0) {
+		if (filter && (filter->vendor_id != 0 || filter->product_id != 0)) {
 			if (!parse_hid_vid_pid_from_sysfs(sysfs_path, &bus_type, &dev_vid, &dev_pid))
 				continue;
 
-			if (vendor_id != 0 && vendor_id != dev_vid)
+			if (filter->vendor_id != 0 && filter->vendor_id != dev_vid)
 				continue;
-			if (product_id != 0 && product_id != dev_pid)
+			if (filter->product_id != 0 && filter->product_id != dev_pid)
 				continue;
 		}
 
-		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
+		raw_dev = udev_device_new_from_syspath(enumerate_udev, sysfs_path);
 		if (!raw_dev)
 			continue;
 
-		tmp = create_device_info_for_device(raw_dev);
+		tmp = create_device_info_for_device(raw_dev, filter, serial_utf8);
+		udev_device_unref(raw_dev);
+
 		if (tmp) {
 			if (cur_dev) {
 				cur_dev->next = tmp;
 			}
 			else {
-				root = tmp;
+				*root = tmp;
 			}
 			cur_dev = tmp;
+			count++;
 
 			/* move the pointer to the tail of returned list */
 			while (cur_dev->next != NULL) {
 				cur_dev = cur_dev->next;
+				count++;
 			}
 		}
-
-		udev_device_unref(raw_dev);
 	}
-	/* Free the enumerator and udev objects. */
+	/* Free the enumerator object. */
 	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
 
-	if (root == NULL) {
-		if (vendor_id == 0 && product_id == 0) {
+	pthread_mutex_unlock(&enumerate_mutex);
+	free(serial_utf8);
+
+	return count;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_enumerate_filter filter;
+
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+
+	return hid_enumerate_ex(&filter);
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enumerate_filter *filter)
+{
+	struct hid_device_info *root = NULL; /* return object */
+
+	if (enumerate_devices(filter, &root) == 0) {
+		if (!filter || (filter->vendor_id == 0 && filter->product_id == 0 &&
+		                !filter->serial_number && filter->usage_page == 0 && filter->usage == 0)) {
 			register_global_error("No HID devices found in the system.");
-		} else {
+		} else if (filter->vendor_id != 0 || filter->product_id != 0) {
 			register_global_error("No HID devices with requested VID/PID found in the system.");
+		} else {
+			register_global_error("No HID devices matching the filter found in the system.");
 		}
 	}
 
 	return root;
 }
 
+int HID_API_EXPORT HID_API_CALL hid_enumerate_foreach(const struct hid_enumerate_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	struct hid_device_info *root = NULL;
+	int count = 0;
+	int stop = 0;
+
+	if (!callback) {
+		register_global_error("No callback given");
+		return -1;
+	}
+
+	/* Same list as hid_enumerate_ex(); the callback runs after
+	   enumerate_mutex is released, so it may call hid_open() or
+	   enumerate. */
+	if (enumerate_devices(filter, &root) < 0)
+		return -1;
+
+	/* Hand over the records one at a time, then free them. */
+	while (root) {
+		struct hid_device_info *next = root->next;
+		root->next = NULL;
+		if (!stop) {
+			count++;
+			stop = callback(root, user_data);
+		}
+		hid_free_enumeration(root);
+		root = next;
+	}
+	return count;
+}
+
 void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 {
 	struct hid_device_info *d = devs;
@@ -950,11 +1140,19 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	struct hid_device_info *devs, *cur_dev;
+	struct hid_enumerate_filter filter;
 	const char *path_to_open = NULL;
 	hid_device *handle = NULL;
 
+	/* Filter on the serial number too, so the strings of other
+	   devices with the same VID/PID are never built. */
+	memset(&filter, 0, sizeof(filter));
+	filter.vendor_id = vendor_id;
+	filter.product_id = product_id;
+	filter.serial_number = serial_number;
+
 	/* register_global_error: global error is reset by hid_enumerate/hid_init */
-	devs = hid_enumerate(vendor_id, product_id);
+	devs = hid_enumerate_ex(&filter);
 	if (devs == NULL) {
 		/* register_global_error: global error is already set by hid_enumerate */
 		return NULL;
@@ -1152,11 +1350,192 @@ int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned c
 	return res;
 }
 
+/* Appends dev to the run queue. Called with worker_pool.mutex locked. */
+static void schedule_device(hid_device *dev)
+{
+	dev->next_scheduled = NULL;
+	if (worker_pool.run_tail)
+		worker_pool.run_tail->next_scheduled = dev;
+	else
+		worker_pool.run_head = dev;
+	worker_pool.run_tail = dev;
+	pthread_cond_signal(&worker_pool.work);
+}
+
+static void free_device(hid_device *dev);
+
+/* Whether the calling thread is one of the workers. Called with
+   worker_pool.mutex locked. */
+static int on_worker_thread(void)
+{
+	int i;
+	for (i = 0; i < worker_pool.num_threads; i++) {
+		if (pthread_equal(worker_pool.threads[i], pthread_self()))
+			return 1;
+	}
+	return 0;
+}
+
+static void *worker_thread(void *param)
+{
+	(void)param;
+
+	pthread_mutex_lock(&worker_pool.mutex);
+	for (;;) {
+		hid_device *dev;
+		struct feature_report_request *req;
+		int res;
+
+		while (!worker_pool.run_head && !worker_pool.shutdown)
+			pthread_cond_wait(&worker_pool.work, &worker_pool.mutex);
+		if (!worker_pool.run_head)
+			break;
+
+		/* Take the next report of the first waiting device. The device
+		   stays scheduled, so no other worker picks it up meanwhile. */
+		dev = worker_pool.run_head;
+		worker_pool.run_head = dev->next_scheduled;
+		if (!worker_pool.run_head)
+			worker_pool.run_tail = NULL;
+		req = dev->requests;
+		dev->requests = req->next;
+		if (!dev->requests)
+			dev->requests_tail = NULL;
+		pthread_mutex_unlock(&worker_pool.mutex);
+
+		if (req->in)
+			res = ioctl(dev->device_handle, HIDIOCGFEATURE(req->length), req->data);
+		else
+			res = ioctl(dev->device_handle, HIDIOCSFEATURE(req->length), req->data);
+		req->callback(dev, req->data, res, req->user_data);
+		free(req);
+
+		pthread_mutex_lock(&worker_pool.mutex);
+		dev->requests_pending--;
+		if (dev->requests) {
+			/* Go to the back of the queue, to be fair to other devices. */
+			schedule_device(dev);
+		}
+		else {
+			dev->scheduled = 0;
+			pthread_cond_broadcast(&worker_pool.idle);
+			if (dev->close_pending) {
+				/* This was the last report, finish the hid_close() */
+				pthread_mutex_unlock(&worker_pool.mutex);
+				free_device(dev);
+				pthread_mutex_lock(&worker_pool.mutex);
+			}
+		}
+	}
+	pthread_mutex_unlock(&worker_pool.mutex);
+
+	return NULL;
+}
+
+/* Called with worker_pool.mutex locked. Returns -1 if no thread could be started. */
+static int start_worker_pool(void)
+{
+	while (worker_pool.num_threads < HIDRAW_WORKER_THREADS) {
+		if (pthread_create(&worker_pool.threads[worker_pool.num_threads], NULL, worker_thread, NULL) != 0)
+			break;
+		worker_pool.num_threads++;
+	}
+	return worker_pool.num_threads > 0 ? 0 : -1;
+}
+
+static void stop_worker_pool(void)
+{
+	int i;
+
+	pthread_mutex_lock(&worker_pool.mutex);
+	worker_pool.shutdown = 1;
+	pthread_cond_broadcast(&worker_pool.work);
+	pthread_mutex_unlock(&worker_pool.mutex);
+
+	/* Workers finish all queued reports before exiting. */
+	for (i = 0; i < worker_pool.num_threads; i++)
+		pthread_join(worker_pool.threads[i], NULL);
+
+	worker_pool.num_threads = 0;
+	worker_pool.shutdown = 0;
+}
+
+static int submit_feature_report(hid_device *dev, unsigned char *data, size_t length, int in, hid_feature_report_callback callback, void *user_data)
+{
+	struct feature_report_request *req;
+
+	register_device_error(dev, NULL);
+
+	req = (struct feature_report_request*) calloc(1, sizeof(*req));
+	if (!req) {
+		register_device_error(dev, "Couldn't allocate memory");
+		return -1;
+	}
+	req->data = data;
+	req->length = length;
+	req->in = in;
+	req->callback = callback;
+	req->user_data = user_data;
+
+	pthread_mutex_lock(&worker_pool.mutex);
+	if (!worker_pool.num_threads && start_worker_pool() < 0) {
+		pthread_mutex_unlock(&worker_pool.mutex);
+		free(req);
+		register_device_error(dev, "Couldn't start worker threads");
+		return -1;
+	}
+
+	if (dev->requests_tail)
+		dev->requests_tail->next = req;
+	else
+		dev->requests = req;
+	dev->requests_tail = req;
+	dev->requests_pending++;
+
+	if (!dev->scheduled) {
+		dev->scheduled = 1;
+		schedule_device(dev);
+	}
+	pthread_mutex_unlock(&worker_pool.mutex);
+
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_send_feature_report_async(hid_device *dev, const unsigned char *data, size_t length, hid_feature_report_callback callback, void *user_data)
+{
+	return submit_feature_report(dev, (unsigned char *)data, length, 0, callback, user_data);
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_feature_report_async(hid_device *dev, unsigned char *data, size_t length, hid_feature_report_callback callback, void *user_data)
+{
+	return submit_feature_report(dev, data, length, 1, callback, user_data);
+}
+
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
 	if (!dev)
 		return;
 
+	/* Let asynchronous feature reports complete. */
+	pthread_mutex_lock(&worker_pool.mutex);
+	if (dev->requests_pending && on_worker_thread()) {
+		/* Called from a completion callback, whose report is still
+		   pending: waiting here could be waiting on this very thread.
+		   The worker finishing the device's last report closes it. */
+		dev->close_pending = 1;
+		pthread_mutex_unlock(&worker_pool.mutex);
+		return;
+	}
+	while (dev->requests_pending)
+		pthread_cond_wait(&worker_pool.idle, &worker_pool.mutex);
+	pthread_mutex_unlock(&worker_pool.mutex);
+
+	free_device(dev);
+}
+
+/* Closes and frees dev, which has no reports pending. */
+static void free_device(hid_device *dev)
+{
 	close(dev->device_handle);
 
 	/* Free the device error message */
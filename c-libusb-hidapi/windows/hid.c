@@ -877,6 +877,71 @@ void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *d
 	}
 }
 
+/* Returns non-zero if info passes every criterion of filter. */
+static int enumerate_filter_matches(const struct hid_enumerate_filter *filter, const struct hid_device_info *info)
+{
+	if (!filter)
+		return 1;
+	if (filter->vendor_id != 0 && filter->vendor_id != info->vendor_id)
+		return 0;
+	if (filter->product_id != 0 && filter->product_id != info->product_id)
+		return 0;
+	if (filter->serial_number &&
+	    (!info->serial_number || wcscmp(filter->serial_number, info->serial_number) != 0))
+		return 0;
+	if (filter->usage_page != 0 && filter->usage_page != info->usage_page)
+		return 0;
+	if (filter->usage != 0 && filter->usage != info->usage)
+		return 0;
+	return 1;
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(const struct hid_enumerate_filter *filter)
+{
+	/* This backend can only narrow the scan by VID/PID; the other
+	   criteria are applied to the result. */
+	struct hid_device_info *root = hid_enumerate(filter ? filter->vendor_id : 0, filter ? filter->product_id : 0);
+	struct hid_device_info **link = &root;
+
+	while (*link) {
+		struct hid_device_info *d = *link;
+		if (enumerate_filter_matches(filter, d)) {
+			link = &d->next;
+		}
+		else {
+			*link = d->next;
+			d->next = NULL;
+			hid_free_enumeration(d);
+		}
+	}
+
+	return root;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_enumerate_foreach(const struct hid_enumerate_filter *filter, hid_enumerate_callback callback, void *user_data)
+{
+	struct hid_device_info *devs = hid_enumerate_ex(filter);
+	struct hid_device_info *d = devs;
+	int count = 0;
+
+	while (d) {
+		struct hid_device_info *next = d->next;
+		count++;
+
+		/* The callback sees each device on its own. */
+		d->next = NULL;
+		if (callback(d, user_data)) {
+			d->next = next;
+			break;
+		}
+		d->next = next;
+		d = next;
+	}
+
+	hid_free_enumeration(devs);
+	return count;
+}
+
 HID_API_EXPORT hid_device * HID_API_CALL hid_open(unsigned short vendor_id, unsigned short product_id, const wchar_t *serial_number)
 {
 	/* TODO: Merge this functions with the Linux version. This function should be platform independent. */
@@ -1273,6 +1338,22 @@ int HID_API_EXPORT HID_API_CALL hid_get_input_report(hid_device *dev, unsigned c
 	return hid_get_report(dev, IOCTL_HID_GET_INPUT_REPORT, data, length);
 }
 
+int HID_API_EXPORT HID_API_CALL hid_send_feature_report_async(hid_device *dev, const unsigned char *data, size_t length, hid_feature_report_callback callback, void *user_data)
+{
+	/* No asynchronous feature reports on this backend yet.
+	   Complete the report before returning. */
+	int res = hid_send_feature_report(dev, data, length);
+	callback(dev, (unsigned char *)data, res, user_data);
+	return 0;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_get_feature_report_async(hid_device *dev, unsigned char *data, size_t length, hid_feature_report_callback callback, void *user_data)
+{
+	int res = hid_get_feature_report(dev, data, length);
+	callback(dev, data, res, user_data);
+	return 0;
+}
+
 void HID_API_EXPORT HID_API_CALL hid_close(hid_device *dev)
 {
 	if (!dev)
@@ -0,0 +1,878 @@
+/**
+ * blink1_core.h -- blink(1) mk3 command handling and LED state machine
+ *
+ * Everything here is independent of the EFM32 peripherals, so the same
+ * code can be built on a host (see "sim/blink1-sim.c").
+ * If you add a global here, reset it in blink1sim_reset() too.
+ *
+ * Before including, define:
+ * - nLEDs, blink1_version_major, blink1_version_minor
+ * - REPORT_ID, REPORT2_ID, REPORT_COUNT, REPORT2_COUNT (see "descriptors.h")
+ * - SL_ALIGN(), SL_ATTRIBUTE_ALIGN() (from em_common.h)
+ * - CORE_DECLARE_IRQ_STATE, CORE_ENTER_ATOMIC(), CORE_EXIT_ATOMIC() (from em_core.h)
+ * - SYSTEM_GetUnique() (from em_system.h)
+ * - dbg_printf(), dbg_str() (see "debug.h")
+ * After including, define displayLEDs() to send leds[] out.
+ *
+ * 2018, Tod E. Kurt, http://todbot.com/blog/
+ *
+ **/
+
+#ifndef BLINK1_CORE_H
+#define BLINK1_CORE_H
+
+#include <stdint.h>
+#include <stdlib.h> // rand()
+#include <stdbool.h>
+#include <string.h>
+
+#include "color_types.h"
+
+// forward decls
+void setLED(uint8_t r, uint8_t g, uint8_t b, uint8_t n);
+static inline void displayLEDs(void);
+static void off();
+#define setLEDsAll(r,g,b) { setLED(r,g,b, 255); } // 255 means all
+
+
+// allocate faders, one per LED
+rgbfader_t fader[nLEDs];
+
+#include "color_funcs.h"   // needs setLED(), nLEDs, fader[] defined
+
+// valid values for 'bootmode' in startup_param
+enum {
+    BOOT_NORMAL = 0,  // normal <v205 behavior
+    BOOT_PLAY   = 1,  // play a script on startup (servertickle)
+    BOOT_OFF    = 2,  // turn off on startup, even with no USB
+    BOOT_SERVERDOWN=3, // serverdown mode?  //just an idea, not implemented
+};
+    
+// layout of the startup params bundle
+// (v206+ stored a smaller startup params in last patternline)
+typedef struct {
+  uint8_t bootmode;  // ledn, bootmode_t enum above
+  uint8_t playstart; // r from v206 mk2
+  uint8_t playend;   // g
+  uint8_t playcount; // b
+  uint8_t bootloaderlock; // is programmatic triggering of bootloader allowed
+  uint8_t  serverdown_playstart;
+  uint8_t  serverdown_playend;
+  uint8_t  serverdown_unused1;
+  uint32_t serverdown_millis;
+} user_params_t;
+
+// array of LED data (sent to LEDs)
+rgb_t leds[nLEDs];
+
+// global which is active LED
+uint8_t ledn;
+
+// number of entries a color pattern can contain
+#define PATT_MAX 32
+// number of pattern lines in one bulk report: {2,cmd,pos,count, 6 bytes per line}
+#define PATT_BULK_MAX ((REPORT2_COUNT-4) / 6)
+
+// define what is in the user data section
+//typedef struct __attribute((packed)) {
+typedef struct {
+  user_params_t startup_params;
+  patternline_t pattern[PATT_MAX];
+} userdata_t;
+
+/*
+ * "Notes" are user-writable and -readable blobs of data
+ * report2 size is 60 bytes (must be mult of 4, must be <64 for feature report)
+ * byte 0 reportid
+ * byte 1 cmd
+ * byte 3 noteid
+ * byte 4-59 notedata == 55 bytes
+ *
+ * Note size = 50
+ * Note count = 20
+ * Total size = 1000 < FLASH_PAGE_SIZE = 1024
+ * .userNotesFlashSection is in flash at address 0xf800 (64k - (2*1k))
+ */
+#define NOTE_SIZE 50
+#define NOTE_COUNT 20
+
+// define what is in a user note
+typedef struct {
+  char note[NOTE_SIZE];  // just a string for now
+} usernote_t;
+
+// just an idea, make the entire notes block its own struct
+//typedef struct {
+//  usernote_t notes[NOTE_COUNT]
+//} usernotes_t;
+
+// factory startup params & color pattern, the initial contents of userFlash
+#define USERDATA_DEFAULT {                                      \
+  .startup_params =                                             \
+  {                                                             \
+    .bootmode = BOOT_NORMAL,                                    \
+    .playstart = 0,                                             \
+    .playend = PATT_MAX,  /* one more than */                   \
+    .playcount = 0,                                             \
+    .bootloaderlock = 0,                                        \
+    .serverdown_playstart = 0,                                  \
+    .serverdown_playend = 0,                                    \
+    .serverdown_millis = 0,                                     \
+  },                                                            \
+  .pattern =                                                    \
+  {                                                             \
+    /*    R     G     B    fade ledn */                         \
+    { { 0xff, 0x00, 0x00 },  50, 1 }, /* 0  red A */            \
+    { { 0xff, 0x00, 0x00 },  50, 2 }, /* 1  red B */            \
+    { { 0x00, 0x00, 0x00 },  50, 0 }, /* 2  off both */         \
+    { { 0x00, 0xff, 0x00 },  50, 1 }, /* 3  grn A */            \
+    { { 0x00, 0xff, 0x00 },  50, 2 }, /* 4  grn B */            \
+    { { 0x00, 0x00, 0x00 },  50, 0 }, /* 5  off both */         \
+    { { 0x00, 0x00, 0xff },  50, 1 }, /* 6  blu A */            \
+    { { 0x00, 0x00, 0xff },  50, 2 }, /* 7  blu B */            \
+    { { 0x00, 0x00, 0x00 },  50, 0 }, /* 8  off both */         \
+    { { 0x80, 0x80, 0x80 }, 100, 0 }, /* 9  half-bright, both LEDs */ \
+    { { 0x00, 0x00, 0x00 }, 100, 0 }, /* 10 off both */         \
+    { { 0xff, 0xff, 0xff },  50, 1 }, /* 11 white A */          \
+    { { 0x00, 0x00, 0x00 },  50, 1 }, /* 12 off A */            \
+    { { 0xff, 0xff, 0xff },  50, 2 }, /* 13 white B */          \
+    { { 0x00, 0x00, 0x00 }, 100, 2 }, /* 14 off B */            \
+    { { 0x00, 0x00, 0x00 }, 100, 0 }, /* 15 off everyone */     \
+  },                                                            \
+}
+
+// RAM copy of non-volatile notes
+// must be word-aligned because that's what MSC_WriteWord() needs
+SL_ALIGN(4)
+usernote_t userNotes[NOTE_COUNT] SL_ATTRIBUTE_ALIGN(4);
+
+// RAM copy of non-volatile startup params & color pattern
+// must be word-aligned because that's what MSC_WriteWord() needs
+SL_ALIGN(4)
+userdata_t userData SL_ATTRIBUTE_ALIGN(4);
+
+uint8_t playpos   = 0; // current play position
+//
+uint8_t playstart = 0; // start play position
+uint8_t playend   = PATT_MAX; // end play position
+uint8_t playcount = 0; // number of times to play loop, or 0=infinite
+//#define playstart userData.startup_params.playstart
+//#define playend   userData.startup_params.playend
+//#define playcount userData.startup_params.playcount
+
+// play modes, valid values for "playing"
+enum {
+    PLAY_OFF       = 0,  // off
+    PLAY_ON        = 1,  // normal playing pattern
+    PLAY_POWERUP   = 2,  // playing from a powerup
+    PLAY_DIRECTLED = 3   // direct LED addressing (FIXME: this is dumb)
+};
+
+uint8_t playing = PLAY_OFF; // playing values: as above enum
+
+bool doPatternWrite = false;
+bool doFrameDisplay = false;  // 'X' frame received, show it now
+
+patternline_t ptmp;  // temp pattern holder
+rgb_t ctmp;      // temp color holder
+uint16_t ttmp;   // temp time holder
+uint8_t ledn;    // temp ledn holder
+
+// The uptime in milliseconds, maintained by the SysTick timer (or the host).
+volatile uint32_t uptime_millis=0;
+
+// next time led_update should run
+const uint32_t led_update_millis = 10;  // tick msec
+uint32_t led_update_next;
+
+uint32_t pattern_update_next;
+
+uint16_t serverdown_millis = 0;
+uint32_t serverdown_update_next;
+uint8_t  serverdown_playstart = 0;        // start play position for serverdown
+uint8_t  serverdown_playend   = PATT_MAX; // end play position for serverdown
+
+// ease-of-use function because I'm used to Arduino
+#define millis() (uptime_millis)
+
+// timed command queue, filled by 'Q' command, run by updateLEDs()
+#define CMDQ_MAX 16
+// number of queue entries in one 'Q' report: {2,'Q',flags,count, 11 bytes per entry}
+#define CMDQ_BULK_MAX ((REPORT2_COUNT-4) / 11)
+typedef struct {
+  uint32_t at;      // millis() to run command at
+  uint8_t cmd[7];   // command & args, as in bytes 1-7 of a report id 1 report
+} cmdq_entry_t;
+cmdq_entry_t cmdq[CMDQ_MAX];  // kept sorted by 'at'
+volatile uint8_t cmdq_count = 0;  // changed in USB interrupt
+
+// Set by 'G' "gobootload" command
+bool shouldRebootToBootloader = false;
+// Set when a Note write should be issued
+bool doNotesWrite = false;
+
+// The USB report packet received from the host
+// could be REPORT_COUNT or REPORT2_COUNT long
+// first byte is reportId
+SL_ALIGN(4)
+static uint8_t  inbuf[REPORT2_COUNT] SL_ATTRIBUTE_ALIGN(4);
+
+// The USB report packet to send to the host
+// generally it's a copy of the last report received, then modified
+SL_ALIGN(4)
+static uint8_t reportToSend[REPORT2_COUNT] SL_ATTRIBUTE_ALIGN(4);
+
+/**********************************************************************
+ * Write a note to RAM from USB.
+ * - Uses global 'inbuf'
+ *********************************************************************/
+static void noteWrite(uint8_t pos )
+{
+  if( pos >= NOTE_COUNT ) {
+    return;      // error
+  }
+  //  memcpy( userNotesData + (pos*NOTE_SIZE), inbuf+3, NOTE_SIZE);
+  memcpy( &userNotes[pos], inbuf+3, NOTE_SIZE);
+}
+
+/**********************************************************************
+ * Read a user note from RAM to USB.
+ * - Uses global 'reportToSend'
+ *********************************************************************/
+static void noteRead(uint8_t pos)
+{
+  dbg_printf("noteRead:%d\n",pos);
+  if( pos >= NOTE_COUNT ) {
+    return;      // error
+  }
+  //memcpy( reportToSend+3, userNotes + (pos*NOTE_SIZE), NOTE_SIZE );
+  memcpy( reportToSend+3, &userNotes[pos], NOTE_SIZE );
+}
+
+/*********************************************************************
+ * set blink1 to not playing, and no LEDs lit
+ *********************************************************************/
+static void off(void)
+{
+    playing = PLAY_OFF;
+    setRGBt(ctmp, 0,0,0);  // starting color
+    rgb_setCurr( &ctmp );  // set all LEDs FIXME: better way to do this?
+}
+
+/*********************************************************************
+ * Start playing the light pattern
+ * playing values: 0 = off, 1 = normal, 2 == playing from powerup
+ *********************************************************************/
+static void startPlaying( void )
+{
+  dbg_str("-startPlaying-");
+  if( playend == 0 || playend > PATT_MAX ) playend = PATT_MAX;
+  if( playstart >= playend ) playstart = 0;  // bad range, play from top
+  playpos = playstart;
+  pattern_update_next = millis(); //uptime_millis; // now;
+}
+
+/**********************************************************************
+ * @brief Set the color of a particular LED, or all of them
+ **********************************************************************/
+void setLED(uint8_t r, uint8_t g, uint8_t b, uint8_t n)
+{
+    if (n == 255) { // all of them  // FIXME: look into why 255
+        for (int i = 0; i < nLEDs; i++) {
+            leds[i].r = r;  leds[i].g = g; leds[i].b = b;
+        }
+    }
+    else if (n < nLEDs) {    // else just one LED, not all of them
+        leds[n].r = r; leds[n].g = g; leds[n].b = b;
+    }
+}
+
+/**********************************************************************
+ * Add command to timed queue, keeping it sorted by deadline
+ * - called from handleMessage(), in USB interrupt context
+ * @return 1 if added, 0 if queue full
+ **********************************************************************/
+static uint8_t cmdqAdd(uint32_t at, uint8_t* cmd)
+{
+  if( cmdq_count == CMDQ_MAX ) return 0;
+  uint8_t i = cmdq_count;
+  while( i > 0 && (int32_t)(cmdq[i-1].at - at) > 0 ) {
+    cmdq[i] = cmdq[i-1];
+    i--;
+  }
+  cmdq[i].at = at;
+  memcpy( cmdq[i].cmd, cmd, sizeof(cmdq[i].cmd) );
+  cmdq_count++;
+  return 1;
+}
+
+/**********************************************************************
+ * Run a command from the timed queue
+ * - supports 'c' fade, 'n' set now, and 'p' play/stop
+ **********************************************************************/
+static void cmdqRun(uint8_t* cmd)
+{
+  rgb_t c = { cmd[1], cmd[2], cmd[3] };
+  if( cmd[0] == 'c' ) {
+    uint16_t dmillis = (cmd[4] << 8) | cmd[5];
+    playing = PLAY_OFF;
+    rgb_setDest( &c, dmillis, cmd[6] );
+  }
+  else if( cmd[0] == 'n' ) {
+    playing = PLAY_OFF;
+    if( cmd[6] > 0 ) {
+      rgb_setCurrN( &c, cmd[6]-1 );
+    } else {
+      rgb_setCurr( &c );
+    }
+  }
+  else if( cmd[0] == 'p' ) {
+    playing   = cmd[1];
+    playstart = cmd[2];
+    playend   = cmd[3];
+    playcount = cmd[4];
+    if( playend == 0 || playend > PATT_MAX )
+      playend = PATT_MAX;
+    else playend++;  // same as 'p' command
+    startPlaying();
+  }
+}
+
+/**********************************************************************
+ * updateLEDs() is the main user-land function that:
+ * - periodically calls the rgb fader code to fade any actively moving colors
+ * - controls sequencing of a light pattern, if playing
+ * - triggers pattern playing on USB disconnect
+ * - handles serverdown logic
+ * - handles startup behavior logic
+ **********************************************************************/
+static void updateLEDs(void)
+{
+  uint32_t now = millis(); // uptime_millis;
+
+    // run any queued commands that are due
+    while( cmdq_count && (int32_t)(now - cmdq[0].at) >= 0 ) {
+        uint8_t cmd[7];
+        bool due = false;
+        CORE_DECLARE_IRQ_STATE;
+        CORE_ENTER_ATOMIC();  // handleMessage() may be adding to or clearing queue
+        // check again, a 'Q' may have cleared the queue since the test above
+        if( cmdq_count && (int32_t)(now - cmdq[0].at) >= 0 ) {
+            memcpy( cmd, cmdq[0].cmd, sizeof(cmd) );
+            cmdq_count--;
+            memmove( &cmdq[0], &cmdq[1], cmdq_count * sizeof(cmdq_entry_t) );
+            due = true;
+        }
+        CORE_EXIT_ATOMIC();
+        if( !due ) break;
+        cmdqRun( cmd );
+    }
+
+    // show a streamed frame right away, don't wait for the next tick
+    if( doFrameDisplay ) {
+        doFrameDisplay = false;
+        displayLEDs();
+    }
+
+    // update LEDs every led_update_millis
+    if( (int32_t)(now - led_update_next) > 0 ) {
+        led_update_next += led_update_millis;
+
+        rgb_updateCurrent(); // playing=3 => direct LED addressing (not anymore)
+        displayLEDs();
+
+        // serverdown logic
+        if( serverdown_millis != 0 ) {  // i.e. servermode has been turned on
+          dbg_str("*S*");
+          if( (int32_t)(now - serverdown_update_next) > 0 ) {
+            serverdown_millis = 0;  // disable this check
+            playing = PLAY_ON;
+            playstart = serverdown_playstart;
+            playend   = serverdown_playend;
+            playcount = 0; // play infinitely
+            startPlaying();
+          }
+        } // serverdown logic
+
+    } // if led_update_next
+
+
+    // playing light pattern logic
+    if( playing ) {
+        if( (int32_t)(millis() - pattern_update_next) > 0  ) { // time to get next line
+            ctmp = userData.pattern[playpos].color;
+            ttmp = userData.pattern[playpos].dmillis;
+            ledn = userData.pattern[playpos].ledn;
+
+            // special command handling
+            if( ledn & 0x80 ) {    // special command bit
+              ledn = ledn & 0x7f;  // mask off special command bit
+              // random
+              if( ledn ) ledn = (rand() % ledn) +1 ; // 0 means all
+              uint8_t h = rand() % 255;
+              uint8_t s = ctmp.g;
+              uint8_t v = ctmp.b;
+              hsbtorgb( h,s,v, &ctmp.r, &ctmp.g, &ctmp.b );  // NOTE: writes to ctmp.{r,g,b}
+            }
+
+#if 0       // print millis on each pattern line
+            dbg_printf("\n%ld %d %d %d %d %d ",millis(),playpos, playstart,playend,playcount,ttmp);
+#endif
+#if 0       // enabling this causes lag in pattern playing because of blocking LEUART writes
+            dbg_printf("\n%ld patt %d rgb:%x %x %x t:%d l:%d ", millis(),
+                       playpos, ctmp.r, ctmp.g, ctmp.b, ttmp, ledn);
+#endif
+            if( ttmp == 0 && ctmp.r == 0 && ctmp.g == 0 && ctmp.b == 0) {
+                // skip lines set to zero
+            } else {
+                rgb_setDest( &ctmp, ttmp, ledn );
+            }
+            playpos++;
+            if( playpos == playend ) {
+                playpos = playstart; // loop the pattern
+                playcount--;
+                if( playcount == 0 ) {
+                    playing = PLAY_OFF; // done!
+                }
+                else if(playcount==255) {
+                    playcount = 0; // infinite playing
+                }
+            }
+            pattern_update_next += ttmp*10;  // okay if ttmp is zero
+        }
+    } // playing
+
+}
+
+/**********************************************************************
+ * handleMessage(char* inbuf) -- main command router
+ *
+ * inbuf[] is 8 bytes long (or 64 bytes for report2)
+ *  byte0 = report-id
+ *  byte1 = command
+ *  byte2..byte7 = args for command
+ *
+ * Available commands:
+ *  - Fade to RGB color       format: { 1, 'c', r,g,b,     th,tl, n }
+ *  - Set RGB color now       format: { 1, 'n', r,g,b,       0,0, n } (*)
+ *  - Read current RGB color  format: { 1, 'r', n,0,0,       0,0, n } (2)
+ *  - Serverdown tickle/off   format: { 1, 'D', on,th,tl,  st,sp,ep } (*)
+ *  - PlayLoop                format: { 1, 'p', on,sp,ep,c,    0, 0 } (2)
+ *  - Playstate readback      format: { 1, 'S', 0,0,0,       0,0, 0 } (2)
+ *  - Set color pattern line  format: { 1, 'P', r,g,b,     th,tl, p }
+ *  - Save color patterns     format: { 1, 'W', 0,0,0,       0,0, 0 } (2)
+ *  - read color pattern line format: { 1, 'R', 0,0,0,       0,0, p }
+ *  - Set ledn                format: { 1, 'l', n,0,0,       0,0, 0 } (2+)
+ *  - Read EEPROM location    format: { 1, 'e', ad,0,0,      0,0, 0 } (1)
+ *  - Write EEPROM location   format: { 1, 'E', ad,v,0,      0,0, 0 } (1)
+ *  - Get version             format: { 1, 'v', 0,0,0,       0,0, 0 }
+ *  - Test command            format: { 1, '!', 0,0,0,       0,0, 0 }
+ *  - Write 50-byte note      format: { 2, 'F', noteid, data0 ... data99 } (3)
+ *  - Read  50-byte note      format: { 2, 'f', noteid, data0 ... data99 } (3)
+ *  - Go to bootloader        format: { 1, 'G', 'o','B','o','o','t',0 } (3)
+ *  - Lock go to bootload     format: { 2','L'  'o','c','k','B','o','o','t','l','o','a','d'} (3)
+ *  - Set startup params      format: { 1, 'B', bootmode, playstart,playend,playcnt,0,0} (3)
+ *  - Get startup params      format: { 1, 'b', 0,0,0, 0,0,0        } (3)
+ *  - Server mode tickle      format: { 1, 'D', {1/0},th,tl, {1,0},sp, ep }
+ *  - Get chip unique id      format: { 2, 'U', 0 } (3)
+ *  - Write pattern lines     format: { 2, 'M', pos,count, r,g,b,th,tl,n, ... } (3)
+ *  - Read pattern lines      format: { 2, 'm', pos,count, 0... } (3)
+ *  - Set LEDs frame          format: { 2, 'X', start,count, r,g,b, r,g,b, ... } (3)
+ *  - Queue timed commands    format: { 2, 'Q', flags,count, t3,t2,t1,t0, cmd,a1..a6, ... } (3)
+ *
+ * x Fade to RGB color        format: { 1, 'c', r,g,b,      th,tl, ledn }
+ * x Set RGB color now        format: { 1, 'n', r,g,b,        0,0, ledn }
+ * x Play/Pause, with pos     format: { 1, 'p', {1/0},pos,0,  0,0,    0 }
+ * x Play/Pause, with pos     format: { 1, 'p', {1/0},pos,endpos, 0,0,0 }
+ * x Write color pattern line format: { 1, 'P', r,g,b,      th,tl,  pos }
+ * x Read color pattern line  format: { 1, 'R', 0,0,0,        0,0, pos }
+ *
+ *********************************************************************/
+static void handleMessage(uint8_t reportId)
+{
+#if DEBUG_HANDLEMESSAGE
+  dbg_printf("%d:%x,%x,%x,%x,%x,%x,%x,%x\n", reportId,
+          inbuf[0],inbuf[1],inbuf[2],inbuf[3],inbuf[4],inbuf[5],inbuf[6],inbuf[7] );
+#endif
+
+  // pre-load response with request, contains report id
+  uint8_t count = (reportId==REPORT_ID) ? REPORT_COUNT : REPORT2_COUNT;
+  memcpy( (void*)reportToSend, (void*)inbuf, count);
+
+  uint8_t rId;
+  uint8_t cmd;
+  rgb_t c; // we need this for many commands so pre-parse it
+  rId = inbuf[0];
+  cmd = inbuf[1];
+  c.r = inbuf[2];
+  c.g = inbuf[3];
+  c.b = inbuf[4];
+
+  //
+  // Fade to RGB color - { 1,'c', r,g,b, th,tl, ledn }
+  //   where t = number of 10msec ticks
+  if(      cmd == 'c' ) {
+    uint16_t dmillis = (inbuf[5] << 8) | inbuf[6];
+    uint8_t ledn = inbuf[7];          // which LED to address
+    playing = PLAY_OFF;
+    rgb_setDest(&c, dmillis, ledn);
+  }
+  //
+  // set RGB color immediately  - {1,'n', r,g,b, 0,0,0 }
+  //
+  else if( cmd == 'n' ) {
+    uint8_t iledn = inbuf[7];          // which LED to address
+    playing = PLAY_OFF;
+    if( iledn > 0 ) {
+      playing = PLAY_DIRECTLED;       // FIXME: wtf non-semantic 3
+      setLED( c.r, c.g, c.b, iledn ); // FIXME: no fading
+    }
+    else {
+      rgb_setDest( &c, 0, 0 );
+      rgb_setCurr( &c );  // FIXME: no LED arg
+    }
+  }
+  //
+  //  Read current color        - { 1,'r', 0,0,0,   0,0, 0}
+  //
+  else if( cmd == 'r' ) {
+    uint8_t iledn = inbuf[7];          // which LED to address
+    if( iledn > 0 ) iledn--;
+    if( iledn >= nLEDs ) iledn = 0;
+    reportToSend[2] = leds[iledn].r;
+    reportToSend[3] = leds[iledn].g;
+    reportToSend[4] = leds[iledn].b;
+    reportToSend[5] = 0;
+    reportToSend[6] = 0;
+    reportToSend[7] = iledn;
+  }
+  //
+  //  Play/Pause, with pos     - { 1, 'p', {1/0},startpos,endpos,  0,0, 0 }
+  //
+  else if( cmd == 'p' ) {
+    playing   = inbuf[2];
+    playstart = inbuf[3];
+    playend   = inbuf[4];
+    playcount = inbuf[5];
+    if( playend == 0 || playend > PATT_MAX )
+      playend = PATT_MAX;
+    else playend++;  // so that it's equivalent to PATT_MAX, if you know what i mean
+    startPlaying();
+  }
+  //
+  // Play state readback      - { 1, 'S', 0,0,0, 0,0,0 }
+  //   resopnse format:
+  //
+  else if( cmd == 'S' ) {
+    reportToSend[2] = playing;
+    reportToSend[3] = playstart;
+    reportToSend[4] = playend-1; // FIXME
+    reportToSend[5] = playcount;
+    reportToSend[6] = playpos;
+    reportToSend[7] = 0;
+  }
+  //
+  // Write color pattern line  - {1,'P', r,g,b, th,tl, pos}
+  //
+  else if( cmd == 'P' ) {
+    // was doing this copy with a cast, but broke it out for clarity
+    ptmp.color.r = inbuf[2];
+    ptmp.color.g = inbuf[3];
+    ptmp.color.b = inbuf[4];
+    ptmp.dmillis = ((uint16_t)inbuf[5] << 8) | inbuf[6];
+    ptmp.ledn    = ledn;
+    uint8_t pos  = inbuf[7];
+    if( pos >= PATT_MAX ) pos = 0;  // just in case
+    // save pattern line to RAM
+    memcpy( &userData.pattern[pos], &ptmp, sizeof(patternline_t) );
+  }
+  //
+  // Read color pattern entry - {1,'R', 0,0,0, 0,0, pos}
+  //
+  else if( cmd == 'R' ) {
+    uint8_t pos = inbuf[7];
+    if( pos >= PATT_MAX ) pos = 0;
+    patternline_t patt = userData.pattern[pos];
+    reportToSend[2] = patt.color.r;
+    reportToSend[3] = patt.color.g;
+    reportToSend[4] = patt.color.b;
+    reportToSend[5] = (patt.dmillis >> 8);
+    reportToSend[6] = (patt.dmillis & 0xff);
+    reportToSend[7] = patt.ledn;
+  }
+  //
+  // Write many color pattern lines - {2,'M', pos,count, r,g,b,th,tl,n, r,g,b,th,tl,n, ...}
+  //   up to PATT_BULK_MAX lines per report, number written is returned in byte 3
+  //
+  else if( cmd == 'M' && rId == 2 ) {
+    uint8_t pos = inbuf[2];
+    uint8_t n   = inbuf[3];
+    if( n > PATT_BULK_MAX ) n = PATT_BULK_MAX;
+    uint8_t* p = &inbuf[4];
+    uint8_t i;
+    for( i=0; i < n && pos+i < PATT_MAX; i++ ) {
+      patternline_t* pl = &userData.pattern[pos+i];
+      pl->color.r = p[0];
+      pl->color.g = p[1];
+      pl->color.b = p[2];
+      pl->dmillis = ((uint16_t)p[3] << 8) | p[4];
+      pl->ledn    = p[5];
+      p += 6;
+    }
+    reportToSend[3] = i;
+  }
+  //
+  // Read many color pattern lines - {2,'m', pos,count, 0...}
+  //   response is {2,'m', pos,n, r,g,b,th,tl,n, ...}, n = number of lines read
+  //
+  else if( cmd == 'm' && rId == 2 ) {
+    uint8_t pos = inbuf[2];
+    uint8_t n   = inbuf[3];
+    if( n > PATT_BULK_MAX ) n = PATT_BULK_MAX;
+    uint8_t* p = &reportToSend[4];
+    uint8_t i;
+    for( i=0; i < n && pos+i < PATT_MAX; i++ ) {
+      patternline_t* pl = &userData.pattern[pos+i];
+      p[0] = pl->color.r;
+      p[1] = pl->color.g;
+      p[2] = pl->color.b;
+      p[3] = (pl->dmillis >> 8);
+      p[4] = (pl->dmillis & 0xff);
+      p[5] = pl->ledn;
+      p += 6;
+    }
+    reportToSend[3] = i;
+  }
+  //
+  // Set LEDs frame, no fading - {2,'X', start,count, r,g,b, r,g,b, ...}
+  //   sets up to nLEDs LEDs from 'start', all shown with one displayLEDs()
+  //
+  else if( cmd == 'X' && rId == 2 ) {
+    uint8_t start = inbuf[2];
+    uint8_t n     = inbuf[3];
+    if( start >= nLEDs ) start = 0;
+    if( n > nLEDs - start ) n = nLEDs - start;
+    playing = PLAY_OFF;
+    uint8_t* p = &inbuf[4];
+    for( uint8_t i=0; i < n; i++ ) {
+      c.r = p[0];
+      c.g = p[1];
+      c.b = p[2];
+      rgb_setCurrN( &c, start+i );
+      p += 3;
+    }
+    reportToSend[3] = n;
+    doFrameDisplay = true;
+  }
+  //
+  // Queue timed commands - {2,'Q', flags,count, t3,t2,t1,t0, cmd,a1,a2,a3,a4,a5,a6, ...}
+  //   t = millis() to run at, cmd+args as in a report id 1 'c','n', or 'p' command
+  //   flags bit0 = clear queue first, count = 0 just reads status
+  //   response is {2,'Q', flags,added, free, m3,m2,m1,m0} m = millis() now
+  //
+  else if( cmd == 'Q' && rId == 2 ) {
+    uint8_t flags = inbuf[2];
+    uint8_t n     = inbuf[3];
+    if( n > CMDQ_BULK_MAX ) n = CMDQ_BULK_MAX;
+    if( flags & 0x01 ) cmdq_count = 0;
+    uint8_t* p = &inbuf[4];
+    uint8_t i;
+    for( i=0; i < n; i++ ) {
+      uint32_t at = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                    ((uint32_t)p[2] << 8)  | p[3];
+      if( !cmdqAdd( at, p+4 ) ) break;
+      p += 11;
+    }
+    uint32_t now = millis();
+    reportToSend[3] = i;
+    reportToSend[4] = CMDQ_MAX - cmdq_count;
+    reportToSend[5] = (uint8_t)(now >> 24);
+    reportToSend[6] = (uint8_t)(now >> 16);
+    reportToSend[7] = (uint8_t)(now >> 8);
+    reportToSend[8] = (uint8_t)(now >> 0);
+  }
+  //
+  // Save color pattern to flash memory: { 1, 'W', 0x55,0xAA, 0xCA,0xFE, 0,0}
+  //
+  else if( cmd == 'W' ) {
+    if( inbuf[2] == 0xBE &&
+        inbuf[3] == 0xEF &&
+        inbuf[4] == 0xCA &&
+        inbuf[5] == 0xFE ) {
+      doPatternWrite = true;
+      // we write in main loop, not in this callback
+    }
+  }
+  //
+  // Set ledn : { 1, 'l', n, 0...}
+  //
+  else if( cmd == 'l' ) {
+    ledn = inbuf[2];
+  }
+  //
+  //  Server mode tickle        format: { 1, 'D', {1/0}, th,tl, st, sp, ep }
+  //     1/0 == on/off
+  //     t == tickle time
+  //     st == stop any playing pattern & turn off or leave things (boolean)
+  //     sp == pattern play start point
+  //     ep == pattern play end point
+  //
+  else if( cmd == 'D' ) {
+    uint8_t serverdown_on = inbuf[2];
+    uint16_t t = ((uint16_t)inbuf[3] << 8) | inbuf[4];
+    uint8_t stop          = inbuf[5];
+    serverdown_playstart  = inbuf[6];
+    serverdown_playend    = inbuf[7];
+    if( serverdown_playend == 0 || serverdown_playend > PATT_MAX )
+      serverdown_playend = PATT_MAX;
+    else     serverdown_playend++;  // to make like 'p' play command
+
+    if( serverdown_on ) {
+      serverdown_millis = t;
+      serverdown_update_next = millis() + (t*10); //uptime_millis + (t*10);
+    } else {
+      serverdown_millis = 0; // turn off serverdown mode
+    }
+    if( stop == 0 ) {   // agreed, confusing
+      off();
+    }
+  }
+  //
+  // Set startup parameters     format: {2, 'B', bootmode, playstart, playend, playcount, 0,0}
+  //
+  else if( cmd == 'B' ) {
+    userData.startup_params.bootmode  = inbuf[2]; // ledn (from v206+)
+    userData.startup_params.playstart = inbuf[3]; // r
+    userData.startup_params.playend   = inbuf[4]; // g
+    userData.startup_params.playcount = inbuf[5]; // b
+#if 0
+    // serverdown variables
+    userData.startup_params.serverdown_playstart  = inbuf[6];
+    userData.startup_params.serverdown_playend    = inbuf[7];
+    userData.startup_params.serverdown_millis     = (inbuf[8] << 8) | inbuf[9];
+#endif
+
+    // fixup playend, copied from 'p'lay/pause
+    // handles case were playend is badly-defined
+    // at sets to it be end+1 not end, because of dim historical for-loop reasons
+    // (FIXME: is there a better way to handle this? )
+    if( userData.startup_params.playend == 0 || userData.startup_params.playend > PATT_MAX )
+      userData.startup_params.playend = PATT_MAX;
+    else
+      userData.startup_params.playend++; // so it's equiv to patt_max, if you know what i mean
+
+    doPatternWrite = true;; // causes all userData to be saved // FIXME: rename
+  }
+  //
+  // Get Startup Params      format: { 2, 'b', 0,0,0,0, 0,0 }
+  //
+  else if( cmd == 'b' ) {
+    reportToSend[2] = userData.startup_params.bootmode;
+    reportToSend[3] = userData.startup_params.playstart;
+    reportToSend[4] = userData.startup_params.playend-1;  // FIXME
+    reportToSend[5] = userData.startup_params.playcount;
+#if 0
+    reportToSend[6] = userData.startup_params.serverdown_playstart;
+    reportToSend[7] = userData.startup_params.serverdown_playend-1; // FIXME
+    reportToSend[8] = userData.startup_params.serverdown_millis >> 8;
+    reportToSend[9] = userData.startup_params.serverdown_millis & 0xff;
+#endif
+  }
+  //
+  //  Get version               format: { 1, 'v', 0,0,0,        0,0, 0 }
+  //
+  else if( cmd == 'v' ) {
+    //GPIO_PinOutSet(gpioPortF, 5);  // debug
+    reportToSend[3] = blink1_version_major;
+    reportToSend[4] = blink1_version_minor;
+  }
+  //
+  // Go to bootloader          format: { 2, 'G','o','B','o','o','t' }
+  // Check against command "GoBoot"
+  //
+  else if( cmd == 'G' ) {
+    if( inbuf[2] == 'o' && inbuf[3] == 'B' && inbuf[4] == 'o' && inbuf[5] == 'o' && inbuf[6] == 't' ) {
+      dbg_str("GoBoot");
+      if( userData.startup_params.bootloaderlock ) {  // firmware has been locked
+        reportToSend[1] = 'L'; // send ack but fail because lock
+        reportToSend[2] = 'O';
+        reportToSend[3] = 'C';
+        reportToSend[4] = 'K';
+        reportToSend[5] = 'E';
+        reportToSend[6] = 'D';
+      }
+      else {
+        shouldRebootToBootloader = true;
+        reportToSend[2] = 'O'; // send acknowledge
+        reportToSend[3] = 'B';
+        reportToSend[4] = 'O';
+        reportToSend[5] = 'O';
+        reportToSend[6] = 'T';
+      }
+    }
+  }
+  //
+  // Lock out USB bootloader   format: {2, 'L','o','c','k','B','o','o','t','l','o','o','d'}
+  //
+  else if( cmd == 'L' && rId == 2 ) {
+    char* bp = (char*) (&inbuf[2]);
+    if( strncmp( bp, "ockBootload",11) == 0 ) {
+      dbg_str("LockBootload");
+      userData.startup_params.bootloaderlock = 1;
+      // save user data
+      doPatternWrite = true;
+    }
+  }
+  //
+  // Get chip unique id    format: { 2, 'U', ... }
+  // Return 8 bytes of unique id
+  else if( cmd == 'U' && rId == 2 ) {
+    dbg_printf("getId");
+    uint64_t id = SYSTEM_GetUnique();
+    uint8_t* idp = (uint8_t*)&id;
+    //reportToSend[0] is report id
+    //reportToSend[1] is cmd ('U' in this case)
+    reportToSend[2]  = idp[0];
+    reportToSend[3]  = idp[1];
+    reportToSend[4]  = idp[2];
+    reportToSend[5]  = idp[3];
+    reportToSend[6]  = idp[4];
+    reportToSend[7]  = idp[5];
+    reportToSend[8]  = idp[6];
+    reportToSend[9]  = idp[7];
+    reportToSend[10] = 0;
+  }
+  //
+  // test test
+  //
+  else if( cmd == '!' ) {  // testtest
+    uint32_t now = millis();
+    reportToSend[2] = 0x55;
+    reportToSend[3] = 0xAA;
+    reportToSend[4] = rId; //(uint8_t)(uptime_millis >> 24);
+    reportToSend[5] = (uint8_t)(now >> 16);
+    reportToSend[6] = (uint8_t)(now >> 8);
+    reportToSend[7] = (uint8_t)(now >> 0);
+  }
+  //
+  // Read User Note       format: { 1, 'f', noteid, 0, 0, 0, 0 }
+  // NOTE: must be sent on reportId 2!
+  //
+  else if( cmd == 'f' && rId == 2 ) {  // read note
+    uint8_t noteid = inbuf[2];
+    noteRead( noteid ); // fills out reportToSend from RAM note
+  }
+  //
+  // Write User Note      format: { 2, 'F', noteid, data0,data1,...,data99 }
+  // NOTE: must be sent on reportId 2!
+  //
+  else if( cmd == 'F' && rId == 2 ) { // write note
+    uint8_t noteid = inbuf[2];
+    noteWrite( noteid ); // reads from global inbuf+3, writes to RAM note
+    doNotesWrite = true; // trigger save all notes
+    // we write in main loop, not in this callback
+  }
+
+}
+
+#endif
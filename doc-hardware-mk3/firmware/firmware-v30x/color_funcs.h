@@ -31,6 +31,9 @@
 // set the current color OF ALL LEDs
 void rgb_setCurr( rgb_t* newcolor );
 
+// set the current color of one LED, no fading
+void rgb_setCurrN( rgb_t* newcolor, uint8_t ledn );
+
 void rgb_setDestN( rgb_t* newcolor, int steps, int16_t ledn );
 
 // set a new destination color
@@ -60,15 +63,34 @@ void rgb_setCurr( rgb_t* newcolor )
     //displayLEDs();
 }
 
+// set the current color of one LED, no fading
+void rgb_setCurrN( rgb_t* newcolor, uint8_t ledn )
+{
+    if( ledn >= nLEDs ) return;  // no such LED
+    rgbfader_t* f = &fader[ledn];
+    f->curr100x.r = newcolor->r * 100;
+    f->curr100x.g = newcolor->g * 100;
+    f->curr100x.b = newcolor->b * 100;
+
+    f->dest100x.r = f->curr100x.r;
+    f->dest100x.g = f->curr100x.g;
+    f->dest100x.b = f->curr100x.b;
+    f->stepcnt = 0;
+
+    setLED( newcolor->r, newcolor->g, newcolor->b, ledn );
+}
+
 // set a 
 void rgb_setDestN( rgb_t* newcolor, int steps, int16_t ledn )
 {
+    if( ledn < 0 || ledn >= nLEDs ) return;  // no such LED
     rgbfader_t* f = &fader[ledn];
     f->dest100x.r = newcolor->r * 100;
     f->dest100x.g = newcolor->g * 100;
     f->dest100x.b = newcolor->b * 100;
 
     f->stepcnt = steps + 1;
+    if( steps == 0 ) return;  // jumps to dest on next tick, step not used
 
     f->step100x.r = (f->dest100x.r - f->curr100x.r) / steps;
     f->step100x.g = (f->dest100x.g - f->curr100x.g) / steps;
@@ -0,0 +1,163 @@
+/*
+ * blink1-sim-bench.c -- how many commands can the firmware state machine absorb
+ *
+ * For each workload, sends an increasing number of commands per LED tick
+ * into blink1-sim and times the host CPU spent per tick (commands plus
+ * the tick's updateLEDs() passes).  Fades start lagging once that passes
+ * the tick period, since the firmware handles reports and LED updates on
+ * the same core.
+ *
+ * Host CPUs are much faster than the EFM32HG, so use "-x FACTOR" to scale
+ * the measured time, e.g. "-x 40" for a device 40x slower than the host.
+ *
+ * Usage: ./blink1-sim-bench [-t ticks] [-x factor] [workload...]
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blink1-sim.h"
+
+static unsigned int seed = 1;
+
+static double nowSecs(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// fade one or all LEDs to a random color over 100 msec
+static void cmdFade(uint8_t* buf)
+{
+    uint8_t b[] = { 1, 'c', rand_r(&seed), rand_r(&seed), rand_r(&seed), 0, 10, rand_r(&seed) % 3 };
+    memcpy(buf, b, sizeof(b));
+}
+
+// set one or all LEDs now
+static void cmdSet(uint8_t* buf)
+{
+    uint8_t b[] = { 1, 'n', rand_r(&seed), rand_r(&seed), rand_r(&seed), 0, 0, rand_r(&seed) % 3 };
+    memcpy(buf, b, sizeof(b));
+}
+
+// whole 18 LED frame
+static void cmdFrame(uint8_t* buf)
+{
+    buf[0] = 2; buf[1] = 'X'; buf[2] = 0; buf[3] = blink1sim_num_leds;
+    for( int i = 0; i < blink1sim_num_leds*3; i++ ) buf[4+i] = rand_r(&seed);
+}
+
+// queue a fade a little in the future, clearing the queue first so it never fills
+static void cmdQueue(uint8_t* buf)
+{
+    uint32_t at = blink1sim_millis() + 5;
+    uint8_t b[] = { 2, 'Q', 1, 1, at>>24, at>>16, at>>8, at,
+                    'c', rand_r(&seed), rand_r(&seed), rand_r(&seed), 0, 10, 0 };
+    memcpy(buf, b, sizeof(b));
+}
+
+// write a bulk pattern block
+static void cmdPattern(uint8_t* buf)
+{
+    buf[0] = 2; buf[1] = 'M'; buf[2] = rand_r(&seed) % 32; buf[3] = 9;
+    for( int i = 0; i < 9*6; i++ ) buf[4+i] = rand_r(&seed);
+}
+
+static void (* const mixed[])(uint8_t*) = { cmdFade, cmdSet, cmdFrame, cmdQueue, cmdPattern };
+
+static void cmdMixed(uint8_t* buf)
+{
+    mixed[ rand_r(&seed) % (sizeof(mixed)/sizeof(mixed[0])) ](buf);
+}
+
+typedef struct {
+    const char* name;
+    void (*makeCmd)(uint8_t* buf);
+    const char* desc;
+} workload_t;
+
+static const workload_t workloads[] = {
+    { "fade",    cmdFade,    "'c' fade to color" },
+    { "set",     cmdSet,     "'n' set color now" },
+    { "frame",   cmdFrame,   "'X' 18-LED frame" },
+    { "queue",   cmdQueue,   "'Q' timed command" },
+    { "pattern", cmdPattern, "'M' bulk pattern write" },
+    { "mixed",   cmdMixed,   "all of the above" },
+};
+static const int workloads_count = sizeof(workloads)/sizeof(workloads[0]);
+
+// run 'ticks' LED ticks with 'rate' commands each, return host secs per tick
+static double runWorkload(const workload_t* w, int rate, int ticks)
+{
+    uint8_t buf[blink1sim_report2_size];
+    blink1sim_reset(3, 0x30000000);
+    // keep a pattern playing underneath, like serverdown or a status loop would
+    uint8_t play[] = { 1, 'p', 1, 0, 15, 0, 0, 0 };
+    blink1sim_sendReport(play, sizeof(play));
+
+    double start = nowSecs();
+    for( int t = 0; t < ticks; t++ ) {
+        for( int i = 0; i < rate; i++ ) {
+            memset(buf, 0, sizeof(buf));
+            w->makeCmd(buf);
+            blink1sim_sendReport(buf, sizeof(buf));
+            blink1sim_getReport(buf, sizeof(buf));
+        }
+        blink1sim_advance(blink1sim_tick_millis);
+    }
+    return (nowSecs() - start) / ticks;
+}
+
+int main(int argc, char** argv)
+{
+    int ticks = 200;
+    double factor = 1;
+    int opt;
+    while( (opt = getopt(argc, argv, "t:x:h")) != -1 ) {
+        switch( opt ) {
+        case 't': ticks = strtol(optarg, NULL, 0); break;
+        case 'x': factor = strtod(optarg, NULL); break;
+        default:
+            fprintf(stderr, "Usage: %s [-t ticks] [-x factor] [workload...]\nworkloads:\n", argv[0]);
+            for( int i = 0; i < workloads_count; i++ ) {
+                fprintf(stderr, "  %-8s %s\n", workloads[i].name, workloads[i].desc);
+            }
+            return 1;
+        }
+    }
+    if( ticks < 1 || factor <= 0 ) {
+        fprintf(stderr, "bad ticks or factor\n");
+        return 1;
+    }
+
+    const double tick_secs = blink1sim_tick_millis / 1000.0;
+    printf("%d ticks per run, time scaled by %.1fx\n", ticks, factor);
+    printf("%-8s %8s %12s %12s %8s\n", "workload", "cmd/tick", "ns/cmd", "tick load", "");
+    for( int i = 0; i < workloads_count; i++ ) {
+        const workload_t* w = &workloads[i];
+        if( optind < argc ) {
+            int want = 0;
+            for( int j = optind; j < argc; j++ ) want |= (strcmp(argv[j], w->name) == 0);
+            if( !want ) continue;
+        }
+        double idle = runWorkload(w, 0, ticks) * factor;
+        int maxrate = 0;
+        for( int rate = 1; rate <= (1<<20); rate *= 2 ) {
+            double secs = runWorkload(w, rate, ticks) * factor;
+            double load = secs / tick_secs;
+            printf("%-8s %8d %12.1f %11.1f%% %8s\n", w->name, rate,
+                   (secs - idle) / rate * 1e9, load * 100, (load > 1) ? "LAGS" : "");
+            if( load > 1 ) break;
+            maxrate = rate;
+        }
+        printf("%-8s max %d cmd/tick = %.0f cmd/sec before fades lag\n\n",
+               w->name, maxrate, maxrate / tick_secs);
+    }
+    return 0;
+}
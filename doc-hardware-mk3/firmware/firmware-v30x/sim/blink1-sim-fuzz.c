@@ -0,0 +1,114 @@
+/*
+ * blink1-sim-fuzz.c -- fuzz the firmware's report handling with blink1-sim
+ *
+ * Input is a stream of steps, each:
+ *   op byte: bit 0 = report id (0 -> 1, 1 -> 2), bits 1-7 = msec to advance
+ *   report bytes: 7 or 59 bytes following the report id
+ * After every step the reply is read back and the firmware state checked.
+ *
+ * Built with clang -fsanitize=fuzzer this is a libFuzzer target.
+ * Otherwise main() replays files given on the command line, or with no
+ * files runs random inputs:  ./blink1-sim-fuzz [-n runs] [-s seed] [files...]
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blink1-sim.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    if( size < 1 ) return 0;
+    blink1sim_reset( 1 + data[0] % 3, 0x30000000 );
+    size_t i = 1;
+    while( i < size ) {
+        uint8_t op = data[i++];
+        uint8_t buf[blink1sim_report2_size];
+        int len = (op & 1) ? blink1sim_report2_size : blink1sim_report_size;
+        memset( buf, 0, sizeof(buf) );
+        buf[0] = (op & 1) ? 2 : 1;
+        size_t n = size - i;
+        if( n > (size_t)(len-1) ) n = len-1;
+        memcpy( buf+1, data+i, n );
+        i += n;
+
+        blink1sim_advance( op >> 1 );
+        if( blink1sim_sendReport( buf, len ) != -1 ) {
+            blink1sim_getReport( buf, len );
+        }
+        if( blink1sim_checkState() == -1 ) abort();
+    }
+    // let any fades, patterns & queued commands run for a while
+    blink1sim_advance( 5000 );
+    if( blink1sim_checkState() == -1 ) abort();
+    return 0;
+}
+
+#ifndef BLINK1SIM_LIBFUZZER
+
+static int runFile(const char* path)
+{
+    FILE* fp = fopen(path, "rb");
+    if( fp == NULL ) {
+        perror(path);
+        return -1;
+    }
+    static uint8_t data[65536];
+    size_t size = fread(data, 1, sizeof(data), fp);
+    fclose(fp);
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    long runs = 100000;
+    unsigned int seed = 1;
+    int opt;
+    while( (opt = getopt(argc, argv, "n:s:")) != -1 ) {
+        switch( opt ) {
+        case 'n': runs = strtol(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n runs] [-s seed] [files...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if( optind < argc ) {
+        for( int i = optind; i < argc; i++ ) {
+            if( runFile(argv[i]) == -1 ) return 1;
+        }
+        printf("ran %d files\n", argc - optind);
+        return 0;
+    }
+
+    // random inputs, each step a real command byte with random args,
+    // so most of them get past the command switch in handleMessage()
+    static const char cmds[] = "cnrpSPRMmXQWlDBbvGLUfF!";
+    uint8_t data[1024];
+    for( long r = 0; r < runs; r++ ) {
+        size_t size = 0;
+        data[size++] = rand_r(&seed);
+        int steps = 1 + rand_r(&seed) % 16;
+        for( int s = 0; s < steps; s++ ) {
+            uint8_t op = rand_r(&seed);
+            int len = (op & 1) ? blink1sim_report2_size : blink1sim_report_size;
+            data[size++] = op;
+            data[size++] = cmds[ rand_r(&seed) % (sizeof(cmds)-1) ];
+            for( int i = 2; i < len; i++ ) {
+                // small numbers are more interesting for counts & positions
+                data[size++] = (rand_r(&seed) & 1) ? rand_r(&seed) % 40 : rand_r(&seed);
+            }
+        }
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    printf("ran %ld random inputs\n", runs);
+    return 0;
+}
+
+#endif
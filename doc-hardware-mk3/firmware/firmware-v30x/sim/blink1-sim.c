@@ -0,0 +1,205 @@
+/*
+ * blink1-sim.c -- host-native simulator of the blink(1) mk3 firmware
+ *
+ * Supplies the hardware hooks blink1_core.h needs, with a virtual clock
+ * in place of SysTick and a frame callback in place of the WS2812 driver.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blink1-sim.h"
+
+// what the firmware core expects from the hardware side, see blink1_core.h
+#define nLEDs blink1sim_num_leds
+#define REPORT_ID  1
+#define REPORT2_ID  2
+#define REPORT_COUNT blink1sim_report_size
+#define REPORT2_COUNT blink1sim_report2_size
+#define SL_ALIGN(x)
+#define SL_ATTRIBUTE_ALIGN(x)
+#define CORE_DECLARE_IRQ_STATE
+#define CORE_ENTER_ATOMIC()
+#define CORE_EXIT_ATOMIC()
+#define dbg_printf(...)
+#define dbg_str(s)
+
+static int sim_type = 3;
+static uint32_t sim_serial;
+static char sim_version_major = '3';
+static char sim_version_minor = '5';
+#define blink1_version_major sim_version_major
+#define blink1_version_minor sim_version_minor
+#define SYSTEM_GetUnique() ((uint64_t)sim_serial)
+
+#include "blink1_core.h"
+
+static const userdata_t userDefault = USERDATA_DEFAULT;
+
+static blink1sim_frameFunc frame_cb = NULL;
+static void* frame_arg = NULL;
+static uint32_t frame_count = 0;
+
+// called by the firmware core on every LED tick or 'X' frame
+static inline void displayLEDs(void)
+{
+    frame_count++;
+    if( frame_cb ) frame_cb( uptime_millis, (const uint8_t*)leds, frame_arg );
+}
+
+// size of a report id's data, including report id byte, or 0 if not supported
+static int reportCount(uint8_t rnum)
+{
+    if( rnum == REPORT_ID ) return REPORT_COUNT;
+    if( rnum == REPORT2_ID && sim_type == 3 ) return REPORT2_COUNT;
+    return 0;
+}
+
+int blink1sim_reset(int type, uint32_t serial)
+{
+    switch( type ) {
+    case 1: sim_version_major = '1'; sim_version_minor = '1'; break;
+    case 2: sim_version_major = '2'; sim_version_minor = '4'; break;
+    case 3: sim_version_major = '3'; sim_version_minor = '5'; break;
+    default: return -1;
+    }
+    sim_type = type;
+    sim_serial = serial;
+    frame_count = 0;
+    srand(1);
+
+    // every global in blink1_core.h, back to its power-up value
+    memset( fader, 0, sizeof(fader) );
+    memset( leds, 0, sizeof(leds) );
+    memset( userNotes, 0, sizeof(userNotes) );
+    memcpy( &userData, &userDefault, sizeof(userdata_t) );
+    memset( &ptmp, 0, sizeof(ptmp) );
+    memset( &ctmp, 0, sizeof(ctmp) );
+    memset( cmdq, 0, sizeof(cmdq) );
+    memset( inbuf, 0, sizeof(inbuf) );
+    memset( reportToSend, 0, sizeof(reportToSend) );
+    ttmp = 0;
+    ledn = 0;
+    uptime_millis = 0;
+    led_update_next = 0;
+    pattern_update_next = 0;
+    cmdq_count = 0;
+    doPatternWrite = false;
+    doFrameDisplay = false;
+    doNotesWrite = false;
+    shouldRebootToBootloader = false;
+
+    // startup params, as main() loads them
+    playpos   = 0;
+    playstart = userData.startup_params.playstart;
+    playend   = userData.startup_params.playend;
+    playcount = userData.startup_params.playcount;
+    serverdown_playstart = userData.startup_params.serverdown_playstart;
+    serverdown_playend   = userData.startup_params.serverdown_playend;
+    serverdown_millis    = userData.startup_params.serverdown_millis;
+    serverdown_update_next = 0;
+
+    off();
+    return 0;
+}
+
+void blink1sim_srand(unsigned int seed)
+{
+    srand(seed);
+}
+
+void blink1sim_setFrameCallback(blink1sim_frameFunc cb, void* arg)
+{
+    frame_cb = cb;
+    frame_arg = arg;
+}
+
+uint32_t blink1sim_millis(void)
+{
+    return uptime_millis;
+}
+
+uint32_t blink1sim_nextEvent(void)
+{
+    uint32_t now = uptime_millis;
+    uint32_t next = led_update_next + 1;  // updateLEDs() ticks when now > next
+    if( playing && (int32_t)(pattern_update_next + 1 - next) < 0 ) {
+        next = pattern_update_next + 1;
+    }
+    if( cmdq_count && (int32_t)(cmdq[0].at - next) < 0 ) {
+        next = cmdq[0].at;
+    }
+    if( (int32_t)(next - now) < 1 ) next = now + 1;  // one pass per millisecond
+    return next;
+}
+
+void blink1sim_advanceTo(uint32_t millis)
+{
+    if( doFrameDisplay ) updateLEDs();  // catch up on reports sent since last pass
+    // skip the passes where updateLEDs() would have nothing to do
+    while( (int32_t)(millis - uptime_millis) > 0 ) {
+        uint32_t next = blink1sim_nextEvent();
+        if( (int32_t)(next - millis) > 0 ) {
+            uptime_millis = millis;
+            break;
+        }
+        uptime_millis = next;
+        updateLEDs();
+    }
+    // no flash or bootloader here, so these are no-ops
+    doPatternWrite = false;
+    doNotesWrite = false;
+    shouldRebootToBootloader = false;
+}
+
+void blink1sim_advance(uint32_t millis)
+{
+    blink1sim_advanceTo( uptime_millis + millis );
+}
+
+int blink1sim_sendReport(const uint8_t* buf, int len)
+{
+    if( buf == NULL || len < 2 ) return -1;
+    int count = reportCount( buf[0] );
+    if( count == 0 ) return -1;
+    if( len > count ) len = count;
+    memset( inbuf, 0, sizeof(inbuf) );
+    memcpy( inbuf, buf, len );
+    handleMessage( buf[0] );
+    return len;
+}
+
+int blink1sim_getReport(uint8_t* buf, int len)
+{
+    if( buf == NULL || len < 1 ) return -1;
+    int count = reportCount( buf[0] );
+    if( count == 0 ) return -1;
+    if( len > count ) len = count;
+    reportToSend[0] = buf[0];
+    memcpy( buf, reportToSend, len );
+    return len;
+}
+
+void blink1sim_getLEDs(uint8_t* rgb)
+{
+    memcpy( rgb, leds, sizeof(leds) );
+}
+
+uint32_t blink1sim_frameCount(void)
+{
+    return frame_count;
+}
+
+int blink1sim_checkState(void)
+{
+    if( playstart >= PATT_MAX || playend > PATT_MAX ) return -1;
+    if( playing && playpos >= PATT_MAX ) return -1;
+    if( cmdq_count > CMDQ_MAX ) return -1;
+    for( int i = 1; i < cmdq_count; i++ ) {
+        if( (int32_t)(cmdq[i].at - cmdq[i-1].at) < 0 ) return -1;
+    }
+    return 0;
+}
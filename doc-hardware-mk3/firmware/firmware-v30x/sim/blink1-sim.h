@@ -0,0 +1,121 @@
+/*
+ * blink1-sim.h -- host-native simulator of the blink(1) mk3 firmware
+ *
+ * Runs the firmware's command handling and LED state machine
+ * (../blink1_core.h) on a host against a virtual millisecond clock.
+ * Reports go in with blink1sim_sendReport(), LED frames come out through
+ * a callback, and time only moves when blink1sim_advance() is called,
+ * so runs are repeatable.
+ *
+ * The firmware keeps its state in globals, so there is one simulated
+ * device per process.
+ *
+ */
+
+#ifndef BLINK1_SIM_H
+#define BLINK1_SIM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define blink1sim_report_size   8   // report id 1, including report id byte
+#define blink1sim_report2_size 60   // report id 2, including report id byte
+#define blink1sim_num_leds     18   // LEDs the firmware drives
+#define blink1sim_tick_millis  10   // LED update period
+
+/**
+ * Called for every frame the firmware sends out to the LEDs.
+ * @param millis virtual time of the frame
+ * @param rgb blink1sim_num_leds r,g,b triplets
+ * @param arg as passed to blink1sim_setFrameCallback()
+ */
+typedef void (*blink1sim_frameFunc)(uint32_t millis, const uint8_t* rgb, void* arg);
+
+/**
+ * Power up the simulated device: clock at 0, factory pattern & settings,
+ * LEDs off, no notes, rand() seeded with 1.
+ * mk1 & mk2 run the same command set, on report id 1 only.
+ * @param type 1, 2, or 3 for mk1, mk2, mk3
+ * @param serial serial number, also used as chip unique id
+ * @return 0 on success, -1 on bad type
+ */
+int blink1sim_reset(int type, uint32_t serial);
+
+/**
+ * Seed the rand() used by random-color pattern lines.
+ */
+void blink1sim_srand(unsigned int seed);
+
+/**
+ * Set function called with every LED frame, NULL to disable.
+ */
+void blink1sim_setFrameCallback(blink1sim_frameFunc cb, void* arg);
+
+/**
+ * Current virtual time.
+ * @return milliseconds since blink1sim_reset()
+ */
+uint32_t blink1sim_millis(void);
+
+/**
+ * Virtual time at which the firmware next has something to do
+ * (LED tick, pattern line, or queued command).
+ * Between now and then, advancing is a no-op.
+ */
+uint32_t blink1sim_nextEvent(void);
+
+/**
+ * Run the firmware main loop up to and including virtual time 'millis',
+ * as if it made one pass per virtual millisecond.
+ * @param millis absolute virtual time, earlier times are ignored
+ */
+void blink1sim_advanceTo(uint32_t millis);
+
+/**
+ * Run the firmware main loop for 'millis' milliseconds of virtual time.
+ */
+void blink1sim_advance(uint32_t millis);
+
+/**
+ * Deliver a feature report to the firmware, like a USB SET_REPORT.
+ * Bytes past the report's size are ignored, missing bytes are zero.
+ * @param buf report, buf[0] is report id
+ * @param len length of buf
+ * @return number of bytes taken, or -1 if report id not supported
+ */
+int blink1sim_sendReport(const uint8_t* buf, int len);
+
+/**
+ * Read the firmware's reply, like a USB GET_REPORT.
+ * @param buf buffer for report, buf[0] must be set to report id
+ * @param len length of buf
+ * @return number of bytes read, or -1 if report id not supported
+ */
+int blink1sim_getReport(uint8_t* buf, int len);
+
+/**
+ * Copy out the colors currently shown on the LEDs.
+ * @param rgb buffer of at least blink1sim_num_leds*3 bytes
+ */
+void blink1sim_getLEDs(uint8_t* rgb);
+
+/**
+ * Number of LED frames sent out since blink1sim_reset().
+ */
+uint32_t blink1sim_frameCount(void);
+
+/**
+ * Check the firmware's internal state is consistent
+ * (play position & range, command queue size & order).
+ * @return 0 if okay, -1 if not
+ */
+int blink1sim_checkState(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif